@@ -0,0 +1,62 @@
+#include "copy_engine.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include <unistd.h>
+
+// Runs the copy-engine calibration that `--copy-engine=auto` performs at
+// startup, with a configurable budget, and prints every engine's throughput
+// per size class ("-" where the filesystem cannot run it natively) along
+// with the engine that would be chosen. The scratch directory defaults to
+// the system temporary directory; pass a directory on the filesystem of
+// interest to measure it instead:
+//
+//   ./bench_copy [MiB per class] [rounds] [scratch parent]
+
+namespace fs = std::filesystem;
+
+int main(int argc, char** argv) {
+    mfs::CalibrationOptions options;
+    // mmap too, for comparison; it is never chosen.
+    options.engines.assign(mfs::kAllCopyEngines.begin(), mfs::kAllCopyEngines.end());
+    if (argc > 1) {
+        options.bytes_per_class = std::strtoull(argv[1], nullptr, 10) * 1024 * 1024;
+    }
+    if (argc > 2) {
+        options.rounds = static_cast<unsigned>(std::strtoul(argv[2], nullptr, 10));
+    }
+    const fs::path parent = argc > 3 ? fs::path(argv[3]) : fs::temp_directory_path();
+
+    const mfs::CopyCalibration calibration =
+        mfs::calibrate_copy_engines(parent / ("bench_copy_" + std::to_string(::getpid())), options);
+
+    std::cerr << "MiB per class: " << options.bytes_per_class / (1024 * 1024) << ", rounds: " << options.rounds
+              << " (MiB/s, best round)" << std::endl;
+    std::cerr << std::left << std::setw(10) << "class";
+    for (const mfs::CopyEngine engine : mfs::kAllCopyEngines) {
+        std::cerr << std::right << std::setw(18) << mfs::copy_engine_name(engine);
+    }
+    std::cerr << "  chosen" << std::endl;
+    for (std::size_t size_class = 0; size_class < mfs::kCopySizeClasses; ++size_class) {
+        std::cerr << std::left << std::setw(10) << mfs::copy_size_class_label(size_class) << std::right
+                  << std::fixed << std::setprecision(1);
+        for (const mfs::CopyEngine engine : mfs::kAllCopyEngines) {
+            const auto timing = std::find_if(calibration.timings.begin(), calibration.timings.end(),
+                                             [&](const mfs::EngineTiming& timing) {
+                                                 return timing.size_class == size_class && timing.engine == engine;
+                                             });
+            if (timing == calibration.timings.end()) {
+                std::cerr << std::setw(18) << "-";
+            } else {
+                std::cerr << std::setw(18) << timing->bytes_per_second / (1024.0 * 1024.0);
+            }
+        }
+        std::cerr << "  " << mfs::copy_engine_name(calibration.table.engine(size_class)) << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,78 @@
+#include "sync.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+// Compares the former iostream rendering of print_synced_metadata with the
+// OutputBuffer-based formatter. Output goes to stdout, timings to stderr:
+//
+//   ./bench_format [entries] > /dev/null
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+std::vector<mfs::FileMetadata> make_entries(std::size_t count) {
+    std::vector<mfs::FileMetadata> entries(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        auto& meta = entries[i];
+        meta.file = "/archive/project_" + std::to_string(i % 97) + "/run_" + std::to_string(i / 1000) +
+                    "/output_" + std::to_string(i) + ".dat";
+        meta.depth = 3;
+        meta.mode = 0100644;
+        meta.uid = 1000 + (i % 7);
+        meta.gid = 100;
+        meta.size = (i * 7919) % (64 << 20);
+        meta.mtime = 1700000000 + i;
+        meta.mtime_nsec = (i * 104729) % 1000000000;
+        meta.atime = meta.mtime + 5;
+        meta.atime_nsec = meta.mtime_nsec;
+        meta.ctime = meta.mtime;
+        meta.ctime_nsec = meta.mtime_nsec;
+    }
+    return entries;
+}
+
+void legacy_print(const std::vector<mfs::FileMetadata>& entries) {
+    std::cout << "\n=== Synchronized Source Entries ===" << std::endl;
+    for (const auto& meta : entries) {
+        std::cout << "  Path: " << meta.file << "\n"
+                  << "    depth: " << meta.depth << "\n"
+                  << "    mode: " << meta.mode << "\n"
+                  << "    uid: " << meta.uid << ", gid: " << meta.gid << "\n"
+                  << "    size: " << meta.size << " bytes\n"
+                  << "    mtime: " << meta.mtime << "s + " << meta.mtime_nsec << "ns\n"
+                  << "    atime: " << meta.atime << "s + " << meta.atime_nsec << "ns\n"
+                  << "    ctime: " << meta.ctime << "s + " << meta.ctime_nsec << "ns\n";
+    }
+    std::cout.flush();
+}
+
+template <typename Fn>
+double time_seconds(Fn&& fn) {
+    const auto start = Clock::now();
+    fn();
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    const auto entries = make_entries(count);
+
+    const double legacy = time_seconds([&] { legacy_print(entries); });
+    const double text = time_seconds([&] { mfs::print_synced_metadata(entries, mfs::OutputFormat::text); });
+    const double jsonl = time_seconds([&] { mfs::print_synced_metadata(entries, mfs::OutputFormat::jsonl); });
+
+    std::cerr << "entries:          " << count << "\n"
+              << "iostream text:    " << legacy << " s\n"
+              << "OutputBuffer text: " << text << " s (" << legacy / text << "x)\n"
+              << "OutputBuffer jsonl: " << jsonl << " s (" << legacy / jsonl << "x)" << std::endl;
+    return 0;
+}
@@ -0,0 +1,143 @@
+#include "flat_hash.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+// Compares std::unordered_set<std::filesystem::path> (the default choice for
+// path sets) with FlatStringSet, and a mutex-guarded unordered_set with
+// ShardedFlatStringSet under concurrent inserts:
+//
+//   ./bench_hash [keys] [threads]
+
+namespace {
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+struct PathHash {
+    std::size_t operator()(const fs::path& path) const { return fs::hash_value(path); }
+};
+
+std::vector<std::string> make_paths(std::size_t count, const char* prefix) {
+    std::vector<std::string> paths;
+    paths.reserve(count);
+    for (std::size_t i = 0; i < count; ++i) {
+        paths.push_back(std::string(prefix) + "/project_" + std::to_string(i % 97) + "/run_" +
+                        std::to_string(i / 1000) + "/output_" + std::to_string(i) + ".dat");
+    }
+    return paths;
+}
+
+template <typename Fn>
+double time_seconds(Fn&& fn) {
+    const auto start = Clock::now();
+    fn();
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+void report(const char* label, double seconds, std::size_t ops) {
+    std::cerr << "  " << label << seconds * 1e9 / static_cast<double>(ops) << " ns/op" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const std::size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    const std::size_t threads = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 4;
+    const auto present = make_paths(count, "/archive");
+    const auto missing = make_paths(count, "/scratch");
+    // The unordered_set side gets ready-made path objects, as its callers would.
+    const std::vector<fs::path> present_paths(present.begin(), present.end());
+    const std::vector<fs::path> missing_paths(missing.begin(), missing.end());
+    std::size_t hits = 0;
+
+    std::cerr << "keys: " << count << "\n"
+              << "std::unordered_set<fs::path>" << std::endl;
+    {
+        std::unordered_set<fs::path, PathHash> set;
+        report("insert:      ", time_seconds([&] {
+                   for (const auto& key : present_paths) {
+                       set.insert(key);
+                   }
+               }),
+               count);
+        report("lookup hit:  ", time_seconds([&] {
+                   for (const auto& key : present_paths) {
+                       hits += set.count(key);
+                   }
+               }),
+               count);
+        report("lookup miss: ", time_seconds([&] {
+                   for (const auto& key : missing_paths) {
+                       hits += set.count(key);
+                   }
+               }),
+               count);
+    }
+
+    std::cerr << "FlatStringSet" << std::endl;
+    {
+        mfs::FlatStringSet set;
+        report("insert:      ", time_seconds([&] {
+                   for (const auto& key : present) {
+                       set.insert(key);
+                   }
+               }),
+               count);
+        report("lookup hit:  ", time_seconds([&] {
+                   for (const auto& key : present) {
+                       hits += set.contains(key);
+                   }
+               }),
+               count);
+        report("lookup miss: ", time_seconds([&] {
+                   for (const auto& key : missing) {
+                       hits += set.contains(key);
+                   }
+               }),
+               count);
+    }
+
+    auto concurrent_insert = [&](auto&& insert) {
+        std::vector<std::thread> workers;
+        for (std::size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t] {
+                for (std::size_t i = t; i < count; i += threads) {
+                    insert(present[i]);
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    };
+
+    std::cerr << threads << " threads inserting" << std::endl;
+    {
+        std::mutex mutex;
+        std::unordered_set<fs::path, PathHash> set;
+        report("mutex + unordered_set<fs::path>: ", time_seconds([&] {
+                   concurrent_insert([&](const std::string& key) {
+                       fs::path path(key);
+                       std::lock_guard<std::mutex> lock(mutex);
+                       set.insert(std::move(path));
+                   });
+               }),
+               count);
+    }
+    {
+        mfs::ShardedFlatStringSet set;
+        report("ShardedFlatStringSet:            ",
+               time_seconds([&] { concurrent_insert([&](const std::string& key) { set.insert(key); }); }), count);
+        hits += set.size();
+    }
+
+    return hits == 0 ? 1 : 0;
+}
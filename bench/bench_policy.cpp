@@ -0,0 +1,99 @@
+#include "sync.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Compares the generic copy loop (every option tested per entry) with the
+// specialization selected for the enabled options, on repeated syncs of an
+// unchanged tree. Wall time there is mostly lstat()/stat(), so user CPU time,
+// which is what the specialization can save, is reported as well. Runs
+// alternate between the two loops and the median of each is reported.
+// Progress lines go to stdout, results to stderr:
+//
+//   ./bench_policy [files] [runs] > /dev/null
+
+namespace {
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+double user_cpu_seconds() {
+    rusage usage{};
+    ::getrusage(RUSAGE_SELF, &usage);
+    return static_cast<double>(usage.ru_utime.tv_sec) + static_cast<double>(usage.ru_utime.tv_usec) / 1e6;
+}
+
+struct Samples {
+    std::vector<double> wall;
+    std::vector<double> user;
+};
+
+double median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    return values[values.size() / 2];
+}
+
+void print(const char* label, const Samples& samples) {
+    std::cerr << label << median(samples.wall) << " ns/entry wall, " << median(samples.user)
+              << " ns/entry user CPU" << std::endl;
+}
+
+void compare(const char* label, const fs::path& source, const fs::path& destination, mfs::SyncOptions options,
+             std::size_t runs) {
+    Samples generic;
+    Samples specialized;
+    for (std::size_t run = 0; run < runs * 2; ++run) {
+        options.specialize = (run % 2) == 1;
+        const auto start = Clock::now();
+        const double user_start = user_cpu_seconds();
+        const double entries = static_cast<double>(
+            mfs::DirectorySyncer(options).synchronize(source, destination).entries_scanned);
+        const double user = user_cpu_seconds() - user_start;
+        const double wall = std::chrono::duration<double>(Clock::now() - start).count();
+        Samples& samples = options.specialize ? specialized : generic;
+        samples.wall.push_back(wall * 1e9 / entries);
+        samples.user.push_back(user * 1e9 / entries);
+    }
+    std::cerr << label << std::endl;
+    print("  generic:     ", generic);
+    print("  specialized: ", specialized);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const std::size_t files = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 20000;
+    const std::size_t runs = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 9;
+
+    const fs::path root = fs::temp_directory_path() / ("bench_policy_" + std::to_string(::getpid()));
+    const fs::path source = root / "source";
+    const fs::path destination = root / "destination";
+    for (std::size_t i = 0; i < files; ++i) {
+        const fs::path dir = source / ("dir_" + std::to_string(i / 1000));
+        if (i % 1000 == 0) {
+            fs::create_directories(dir);
+        }
+        std::ofstream(dir / ("file_" + std::to_string(i) + ".dat")) << i;
+    }
+
+    mfs::SyncOptions options;
+    options.remove_extraneous = false;
+    mfs::DirectorySyncer(options).synchronize(source, destination);
+
+    std::cerr << "entries: " << files << ", runs: " << runs << " per loop" << std::endl;
+    compare("no optional features", source, destination, options, runs);
+    options.account_usage = true;
+    compare("usage accounting", source, destination, options, runs);
+
+    fs::remove_all(root);
+    return 0;
+}
@@ -0,0 +1,144 @@
+#include "transport.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Streams a tree of large files from a sender to a receiver process over a
+// pair of pipes and over a socketpair, once with file data moved by
+// splice(2) and once through user-space buffers, and prints wall-clock
+// throughput and the CPU time each side spent per GiB moved. The files stay
+// in the page cache, so the numbers are the cost of moving bytes rather
+// than of storage:
+//
+//   ./bench_transport [MiB total] [files] [rounds]
+
+namespace fs = std::filesystem;
+
+namespace {
+
+double cpu_seconds(const rusage& usage) {
+    return static_cast<double>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) +
+           static_cast<double>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+struct RunResult {
+    double seconds;
+    double sender_cpu;
+    double receiver_cpu;
+    std::uint64_t bytes;
+};
+
+RunResult run_once(const fs::path& source, const fs::path& destination, bool socket, bool zero_copy) {
+    fs::remove_all(destination);
+    int to_receiver[2];
+    int to_sender[2];
+    if (socket) {
+        int ends[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, ends) != 0) {
+            throw std::runtime_error("socketpair failed");
+        }
+        // Both directions share the socket: ends[0] is the sender's.
+        to_receiver[0] = ends[1];
+        to_receiver[1] = ends[0];
+        to_sender[0] = ::dup(ends[0]);
+        to_sender[1] = ::dup(ends[1]);
+    } else if (::pipe2(to_receiver, O_CLOEXEC) != 0 || ::pipe2(to_sender, O_CLOEXEC) != 0) {
+        throw std::runtime_error("pipe failed");
+    }
+    // Sender reads to_sender[0] and writes to_receiver[1]; the receiver the
+    // other two.
+    mfs::TransportOptions options;
+    options.zero_copy = zero_copy;
+    const auto start = std::chrono::steady_clock::now();
+    const pid_t pid = ::fork();
+    if (pid == 0) {
+        ::close(to_receiver[1]);
+        ::close(to_sender[0]);
+        const int null = ::open("/dev/null", O_WRONLY);
+        ::dup2(null, STDERR_FILENO);
+        try {
+            mfs::SyncReceiver(to_receiver[0], to_sender[1], options).receive(destination);
+        } catch (const std::exception&) {
+            ::_exit(1);
+        }
+        ::_exit(0);
+    }
+    ::close(to_receiver[0]);
+    ::close(to_sender[1]);
+
+    rusage before{};
+    ::getrusage(RUSAGE_SELF, &before);
+    const mfs::SyncStats stats = mfs::SyncSender(to_sender[0], to_receiver[1], options).send(source);
+    rusage after{};
+    ::getrusage(RUSAGE_SELF, &after);
+    ::close(to_sender[0]);
+    ::close(to_receiver[1]);
+
+    int status = 0;
+    rusage child{};
+    ::wait4(pid, &status, 0, &child);
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        throw std::runtime_error("receiver failed");
+    }
+    return RunResult{seconds, cpu_seconds(after) - cpu_seconds(before), cpu_seconds(child), stats.bytes_copied};
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const std::uint64_t total_mib = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 512;
+    const std::size_t files = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 16;
+    const unsigned rounds = argc > 3 ? static_cast<unsigned>(std::strtoul(argv[3], nullptr, 10)) : 3;
+    std::signal(SIGPIPE, SIG_IGN);
+
+    const fs::path root = fs::temp_directory_path() / ("bench_transport_" + std::to_string(::getpid()));
+    const fs::path source = root / "source";
+    fs::create_directories(source);
+    const std::size_t file_bytes = static_cast<std::size_t>(total_mib * 1024 * 1024 / files);
+    std::vector<char> data(file_bytes);
+    for (std::size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>((i * 2654435761u) >> 13);
+    }
+    for (std::size_t i = 0; i < files; ++i) {
+        std::ofstream(source / ("file" + std::to_string(i)), std::ios::binary).write(data.data(), data.size());
+    }
+
+    std::cerr << "Files: " << files << " x " << file_bytes / (1024 * 1024) << " MiB, rounds: " << rounds
+              << " (best round)" << std::endl;
+    std::cerr << std::left << std::setw(12) << "link" << std::setw(10) << "path" << std::right << std::setw(12)
+              << "MiB/s" << std::setw(18) << "sender CPU s/GiB" << std::setw(20) << "receiver CPU s/GiB"
+              << std::endl;
+    for (const bool socket : {false, true}) {
+        for (const bool zero_copy : {false, true}) {
+            RunResult best{1e300, 0, 0, 0};
+            for (unsigned round = 0; round < rounds; ++round) {
+                const RunResult result = run_once(source, root / "destination", socket, zero_copy);
+                if (result.seconds < best.seconds) {
+                    best = result;
+                }
+            }
+            const double gib = static_cast<double>(best.bytes) / (1024.0 * 1024.0 * 1024.0);
+            std::cerr << std::left << std::setw(12) << (socket ? "socketpair" : "pipes") << std::setw(10)
+                      << (zero_copy ? "splice" : "buffered") << std::right << std::fixed << std::setprecision(1)
+                      << std::setw(12) << static_cast<double>(best.bytes) / (1024.0 * 1024.0) / best.seconds
+                      << std::setprecision(3) << std::setw(18) << best.sender_cpu / gib << std::setw(20)
+                      << best.receiver_cpu / gib << std::endl;
+        }
+    }
+    fs::remove_all(root);
+    return 0;
+}
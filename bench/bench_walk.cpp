@@ -0,0 +1,113 @@
+#include "dir_reader.hpp"
+#include "sync.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include <unistd.h>
+
+// Counts heap allocations per entry while listing and synchronizing a tree of
+// small files: the listing reuses one BumpArena for all directories, the
+// first sync copies everything and the second finds every entry unchanged
+// (the common case for a repeated sync). Progress lines go to stdout,
+// results to stderr:
+//
+//   ./bench_walk [files] [workers] > /dev/null
+
+namespace {
+
+std::atomic<std::size_t> allocations{0};
+
+} // namespace
+
+void* operator new(std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+void list(const fs::path& source) {
+    mfs::BumpArena arena;
+    std::size_t entries = 0;
+    std::size_t before = 0;
+    // The first directory warms the arena up; count the rest.
+    for (int dir = 0; fs::exists(source / ("dir_" + std::to_string(dir))); ++dir) {
+        const fs::path path = source / ("dir_" + std::to_string(dir));
+        if (dir == 1) {
+            before = allocations.load();
+        }
+        mfs::ArenaScope scope(arena);
+        mfs::DirectoryReader reader(path, arena);
+        mfs::ArenaVector<mfs::DirEntryName> batch{mfs::ArenaAllocator<mfs::DirEntryName>(arena)};
+        while (reader.next_batch(batch)) {
+            if (dir > 0) {
+                entries += batch.size();
+            }
+        }
+    }
+    std::cerr << "listing:       " << entries << " entries, "
+              << static_cast<double>(allocations.load() - before) / static_cast<double>(entries)
+              << " allocations/entry" << std::endl;
+}
+
+void run(const char* label, const fs::path& source, const fs::path& destination, const mfs::SyncOptions& options) {
+    const std::size_t before = allocations.load();
+    const auto start = Clock::now();
+    const mfs::SyncStats stats = mfs::DirectorySyncer(options).synchronize(source, destination);
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    const std::size_t count = allocations.load() - before;
+    std::cerr << label << stats.entries_scanned << " entries, "
+              << static_cast<double>(count) / static_cast<double>(stats.entries_scanned) << " allocations/entry, "
+              << seconds << " s" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    const std::size_t files = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 20000;
+    const std::size_t workers = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 1;
+
+    const fs::path root = fs::temp_directory_path() / ("bench_walk_" + std::to_string(::getpid()));
+    const fs::path source = root / "source";
+    const fs::path destination = root / "destination";
+    for (std::size_t i = 0; i < files; ++i) {
+        const fs::path dir = source / ("dir_" + std::to_string(i / 1000));
+        if (i % 1000 == 0) {
+            fs::create_directories(dir);
+        }
+        std::ofstream(dir / ("file_with_a_longer_name_" + std::to_string(i) + ".dat")) << i;
+    }
+
+    mfs::SyncOptions options;
+    options.remove_extraneous = false;
+    options.workers = workers;
+    options.split_threshold = 256;
+
+    list(source);
+    run("copy run:      ", source, destination, options);
+    run("unchanged run: ", source, destination, options);
+
+    fs::remove_all(root);
+    return 0;
+}
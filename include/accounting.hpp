@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace mfs {
+
+struct UsageCounters {
+    std::uint64_t bytes_copied{0};
+    std::uint64_t files_copied{0};
+    std::uint64_t files_deleted{0};
+    std::uint64_t files_skipped{0};
+
+    UsageCounters& operator+=(const UsageCounters& other) {
+        bytes_copied += other.bytes_copied;
+        files_copied += other.files_copied;
+        files_deleted += other.files_deleted;
+        files_skipped += other.files_skipped;
+        return *this;
+    }
+};
+
+// Merged per-key totals, each table sorted by bytes copied (descending) and
+// then by key.
+struct UsageReport {
+    std::vector<std::pair<std::uint64_t, UsageCounters>> by_uid{};
+    std::vector<std::pair<std::uint64_t, UsageCounters>> by_gid{};
+    std::vector<std::pair<std::string, UsageCounters>> by_project{};
+
+    bool empty() const { return by_uid.empty() && by_gid.empty() && by_project.empty(); }
+};
+
+// Project key used for entries that sit directly in the synchronized root.
+constexpr std::string_view kRootProject = ".";
+
+// Accumulator owned by a single thread; updates are plain map operations
+// without any synchronization.
+class UsageShard {
+public:
+    void copied(std::uint64_t uid, std::uint64_t gid, std::string_view project, std::uint64_t bytes);
+    void skipped(std::uint64_t uid, std::uint64_t gid, std::string_view project);
+    void deleted(std::uint64_t uid, std::uint64_t gid, std::string_view project, std::uint64_t entries);
+
+private:
+    friend class UsageAccounting;
+
+    std::unordered_map<std::uint64_t, UsageCounters> by_uid_{};
+    std::unordered_map<std::uint64_t, UsageCounters> by_gid_{};
+    std::unordered_map<std::string, UsageCounters> by_project_{};
+    // Consecutive entries nearly always share a project; remembering the last
+    // one avoids building a key string per update. Map nodes are stable.
+    std::string last_project_name_{};
+    UsageCounters* last_project_{nullptr};
+
+    UsageCounters& project(std::string_view name);
+};
+
+// Hands out one UsageShard per thread and merges them on demand. Threads take
+// the registry lock once to obtain their shard and then update it freely.
+class UsageAccounting {
+public:
+    UsageShard& local();
+    UsageReport merge() const;
+
+private:
+    mutable std::mutex mutex_;
+    std::map<std::thread::id, std::unique_ptr<UsageShard>> shards_;
+};
+
+} // namespace mfs
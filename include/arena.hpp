@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+namespace mfs {
+
+// Append-only storage for string bytes. Copies are packed into large chunks,
+// so millions of short keys cost a handful of allocations, and the returned
+// views stay valid until the arena is destroyed (moving it keeps them valid).
+class StringArena {
+public:
+    explicit StringArena(std::size_t chunk_bytes = 64 * 1024) : chunk_bytes_(chunk_bytes) {}
+
+    StringArena(StringArena&&) = default;
+    StringArena& operator=(StringArena&&) = default;
+
+    std::string_view intern(std::string_view text) {
+        if (text.empty()) {
+            return {};
+        }
+        if (text.size() > remaining_) {
+            if (text.size() > chunk_bytes_ / 4) {
+                return intern_large(text);
+            }
+            grow();
+        }
+        char* out = cursor_;
+        std::memcpy(out, text.data(), text.size());
+        cursor_ += text.size();
+        remaining_ -= text.size();
+        return std::string_view(out, text.size());
+    }
+
+    // Bytes reserved from the system, including unused chunk tails.
+    std::size_t allocated_bytes() const { return allocated_; }
+
+private:
+    std::size_t chunk_bytes_;
+    std::vector<std::unique_ptr<char[]>> chunks_;
+    char* cursor_{nullptr};
+    std::size_t remaining_{0};
+    std::size_t allocated_{0};
+
+    void grow();
+    std::string_view intern_large(std::string_view text);
+};
+
+// Bump allocator for short-lived state such as the listing buffer, entry
+// batch and names of the directory being walked. Allocation is a pointer
+// increment; memory is only given back by rewinding to an earlier mark, and
+// chunks are kept for reuse, so once a walk has warmed up the arena it no
+// longer touches the heap.
+class BumpArena {
+public:
+    struct Mark {
+        std::size_t chunks{0};
+        char* cursor{nullptr};
+    };
+
+    explicit BumpArena(std::size_t chunk_bytes = 64 * 1024) : chunk_bytes_(chunk_bytes) {}
+
+    BumpArena(BumpArena&& other) noexcept;
+    BumpArena& operator=(BumpArena&& other) noexcept;
+
+    void* allocate(std::size_t bytes, std::size_t align = alignof(std::max_align_t)) {
+        const std::size_t padding = -reinterpret_cast<std::uintptr_t>(cursor_) & (align - 1);
+        if (padding + bytes <= static_cast<std::size_t>(end_ - cursor_)) {
+            char* out = cursor_ + padding;
+            cursor_ = out + bytes;
+            return out;
+        }
+        return allocate_slow(bytes, align);
+    }
+
+    // NUL-terminated copy, so the result can be handed to system calls.
+    std::string_view copy(std::string_view text) {
+        char* out = static_cast<char*>(allocate(text.size() + 1, 1));
+        std::memcpy(out, text.data(), text.size());
+        out[text.size()] = '\0';
+        return std::string_view(out, text.size());
+    }
+
+    Mark mark() const { return Mark{used_, cursor_}; }
+    // Releases everything allocated since `mark` was taken.
+    void rewind(const Mark& mark);
+    void reset() { rewind(Mark{}); }
+
+    std::size_t allocated_bytes() const { return allocated_; }
+
+private:
+    struct Chunk {
+        std::unique_ptr<char[]> data;
+        std::size_t size;
+    };
+
+    std::size_t chunk_bytes_;
+    std::vector<Chunk> chunks_;
+    // chunks_[0, used_) hold live allocations; cursor_ points into the last.
+    std::size_t used_{0};
+    char* cursor_{nullptr};
+    char* end_{nullptr};
+    std::size_t allocated_{0};
+
+    void* allocate_slow(std::size_t bytes, std::size_t align);
+};
+
+// Rewinds `arena` to where it stood at construction. Scopes must nest; any
+// container allocating from the arena has to be destroyed before its scope.
+class ArenaScope {
+public:
+    explicit ArenaScope(BumpArena& arena) : arena_(arena), mark_(arena.mark()) {}
+    ~ArenaScope() { arena_.rewind(mark_); }
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+
+private:
+    BumpArena& arena_;
+    BumpArena::Mark mark_;
+};
+
+// Standard allocator over a BumpArena; deallocation is a no-op.
+template <typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+
+    explicit ArenaAllocator(BumpArena& arena) noexcept : arena_(&arena) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) noexcept : arena_(&other.arena()) {}
+
+    T* allocate(std::size_t n) { return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, std::size_t) noexcept {}
+
+    BumpArena& arena() const { return *arena_; }
+
+    friend bool operator==(const ArenaAllocator& lhs, const ArenaAllocator& rhs) { return lhs.arena_ == rhs.arena_; }
+    friend bool operator!=(const ArenaAllocator& lhs, const ArenaAllocator& rhs) { return lhs.arena_ != rhs.arena_; }
+
+private:
+    BumpArena* arena_;
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+} // namespace mfs
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace mfs {
+
+struct BufferPoolStats {
+    std::size_t buffers{0};
+    std::size_t buffer_bytes{0};
+    std::size_t acquisitions{0};
+    // Acquisitions that found every buffer in use and had to wait.
+    std::size_t waits{0};
+    std::size_t peak_in_use{0};
+    // Bytes of the pool backed by huge pages once it was faulted in.
+    std::uintmax_t huge_page_bytes{0};
+    // The pool came from reserved huge pages (MAP_HUGETLB) rather than
+    // transparent huge pages.
+    bool hugetlb{false};
+};
+
+// Fixed set of equally sized copy buffers carved out of one mapping that is
+// allocated up front and recycled across files. The mapping is taken from
+// reserved huge pages (MAP_HUGETLB) when the system has enough, otherwise
+// it is 2 MiB-aligned and advised for transparent huge pages
+// (MADV_HUGEPAGE); when neither applies it is plain memory.
+class BufferPool {
+public:
+    class Lease {
+    public:
+        Lease(Lease&& other) noexcept;
+        Lease& operator=(Lease&&) = delete;
+        ~Lease();
+
+        char* data() const { return data_; }
+        std::size_t size() const { return pool_->buffer_bytes_; }
+
+    private:
+        friend class BufferPool;
+        Lease(BufferPool* pool, char* data) : pool_(pool), data_(data) {}
+
+        BufferPool* pool_;
+        char* data_;
+    };
+
+    // Throws std::runtime_error if the memory cannot be mapped.
+    BufferPool(std::size_t buffers, std::size_t buffer_bytes);
+    ~BufferPool();
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // Blocks until a buffer is free.
+    Lease acquire();
+    BufferPoolStats stats() const;
+
+private:
+    std::size_t buffer_bytes_;
+    void* mapping_{nullptr};
+    std::size_t mapping_bytes_{0};
+
+    mutable std::mutex mutex_;
+    std::condition_variable released_;
+    std::vector<char*> free_;
+    BufferPoolStats stats_;
+
+    void release(char* data);
+};
+
+} // namespace mfs
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "sync.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace mfs {
+
+// A deduplicating backup destination. Files are split into variable-size
+// chunks at content-defined boundaries, so an insertion only changes the
+// chunks around it, and every distinct chunk is stored once, keyed by its
+// SHA-256:
+//
+//   <store>/packs/00000001.pack    chunk data, appended; never rewritten
+//   <store>/index                  digest:32 pack:u32le offset:u64le length:u32le
+//   <store>/manifests/<run>.manifest
+//
+// A manifest lists every directory and regular file of one backup run with
+// its mode, mtime and size, and each file's chunk digests in order; restore()
+// rebuilds the plain tree from it. Manifests use the transport's varint
+// encoding (see WireWriter).
+
+using ChunkDigest = std::array<unsigned char, 32>;
+
+ChunkDigest sha256(const char* data, std::size_t size);
+std::string to_hex(const ChunkDigest& digest);
+
+// FastCDC boundaries: no cut before `min_bytes`, a harder mask up to
+// `avg_bytes` and an easier one after it, so sizes cluster around the
+// average, and a forced cut at `max_bytes`. `avg_bytes` must be a power of
+// two.
+struct ChunkingParams {
+    std::size_t min_bytes{16 * 1024};
+    std::size_t avg_bytes{64 * 1024};
+    std::size_t max_bytes{256 * 1024};
+};
+
+// Length of the chunk at the start of `data`, which holds `size` bytes: at
+// least params.max_bytes unless the file ends there.
+std::size_t cdc_cut(const char* data, std::size_t size, const ChunkingParams& params);
+
+struct ChunkStoreOptions {
+    // Threads chunking and hashing files; the walking thread hands them
+    // whole files.
+    std::size_t workers{4};
+    ChunkingParams chunking{};
+    // A pack is closed and the next one started past this size.
+    std::uint64_t pack_bytes{256ull * 1024 * 1024};
+};
+
+class ChunkStore {
+public:
+    // Opens the store at `root`, creating it if needed, and loads its index.
+    // Throws std::runtime_error if the directory cannot be used.
+    explicit ChunkStore(std::filesystem::path root, ChunkStoreOptions options = {});
+    ~ChunkStore();
+
+    ChunkStore(const ChunkStore&) = delete;
+    ChunkStore& operator=(const ChunkStore&) = delete;
+
+    // Backs up `source` as a new run and returns its statistics. Files whose
+    // size and mtime match the previous run's manifest reuse its chunk list
+    // without being read. The manifest is renamed into place only after the
+    // packs and index are on disk, so an interrupted run leaves no manifest.
+    SyncStats backup(const std::filesystem::path& source);
+    // Rebuilds the tree of `run` (the latest when empty) under `destination`,
+    // verifying every chunk's digest. Nothing is pruned.
+    SyncStats restore(const std::string& run, const std::filesystem::path& destination);
+
+    // Run names, oldest first.
+    std::vector<std::string> runs() const;
+    // The name backup() gave its run.
+    const std::string& last_run() const { return last_run_; }
+
+private:
+    struct State;
+
+    std::filesystem::path root_;
+    ChunkStoreOptions options_;
+    std::unique_ptr<State> state_;
+    std::string last_run_;
+};
+
+} // namespace mfs
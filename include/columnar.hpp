@@ -0,0 +1,117 @@
+#pragma once
+
+#include "sync.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace mfs {
+
+// Columns written by ColumnarWriter. Each column lives in its own file named
+// "<column>.col" inside the export directory.
+enum class MetadataColumn : std::uint8_t {
+    path,
+    depth,
+    detail,
+    mode,
+    uid,
+    gid,
+    atime,
+    atime_nsec,
+    mtime,
+    mtime_nsec,
+    ctime,
+    ctime_nsec,
+    size,
+};
+
+constexpr std::size_t kMetadataColumnCount = 13;
+
+// Per-column encodings.
+//   plain:  unsigned LEB128 varint per row.
+//   dict:   varint dictionary code per row; a code equal to the current
+//           dictionary size introduces a new value, which follows inline.
+//   delta:  zigzag varint of the difference from the previous row.
+//   front:  varint shared-prefix length, varint suffix length, suffix bytes.
+enum class ColumnEncoding : std::uint8_t {
+    plain = 0,
+    dict = 1,
+    delta = 2,
+    front = 3,
+};
+
+const char* column_name(MetadataColumn column);
+ColumnEncoding column_encoding(MetadataColumn column);
+
+// Streams FileMetadata rows into one file per field. Encoded bytes are held
+// in per-column buffers and flushed once their combined size reaches
+// `buffer_limit`, so memory stays bounded regardless of row count.
+class ColumnarWriter {
+public:
+    ColumnarWriter(const std::filesystem::path& directory, std::size_t buffer_limit = 1 << 20);
+    ~ColumnarWriter();
+
+    ColumnarWriter(const ColumnarWriter&) = delete;
+    ColumnarWriter& operator=(const ColumnarWriter&) = delete;
+
+    void append(const FileMetadata& meta);
+    void flush();
+    // Flushes remaining buffers and writes the manifest. Called by the
+    // destructor if not invoked explicitly.
+    void close();
+
+    std::uint64_t rows() const { return rows_; }
+
+private:
+    struct Column {
+        std::ofstream file;
+        std::string buffer;
+    };
+
+    std::filesystem::path directory_;
+    std::size_t buffer_limit_;
+    std::size_t buffered_{0};
+    std::uint64_t rows_{0};
+    bool closed_{false};
+
+    std::array<Column, kMetadataColumnCount> columns_{};
+    std::unordered_map<std::uint64_t, std::uint64_t> uid_dict_{};
+    std::unordered_map<std::uint64_t, std::uint64_t> gid_dict_{};
+    std::array<std::uint64_t, kMetadataColumnCount> previous_{};
+    std::string previous_path_{};
+
+    Column& column(MetadataColumn id) { return columns_[static_cast<std::size_t>(id)]; }
+    void put_plain(MetadataColumn id, std::uint64_t value);
+    void put_dict(MetadataColumn id, std::unordered_map<std::uint64_t, std::uint64_t>& dict, std::uint64_t value);
+    void put_delta(MetadataColumn id, std::uint64_t value);
+    void put_path(const std::string& path);
+    void write_manifest();
+};
+
+// Reads a columnar export. Each scan opens only the requested column file and
+// decodes it in fixed-size chunks; other columns are never touched.
+class ColumnarReader {
+public:
+    explicit ColumnarReader(const std::filesystem::path& directory);
+
+    std::uint64_t rows() const { return rows_; }
+
+    void scan(MetadataColumn column, const std::function<void(std::uint64_t)>& visit) const;
+    void scan_paths(const std::function<void(const std::string&)>& visit) const;
+
+    std::vector<std::uint64_t> read(MetadataColumn column) const;
+    std::vector<std::string> read_paths() const;
+
+private:
+    std::filesystem::path directory_;
+    std::uint64_t rows_{0};
+};
+
+} // namespace mfs
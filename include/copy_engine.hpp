@@ -0,0 +1,198 @@
+#pragma once
+
+#include "buffer_pool.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace mfs {
+
+// Ways of moving a file's contents. Each is a complete copy with the
+// semantics of std::filesystem::copy_file with overwrite_existing: the
+// destination is created or truncated and gets the source's permissions.
+// Engines that a pair of filesystems does not support fall back to one that
+// always works, as noted.
+enum class CopyEngine {
+    // copy_file_range(2) in the kernel; sendfile(2) where it is refused.
+    copy_file_range,
+    // read(2)/write(2) through a buffer from a BufferPool.
+    read_write,
+    // The source mapped read-only (MAP_POPULATE, MADV_SEQUENTIAL) and
+    // written out from the mapping.
+    mmap,
+    // A copy-on-write clone (FICLONE) sharing the source's extents;
+    // copy_file_range where the filesystem cannot clone.
+    reflink,
+    // sendfile(2) from the source to the destination.
+    sendfile,
+    // read/write with O_DIRECT on both ends, bypassing the page cache;
+    // read_write where O_DIRECT is refused.
+    direct,
+};
+
+inline constexpr std::size_t kCopyEngines = 6;
+inline constexpr std::array<CopyEngine, kCopyEngines> kAllCopyEngines{
+    CopyEngine::copy_file_range, CopyEngine::read_write, CopyEngine::mmap,
+    CopyEngine::reflink,         CopyEngine::sendfile,   CopyEngine::direct};
+// The engines `auto` times and picks from. mmap is only used when asked for
+// by name: a source truncated while it is mapped kills the process with
+// SIGBUS, and a sync runs over trees that are in use.
+inline constexpr std::array<CopyEngine, kCopyEngines - 1> kAutoCopyEngines{
+    CopyEngine::copy_file_range, CopyEngine::read_write, CopyEngine::reflink, CopyEngine::sendfile,
+    CopyEngine::direct};
+
+std::string_view copy_engine_name(CopyEngine engine);
+std::optional<CopyEngine> parse_copy_engine(std::string_view name);
+
+// Files are grouped into size classes, each with its own engine. The limits
+// are the exclusive upper bounds of every class but the last.
+inline constexpr std::size_t kCopySizeClasses = 4;
+inline constexpr std::array<std::uintmax_t, kCopySizeClasses - 1> kCopySizeClassLimits{
+    64 * 1024, 1024 * 1024, 8 * 1024 * 1024};
+
+std::size_t copy_size_class(std::uintmax_t size);
+// "<64K", "64K-1M", "1M-8M", ">=8M".
+std::string_view copy_size_class_label(std::size_t size_class);
+
+class CopyEngineTable {
+public:
+    explicit CopyEngineTable(CopyEngine engine = CopyEngine::copy_file_range) { engines_.fill(engine); }
+
+    CopyEngine engine_for(std::uintmax_t size) const { return engines_[copy_size_class(size)]; }
+    CopyEngine engine(std::size_t size_class) const { return engines_[size_class]; }
+    void set(std::size_t size_class, CopyEngine engine) { engines_[size_class] = engine; }
+    bool uses(CopyEngine engine) const;
+
+private:
+    std::array<CopyEngine, kCopySizeClasses> engines_;
+};
+
+// Throws std::filesystem::filesystem_error; all return the bytes copied.
+std::uintmax_t copy_file_kernel(const std::filesystem::path& source, const std::filesystem::path& destination);
+std::uintmax_t copy_file_buffered(const std::filesystem::path& source, const std::filesystem::path& destination,
+                                  BufferPool& pool);
+// The source must not be truncated while it is copied: touching a page of
+// the mapping past the new end of file raises SIGBUS. Hence not in
+// kAutoCopyEngines.
+std::uintmax_t copy_file_mmap(const std::filesystem::path& source, const std::filesystem::path& destination);
+std::uintmax_t copy_file_reflink(const std::filesystem::path& source, const std::filesystem::path& destination);
+std::uintmax_t copy_file_sendfile(const std::filesystem::path& source, const std::filesystem::path& destination);
+// Pool buffers are page aligned, as O_DIRECT requires.
+std::uintmax_t copy_file_direct(const std::filesystem::path& source, const std::filesystem::path& destination,
+                                BufferPool& pool);
+// `pool` is used by CopyEngine::read_write and CopyEngine::direct only.
+std::uintmax_t copy_file_with(CopyEngine engine, const std::filesystem::path& source,
+                              const std::filesystem::path& destination, BufferPool& pool);
+
+// Length of the prefix a partially written `destination` shares with
+// `source`: both are compared in blocks of `block_bytes` on `threads`
+// threads, and the prefix ends at the first block that differs (or at the
+// shorter file's end). Throws std::filesystem::filesystem_error.
+std::uintmax_t matching_prefix(const std::filesystem::path& source, const std::filesystem::path& destination,
+                               std::size_t block_bytes, std::size_t threads);
+// Completes a copy whose first `offset` bytes are already in `destination`:
+// cuts the destination there and copies the rest of the source after it
+// (copy_file_range where available). Throws
+// std::filesystem::filesystem_error; returns the bytes copied.
+std::uintmax_t resume_copy(const std::filesystem::path& source, const std::filesystem::path& destination,
+                           std::uintmax_t offset);
+
+// The source version a copy in progress was taken from. It is kept in an
+// extended attribute of the destination from before its first byte is
+// written until the copy is complete, so a shorter destination found later
+// is known to be a prefix of that version, and only of that version.
+struct PartialCopyMarker {
+    std::uint64_t size{0};
+    std::uint64_t mtime{0};
+    std::uint64_t mtime_nsec{0};
+    std::uint64_t inode{0};
+
+    bool operator==(const PartialCopyMarker& other) const {
+        return size == other.size && mtime == other.mtime && mtime_nsec == other.mtime_nsec &&
+               inode == other.inode;
+    }
+};
+
+// Creates `destination` if needed and marks it; false where the filesystem
+// has no user extended attributes (such copies are never trusted later).
+bool mark_partial_copy(const std::filesystem::path& destination, const PartialCopyMarker& marker);
+// True if `destination` carries a marker equal to `marker`.
+bool partial_copy_marked(const std::filesystem::path& destination, const PartialCopyMarker& marker);
+void clear_partial_copy(const std::filesystem::path& destination);
+
+// Physical byte offset of the first extent of `source` on its device
+// (FS_IOC_FIEMAP), for ordering reads on rotating disks. Nothing when the
+// file has no placed extent yet (empty, inline or delayed allocation) or
+// cannot be opened; `unsupported` is set as well when the filesystem cannot
+// report extents at all.
+std::optional<std::uint64_t> first_extent_offset(const char* source, bool* unsupported = nullptr);
+
+struct FilesystemInfo {
+    std::uint64_t device{0};
+    // statfs(2) f_type.
+    std::uint64_t magic{0};
+    // "ext4", "xfs", ... or the magic in hex for filesystems not known here.
+    std::string type{};
+};
+
+// Throws std::filesystem::filesystem_error.
+FilesystemInfo probe_filesystem(const std::filesystem::path& path);
+
+struct EngineTiming {
+    std::size_t size_class;
+    CopyEngine engine;
+    // Best of the calibration rounds.
+    double bytes_per_second;
+};
+
+struct CalibrationOptions {
+    // Data copied per engine, size class and round, split into files of a
+    // size typical for the class (at least two of them).
+    std::uintmax_t bytes_per_class{8 * 1024 * 1024};
+    unsigned rounds{3};
+    // Buffer size for the buffered engines; use the one the run will use.
+    std::size_t buffer_bytes{1024 * 1024};
+    // Engines to time; the others are never chosen, and neither is one
+    // outside kAutoCopyEngines.
+    std::vector<CopyEngine> engines{kAutoCopyEngines.begin(), kAutoCopyEngines.end()};
+};
+
+struct CopyCalibration {
+    CopyEngineTable table{};
+    std::vector<EngineTiming> timings{};
+};
+
+// Times the engines on freshly written files in `scratch_dir` (created, and
+// removed again afterwards) and picks the fastest engine per size class.
+// The files stay in the page cache, so this measures the per-file and
+// per-byte cost of each engine (and of cloning or bypassing the cache where
+// the filesystem supports it) rather than the storage. Throws
+// std::filesystem::filesystem_error.
+CopyCalibration calibrate_copy_engines(const std::filesystem::path& scratch_dir,
+                                       const CalibrationOptions& options = {});
+
+// The fastest engine of kAutoCopyEngines per size class in `timings`
+// (other timings, e.g. of mmap, are ignored); earlier engines there win
+// ties, copy_file_range for classes without timings.
+CopyEngineTable choose_copy_engines(const std::vector<EngineTiming>& timings);
+
+// Calibrations are cached in a text file, one timing per line, under a key
+// naming the source and destination device and filesystem type.
+std::string calibration_cache_key(const FilesystemInfo& source, const FilesystemInfo& destination);
+// $XDG_CACHE_HOME/simplesync/copy_engines, or ~/.cache/...; empty if
+// neither variable is set.
+std::filesystem::path default_calibration_cache();
+// Returns nothing if the file or key is missing or the entry is incomplete.
+std::optional<CopyCalibration> load_cached_calibration(const std::filesystem::path& cache, std::string_view key);
+// Replaces the entry for `key`, keeping other keys. Throws
+// std::runtime_error if the file cannot be written.
+void store_cached_calibration(const std::filesystem::path& cache, std::string_view key,
+                              const CopyCalibration& calibration);
+
+} // namespace mfs
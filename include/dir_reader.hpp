@@ -0,0 +1,70 @@
+#pragma once
+
+#include "arena.hpp"
+#include "flat_hash.hpp"
+
+#include <cstddef>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+namespace mfs {
+
+// One name from a directory listing. `type` is the d_type hint (DT_REG,
+// DT_DIR, ...), DT_UNKNOWN when the filesystem does not provide one. `name`
+// is NUL-terminated and valid until the next DirectoryReader::next_batch().
+struct DirEntryName {
+    std::string_view name;
+    unsigned char type;
+};
+
+// Streams a directory without materializing the whole listing: every
+// next_batch() call issues a single getdents64(2) (readdir(3) on platforms
+// without it) and returns the names that call produced, minus "." and "..".
+// The read buffer comes from `arena` and names point straight into it, so a
+// walker that rewinds its arena per directory reads without heap allocation.
+class DirectoryReader {
+public:
+    DirectoryReader(const std::filesystem::path& dir, BumpArena& arena, std::size_t buffer_bytes = 128 * 1024);
+    ~DirectoryReader();
+
+    DirectoryReader(const DirectoryReader&) = delete;
+    DirectoryReader& operator=(const DirectoryReader&) = delete;
+
+    bool is_open() const { return fd_ >= 0; }
+    // Set when opening or reading failed; next_batch() then returns false.
+    const std::error_code& error() const { return error_; }
+
+    // Replaces the contents of `batch`. Returns false at the end of the
+    // directory or on error.
+    bool next_batch(ArenaVector<DirEntryName>& batch);
+
+private:
+    int fd_{-1};
+    void* dir_{nullptr}; // DIR* for the readdir(3) fallback
+    BumpArena& arena_;
+    char* buffer_{nullptr};
+    std::size_t buffer_bytes_;
+    std::error_code error_;
+
+    void close();
+};
+
+// Name -> d_type map of a whole directory, read once so that the entries of
+// a huge directory can be matched without one stat() per name.
+class DirectoryListing {
+public:
+    // A directory that cannot be read yields an empty listing and `error`.
+    static DirectoryListing read(const std::filesystem::path& dir, std::error_code& error);
+
+    std::optional<unsigned char> find(std::string_view name) const;
+    std::size_t size() const { return entries_.size(); }
+
+private:
+    FlatStringMap<unsigned char> entries_;
+};
+
+} // namespace mfs
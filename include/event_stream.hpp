@@ -0,0 +1,98 @@
+#pragma once
+
+#include "output_format.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+
+namespace mfs {
+
+struct SyncStats;
+
+// Machine-readable event stream: one compact JSON object per line, e.g.
+//   {"ts":0.001234,"event":"copied","source":"...","destination":"...","bytes":42}
+// Producers format into an in-memory buffer under a short lock; a background
+// thread swaps buffers and performs the actual writes, so a slow consumer
+// never blocks the sync on I/O. While the writer is stuck, events beyond
+// `max_pending_bytes` are dropped and counted rather than buffered; the
+// summary event is always kept and reports the count.
+class EventStream {
+public:
+    static constexpr std::size_t kDefaultMaxPendingBytes = 16 * 1024 * 1024;
+
+    // Writes to `fd`. When `close_fd` is set the descriptor is closed by close().
+    explicit EventStream(int fd, bool close_fd = false,
+                         std::chrono::milliseconds progress_interval = std::chrono::seconds(1),
+                         std::size_t max_pending_bytes = kDefaultMaxPendingBytes);
+    ~EventStream();
+
+    EventStream(const EventStream&) = delete;
+    EventStream& operator=(const EventStream&) = delete;
+
+    static std::shared_ptr<EventStream> open_file(const std::filesystem::path& file);
+
+    void copied(const std::filesystem::path& source, const std::filesystem::path& destination,
+                std::uint64_t bytes);
+    void skipped(const std::filesystem::path& path, std::string_view reason);
+    void created_directory(const std::filesystem::path& path);
+    void deleted(const std::filesystem::path& path, bool directory, std::uint64_t entries);
+    void error(std::string_view operation, const std::filesystem::path& path, std::string_view message);
+    void retry(std::string_view operation, const std::filesystem::path& path, unsigned attempt,
+               std::string_view message, std::chrono::nanoseconds delay);
+    void stalled(std::string_view operation, const std::filesystem::path& path, std::size_t worker,
+                 std::chrono::duration<double> elapsed);
+    void stage(std::string_view name, std::chrono::duration<double> elapsed);
+    void progress(const SyncStats& stats);
+    void summary(const SyncStats& stats);
+
+    // True once per progress interval; cheap enough to poll for every entry.
+    // Safe to poll from several threads: one of them gets each interval.
+    bool progress_due();
+
+    // Why the writer stopped writing events, once; empty if it has not.
+    // The stream does not print it: its owner reports it where it logs.
+    std::string take_failure();
+
+    // Events dropped so far because too many bytes were pending.
+    std::uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+    // Drains pending events, stops the writer thread and closes the fd if owned.
+    void close();
+
+private:
+    int fd_;
+    bool close_fd_;
+    std::chrono::steady_clock::time_point start_;
+    std::chrono::steady_clock::duration progress_interval_;
+    std::atomic<std::chrono::steady_clock::time_point> next_progress_;
+    std::size_t max_pending_bytes_;
+    std::atomic<std::uint64_t> dropped_{0};
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::unique_ptr<OutputBuffer> front_;
+    std::unique_ptr<OutputBuffer> back_;
+    bool stopping_{false};
+    bool closed_{false};
+    bool write_failed_{false};
+    std::string failure_;
+    // Where the event being formatted starts in front_.
+    std::size_t event_start_{0};
+    std::thread writer_;
+
+    // Both expect mutex_ to be held. end_event() takes the event back out
+    // when it does not fit under max_pending_bytes_, unless `keep` is set.
+    OutputBuffer& begin_event(std::string_view event);
+    void end_event(bool keep = false);
+    void writer_loop();
+};
+
+} // namespace mfs
@@ -0,0 +1,377 @@
+#pragma once
+
+#include "arena.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace mfs {
+
+// Final mixer of MurmurHash3; spreads integer keys over all 64 bits.
+inline std::uint64_t mix_hash(std::uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Hash used by the flat tables. Both the low 7 bits (fingerprint) and the
+// bits above them (group index) must be well spread, so integers, which
+// std::hash maps to themselves, are mixed first.
+template <typename Key, typename = void>
+struct FlatHash {
+    std::size_t operator()(const Key& key) const { return std::hash<Key>{}(key); }
+};
+
+template <typename Key>
+struct FlatHash<Key, std::enable_if_t<std::is_integral_v<Key>>> {
+    std::size_t operator()(Key key) const {
+        return static_cast<std::size_t>(mix_hash(static_cast<std::uint64_t>(key)));
+    }
+};
+
+namespace flat_detail {
+
+constexpr std::size_t kGroupWidth = 16;
+constexpr std::int8_t kEmpty = -128;
+
+// Bitmask of the control bytes of a 16-slot group equal to `value`: one
+// compare and one movemask with SSE2, a byte loop elsewhere.
+inline std::uint32_t match_byte(const std::int8_t* group, std::int8_t value) {
+#if defined(__SSE2__)
+    const __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+    return static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(value))));
+#else
+    std::uint32_t mask = 0;
+    for (std::size_t i = 0; i < kGroupWidth; ++i) {
+        mask |= static_cast<std::uint32_t>(group[i] == value) << i;
+    }
+    return mask;
+#endif
+}
+
+inline std::size_t lowest_bit(std::uint32_t mask) {
+    return static_cast<std::size_t>(__builtin_ctz(mask));
+}
+
+} // namespace flat_detail
+
+// Insert-only open-addressing table in the Swiss-table layout: one control
+// byte per slot (empty, or the 7-bit fingerprint of a full slot's hash) and
+// the slots themselves in a separate flat array. A lookup loads a group of 16
+// control bytes, compares all fingerprints at once and only touches slots
+// whose fingerprint matches; groups are probed triangularly, which visits
+// every group of a power-of-two table. Erase is deliberately not supported:
+// every set in the engine only grows during a run, and without tombstones a
+// probe stops at the first group with an empty byte.
+template <typename Key, typename Value, typename Hash = FlatHash<Key>, typename Equal = std::equal_to<Key>>
+class FlatHashMap {
+public:
+    FlatHashMap() = default;
+    ~FlatHashMap() { destroy(); }
+
+    FlatHashMap(const FlatHashMap&) = delete;
+    FlatHashMap& operator=(const FlatHashMap&) = delete;
+
+    FlatHashMap(FlatHashMap&& other) noexcept { swap(other); }
+    FlatHashMap& operator=(FlatHashMap&& other) noexcept {
+        if (this != &other) {
+            FlatHashMap(std::move(other)).swap(*this);
+        }
+        return *this;
+    }
+
+    void swap(FlatHashMap& other) noexcept {
+        std::swap(ctrl_, other.ctrl_);
+        std::swap(slots_, other.slots_);
+        std::swap(capacity_, other.capacity_);
+        std::swap(size_, other.size_);
+        std::swap(hash_, other.hash_);
+        std::swap(equal_, other.equal_);
+    }
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    std::size_t capacity() const { return capacity_; }
+
+    // Sizes the table so that `expected` entries fit without rehashing.
+    void reserve(std::size_t expected) {
+        std::size_t capacity = flat_detail::kGroupWidth;
+        while (capacity - capacity / 8 < expected) {
+            capacity *= 2;
+        }
+        if (capacity > capacity_) {
+            rehash(capacity);
+        }
+    }
+
+    std::size_t hash_of(const Key& key) const { return hash_(key); }
+
+    Value* find(const Key& key) { return find_hashed(key, hash_(key)); }
+    const Value* find(const Key& key) const { return find_hashed(key, hash_(key)); }
+    bool contains(const Key& key) const { return find(key) != nullptr; }
+
+    Value* find_hashed(const Key& key, std::size_t hash) {
+        return const_cast<Value*>(static_cast<const FlatHashMap*>(this)->find_hashed(key, hash));
+    }
+
+    const Value* find_hashed(const Key& key, std::size_t hash) const {
+        if (capacity_ == 0) {
+            return nullptr;
+        }
+        const std::int8_t fp = fingerprint(hash);
+        const std::size_t group_mask = capacity_ / flat_detail::kGroupWidth - 1;
+        std::size_t group = group_index(hash);
+        for (std::size_t step = 1;; ++step) {
+            const std::int8_t* ctrl = ctrl_.get() + group * flat_detail::kGroupWidth;
+            for (std::uint32_t match = flat_detail::match_byte(ctrl, fp); match != 0; match &= match - 1) {
+                const Slot& slot = slots_[group * flat_detail::kGroupWidth + flat_detail::lowest_bit(match)];
+                if (slot.hash == hash && equal_(slot.key, key)) {
+                    return &slot.value;
+                }
+            }
+            if (flat_detail::match_byte(ctrl, flat_detail::kEmpty) != 0) {
+                return nullptr;
+            }
+            group = (group + step) & group_mask;
+        }
+    }
+
+    // Inserts Value(args...) under `key` unless the key is present. The table
+    // stores store_key(key), which lets string tables keep a copy of the key
+    // in an arena; it only runs when an entry is actually inserted.
+    template <typename StoreKey, typename... Args>
+    std::pair<Value*, bool> try_emplace_hashed(const Key& key, std::size_t hash, StoreKey&& store_key,
+                                               Args&&... args) {
+        if (Value* found = find_hashed(key, hash)) {
+            return {found, false};
+        }
+        if (size_ + 1 > capacity_ - capacity_ / 8) {
+            rehash(capacity_ == 0 ? flat_detail::kGroupWidth : capacity_ * 2);
+        }
+        const std::size_t index = free_slot(hash);
+        Slot* slot = ::new (static_cast<void*>(slots_ + index))
+            Slot{hash, Key(store_key(key)), Value(std::forward<Args>(args)...)};
+        ctrl_[index] = fingerprint(hash);
+        ++size_;
+        return {&slot->value, true};
+    }
+
+    template <typename... Args>
+    std::pair<Value*, bool> try_emplace(const Key& key, Args&&... args) {
+        return try_emplace_hashed(
+            key, hash_(key), [](const Key& k) { return k; }, std::forward<Args>(args)...);
+    }
+
+    // Visits every entry in table order.
+    template <typename Fn>
+    void for_each(Fn&& fn) const {
+        for (std::size_t i = 0; i < capacity_; ++i) {
+            if (ctrl_[i] >= 0) {
+                fn(slots_[i].key, slots_[i].value);
+            }
+        }
+    }
+
+    void clear() {
+        destroy();
+        ctrl_.reset();
+        slots_ = nullptr;
+        capacity_ = 0;
+        size_ = 0;
+    }
+
+private:
+    // The full hash is kept next to the key: growing the table then never
+    // touches the keys (string bytes live elsewhere, in an arena), and a
+    // fingerprint collision is usually rejected without comparing them.
+    struct Slot {
+        std::size_t hash;
+        Key key;
+        Value value;
+    };
+
+    std::unique_ptr<std::int8_t[]> ctrl_;
+    Slot* slots_{nullptr};
+    std::size_t capacity_{0};
+    std::size_t size_{0};
+    Hash hash_{};
+    Equal equal_{};
+
+    static std::int8_t fingerprint(std::size_t hash) { return static_cast<std::int8_t>(hash & 0x7f); }
+
+    std::size_t group_index(std::size_t hash) const {
+        return (hash >> 7) & (capacity_ / flat_detail::kGroupWidth - 1);
+    }
+
+    std::size_t free_slot(std::size_t hash) const {
+        const std::size_t group_mask = capacity_ / flat_detail::kGroupWidth - 1;
+        std::size_t group = group_index(hash);
+        for (std::size_t step = 1;; ++step) {
+            const std::int8_t* ctrl = ctrl_.get() + group * flat_detail::kGroupWidth;
+            const std::uint32_t empty = flat_detail::match_byte(ctrl, flat_detail::kEmpty);
+            if (empty != 0) {
+                return group * flat_detail::kGroupWidth + flat_detail::lowest_bit(empty);
+            }
+            group = (group + step) & group_mask;
+        }
+    }
+
+    void rehash(std::size_t capacity) {
+        FlatHashMap next;
+        next.hash_ = hash_;
+        next.equal_ = equal_;
+        next.ctrl_.reset(new std::int8_t[capacity]);
+        std::memset(next.ctrl_.get(), static_cast<unsigned char>(flat_detail::kEmpty), capacity);
+        next.slots_ = std::allocator<Slot>().allocate(capacity);
+        next.capacity_ = capacity;
+
+        for (std::size_t i = 0; i < capacity_; ++i) {
+            if (ctrl_[i] < 0) {
+                continue;
+            }
+            const std::size_t hash = slots_[i].hash;
+            const std::size_t index = next.free_slot(hash);
+            ::new (static_cast<void*>(next.slots_ + index)) Slot(std::move(slots_[i]));
+            next.ctrl_[index] = fingerprint(hash);
+            ++next.size_;
+        }
+        swap(next);
+    }
+
+    void destroy() {
+        if (slots_ == nullptr) {
+            return;
+        }
+        if constexpr (!std::is_trivially_destructible_v<Slot>) {
+            for (std::size_t i = 0; i < capacity_; ++i) {
+                if (ctrl_[i] >= 0) {
+                    slots_[i].~Slot();
+                }
+            }
+        }
+        std::allocator<Slot>().deallocate(slots_, capacity_);
+        slots_ = nullptr;
+    }
+};
+
+// String-keyed FlatHashMap whose keys are copied into an arena: one chunk
+// allocation per 64 KiB of key bytes instead of a heap node plus a
+// std::string (or std::filesystem::path) per entry.
+template <typename Value>
+class FlatStringMap {
+public:
+    std::size_t size() const { return table_.size(); }
+    bool empty() const { return table_.empty(); }
+    void reserve(std::size_t expected) { table_.reserve(expected); }
+
+    std::size_t hash_of(std::string_view key) const { return table_.hash_of(key); }
+
+    Value* find(std::string_view key) { return table_.find(key); }
+    const Value* find(std::string_view key) const { return table_.find(key); }
+    const Value* find_hashed(std::string_view key, std::size_t hash) const { return table_.find_hashed(key, hash); }
+    bool contains(std::string_view key) const { return table_.contains(key); }
+
+    template <typename... Args>
+    std::pair<Value*, bool> try_emplace(std::string_view key, Args&&... args) {
+        return try_emplace_hashed(key, table_.hash_of(key), std::forward<Args>(args)...);
+    }
+
+    template <typename... Args>
+    std::pair<Value*, bool> try_emplace_hashed(std::string_view key, std::size_t hash, Args&&... args) {
+        return table_.try_emplace_hashed(
+            key, hash, [this](std::string_view k) { return arena_.intern(k); }, std::forward<Args>(args)...);
+    }
+
+    template <typename Fn>
+    void for_each(Fn&& fn) const {
+        table_.for_each(std::forward<Fn>(fn));
+    }
+
+private:
+    FlatHashMap<std::string_view, Value> table_;
+    StringArena arena_;
+};
+
+class FlatStringSet {
+public:
+    std::size_t size() const { return map_.size(); }
+    bool empty() const { return map_.empty(); }
+    void reserve(std::size_t expected) { map_.reserve(expected); }
+
+    std::size_t hash_of(std::string_view key) const { return map_.hash_of(key); }
+
+    // Returns true if `key` was not present before.
+    bool insert(std::string_view key) { return map_.try_emplace(key).second; }
+    bool insert_hashed(std::string_view key, std::size_t hash) { return map_.try_emplace_hashed(key, hash).second; }
+    bool contains(std::string_view key) const { return map_.contains(key); }
+    bool contains_hashed(std::string_view key, std::size_t hash) const {
+        return map_.find_hashed(key, hash) != nullptr;
+    }
+
+private:
+    struct Present {};
+    FlatStringMap<Present> map_;
+};
+
+// FlatStringSet for several writers: the top bits of the key hash pick one of
+// 64 shards, each behind its own mutex, so concurrent inserts rarely contend.
+// The hash is computed once, outside the lock, and reused by the shard.
+class ShardedFlatStringSet {
+public:
+    static constexpr std::size_t kShardBits = 6;
+    static constexpr std::size_t kShards = std::size_t{1} << kShardBits;
+
+    bool insert(std::string_view key) {
+        const std::size_t hash = hash_(key);
+        Shard& shard = shards_[shard_index(hash)];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.set.insert_hashed(key, hash);
+    }
+
+    bool contains(std::string_view key) const {
+        const std::size_t hash = hash_(key);
+        const Shard& shard = shards_[shard_index(hash)];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.set.contains_hashed(key, hash);
+    }
+
+    std::size_t size() const {
+        std::size_t total = 0;
+        for (const Shard& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total += shard.set.size();
+        }
+        return total;
+    }
+
+private:
+    struct alignas(64) Shard {
+        mutable std::mutex mutex;
+        FlatStringSet set;
+    };
+
+    FlatHash<std::string_view> hash_{};
+    std::array<Shard, kShards> shards_;
+
+    static std::size_t shard_index(std::size_t hash) {
+        return static_cast<std::size_t>(static_cast<std::uint64_t>(hash) >> (64 - kShardBits));
+    }
+};
+
+} // namespace mfs
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "output_format.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string_view>
+
+namespace mfs {
+
+struct SyncStats;
+
+enum class SyncStage : std::uint32_t {
+    validate = 0,
+    prepare = 1,
+    copy = 2,
+    prune = 3,
+};
+
+enum class StageState : std::uint32_t {
+    pending = 0,
+    running = 1,
+    done = 2,
+    skipped = 3,
+};
+
+constexpr std::size_t kLiveStageCount = 4;
+// Bucket i counts values v with floor(log2(v)) == i - 1; bucket 0 counts zero.
+constexpr std::size_t kSizeHistogramBuckets = 48;
+constexpr std::size_t kLatencyHistogramBuckets = 40;
+
+constexpr std::uint32_t kLiveStatsMagic = 0x4c53464d; // "MFSL"
+constexpr std::uint32_t kLiveStatsVersion = 1;
+
+const char* stage_name(SyncStage stage);
+const char* stage_state_name(StageState state);
+
+// Plain copy of the published values, as returned to readers.
+struct LiveStatsSnapshot {
+    std::uint32_t version{0};
+    std::uint32_t pid{0};
+    std::uint64_t sequence{0};
+    std::uint64_t start_unix_ns{0};
+    std::uint64_t update_unix_ns{0};
+    bool finished{false};
+    std::uint64_t entries_scanned{0};
+    std::uint64_t files_copied{0};
+    std::uint64_t files_skipped{0};
+    std::uint64_t files_deleted{0};
+    std::uint64_t directories_created{0};
+    std::uint64_t bytes_copied{0};
+    std::array<StageState, kLiveStageCount> stage_state{};
+    std::array<std::uint64_t, kLiveStageCount> stage_elapsed_ns{};
+    std::array<std::uint64_t, kSizeHistogramBuckets> size_histogram{};
+    std::array<std::uint64_t, kLatencyHistogramBuckets> latency_histogram{};
+    std::uint64_t latency_sum_ns{0};
+};
+
+// Shared-memory layout (version 1). All value words are written with relaxed
+// atomic stores between two increments of `sequence` (seqlock): an odd
+// sequence means an update is in progress, and readers retry until they see
+// the same even value before and after copying.
+struct LiveStatsLayout {
+    std::uint32_t magic;
+    std::uint32_t version;
+    std::uint32_t layout_size;
+    std::uint32_t pid;
+    std::atomic<std::uint64_t> sequence;
+    std::atomic<std::uint64_t> start_unix_ns;
+    std::atomic<std::uint64_t> update_unix_ns;
+    std::atomic<std::uint64_t> finished;
+    std::atomic<std::uint64_t> entries_scanned;
+    std::atomic<std::uint64_t> files_copied;
+    std::atomic<std::uint64_t> files_skipped;
+    std::atomic<std::uint64_t> files_deleted;
+    std::atomic<std::uint64_t> directories_created;
+    std::atomic<std::uint64_t> bytes_copied;
+    std::atomic<std::uint64_t> stage_state[kLiveStageCount];
+    std::atomic<std::uint64_t> stage_elapsed_ns[kLiveStageCount];
+    std::atomic<std::uint64_t> size_histogram[kSizeHistogramBuckets];
+    std::atomic<std::uint64_t> latency_histogram[kLatencyHistogramBuckets];
+    std::atomic<std::uint64_t> latency_sum_ns;
+};
+
+// Single-writer publisher backed by a memory-mapped file (by default under
+// /dev/shm). Histogram samples are accumulated locally (record_copy() may be
+// called from any worker) and copied into the mapping on publish(), which
+// costs a few dozen plain stores; publish() itself has a single caller.
+class LiveStatsPublisher {
+public:
+    // Creates (or truncates) `file`. When `unlink_on_close` is set the file is
+    // removed again by close().
+    explicit LiveStatsPublisher(const std::filesystem::path& file, bool unlink_on_close = false);
+    ~LiveStatsPublisher();
+
+    LiveStatsPublisher(const LiveStatsPublisher&) = delete;
+    LiveStatsPublisher& operator=(const LiveStatsPublisher&) = delete;
+
+    static std::filesystem::path default_path();
+
+    const std::filesystem::path& path() const { return path_; }
+
+    void set_stage(SyncStage stage, StageState state, std::chrono::duration<double> elapsed = {});
+    void record_copy(std::uint64_t bytes, std::chrono::steady_clock::duration latency);
+    void publish(const SyncStats& stats, bool finished = false);
+    void close();
+
+private:
+    std::filesystem::path path_;
+    bool unlink_on_close_;
+    LiveStatsLayout* layout_{nullptr};
+    std::array<StageState, kLiveStageCount> stage_state_{};
+    std::array<std::uint64_t, kLiveStageCount> stage_elapsed_ns_{};
+    std::array<std::atomic<std::uint64_t>, kSizeHistogramBuckets> size_histogram_{};
+    std::array<std::atomic<std::uint64_t>, kLatencyHistogramBuckets> latency_histogram_{};
+    std::atomic<std::uint64_t> latency_sum_ns_{0};
+};
+
+// Maps `file` read-only and returns a consistent snapshot. Throws
+// std::runtime_error if the file is missing or has an unknown version.
+LiveStatsSnapshot read_live_stats(const std::filesystem::path& file);
+
+void format_live_stats(OutputBuffer& out, const LiveStatsSnapshot& snapshot);
+// Prometheus text exposition format (version 0.0.4).
+void format_live_stats_prometheus(OutputBuffer& out, const LiveStatsSnapshot& snapshot);
+
+} // namespace mfs
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <mutex>
+#include <ostream>
+#include <sstream>
+
+namespace mfs {
+
+// Guards every progress and warning line, whichever stream it goes to.
+inline std::mutex log_mutex;
+
+// Writes one line to `out` whole: lines of concurrent synchronize() calls
+// and of their threads never interleave, even on a shared stream.
+template <typename... Args>
+void log_line(std::ostream& out, const Args&... args) {
+    std::ostringstream line;
+    (line << ... << args);
+    std::lock_guard<std::mutex> lock(log_mutex);
+    out << line.str() << std::endl;
+}
+
+} // namespace mfs
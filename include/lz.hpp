@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+
+namespace mfs {
+
+// A small LZ77 block codec in the style of LZ4 for the stream transport:
+// one hash probe per position, byte-aligned sequences of literals and
+// matches, no entropy coding. It trades ratio for speed; a block is a
+// sequence of
+//
+//   token:u8 (literal length << 4 | match length - 4)
+//   [literal length - 15 as 255-runs]  literals  offset:u16le
+//   [match length - 19 as 255-runs]
+//
+// where the last sequence ends after its literals.
+
+// Worst-case output size of lz_compress() for `size` input bytes.
+std::size_t lz_compress_bound(std::size_t size);
+
+// Compresses `size` bytes into `out`, which must hold
+// lz_compress_bound(size) bytes, and returns the compressed size.
+std::size_t lz_compress(const char* in, std::size_t size, char* out);
+
+// Decompresses a block from lz_compress() into exactly `out_size` bytes.
+// Throws std::runtime_error on malformed input.
+void lz_decompress(const char* in, std::size_t size, char* out, std::size_t out_size);
+
+// Shannon entropy, in bits per byte, of a sample spread across the block;
+// a cheap test for data that is already compressed or encrypted.
+double sample_entropy(const char* data, std::size_t size);
+
+} // namespace mfs
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string_view>
+#include <vector>
+
+namespace mfs {
+
+struct NumaNode {
+    int id;
+    // Online CPUs of the node; empty means "any CPU" (no placement).
+    std::vector<int> cpus;
+};
+
+// NUMA layout of the machine as exposed under /sys/devices/system/node.
+// Memory-only nodes are left out. Without that directory, or with a single
+// node, the topology has one node and every NUMA feature is a no-op.
+class NumaTopology {
+public:
+    NumaTopology();
+    explicit NumaTopology(std::vector<NumaNode> nodes);
+
+    static NumaTopology detect(const std::filesystem::path& sysfs_root = "/sys/devices/system/node");
+
+    const std::vector<NumaNode>& nodes() const { return nodes_; }
+    std::size_t size() const { return nodes_.size(); }
+    bool multi_node() const { return nodes_.size() > 1; }
+    // Index into nodes() of the node worker `worker` is placed on: workers
+    // are dealt to the nodes round-robin.
+    std::size_t node_of_worker(std::size_t worker) const { return worker % nodes_.size(); }
+
+private:
+    std::vector<NumaNode> nodes_;
+};
+
+// Parses a kernel CPU list such as "0-3,8,10-11". Throws std::runtime_error
+// on malformed input.
+std::vector<int> parse_cpu_list(std::string_view list);
+
+// Restricts the calling thread to `cpus`, so memory it touches first is
+// allocated on their node. Returns false (leaving the thread as it was) when
+// `cpus` is empty or the platform does not support affinity.
+bool pin_current_thread(const std::vector<int>& cpus);
+
+// Pins the calling thread for the lifetime of the object and then restores
+// its previous affinity.
+class ScopedThreadPin {
+public:
+    explicit ScopedThreadPin(const std::vector<int>& cpus);
+    ~ScopedThreadPin();
+
+    ScopedThreadPin(const ScopedThreadPin&) = delete;
+    ScopedThreadPin& operator=(const ScopedThreadPin&) = delete;
+
+private:
+    std::vector<int> previous_;
+    bool pinned_{false};
+};
+
+struct NodeThroughput {
+    int node;
+    std::size_t workers{0};
+    std::size_t files_copied{0};
+    std::uintmax_t bytes_copied{0};
+    std::chrono::duration<double> copy_elapsed{};
+    // Batches queued for another node that this node's workers ran.
+    std::size_t tasks_stolen{0};
+};
+
+} // namespace mfs
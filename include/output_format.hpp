@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include <unistd.h>
+
+namespace mfs {
+
+enum class OutputFormat {
+    text,
+    jsonl,
+};
+
+// Writes the whole range, retrying on EINTR and short writes. Throws
+// std::runtime_error on failure.
+void write_fully(int fd, const char* data, std::size_t size);
+
+// Append-only formatting buffer that renders numbers with std::to_chars and
+// hands the bytes to a file descriptor in large writes. A negative fd keeps
+// everything in memory (the buffer grows instead of flushing), which is
+// useful for tests and for callers that embed the text elsewhere.
+class OutputBuffer {
+public:
+    explicit OutputBuffer(int fd = STDOUT_FILENO, std::size_t capacity = 1 << 20);
+    ~OutputBuffer();
+
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    void append(std::string_view text) {
+        if (capacity_ - used_ >= text.size()) {
+            std::memcpy(data_.get() + used_, text.data(), text.size());
+            used_ += text.size();
+        } else {
+            append_slow(text);
+        }
+    }
+    void append(char c) {
+        *reserve(1) = c;
+        ++used_;
+    }
+    void append_uint(std::uint64_t value);
+    void append_int(std::int64_t value);
+    // Right-aligned in a field of at least `width` bytes.
+    void append_uint_right(std::uint64_t value, std::size_t width);
+    void append_fixed(double value, int precision);
+    // Double-quoted with '"' and '\\' escaped, matching how std::filesystem::path
+    // is rendered by operator<<.
+    void append_quoted(std::string_view text);
+    // JSON string literal including the surrounding quotes.
+    void append_json_string(std::string_view text);
+    // Left-aligned text padded with spaces to at least `width` bytes.
+    void append_padded(std::string_view text, std::size_t width);
+
+    std::size_t size() const { return used_; }
+    std::string_view view() const { return std::string_view(data_.get(), used_); }
+    void clear() { used_ = 0; }
+    // Forgets everything after the first `size` bytes.
+    void truncate(std::size_t size) { used_ = std::min(used_, size); }
+    void flush();
+
+private:
+    int fd_;
+    std::size_t capacity_;
+    std::size_t used_{0};
+    std::unique_ptr<char[]> data_;
+
+    char* reserve(std::size_t bytes) {
+        if (capacity_ - used_ < bytes) {
+            make_room(bytes);
+        }
+        return data_.get() + used_;
+    }
+    void append_slow(std::string_view text);
+    void make_room(std::size_t bytes);
+    void grow(std::size_t bytes);
+};
+
+} // namespace mfs
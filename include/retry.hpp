@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <queue>
+#include <random>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace mfs {
+
+enum class ErrorClass {
+    transient,
+    permanent,
+};
+
+// EIO, ESTALE, EAGAIN/EWOULDBLOCK, ETIMEDOUT, EINTR, EBUSY and ENOLCK are
+// treated as transient (typical of NFS/Lustre hiccups); everything else is
+// permanent.
+ErrorClass classify_errno(int err);
+ErrorClass classify_error(const std::error_code& ec);
+
+struct RetryPolicy {
+    // Retries after the first failure; 0 disables the deferred queue.
+    unsigned max_retries{4};
+    std::chrono::milliseconds initial_delay{200};
+    std::chrono::milliseconds max_delay{10000};
+    double multiplier{2.0};
+    // Fraction of each delay that is randomized: the actual delay is drawn
+    // uniformly from [delay * (1 - jitter), delay].
+    double jitter{0.5};
+};
+
+// Delay before retry number `attempt` (1-based).
+std::chrono::nanoseconds retry_delay(const RetryPolicy& policy, unsigned attempt, std::mt19937_64& rng);
+
+// Min-heap of items keyed by the time they become due. Nothing here sleeps:
+// the owner polls pop_due() between regular work items and only waits on
+// next_due() once no other work is left.
+template <typename Item>
+class DeferredRetryQueue {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    explicit DeferredRetryQueue(RetryPolicy policy) : policy_(policy), rng_(std::random_device{}()) {}
+
+    const RetryPolicy& policy() const { return policy_; }
+    bool empty() const { return heap_.empty(); }
+    std::size_t size() const { return heap_.size(); }
+
+    // Schedules retry number `attempt` and returns the chosen delay.
+    std::chrono::nanoseconds push(Item item, unsigned attempt) {
+        const auto delay = retry_delay(policy_, attempt, rng_);
+        heap_.push(Entry{Clock::now() + delay, sequence_++, std::move(item)});
+        return delay;
+    }
+
+    Clock::time_point next_due() const { return heap_.top().due; }
+
+    std::optional<Item> pop_due(Clock::time_point now = Clock::now()) {
+        if (heap_.empty() || heap_.top().due > now) {
+            return std::nullopt;
+        }
+        Item item = std::move(const_cast<Entry&>(heap_.top()).item);
+        heap_.pop();
+        return item;
+    }
+
+private:
+    struct Entry {
+        Clock::time_point due;
+        std::uint64_t sequence;
+        Item item;
+
+        // Inverted so std::priority_queue yields the earliest (then oldest) entry.
+        bool operator<(const Entry& other) const {
+            return due != other.due ? due > other.due : sequence > other.sequence;
+        }
+    };
+
+    RetryPolicy policy_;
+    std::mt19937_64 rng_;
+    std::uint64_t sequence_{0};
+    std::priority_queue<Entry> heap_;
+};
+
+} // namespace mfs
@@ -1,15 +1,164 @@
 #pragma once
 
+#include "accounting.hpp"
+#include "buffer_pool.hpp"
+#include "copy_engine.hpp"
+#include "numa.hpp"
+#include "output_format.hpp"
+#include "retry.hpp"
+#include "watchdog.hpp"
+
+#include <array>
 #include <chrono>
 #include <cstdint>
 #include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <iosfwd>
 #include <string>
+#include <string_view>
+#include <system_error>
 #include <vector>
 
 namespace mfs {
 
+class DirectoryListing;
+class EventStream;
+class LiveStatsPublisher;
+class ShardedFlatStringSet;
+class TarWriter;
+class WorkerPool;
+
+// How a destination file shorter than its source is treated.
+enum class ResumeMode {
+    // Copied again from the start.
+    off,
+    // Compared with the source block by block; copying resumes at the first
+    // block that differs.
+    verify,
+    // Trusted if the destination still carries the marker of a copy from
+    // the source as it is now (see PartialCopyMarker): the copy engines
+    // write front to back, so what is there is then a correct prefix.
+    // Copied again from the start otherwise.
+    append,
+};
+
+// The order in which a pass copies the files it found to need copying.
+enum class CopyOrder {
+    // As the directory listing returns them.
+    directory,
+    // Gathered into windows (SyncOptions::copy_window) and issued by inode
+    // number, which tracks allocation order on many filesystems.
+    inode,
+    // As `inode`, but by the physical offset of each file's first extent
+    // (FIEMAP) where the filesystem reports one.
+    extent,
+};
+
+// Priority classes of the copy scheduler: 0 is bulk work, higher is more
+// urgent.
+constexpr std::size_t kPriorityLevels = 8;
+
+// Gives the directories matching `pattern` (fnmatch(3) with FNM_PATHNAME,
+// against the path relative to the source root, e.g. "current" or
+// "*/index") and their whole subtrees the class `level`, 1 to
+// kPriorityLevels - 1. The most urgent matching rule wins.
+struct PriorityRule {
+    std::string pattern;
+    std::size_t level{1};
+};
+
 struct SyncOptions {
     bool remove_extraneous{true};
+    // When non-empty, synchronized entries are also streamed to a columnar
+    // export in this directory (see columnar.hpp).
+    std::filesystem::path columnar_export_dir{};
+    std::size_t columnar_buffer_bytes{1 << 20};
+    // Optional JSON Lines event sink (see event_stream.hpp). The caller owns
+    // its lifetime and closes it after synchronize() returns.
+    std::shared_ptr<EventStream> events{};
+    // Optional shared-memory counters for external monitors (see live_stats.hpp).
+    std::shared_ptr<LiveStatsPublisher> live_stats{};
+    // Aggregate copied/skipped/deleted counts per uid, gid and top-level
+    // directory into SyncStats::usage.
+    bool account_usage{false};
+    // Transient lstat/mkdir/copy failures (see classify_errno) are deferred
+    // and retried with exponential backoff instead of being skipped.
+    RetryPolicy retry{};
+    // Reports filesystem calls that hang (e.g. on a dead NFS server) and can
+    // fence off their subtree (see watchdog.hpp).
+    WatchdogOptions watchdog{};
+    // Worker threads for huge directories. Once a directory has produced more
+    // than `split_threshold` entries, each further getdents64 batch becomes a
+    // work item (stat, compare, copy) for the workers, and the destination
+    // side is matched through an in-memory listing. 1 disables splitting.
+    std::size_t workers{1};
+    std::size_t split_threshold{10000};
+    // With workers > 1 on a multi-node machine: pin the workers to the NUMA
+    // nodes round-robin and the walking thread to the first node, so that
+    // each pass's arena is allocated node-locally on first touch; workers
+    // prefer batches queued for their node, and SyncStats::numa_nodes gets
+    // per-node throughput. A no-op on single-node machines.
+    bool numa{false};
+    // Layout to place threads on; detected from sysfs when null.
+    std::shared_ptr<const NumaTopology> numa_topology{};
+    // When non-zero, file data is copied through a preallocated, huge-page
+    // backed pool of buffers of this size (one per copying thread) instead
+    // of std::filesystem::copy_file (see buffer_pool.hpp).
+    std::size_t copy_buffer_bytes{0};
+    // Copy every file with this engine (see copy_engine.hpp) instead of
+    // std::filesystem::copy_file.
+    std::optional<CopyEngine> copy_engine{};
+    // Pick the fastest copy engine per size class for this pair of
+    // filesystems (probed with statfs): from `copy_engine_cache` when it has
+    // an entry for the pair, otherwise by timing the engines on scratch
+    // files in the destination before the copy stage. Overrides copy_engine.
+    bool calibrate_copy{false};
+    CalibrationOptions calibration{};
+    // Empty disables the cache (see default_calibration_cache()).
+    std::filesystem::path copy_engine_cache{};
+    // Calibrate even when the cache has an entry, and replace it.
+    bool recalibrate_copy{false};
+    // Run the copy loop specialized for the features enabled above. false
+    // selects the generic loop, which tests every option per entry; it is
+    // kept for comparison (bench/bench_policy.cpp).
+    bool specialize{true};
+    // Write the entries the copy stage would copy to this tar stream (see
+    // tar.hpp) instead of to the destination, which is only compared
+    // against and may be missing. Nothing is pruned. The caller finishes
+    // nothing: synchronize() writes the end-of-archive blocks.
+    std::shared_ptr<TarWriter> tar_export{};
+    // Resume interrupted copies of files of at least `resume_min_bytes`
+    // whose destination is shorter than the source. verify compares blocks
+    // of `resume_block_bytes` on `resume_threads` threads.
+    ResumeMode resume{ResumeMode::off};
+    std::uintmax_t resume_min_bytes{8 * 1024 * 1024};
+    std::size_t resume_block_bytes{1024 * 1024};
+    std::size_t resume_threads{4};
+    // With rules, the walker keeps one queue of pending directories per
+    // class and serves the most urgent first: a directory found to be more
+    // urgent than the one being read is walked before the next batch of
+    // that one is read. A less urgent class passed over `priority_aging`
+    // times in a row is served next anyway (0: never), so bulk subtrees
+    // are not starved. Split batches keep the pool's order.
+    std::vector<PriorityRule> priority_rules{};
+    std::size_t priority_aging{64};
+    // Bulk data lane: with data_workers > 0, regular files of at least
+    // `data_min_bytes` are copied by a pool of their own, while the walker
+    // and the `workers` pool (the metadata lane) go on with lstat, mkdir
+    // and small files. `data_queue_bytes` bounds the bytes of the copies
+    // queued or running in the lane; a hand-off beyond it waits.
+    std::size_t data_workers{0};
+    std::uintmax_t data_min_bytes{1024 * 1024};
+    std::uintmax_t data_queue_bytes{256ull * 1024 * 1024};
+    // Outside CopyOrder::directory, each pass holds back up to
+    // `copy_window` copies and issues them sorted, most urgent class first,
+    // so reads sweep the source disk instead of seeking to and fro. The
+    // window bounds how long a copy can be held back; a pass also issues
+    // what it holds when it runs out of work.
+    CopyOrder copy_order{CopyOrder::directory};
+    std::size_t copy_window{256};
 };
 
 struct FileMetadata {
@@ -26,6 +175,84 @@ struct FileMetadata {
     std::uint64_t ctime{0};
     std::uint64_t ctime_nsec{0};
     std::uint64_t size{0};
+    std::uint64_t inode{0};
+};
+
+struct CopyEngineStats {
+    // An engine table replaced std::filesystem::copy_file for this run.
+    bool active{false};
+    CopyEngineTable table{};
+    // Set with SyncOptions::calibrate_copy.
+    FilesystemInfo source_filesystem{};
+    FilesystemInfo destination_filesystem{};
+    std::vector<EngineTiming> calibration{};
+    // The calibration was loaded from SyncOptions::copy_engine_cache.
+    bool cached{false};
+    std::array<std::size_t, kCopySizeClasses> files_copied{};
+};
+
+// Set by ChunkStore::backup (chunk_store.hpp).
+struct DedupStats {
+    // Chunks of the files read this run, and those new to the store.
+    std::uint64_t chunks{0};
+    std::uint64_t chunks_stored{0};
+    std::uint64_t bytes_chunked{0};
+    std::uint64_t bytes_stored{0};
+    // File bytes in the run's manifest, and pack bytes after the run.
+    std::uint64_t snapshot_bytes{0};
+    std::uint64_t store_bytes{0};
+    // Thread time spent reading, chunking and hashing, summed over workers.
+    std::chrono::duration<double> chunk_elapsed{};
+};
+
+// Set by SyncSender and SyncReceiver (transport.hpp); zero for local syncs.
+struct TransportStats {
+    std::uint64_t frames_sent{0};
+    std::uint64_t frames_received{0};
+    std::uint64_t bytes_sent{0};
+    std::uint64_t bytes_received{0};
+    // File bytes moved with splice(2) rather than through a buffer.
+    std::uint64_t bytes_spliced{0};
+    std::size_t peak_files_in_flight{0};
+    // Sender side, with TransportOptions::compress. Skipped chunks failed
+    // the entropy and trial test; file bytes in and wire bytes out cover
+    // every chunk.
+    std::uint64_t chunks_compressed{0};
+    std::uint64_t chunks_skipped{0};
+    std::uint64_t compress_bytes_in{0};
+    std::uint64_t compress_bytes_out{0};
+    // Bytes given to the codec and the thread time it took, summed over
+    // the compressing threads.
+    std::uint64_t codec_bytes{0};
+    std::chrono::duration<double> codec_elapsed{};
+};
+
+// Work of one priority class (see SyncOptions::priority_rules).
+struct PriorityClassStats {
+    std::size_t directories{0};
+    std::size_t entries{0};
+    std::size_t files_copied{0};
+    std::uintmax_t bytes_copied{0};
+    // From the start of the copy stage until the class's last directory or
+    // batch was done.
+    std::chrono::duration<double> completed{};
+};
+
+// Copies handed to the data lane (see SyncOptions::data_workers).
+struct DataLaneStats {
+    std::size_t files{0};
+    std::uintmax_t bytes{0};
+    std::uintmax_t peak_queued_bytes{0};
+    // Hand-offs that waited for the lane's byte budget.
+    std::size_t waits{0};
+};
+
+// Copies issued in sorted windows (see SyncOptions::copy_order).
+struct CopyOrderStats {
+    std::size_t windows{0};
+    std::size_t by_extent{0};
+    // Also counts files without a placed extent under CopyOrder::extent.
+    std::size_t by_inode{0};
 };
 
 struct SyncStats {
@@ -35,38 +262,171 @@ struct SyncStats {
     std::size_t files_deleted{0};
     std::size_t directories_created{0};
     std::uintmax_t bytes_copied{0};
+    // Files completed from a partial destination, and the bytes kept there
+    // (not part of bytes_copied).
+    std::size_t files_resumed{0};
+    std::uintmax_t bytes_resumed{0};
+    std::size_t retries{0};
+    std::size_t retry_failures{0};
+    std::chrono::duration<double> retry_elapsed{};
     std::chrono::duration<double> scan_elapsed{};
     std::chrono::duration<double> copy_elapsed{};
     std::chrono::duration<double> prune_elapsed{};
     std::chrono::duration<double> total_elapsed{};
     std::vector<FileMetadata> synced_entries{};
+    UsageReport usage{};
+    std::vector<StalledOperation> stalled_operations{};
+    std::vector<std::filesystem::path> quarantined{};
+    // Entries not visited because they fell inside a quarantined subtree.
+    std::size_t quarantine_skipped{0};
+    std::size_t directories_split{0};
+    // One row per node when SyncOptions::numa was in effect.
+    std::vector<NodeThroughput> numa_nodes{};
+    // Zero buffers unless SyncOptions::copy_buffer_bytes was set.
+    BufferPoolStats buffer_pool{};
+    CopyEngineStats copy_engines{};
+    TransportStats transport{};
+    // Tar stream bytes written with SyncOptions::tar_export, or read by
+    // TarImporter.
+    std::uint64_t archive_bytes{0};
+    DedupStats dedup{};
+    // Indexed by class, up to the most urgent one in use; empty without
+    // priority rules.
+    std::vector<PriorityClassStats> priority_classes{};
+    DataLaneStats data_lane{};
+    CopyOrderStats copy_order{};
 };
 
+class ColumnarWriter;
+
+// Per-call settings of DirectorySyncer::synchronize().
+struct SyncCall {
+    // Progress lines and warnings go here; std::cout and std::cerr when null.
+    // Lines are written whole, so calls may share a stream.
+    std::ostream* out{nullptr};
+    std::ostream* err{nullptr};
+    // Replaces SyncOptions::events for this call.
+    std::shared_ptr<EventStream> events{};
+};
+
+// One syncer may serve any number of synchronize() calls at a time, from
+// any threads. Everything a call writes lives in its own Run; what calls
+// share is thread-safe: the worker pool (created by the first call that
+// needs it and kept until the syncer is destroyed) and the copy-engine
+// calibrations, made once per pair of filesystems. The options that name a
+// single output (tar_export, columnar_export_dir, live_stats) cannot serve
+// two calls at once; a call that would overlap another then throws
+// std::runtime_error.
 class DirectorySyncer {
 public:
     explicit DirectorySyncer(SyncOptions options = {});
+    ~DirectorySyncer();
+
+    DirectorySyncer(const DirectorySyncer&) = delete;
+    DirectorySyncer& operator=(const DirectorySyncer&) = delete;
 
     SyncStats synchronize(const std::filesystem::path& source,
-                          const std::filesystem::path& destination);
+                          const std::filesystem::path& destination,
+                          const SyncCall& call = {});
 
 private:
+    struct Shared;
+    struct Run;
+
     SyncOptions options_;
+    std::unique_ptr<Shared> shared_;
 
     void validate_inputs(const std::filesystem::path& source,
                          const std::filesystem::path& destination);
-    void ensure_destination_root(const std::filesystem::path& destination);
-    void copy_from_source(const std::filesystem::path& source,
-                         const std::filesystem::path& destination,
-                         SyncStats& stats);
-    void prune_destination(const std::filesystem::path& source,
+    void ensure_destination_root(Run& run, const std::filesystem::path& destination);
+    struct CopyPass;
+    struct PendingDirectory;
+    struct EntryPaths;
+    struct EntryBatch;
+    struct DirectoryQueue;
+    struct DataLane;
+    struct PassProgress;
+
+    // The metadata and data lanes' pools, created on first use; null when
+    // the lane has no workers.
+    WorkerPool* shared_pool();
+    WorkerPool* shared_data_pool();
+    CopyEngineTable select_copy_engines(Run& run, const std::filesystem::path& source,
+                                        const std::filesystem::path& destination, std::size_t buffer_bytes,
+                                        SyncStats& stats);
+    void copy_from_source(Run& run,
+                          const std::filesystem::path& source,
+                          const std::filesystem::path& destination,
+                          SyncStats& stats);
+    // The copy loop below is instantiated once per SyncPolicy (see sync.cpp):
+    // copy_from_source() picks the specialization for the enabled features
+    // so that disabled ones cost nothing per entry.
+    // `relative` is the root's path below the source root ("" for the root).
+    template <typename Policy>
+    void walk_source(CopyPass& pass, const std::filesystem::path& root, std::string relative, int base_depth,
+                     std::string project);
+    // Walks the queued directories of class `min_level` and above.
+    template <typename Policy>
+    void walk_queue(CopyPass& pass, DirectoryQueue& queue, std::size_t min_level);
+    template <typename Policy>
+    void walk_directory(CopyPass& pass, const PendingDirectory& dir, DirectoryQueue& queue);
+    template <typename Policy>
+    void process_batch(CopyPass& pass, const PendingDirectory& dir, const EntryBatch& batch,
+                       const DirectoryListing* listing);
+    std::shared_ptr<const DirectoryListing> read_destination_listing(CopyPass& pass, const PendingDirectory& dir);
+    // True if the source or destination side of the entry is quarantined.
+    bool skip_quarantined(CopyPass& pass, const EntryPaths& paths);
+    // Live stats and progress events of the copy stage, from the walking
+    // thread's pass only; `publish_live` when the live counters are due.
+    void report_progress(CopyPass& pass, bool publish_live);
+    // Class of the directory at `relative`: that of its parent, `inherited`,
+    // raised by the rules matching it.
+    std::size_t directory_priority(const std::string& relative, std::size_t inherited) const;
+    // Returns true when the entry is a directory whose children should be
+    // visited. `listing`, when given, replaces the stat() of the destination
+    // entry.
+    template <typename Policy>
+    bool sync_source_entry(CopyPass& pass, const EntryPaths& paths, int depth, unsigned attempt,
+                           std::string& project, const DirectoryListing* listing = nullptr);
+    // The copy itself, once sync_source_entry() has decided on it and the
+    // parent directory exists; on the pass's thread or a data lane worker.
+    template <typename Policy>
+    void copy_entry(CopyPass& pass, const EntryPaths& paths, FileMetadata& src_meta, int depth, unsigned attempt,
+                    const std::string& project, std::uintmax_t partial_bytes);
+    template <typename Policy>
+    void hand_off_copy(CopyPass& pass, const EntryPaths& paths, const FileMetadata& src_meta, int depth,
+                       unsigned attempt, const std::string& project, std::uintmax_t partial_bytes);
+    // Sorts the copies the pass held back (SyncOptions::copy_order) and
+    // issues them.
+    template <typename Policy>
+    void flush_copies(CopyPass& pass);
+    // Returns true if the failure was handled by the retry machinery (queued,
+    // or reported as exhausted); false for permanent errors.
+    bool schedule_retry(CopyPass& pass, const EntryPaths& paths, int depth, const std::string& project,
+                        unsigned attempt, std::string_view operation, const std::error_code& ec);
+    template <typename Policy>
+    void run_due_retries(CopyPass& pass);
+    template <typename Policy>
+    void drain_retries(CopyPass& pass);
+    void prune_destination(Run& run,
+                           const std::filesystem::path& source,
                            const std::filesystem::path& destination,
                            SyncStats& stats);
 
-    bool collect_metadata(const std::filesystem::path& path, int depth, FileMetadata& out);
-    void log_lstat_error(const std::filesystem::path& path, int err);
+    // Sets meta.file to `path` before recording the entry.
+    void record_synced(Run& run, FileMetadata& meta, std::string_view path, SyncStats& stats);
+    // lstat()s `path` into everything but out.file.
+    bool collect_metadata(Run& run, const char* path, int depth, FileMetadata& out, int* error = nullptr);
+    void log_lstat_error(Run& run, const char* path, int err);
 };
 
-void print_report(const SyncStats& stats);
-void print_synced_metadata(const std::vector<FileMetadata>& entries);
+// Both printers render through OutputBuffer and write to stdout in large
+// chunks; std::cout is flushed first so earlier progress lines stay ordered.
+void print_report(const SyncStats& stats, OutputFormat format = OutputFormat::text);
+void print_synced_metadata(const std::vector<FileMetadata>& entries, OutputFormat format = OutputFormat::text);
+
+// Buffer-level variants used by the printers above.
+void format_report(OutputBuffer& out, const SyncStats& stats, OutputFormat format);
+void format_synced_metadata(OutputBuffer& out, const std::vector<FileMetadata>& entries, OutputFormat format);
 
 } // namespace mfs
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "sync.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <iosfwd>
+#include <mutex>
+#include <string>
+#include <string_view>
+
+namespace mfs {
+
+// POSIX.1-2001 (pax) tar streams: ustar headers, preceded by a pax extended
+// header where a field does not fit (long paths, sizes of 8 GiB and more,
+// large ids, mtimes before 1970 or after 2242) or would lose precision
+// (sub-second mtimes).
+
+// Writes entries to a descriptor as they come; safe to call from several
+// threads, each entry is written whole under a lock. Throws
+// std::runtime_error when the stream cannot be written.
+class TarWriter {
+public:
+    explicit TarWriter(int fd);
+
+    // `path` is relative, without a trailing slash.
+    void add_directory(std::string_view path, const FileMetadata& meta);
+    // Streams `meta.size` bytes of `source` through `buffer`. Throws
+    // std::filesystem::filesystem_error, having written nothing, if the
+    // file cannot be opened; a file that shrinks while it is read is padded
+    // with zeros to the size in its header, one that grows is cut there,
+    // with a warning to `log` (std::cerr when null).
+    void add_file(std::string_view path, const FileMetadata& meta, const std::filesystem::path& source, char* buffer,
+                  std::size_t buffer_bytes, std::ostream* log = nullptr);
+    // Writes the end-of-archive blocks; nothing may be added afterwards.
+    void finish();
+
+    std::uint64_t entries() const;
+    std::uint64_t bytes() const;
+
+private:
+    int fd_;
+    mutable std::mutex mutex_;
+    std::uint64_t entries_{0};
+    std::uint64_t bytes_{0};
+    bool finished_{false};
+
+    void write_header(std::string_view path, char type, const FileMetadata& meta, std::uint64_t size);
+    void write(const char* data, std::size_t size);
+};
+
+struct TarImportOptions {
+    // Threads writing file data; the reading thread hands them chunks.
+    std::size_t workers{4};
+    // Chunks are read into a BufferPool of `workers` + 2 buffers of this
+    // size, which bounds the memory in use.
+    std::size_t buffer_bytes{1024 * 1024};
+};
+
+// Applies a tar stream to a destination tree: directories are created,
+// regular files written (replacing what is there) with their mode and
+// mtime. Other entry types are skipped with a warning, and paths that would
+// leave the destination are rejected. Nothing is pruned. A file that cannot
+// be written whole is removed again and counted as skipped. Throws
+// std::runtime_error on a malformed or truncated stream, once the file it
+// ended inside is removed.
+class TarImporter {
+public:
+    explicit TarImporter(TarImportOptions options = {});
+
+    SyncStats apply(int fd, const std::filesystem::path& destination);
+
+private:
+    TarImportOptions options_;
+};
+
+} // namespace mfs
@@ -0,0 +1,224 @@
+#pragma once
+
+#include "sync.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace mfs {
+
+// Sender/receiver split of a sync for trees that are only reachable through
+// a byte stream (ssh, container exec, a pipe). The sender walks and reads
+// the source, the receiver compares and writes the destination; they speak
+// a framed protocol over a pair of file descriptors:
+//
+//   frame   := type:u8 length:u32le payload[length]
+//   hello   := version:varint flags:varint                 (both ways)
+//   entries := first_id:varint count:varint entry*        (sender)
+//   entry   := kind:u8 mode size mtime mtime_nsec:varint path:string
+//   want    := count:varint id:varint*                     (receiver, one per entries)
+//   data    := id:varint bytes...                          (sender)
+//   data_lz := id:varint size:varint block...              (sender, lz.hpp block of `size` bytes)
+//   file_end := id:varint size:varint                      (sender)
+//   file_abort := id:varint reason:string                  (sender)
+//   done                                                   (sender)
+//   summary := counters:varint*                            (receiver)
+//   error   := message:string                              (either)
+//
+// Entries are batched; the sender keeps walking while wants come back and
+// streams data for several wanted files at once, interleaving their chunks.
+// File bytes in data frames are moved with splice(2) where the descriptors
+// allow it, so they never pass through a user-space buffer on either end.
+// Both ends must ignore SIGPIPE so a vanished peer surfaces as an error.
+
+enum class FrameType : std::uint8_t {
+    hello = 1,
+    entries = 2,
+    want = 3,
+    data = 4,
+    file_end = 5,
+    file_abort = 6,
+    done = 7,
+    summary = 8,
+    error = 9,
+    data_lz = 10,
+};
+
+inline constexpr std::uint32_t kTransportVersion = 2;
+inline constexpr std::uint32_t kMaxFramePayload = 16 * 1024 * 1024;
+
+// Payload encoder: little-endian base-128 varints and length-prefixed
+// strings, appended to a reused buffer.
+class WireWriter {
+public:
+    void clear() { bytes_.clear(); }
+    void put_u8(std::uint8_t value) { bytes_.push_back(static_cast<char>(value)); }
+    void put_varint(std::uint64_t value);
+    void put_string(std::string_view text);
+    void put_bytes(const char* data, std::size_t size) { bytes_.append(data, size); }
+
+    std::string_view view() const { return bytes_; }
+    std::size_t size() const { return bytes_.size(); }
+
+private:
+    std::string bytes_;
+};
+
+// Payload decoder over a received frame. Throws std::runtime_error on
+// truncated or malformed input.
+class WireReader {
+public:
+    explicit WireReader(std::string_view bytes) : bytes_(bytes) {}
+
+    std::uint8_t get_u8();
+    std::uint64_t get_varint();
+    std::string_view get_string();
+    std::string_view get_bytes(std::size_t size);
+    // Everything not consumed yet.
+    std::string_view rest() const { return bytes_.substr(offset_); }
+    bool at_end() const { return offset_ == bytes_.size(); }
+
+private:
+    std::string_view bytes_;
+    std::size_t offset_{0};
+};
+
+struct Frame {
+    FrameType type{FrameType::error};
+    std::string payload;
+};
+
+// Writes whole frames to a blocking descriptor. Throws std::runtime_error
+// when the peer has gone away or the write fails.
+class FrameWriter {
+public:
+    explicit FrameWriter(int fd) : fd_(fd) {}
+
+    void write(FrameType type, std::string_view payload);
+    // Header, `prefix` and `body` in one writev(), so file data is not
+    // copied into a frame buffer first.
+    void write(FrameType type, std::string_view prefix, std::string_view body);
+    // Header and `prefix` of a frame whose remaining `body_bytes` the caller
+    // writes to fd() itself, e.g. with splice(2), before the next frame.
+    void write_header(FrameType type, std::string_view prefix, std::size_t body_bytes);
+
+    int fd() const { return fd_; }
+    std::uint64_t frames() const { return frames_; }
+    std::uint64_t bytes() const { return bytes_; }
+
+private:
+    int fd_;
+    std::uint64_t frames_{0};
+    std::uint64_t bytes_{0};
+};
+
+// Reads whole frames, reusing the payload buffer of `frame`. Returns false
+// on end of stream at a frame boundary; throws std::runtime_error on a
+// truncated or oversized frame.
+class FrameReader {
+public:
+    explicit FrameReader(int fd) : fd_(fd) {}
+
+    bool read(Frame& frame);
+
+    // The same in steps, so that a payload can be taken straight from fd():
+    // read_header() returns false at end of stream like read(), then the
+    // `length` payload bytes must be consumed before the next header.
+    bool read_header(FrameType& type, std::uint32_t& length);
+    void read_payload(std::string& payload, std::uint32_t length);
+    // Reads one varint of the payload, reducing `length` by its size.
+    std::uint64_t read_varint(std::uint32_t& length);
+
+    int fd() const { return fd_; }
+    std::uint64_t frames() const { return frames_; }
+    std::uint64_t bytes() const { return bytes_; }
+
+private:
+    int fd_;
+    std::uint64_t frames_{0};
+    std::uint64_t bytes_{0};
+};
+
+struct TransportOptions {
+    // Wanted files the sender streams at once, interleaving their chunks.
+    std::size_t files_in_flight{4};
+    std::size_t chunk_bytes{256 * 1024};
+    // Entries per metadata frame.
+    std::size_t batch_entries{256};
+    // Sent to the receiver in the hello: prune destination entries that the
+    // sender did not list.
+    bool remove_extraneous{true};
+    // Move file data with splice(2) through a pipe, falling back to
+    // read/write for descriptors that refuse it. Applies to either end.
+    bool zero_copy{true};
+    // Compress chunks with the lz.hpp codec before sending them; chunks
+    // whose byte sample looks random and whose first few KiB do not
+    // compress, and chunks that do not shrink, are sent as they are.
+    // Overrides zero_copy on the sender, since the bytes have to pass
+    // through user space.
+    bool compress{false};
+    // Threads compressing chunks of the files in flight; 0 uses one per CPU.
+    std::size_t compress_threads{0};
+};
+
+// Walks `source` and streams it to a receiver on the other end of
+// `in_fd`/`out_fd`. The returned stats combine the sender's walk with the
+// receiver's summary (copies, skips, deletions). Progress goes to
+// std::cout. Throws std::runtime_error on protocol or peer errors.
+class SyncSender {
+public:
+    SyncSender(int in_fd, int out_fd, TransportOptions options = {});
+
+    SyncStats send(const std::filesystem::path& source);
+
+private:
+    int in_fd_;
+    int out_fd_;
+    TransportOptions options_;
+};
+
+// Applies a sender's stream to `destination`. Logs go to std::cerr, since
+// std::cout is usually the stream back to the sender. Only
+// TransportOptions::zero_copy applies here; the rest come from the sender.
+// Throws std::runtime_error on protocol errors.
+class SyncReceiver {
+public:
+    SyncReceiver(int in_fd, int out_fd, TransportOptions options = {});
+
+    SyncStats receive(const std::filesystem::path& destination);
+
+private:
+    int in_fd_;
+    int out_fd_;
+    TransportOptions options_;
+};
+
+// `command` run through /bin/sh -c with its stdin and stdout connected to
+// pipes, e.g. "ssh host simplesync --receiver /backup".
+class ChildProcess {
+public:
+    explicit ChildProcess(const std::string& command);
+    ~ChildProcess();
+
+    ChildProcess(const ChildProcess&) = delete;
+    ChildProcess& operator=(const ChildProcess&) = delete;
+
+    int to_child() const { return to_child_; }
+    int from_child() const { return from_child_; }
+    // Closes the pipes and waits; returns the exit status (128 + signal
+    // when killed).
+    int wait();
+
+private:
+    pid_t pid_{-1};
+    int to_child_{-1};
+    int from_child_{-1};
+};
+
+} // namespace mfs
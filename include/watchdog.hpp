@@ -0,0 +1,158 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace mfs {
+
+class EventStream;
+
+enum class FsOp : std::uint8_t {
+    lstat,
+    readdir,
+    mkdir,
+    copy,
+    remove,
+};
+
+const char* fs_op_name(FsOp op);
+
+struct WatchdogOptions {
+    bool enabled{false};
+    // An operation running longer than this is reported (once per operation).
+    std::chrono::milliseconds threshold{30000};
+    std::chrono::milliseconds poll_interval{1000};
+    // Stop visiting the subtree of a hung operation so the rest of the run
+    // can proceed once the call returns (or on other workers).
+    bool quarantine{false};
+};
+
+// In-flight operation slot owned by one worker thread. The worker writes it
+// at the start and end of every guarded call; the watchdog thread only reads.
+struct WatchdogSlot {
+    std::size_t worker{0};
+    std::atomic<std::int64_t> start_ns{0};
+    std::atomic<std::uint64_t> generation{0};
+    std::uint64_t reported_generation{0};
+    std::mutex mutex;
+    FsOp op{FsOp::lstat};
+    std::string path;
+};
+
+struct StalledOperation {
+    std::size_t worker;
+    FsOp op;
+    std::filesystem::path path;
+    std::chrono::duration<double> elapsed;
+};
+
+class Watchdog {
+public:
+    // Stalls and quarantines are reported to `log` (std::cerr when null)
+    // and to `events`.
+    explicit Watchdog(WatchdogOptions options, EventStream* events = nullptr, std::ostream* log = nullptr);
+    ~Watchdog();
+
+    Watchdog(const Watchdog&) = delete;
+    Watchdog& operator=(const Watchdog&) = delete;
+
+    // Gives the calling thread a slot; FsOpGuard instances on this thread are
+    // tracked until detach_current_thread(). The slot stays valid for the
+    // watchdog's lifetime.
+    WatchdogSlot* attach_current_thread();
+    // Re-attaches the calling thread to a slot it was given before, so a
+    // pooled thread serving several runs keeps one slot per watchdog.
+    static void resume_current_thread(WatchdogSlot* slot);
+    static void detach_current_thread();
+
+    // Cheap pre-check for hot paths: false until something is quarantined.
+    bool any_quarantined() const { return any_quarantined_.load(std::memory_order_acquire); }
+    bool quarantined(const std::filesystem::path& path) const;
+    std::vector<std::filesystem::path> quarantined_paths() const;
+    std::vector<StalledOperation> stalled_operations() const;
+
+    void stop();
+
+private:
+    WatchdogOptions options_;
+    EventStream* events_;
+    std::ostream& log_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable wake_;
+    bool stopping_{false};
+    std::vector<std::unique_ptr<WatchdogSlot>> slots_;
+    std::vector<StalledOperation> stalled_;
+    std::vector<std::filesystem::path> quarantine_;
+    std::atomic<bool> any_quarantined_{false};
+    std::thread thread_;
+
+    void monitor();
+    void inspect(WatchdogSlot& slot, std::int64_t now_ns);
+};
+
+// Attaches the calling thread for the lifetime of the object so a slot is
+// never left dangling when a run unwinds through an exception. `watchdog`
+// may be null.
+class WatchdogAttachment {
+public:
+    explicit WatchdogAttachment(Watchdog* watchdog) : attached_(watchdog != nullptr) {
+        if (attached_) {
+            watchdog->attach_current_thread();
+        }
+    }
+    // Attaches through `slot`: a new slot stored there on first use, the
+    // same one again afterwards.
+    WatchdogAttachment(Watchdog* watchdog, WatchdogSlot*& slot) : attached_(watchdog != nullptr) {
+        if (!attached_) {
+            return;
+        }
+        if (slot) {
+            Watchdog::resume_current_thread(slot);
+        } else {
+            slot = watchdog->attach_current_thread();
+        }
+    }
+    ~WatchdogAttachment() {
+        if (attached_) {
+            Watchdog::detach_current_thread();
+        }
+    }
+
+    WatchdogAttachment(const WatchdogAttachment&) = delete;
+    WatchdogAttachment& operator=(const WatchdogAttachment&) = delete;
+
+private:
+    bool attached_;
+};
+
+// RAII marker around a potentially blocking filesystem call. A no-op on
+// threads that are not attached to a Watchdog.
+class FsOpGuard {
+public:
+    FsOpGuard(FsOp op, std::string_view path);
+    // Exact fs::path only, so literals and strings take the overload above.
+    template <typename Path, std::enable_if_t<std::is_same_v<Path, std::filesystem::path>, int> = 0>
+    FsOpGuard(FsOp op, const Path& path) : FsOpGuard(op, std::string_view(path.native())) {}
+    ~FsOpGuard();
+
+    FsOpGuard(const FsOpGuard&) = delete;
+    FsOpGuard& operator=(const FsOpGuard&) = delete;
+
+private:
+    WatchdogSlot* slot_;
+};
+
+} // namespace mfs
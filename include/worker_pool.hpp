@@ -0,0 +1,114 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mfs {
+
+// Fixed set of threads draining a bounded FIFO of tasks. submit() blocks
+// while the queue is full, so a producer streaming millions of entries stays
+// a bounded distance ahead of the workers.
+//
+// Workers may be split into groups (NUMA nodes): each group then has its own
+// FIFO, submit() deals tasks to the groups round-robin, and a worker runs
+// tasks of its own group first and steals from the fullest other group only
+// when its own queue is empty. The capacity bounds all queues together.
+//
+// Several producers can share one pool: each submits through its own
+// TaskSet and waits for its own tasks only.
+class WorkerPool {
+public:
+    using Task = std::function<void(std::size_t worker)>;
+
+    // Tasks submitted together and awaited apart from the rest of the pool.
+    // Several threads may submit to one set; wait() once none of them will
+    // submit any more.
+    class TaskSet {
+    public:
+        explicit TaskSet(WorkerPool& pool);
+        // Waits for the set's tasks, which may refer to the producer's stack;
+        // their exceptions are dropped.
+        ~TaskSet();
+
+        TaskSet(const TaskSet&) = delete;
+        TaskSet& operator=(const TaskSet&) = delete;
+
+        void submit(Task task);
+        // Blocks until every task of the set has finished; rethrows the
+        // first exception one of them let escape.
+        void wait();
+        // wait() for at most `timeout`; false if tasks are still pending.
+        bool wait_for(std::chrono::milliseconds timeout);
+        // Tasks of this set `worker` took from another group's queue.
+        std::size_t stolen(std::size_t worker) const;
+
+    private:
+        friend class WorkerPool;
+
+        WorkerPool& pool_;
+        std::condition_variable done_;
+        std::size_t pending_{0};
+        std::exception_ptr failure_;
+        std::vector<std::size_t> stolen_;
+    };
+
+    // Run on each worker thread before its first and after its last task.
+    using ThreadHook = std::function<void(std::size_t worker)>;
+
+    // `worker_groups[i]` is the group of worker i; empty puts every worker
+    // in a single group.
+    WorkerPool(std::size_t threads, std::size_t queue_capacity, ThreadHook on_start = {}, ThreadHook on_exit = {},
+               std::vector<std::size_t> worker_groups = {});
+    // Finishes the queued tasks, then joins the threads.
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    std::size_t size() const { return threads_.size(); }
+
+    void submit(Task task);
+    // Blocks until every submitted task, of any set, has finished; rethrows
+    // the first exception a task submitted without a set let escape.
+    void wait_idle();
+    // Tasks `worker` took from another group's queue so far.
+    std::size_t stolen(std::size_t worker) const;
+
+private:
+    struct Job {
+        Task task;
+        TaskSet* set;
+    };
+
+    std::size_t capacity_;
+    ThreadHook on_start_;
+    ThreadHook on_exit_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable work_ready_;
+    std::condition_variable space_ready_;
+    std::condition_variable idle_;
+    std::vector<std::size_t> worker_groups_;
+    std::vector<std::deque<Job>> queues_;
+    std::vector<std::size_t> stolen_;
+    std::size_t queued_{0};
+    std::size_t next_group_{0};
+    std::size_t running_{0};
+    bool stopping_{false};
+    std::exception_ptr failure_;
+    std::vector<std::thread> threads_;
+
+    void run(std::size_t worker);
+    void enqueue(Task task, TaskSet* set);
+    // Next job for `worker`; requires queued_ > 0 and mutex_ held.
+    Job take(std::size_t worker);
+};
+
+} // namespace mfs
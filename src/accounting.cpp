@@ -0,0 +1,84 @@
+#include "accounting.hpp"
+
+#include <algorithm>
+
+namespace mfs {
+
+namespace {
+
+template <typename Key>
+std::vector<std::pair<Key, UsageCounters>> sorted_table(std::map<Key, UsageCounters>& merged) {
+    std::vector<std::pair<Key, UsageCounters>> table(merged.begin(), merged.end());
+    std::stable_sort(table.begin(), table.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.second.bytes_copied > rhs.second.bytes_copied;
+    });
+    return table;
+}
+
+} // namespace
+
+void UsageShard::copied(std::uint64_t uid, std::uint64_t gid, std::string_view project_name, std::uint64_t bytes) {
+    const UsageCounters delta{bytes, 1, 0, 0};
+    by_uid_[uid] += delta;
+    by_gid_[gid] += delta;
+    project(project_name) += delta;
+}
+
+void UsageShard::skipped(std::uint64_t uid, std::uint64_t gid, std::string_view project_name) {
+    const UsageCounters delta{0, 0, 0, 1};
+    by_uid_[uid] += delta;
+    by_gid_[gid] += delta;
+    project(project_name) += delta;
+}
+
+void UsageShard::deleted(std::uint64_t uid, std::uint64_t gid, std::string_view project_name, std::uint64_t entries) {
+    const UsageCounters delta{0, 0, entries, 0};
+    by_uid_[uid] += delta;
+    by_gid_[gid] += delta;
+    project(project_name) += delta;
+}
+
+UsageCounters& UsageShard::project(std::string_view name) {
+    if (last_project_ == nullptr || name != last_project_name_) {
+        last_project_name_.assign(name.data(), name.size());
+        last_project_ = &by_project_[last_project_name_];
+    }
+    return *last_project_;
+}
+
+UsageShard& UsageAccounting::local() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& shard = shards_[std::this_thread::get_id()];
+    if (!shard) {
+        shard = std::make_unique<UsageShard>();
+    }
+    return *shard;
+}
+
+UsageReport UsageAccounting::merge() const {
+    std::map<std::uint64_t, UsageCounters> uids;
+    std::map<std::uint64_t, UsageCounters> gids;
+    std::map<std::string, UsageCounters> projects;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& [id, shard] : shards_) {
+        (void)id;
+        for (const auto& [uid, counters] : shard->by_uid_) {
+            uids[uid] += counters;
+        }
+        for (const auto& [gid, counters] : shard->by_gid_) {
+            gids[gid] += counters;
+        }
+        for (const auto& [name, counters] : shard->by_project_) {
+            projects[name] += counters;
+        }
+    }
+
+    UsageReport report;
+    report.by_uid = sorted_table(uids);
+    report.by_gid = sorted_table(gids);
+    report.by_project = sorted_table(projects);
+    return report;
+}
+
+} // namespace mfs
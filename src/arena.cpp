@@ -0,0 +1,71 @@
+#include "arena.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace mfs {
+
+void StringArena::grow() {
+    chunks_.push_back(std::unique_ptr<char[]>(new char[chunk_bytes_]));
+    allocated_ += chunk_bytes_;
+    cursor_ = chunks_.back().get();
+    remaining_ = chunk_bytes_;
+}
+
+std::string_view StringArena::intern_large(std::string_view text) {
+    // Oversized strings get a chunk of their own so the tail of the current
+    // chunk stays available for the small ones that follow.
+    chunks_.push_back(std::unique_ptr<char[]>(new char[text.size()]));
+    allocated_ += text.size();
+    std::memcpy(chunks_.back().get(), text.data(), text.size());
+    return std::string_view(chunks_.back().get(), text.size());
+}
+
+BumpArena::BumpArena(BumpArena&& other) noexcept
+    : chunk_bytes_(other.chunk_bytes_),
+      chunks_(std::move(other.chunks_)),
+      used_(std::exchange(other.used_, 0)),
+      cursor_(std::exchange(other.cursor_, nullptr)),
+      end_(std::exchange(other.end_, nullptr)),
+      allocated_(std::exchange(other.allocated_, 0)) {}
+
+BumpArena& BumpArena::operator=(BumpArena&& other) noexcept {
+    if (this != &other) {
+        chunk_bytes_ = other.chunk_bytes_;
+        chunks_ = std::move(other.chunks_);
+        used_ = std::exchange(other.used_, 0);
+        cursor_ = std::exchange(other.cursor_, nullptr);
+        end_ = std::exchange(other.end_, nullptr);
+        allocated_ = std::exchange(other.allocated_, 0);
+    }
+    return *this;
+}
+
+void BumpArena::rewind(const Mark& mark) {
+    used_ = mark.chunks;
+    cursor_ = mark.cursor;
+    end_ = used_ == 0 ? nullptr : chunks_[used_ - 1].data.get() + chunks_[used_ - 1].size;
+}
+
+void* BumpArena::allocate_slow(std::size_t bytes, std::size_t align) {
+    const std::size_t needed = bytes + align - 1;
+    // Chunks released by a rewind are reused in order; one too small for this
+    // request stays unused until the next rewind.
+    while (used_ < chunks_.size()) {
+        const Chunk& chunk = chunks_[used_++];
+        if (chunk.size >= needed) {
+            cursor_ = chunk.data.get();
+            end_ = cursor_ + chunk.size;
+            return allocate(bytes, align);
+        }
+    }
+    const std::size_t size = std::max(chunk_bytes_, needed);
+    chunks_.push_back(Chunk{std::unique_ptr<char[]>(new char[size]), size});
+    allocated_ += size;
+    used_ = chunks_.size();
+    cursor_ = chunks_.back().data.get();
+    end_ = cursor_ + size;
+    return allocate(bytes, align);
+}
+
+} // namespace mfs
@@ -0,0 +1,144 @@
+#include "buffer_pool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <sys/mman.h>
+
+namespace mfs {
+
+namespace {
+
+constexpr std::size_t kHugePageBytes = 2 * 1024 * 1024;
+constexpr std::size_t kPageBytes = 4096;
+
+std::size_t round_up(std::size_t value, std::size_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+// AnonHugePages of the mapping starting at `start`, from /proc/self/smaps.
+// Zero where the file does not exist.
+std::uintmax_t transparent_huge_bytes(const void* start, std::size_t length) {
+    std::ifstream smaps("/proc/self/smaps");
+    const auto target = reinterpret_cast<std::uintptr_t>(start);
+    std::string line;
+    bool in_mapping = false;
+    while (std::getline(smaps, line)) {
+        unsigned long low = 0;
+        unsigned long high = 0;
+        if (std::sscanf(line.c_str(), "%lx-%lx ", &low, &high) == 2 && line.find(':') > line.find(' ')) {
+            in_mapping = low <= target && target < high;
+            continue;
+        }
+        unsigned long kib = 0;
+        if (in_mapping && std::sscanf(line.c_str(), "AnonHugePages: %lu kB", &kib) == 1) {
+            // The kernel may have merged the pool with a neighbouring mapping.
+            return std::min<std::uintmax_t>(static_cast<std::uintmax_t>(kib) * 1024, length);
+        }
+    }
+    return 0;
+}
+
+} // namespace
+
+BufferPool::Lease::Lease(Lease&& other) noexcept : pool_(other.pool_), data_(std::exchange(other.data_, nullptr)) {}
+
+BufferPool::Lease::~Lease() {
+    if (data_ != nullptr) {
+        pool_->release(data_);
+    }
+}
+
+BufferPool::BufferPool(std::size_t buffers, std::size_t buffer_bytes)
+    : buffer_bytes_(round_up(std::max<std::size_t>(buffer_bytes, kPageBytes), kPageBytes)) {
+    buffers = std::max<std::size_t>(buffers, 1);
+    mapping_bytes_ = round_up(buffers * buffer_bytes_, kHugePageBytes);
+
+    char* base = nullptr;
+#if defined(MAP_HUGETLB)
+    void* huge = ::mmap(nullptr, mapping_bytes_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                        -1, 0);
+    if (huge != MAP_FAILED) {
+        mapping_ = huge;
+        base = static_cast<char*>(huge);
+        stats_.hugetlb = true;
+    }
+#endif
+    if (base == nullptr) {
+        // Over-allocate so a 2 MiB-aligned range can be cut out of it; only
+        // aligned ranges can be backed by transparent huge pages.
+        const std::size_t padded = mapping_bytes_ + kHugePageBytes;
+        void* raw = ::mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            throw std::runtime_error("Failed to map copy buffer pool: " +
+                                     std::error_code(errno, std::generic_category()).message());
+        }
+        const auto address = reinterpret_cast<std::uintptr_t>(raw);
+        const std::uintptr_t aligned = round_up(address, kHugePageBytes);
+        if (aligned > address) {
+            ::munmap(raw, aligned - address);
+        }
+        const std::uintptr_t tail = aligned + mapping_bytes_;
+        if (address + padded > tail) {
+            ::munmap(reinterpret_cast<void*>(tail), address + padded - tail);
+        }
+        mapping_ = reinterpret_cast<void*>(aligned);
+        base = static_cast<char*>(mapping_);
+#if defined(MADV_HUGEPAGE)
+        ::madvise(mapping_, mapping_bytes_, MADV_HUGEPAGE); // advisory; failure is fine
+#endif
+    }
+
+    // Fault the pool in now rather than on the first copies.
+    for (std::size_t offset = 0; offset < mapping_bytes_; offset += kPageBytes) {
+        base[offset] = 0;
+    }
+    // Only the part handed out as buffers counts; the tail past it is padding.
+    const std::uintmax_t backed = stats_.hugetlb ? mapping_bytes_ : transparent_huge_bytes(mapping_, mapping_bytes_);
+    stats_.huge_page_bytes = std::min<std::uintmax_t>(backed, buffers * buffer_bytes_);
+
+    stats_.buffers = buffers;
+    stats_.buffer_bytes = buffer_bytes_;
+    free_.reserve(buffers);
+    for (std::size_t i = buffers; i-- > 0;) {
+        free_.push_back(base + i * buffer_bytes_);
+    }
+}
+
+BufferPool::~BufferPool() {
+    ::munmap(mapping_, mapping_bytes_);
+}
+
+BufferPool::Lease BufferPool::acquire() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++stats_.acquisitions;
+    if (free_.empty()) {
+        ++stats_.waits;
+        released_.wait(lock, [this] { return !free_.empty(); });
+    }
+    char* data = free_.back();
+    free_.pop_back();
+    stats_.peak_in_use = std::max(stats_.peak_in_use, stats_.buffers - free_.size());
+    return Lease(this, data);
+}
+
+BufferPoolStats BufferPool::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void BufferPool::release(char* data) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        free_.push_back(data);
+    }
+    released_.notify_one();
+}
+
+} // namespace mfs
@@ -0,0 +1,835 @@
+#include "chunk_store.hpp"
+
+#include "arena.hpp"
+#include "buffer_pool.hpp"
+#include "dir_reader.hpp"
+#include "output_format.hpp"
+#include "transport.hpp"
+#include "worker_pool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mfs {
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr std::string_view kManifestMagic = "simplesync-manifest 1\n";
+constexpr std::string_view kManifestSuffix = ".manifest";
+constexpr std::size_t kIndexRecord = 32 + 4 + 8 + 4;
+constexpr std::uint8_t kEntryDirectory = 1;
+constexpr std::uint8_t kEntryFile = 2;
+
+// SHA-256 (FIPS 180-4).
+constexpr std::uint32_t kSha256Rounds[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+std::uint32_t rotr(std::uint32_t value, unsigned bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+void sha256_block(std::uint32_t state[8], const unsigned char* block) {
+    std::uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+        w[i] = static_cast<std::uint32_t>(block[i * 4]) << 24 | static_cast<std::uint32_t>(block[i * 4 + 1]) << 16 |
+               static_cast<std::uint32_t>(block[i * 4 + 2]) << 8 | static_cast<std::uint32_t>(block[i * 4 + 3]);
+    }
+    for (int i = 16; i < 64; ++i) {
+        const std::uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        const std::uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    std::uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    std::uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+        const std::uint32_t t1 =
+            h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + kSha256Rounds[i] + w[i];
+        const std::uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+// Fixed pseudo-random table (splitmix64), so boundaries are stable across
+// builds and stores can be shared between them.
+constexpr std::array<std::uint64_t, 256> make_gear_table() {
+    std::array<std::uint64_t, 256> table{};
+    std::uint64_t seed = 0x6a09e667f3bcc908ull;
+    for (auto& value : table) {
+        seed += 0x9e3779b97f4a7c15ull;
+        std::uint64_t z = seed;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        value = z ^ (z >> 31);
+    }
+    return table;
+}
+
+constexpr std::array<std::uint64_t, 256> kGear = make_gear_table();
+
+// The top `bits` bits: with a left-shifting gear hash they depend on the
+// most recent 64 bytes.
+std::uint64_t top_bits(unsigned bits) {
+    return bits == 0 ? 0 : ~std::uint64_t{0} << (64 - bits);
+}
+
+unsigned log2_floor(std::size_t value) {
+    unsigned bits = 0;
+    while (value > 1) {
+        value >>= 1;
+        ++bits;
+    }
+    return bits;
+}
+
+struct ChunkLocation {
+    std::uint32_t pack;
+    std::uint64_t offset;
+    std::uint32_t length;
+};
+
+struct DigestHash {
+    std::size_t operator()(const ChunkDigest& digest) const {
+        std::size_t value;
+        std::memcpy(&value, digest.data(), sizeof(value));
+        return value;
+    }
+};
+
+struct ChunkRef {
+    ChunkDigest digest;
+    std::uint32_t length;
+};
+
+struct ManifestEntry {
+    std::uint8_t kind{kEntryFile};
+    std::string path;
+    std::uint64_t mode{0};
+    std::uint64_t mtime{0};
+    std::uint64_t mtime_nsec{0};
+    std::uint64_t size{0};
+    std::vector<ChunkRef> chunks;
+    // Could not be read; left out of the manifest.
+    bool failed{false};
+};
+
+std::string errno_message(int err) {
+    return std::error_code(err, std::generic_category()).message();
+}
+
+[[noreturn]] void throw_errno(const std::string& what, const fs::path& path) {
+    throw std::runtime_error(what + " " + path.string() + ": " + errno_message(errno));
+}
+
+void sync_fd(int fd, const fs::path& path) {
+    if (::fsync(fd) != 0) {
+        throw_errno("Failed to flush", path);
+    }
+}
+
+std::string read_whole_file(const fs::path& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw_errno("Failed to open", path);
+    }
+    std::string data;
+    char buffer[64 * 1024];
+    for (;;) {
+        const ssize_t n = ::read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            ::close(fd);
+            throw_errno("Failed to read", path);
+        }
+        if (n == 0) {
+            break;
+        }
+        data.append(buffer, static_cast<std::size_t>(n));
+    }
+    ::close(fd);
+    return data;
+}
+
+std::string pack_name(std::uint32_t pack) {
+    std::string name = std::to_string(pack);
+    name.insert(0, name.size() < 8 ? 8 - name.size() : 0, '0');
+    return name + ".pack";
+}
+
+std::string join(const std::string& parent, std::string_view name) {
+    std::string path = parent;
+    if (!path.empty()) {
+        path += '/';
+    }
+    path += name;
+    return path;
+}
+
+std::vector<ManifestEntry> parse_manifest(const std::string& data, const std::string& run) {
+    std::vector<ManifestEntry> entries;
+    if (data.compare(0, kManifestMagic.size(), kManifestMagic) != 0) {
+        throw std::runtime_error("Not a chunk store manifest: " + run);
+    }
+    try {
+        WireReader reader(std::string_view(data).substr(kManifestMagic.size()));
+        while (!reader.at_end()) {
+            ManifestEntry entry;
+            entry.kind = reader.get_u8();
+            entry.path = std::string(reader.get_string());
+            entry.mode = reader.get_varint();
+            entry.mtime = reader.get_varint();
+            entry.mtime_nsec = reader.get_varint();
+            entry.size = reader.get_varint();
+            if (entry.kind == kEntryFile) {
+                const std::uint64_t count = reader.get_varint();
+                if (count > reader.rest().size() / (sizeof(ChunkDigest) + 1)) {
+                    throw std::runtime_error("chunk count past the end");
+                }
+                entry.chunks.resize(static_cast<std::size_t>(count));
+                for (ChunkRef& chunk : entry.chunks) {
+                    const std::string_view digest = reader.get_bytes(chunk.digest.size());
+                    std::memcpy(chunk.digest.data(), digest.data(), digest.size());
+                    chunk.length = static_cast<std::uint32_t>(reader.get_varint());
+                }
+            } else if (entry.kind != kEntryDirectory) {
+                throw std::runtime_error("unknown entry kind");
+            }
+            entries.push_back(std::move(entry));
+        }
+    } catch (const std::runtime_error&) {
+        throw std::runtime_error("Malformed chunk store manifest: " + run);
+    }
+    return entries;
+}
+
+} // namespace
+
+ChunkDigest sha256(const char* data, std::size_t size) {
+    std::uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                              0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    const auto* in = reinterpret_cast<const unsigned char*>(data);
+    std::size_t remaining = size;
+    while (remaining >= 64) {
+        sha256_block(state, in);
+        in += 64;
+        remaining -= 64;
+    }
+    // Padding: 0x80, zeros, and the bit length in the last 8 bytes.
+    unsigned char tail[128] = {};
+    std::memcpy(tail, in, remaining);
+    tail[remaining] = 0x80;
+    const std::size_t tail_bytes = remaining < 56 ? 64 : 128;
+    const std::uint64_t bits = static_cast<std::uint64_t>(size) * 8;
+    for (int i = 0; i < 8; ++i) {
+        tail[tail_bytes - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+    }
+    for (std::size_t offset = 0; offset < tail_bytes; offset += 64) {
+        sha256_block(state, tail + offset);
+    }
+    ChunkDigest digest;
+    for (int i = 0; i < 8; ++i) {
+        digest[i * 4] = static_cast<unsigned char>(state[i] >> 24);
+        digest[i * 4 + 1] = static_cast<unsigned char>(state[i] >> 16);
+        digest[i * 4 + 2] = static_cast<unsigned char>(state[i] >> 8);
+        digest[i * 4 + 3] = static_cast<unsigned char>(state[i]);
+    }
+    return digest;
+}
+
+std::string to_hex(const ChunkDigest& digest) {
+    static const char kDigits[] = "0123456789abcdef";
+    std::string text;
+    text.reserve(digest.size() * 2);
+    for (const unsigned char byte : digest) {
+        text += kDigits[byte >> 4];
+        text += kDigits[byte & 15];
+    }
+    return text;
+}
+
+std::size_t cdc_cut(const char* data, std::size_t size, const ChunkingParams& params) {
+    if (size <= params.min_bytes) {
+        return size;
+    }
+    const std::size_t limit = std::min(size, params.max_bytes);
+    const std::size_t normal = std::min(limit, params.avg_bytes);
+    const unsigned bits = log2_floor(params.avg_bytes);
+    // Normalized chunking, level 2: two bits harder before the average,
+    // two bits easier after it.
+    const std::uint64_t mask_small = top_bits(bits + 2);
+    const std::uint64_t mask_large = top_bits(bits > 2 ? bits - 2 : 0);
+    const auto* in = reinterpret_cast<const unsigned char*>(data);
+    std::uint64_t hash = 0;
+    // Bytes before min_bytes cannot end a chunk and are not hashed; the
+    // window is primed well before any cut can happen.
+    std::size_t i = params.min_bytes;
+    for (; i < normal; ++i) {
+        hash = (hash << 1) + kGear[in[i]];
+        if ((hash & mask_small) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < limit; ++i) {
+        hash = (hash << 1) + kGear[in[i]];
+        if ((hash & mask_large) == 0) {
+            return i + 1;
+        }
+    }
+    return limit;
+}
+
+struct ChunkStore::State {
+    std::mutex mutex;
+    std::unordered_map<ChunkDigest, ChunkLocation, DigestHash> index;
+    // Records for chunks added this run, appended to the index at the end.
+    std::string index_tail;
+    std::uint32_t next_pack{1};
+    // The pack being appended to, -1 before the first new chunk.
+    int pack_fd{-1};
+    std::uint32_t pack{0};
+    std::uint64_t pack_size{0};
+    std::uint64_t store_bytes{0};
+    // Packs opened for reading, by number.
+    std::unordered_map<std::uint32_t, int> readers;
+
+    ~State() {
+        if (pack_fd >= 0) {
+            ::close(pack_fd);
+        }
+        for (const auto& reader : readers) {
+            ::close(reader.second);
+        }
+    }
+};
+
+ChunkStore::ChunkStore(fs::path root, ChunkStoreOptions options)
+    : root_(std::move(root)), options_(options), state_(std::make_unique<State>()) {
+    if ((options_.chunking.avg_bytes & (options_.chunking.avg_bytes - 1)) != 0 ||
+        options_.chunking.min_bytes >= options_.chunking.avg_bytes ||
+        options_.chunking.avg_bytes >= options_.chunking.max_bytes) {
+        throw std::runtime_error("Invalid chunking parameters: min < avg < max, avg a power of two");
+    }
+    fs::create_directories(root_ / "packs");
+    fs::create_directories(root_ / "manifests");
+
+    for (const auto& entry : fs::directory_iterator(root_ / "packs")) {
+        const std::string name = entry.path().filename().string();
+        if (entry.path().extension() == ".pack") {
+            const auto number = static_cast<std::uint32_t>(std::strtoul(name.c_str(), nullptr, 10));
+            state_->next_pack = std::max(state_->next_pack, number + 1);
+            state_->store_bytes += entry.file_size();
+        }
+    }
+    if (fs::exists(root_ / "index")) {
+        const std::string index = read_whole_file(root_ / "index");
+        // A record torn by a crash is ignored; its chunk is stored again.
+        for (std::size_t offset = 0; offset + kIndexRecord <= index.size(); offset += kIndexRecord) {
+            const char* record = index.data() + offset;
+            ChunkDigest digest;
+            std::memcpy(digest.data(), record, digest.size());
+            ChunkLocation location{};
+            std::memcpy(&location.pack, record + 32, 4);
+            std::memcpy(&location.offset, record + 36, 8);
+            std::memcpy(&location.length, record + 44, 4);
+            state_->index.emplace(digest, location);
+        }
+    }
+}
+
+ChunkStore::~ChunkStore() = default;
+
+std::vector<std::string> ChunkStore::runs() const {
+    std::vector<std::string> names;
+    for (const auto& entry : fs::directory_iterator(root_ / "manifests")) {
+        const std::string name = entry.path().filename().string();
+        if (name.size() > kManifestSuffix.size() &&
+            name.compare(name.size() - kManifestSuffix.size(), kManifestSuffix.size(), kManifestSuffix) == 0) {
+            names.push_back(name.substr(0, name.size() - kManifestSuffix.size()));
+        }
+    }
+    // Names are UTC timestamps, so they sort by age.
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+SyncStats ChunkStore::backup(const fs::path& source) {
+    const auto start = Clock::now();
+    if (!fs::is_directory(source)) {
+        throw std::runtime_error("Source path is not a directory: " + source.string());
+    }
+    SyncStats stats;
+    State& state = *state_;
+
+    // Unchanged files are taken from the latest run without reading them.
+    std::unordered_map<std::string, ManifestEntry> previous;
+    const std::vector<std::string> earlier = runs();
+    if (!earlier.empty()) {
+        const std::string& run = earlier.back();
+        for (ManifestEntry& entry :
+             parse_manifest(read_whole_file(root_ / "manifests" / (run + std::string(kManifestSuffix))), run)) {
+            if (entry.kind == kEntryFile) {
+                std::string path = entry.path;
+                previous.emplace(std::move(path), std::move(entry));
+            }
+        }
+    }
+
+    // Chunks are read into the pool and cut there; a buffer holds several
+    // maximum-size chunks so refills are rare.
+    const ChunkingParams params = options_.chunking;
+    const std::size_t workers = std::max<std::size_t>(options_.workers, 1);
+    BufferPool buffers(workers, std::max<std::size_t>(4 * params.max_bytes, 1024 * 1024));
+    std::mutex stats_mutex;
+
+    // Stores a chunk unless the index has it; true if it was new.
+    auto store_chunk = [&](const ChunkDigest& digest, const char* data, std::size_t length) {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        if (state.index.count(digest) != 0) {
+            return false;
+        }
+        if (state.pack_fd < 0 || state.pack_size + length > options_.pack_bytes) {
+            if (state.pack_fd >= 0) {
+                sync_fd(state.pack_fd, root_ / "packs" / pack_name(state.pack));
+                ::close(state.pack_fd);
+            }
+            state.pack = state.next_pack++;
+            const fs::path path = root_ / "packs" / pack_name(state.pack);
+            state.pack_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            if (state.pack_fd < 0) {
+                throw_errno("Failed to create pack", path);
+            }
+            state.pack_size = 0;
+        }
+        write_fully(state.pack_fd, data, length);
+        const ChunkLocation location{state.pack, state.pack_size, static_cast<std::uint32_t>(length)};
+        state.index.emplace(digest, location);
+        char record[kIndexRecord];
+        std::memcpy(record, digest.data(), digest.size());
+        std::memcpy(record + 32, &location.pack, 4);
+        std::memcpy(record + 36, &location.offset, 8);
+        std::memcpy(record + 44, &location.length, 4);
+        state.index_tail.append(record, sizeof(record));
+        state.pack_size += length;
+        state.store_bytes += length;
+        return true;
+    };
+
+    auto chunk_file = [&](ManifestEntry& entry, const fs::path& path) {
+        const auto chunk_start = Clock::now();
+        std::uint64_t chunks = 0, stored = 0, stored_bytes = 0, total = 0;
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "    Warning: failed to open " << path << ": " << errno_message(errno) << std::endl;
+            entry.failed = true;
+            return;
+        }
+#if defined(POSIX_FADV_SEQUENTIAL)
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        BufferPool::Lease lease = buffers.acquire();
+        char* const buffer = lease.data();
+        std::size_t begin = 0, end = 0;
+        bool eof = false;
+        while (true) {
+            if (!eof && end - begin < params.max_bytes) {
+                std::memmove(buffer, buffer + begin, end - begin);
+                end -= begin;
+                begin = 0;
+                while (!eof && end < lease.size()) {
+                    const ssize_t n = ::read(fd, buffer + end, lease.size() - end);
+                    if (n < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (n < 0) {
+                        std::cerr << "    Warning: failed to read " << path << ": " << errno_message(errno)
+                                  << std::endl;
+                        ::close(fd);
+                        entry.failed = true;
+                        return;
+                    }
+                    eof = n == 0;
+                    end += static_cast<std::size_t>(n);
+                    total += static_cast<std::uint64_t>(n);
+                }
+            }
+            if (begin == end) {
+                break;
+            }
+            const std::size_t length = cdc_cut(buffer + begin, end - begin, params);
+            const ChunkDigest digest = sha256(buffer + begin, length);
+            bool stored_new = false;
+            try {
+                stored_new = store_chunk(digest, buffer + begin, length);
+            } catch (...) {
+                ::close(fd);
+                throw;
+            }
+            if (stored_new) {
+                ++stored;
+                stored_bytes += length;
+            }
+            entry.chunks.push_back(ChunkRef{digest, static_cast<std::uint32_t>(length)});
+            ++chunks;
+            begin += length;
+        }
+        ::close(fd);
+        if (total != entry.size) {
+            std::cerr << "    Warning: " << path << " changed size while read (" << entry.size << " -> " << total
+                      << " bytes)" << std::endl;
+            entry.size = total;
+        }
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        ++stats.files_copied;
+        stats.bytes_copied += total;
+        stats.dedup.chunks += chunks;
+        stats.dedup.chunks_stored += stored;
+        stats.dedup.bytes_chunked += total;
+        stats.dedup.bytes_stored += stored_bytes;
+        stats.dedup.chunk_elapsed += Clock::now() - chunk_start;
+        std::cout << "    Chunked file: " << path << " (" << chunks << " chunks, " << stored << " new)" << std::endl;
+    };
+
+    // Entries keep their addresses while the walk appends more, so workers
+    // fill them in place.
+    std::deque<ManifestEntry> entries;
+    {
+        WorkerPool pool(workers, workers * 2);
+        BumpArena arena;
+        std::vector<std::string> stack{std::string()};
+        std::vector<std::string> subdirs;
+        while (!stack.empty()) {
+            const std::string relative = std::move(stack.back());
+            stack.pop_back();
+            const fs::path directory = relative.empty() ? source : source / relative;
+
+            ArenaScope directory_scope(arena);
+            DirectoryReader reader(directory, arena);
+            ArenaVector<DirEntryName> batch{ArenaAllocator<DirEntryName>(arena)};
+            while (reader.next_batch(batch)) {
+                for (const DirEntryName& name : batch) {
+                    std::string path = join(relative, name.name);
+                    const fs::path full = source / path;
+                    struct stat st {};
+                    if (::lstat(full.c_str(), &st) != 0) {
+                        std::cerr << "    Error: lstat failed for " << full << ": " << errno_message(errno)
+                                  << std::endl;
+                        continue;
+                    }
+                    ++stats.entries_scanned;
+                    if (S_ISLNK(st.st_mode)) {
+                        std::cout << "    Skipping symlink: " << full << std::endl;
+                        continue;
+                    }
+                    if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+                        std::cout << "    Skipping non-regular entry: " << full << std::endl;
+                        continue;
+                    }
+#if defined(__APPLE__) || defined(__MACH__)
+                    const auto mtime = st.st_mtimespec;
+#else
+                    const auto mtime = st.st_mtim;
+#endif
+                    ManifestEntry& entry = entries.emplace_back();
+                    entry.kind = S_ISDIR(st.st_mode) ? kEntryDirectory : kEntryFile;
+                    entry.path = path;
+                    entry.mode = static_cast<std::uint64_t>(st.st_mode & 07777);
+                    entry.mtime = static_cast<std::uint64_t>(mtime.tv_sec);
+                    entry.mtime_nsec = static_cast<std::uint64_t>(mtime.tv_nsec);
+                    if (entry.kind == kEntryDirectory) {
+                        subdirs.push_back(std::move(path));
+                        continue;
+                    }
+                    entry.size = static_cast<std::uint64_t>(st.st_size);
+                    const auto it = previous.find(path);
+                    if (it != previous.end() && it->second.size == entry.size && it->second.mtime == entry.mtime &&
+                        it->second.mtime_nsec == entry.mtime_nsec) {
+                        std::lock_guard<std::mutex> lock(state.mutex);
+                        const bool stored = std::all_of(
+                            it->second.chunks.begin(), it->second.chunks.end(),
+                            [&](const ChunkRef& chunk) { return state.index.count(chunk.digest) != 0; });
+                        if (stored) {
+                            entry.chunks = std::move(it->second.chunks);
+                            ++stats.files_skipped;
+                            continue;
+                        }
+                    }
+                    pool.submit([&chunk_file, &entry, full](std::size_t) { chunk_file(entry, full); });
+                }
+            }
+            if (reader.error()) {
+                std::cerr << "    Warning: failed to read directory " << directory << ": "
+                          << reader.error().message() << std::endl;
+            }
+            // Depth first, in listing order.
+            stack.insert(stack.end(), std::make_move_iterator(subdirs.rbegin()),
+                         std::make_move_iterator(subdirs.rend()));
+            subdirs.clear();
+        }
+        pool.wait_idle();
+    }
+
+    // Packs and index reach the disk before the manifest that refers to them.
+    if (state.pack_fd >= 0) {
+        sync_fd(state.pack_fd, root_ / "packs" / pack_name(state.pack));
+        ::close(state.pack_fd);
+        state.pack_fd = -1;
+    }
+    if (!state.index_tail.empty()) {
+        const fs::path index_path = root_ / "index";
+        const int fd = ::open(index_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw_errno("Failed to open", index_path);
+        }
+        write_fully(fd, state.index_tail.data(), state.index_tail.size());
+        sync_fd(fd, index_path);
+        ::close(fd);
+        state.index_tail.clear();
+    }
+
+    WireWriter manifest;
+    manifest.put_bytes(kManifestMagic.data(), kManifestMagic.size());
+    for (const ManifestEntry& entry : entries) {
+        if (entry.failed) {
+            continue;
+        }
+        manifest.put_u8(entry.kind);
+        manifest.put_string(entry.path);
+        manifest.put_varint(entry.mode);
+        manifest.put_varint(entry.mtime);
+        manifest.put_varint(entry.mtime_nsec);
+        manifest.put_varint(entry.size);
+        if (entry.kind == kEntryFile) {
+            manifest.put_varint(entry.chunks.size());
+            for (const ChunkRef& chunk : entry.chunks) {
+                manifest.put_bytes(reinterpret_cast<const char*>(chunk.digest.data()), chunk.digest.size());
+                manifest.put_varint(chunk.length);
+            }
+            stats.dedup.snapshot_bytes += entry.size;
+        }
+    }
+
+    // UTC with microseconds; a collision only happens within one microsecond.
+    const auto now = std::chrono::system_clock::now();
+    const std::time_t seconds = std::chrono::system_clock::to_time_t(now);
+    const auto micros =
+        std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count() % 1000000;
+    std::tm utc{};
+    ::gmtime_r(&seconds, &utc);
+    char name[32];
+    std::strftime(name, sizeof(name), "%Y%m%dT%H%M%S", &utc);
+    std::string micro_text = std::to_string(micros);
+    const std::string run = std::string(name) + "." + std::string(6 - micro_text.size(), '0') + micro_text + "Z";
+    const fs::path manifest_path = root_ / "manifests" / (run + std::string(kManifestSuffix));
+    const fs::path temporary = root_ / "manifests" / (run + ".tmp");
+    const int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw_errno("Failed to create", temporary);
+    }
+    write_fully(fd, manifest.view().data(), manifest.size());
+    sync_fd(fd, temporary);
+    ::close(fd);
+    fs::rename(temporary, manifest_path);
+    last_run_ = run;
+    std::cout << "    Wrote manifest: " << manifest_path << std::endl;
+
+    stats.dedup.store_bytes = state.store_bytes;
+    stats.buffer_pool = buffers.stats();
+    stats.copy_elapsed = Clock::now() - start;
+    stats.total_elapsed = stats.copy_elapsed;
+    return stats;
+}
+
+SyncStats ChunkStore::restore(const std::string& run, const fs::path& destination) {
+    const auto start = Clock::now();
+    std::string name = run;
+    if (name.empty()) {
+        const std::vector<std::string> all = runs();
+        if (all.empty()) {
+            throw std::runtime_error("Chunk store has no runs: " + root_.string());
+        }
+        name = all.back();
+    }
+    const fs::path manifest_path = root_ / "manifests" / (name + std::string(kManifestSuffix));
+    if (!fs::exists(manifest_path)) {
+        throw std::runtime_error("No such run in chunk store: " + name);
+    }
+    const std::vector<ManifestEntry> entries = parse_manifest(read_whole_file(manifest_path), name);
+    std::cout << "    Restoring run " << name << " to " << destination << std::endl;
+
+    SyncStats stats;
+    State& state = *state_;
+    std::mutex stats_mutex;
+    std::uint32_t largest = 1;
+    for (const ManifestEntry& entry : entries) {
+        for (const ChunkRef& chunk : entry.chunks) {
+            largest = std::max(largest, chunk.length);
+        }
+    }
+    const std::size_t workers = std::max<std::size_t>(options_.workers, 1);
+    BufferPool buffers(workers, largest);
+
+    auto pack_reader = [&](std::uint32_t pack) {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        const auto it = state.readers.find(pack);
+        if (it != state.readers.end()) {
+            return it->second;
+        }
+        const fs::path path = root_ / "packs" / pack_name(pack);
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            throw_errno("Failed to open pack", path);
+        }
+        state.readers.emplace(pack, fd);
+        return fd;
+    };
+    auto locate = [&](const ChunkDigest& digest) {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        const auto it = state.index.find(digest);
+        if (it == state.index.end()) {
+            throw std::runtime_error("Chunk store is missing chunk " + to_hex(digest));
+        }
+        return it->second;
+    };
+
+    auto restore_file = [&](const ManifestEntry& entry, const fs::path& target) {
+        std::error_code ec;
+        if (fs::is_symlink(target, ec) || (fs::exists(target, ec) && !fs::is_regular_file(target, ec))) {
+            fs::remove_all(target);
+        }
+        int fd = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (fd < 0 && errno == ENOENT) {
+            fs::create_directories(target.parent_path());
+            fd = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        }
+        if (fd < 0) {
+            throw_errno("Failed to create", target);
+        }
+        BufferPool::Lease lease = buffers.acquire();
+        try {
+            for (const ChunkRef& chunk : entry.chunks) {
+                const ChunkLocation location = locate(chunk.digest);
+                if (location.length != chunk.length) {
+                    throw std::runtime_error("Chunk store corrupt: length mismatch for chunk " + to_hex(chunk.digest));
+                }
+                const int pack = pack_reader(location.pack);
+                std::size_t done = 0;
+                while (done < location.length) {
+                    const ssize_t n = ::pread(pack, lease.data() + done, location.length - done,
+                                              static_cast<off_t>(location.offset + done));
+                    if (n < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    if (n <= 0) {
+                        throw std::runtime_error("Chunk store corrupt: short read of chunk " + to_hex(chunk.digest));
+                    }
+                    done += static_cast<std::size_t>(n);
+                }
+                if (sha256(lease.data(), location.length) != chunk.digest) {
+                    throw std::runtime_error("Chunk store corrupt: digest mismatch for chunk " +
+                                             to_hex(chunk.digest));
+                }
+                write_fully(fd, lease.data(), location.length);
+            }
+            const timespec times[2] = {{0, UTIME_OMIT},
+                                       {static_cast<time_t>(entry.mtime), static_cast<long>(entry.mtime_nsec)}};
+            if (::fchmod(fd, static_cast<mode_t>(entry.mode)) != 0 || ::futimens(fd, times) != 0) {
+                throw_errno("Failed to set attributes of", target);
+            }
+        } catch (...) {
+            ::close(fd);
+            throw;
+        }
+        if (::close(fd) != 0) {
+            throw_errno("Failed to write", target);
+        }
+        std::lock_guard<std::mutex> lock(stats_mutex);
+        ++stats.files_copied;
+        stats.bytes_copied += entry.size;
+        std::cout << "    Restored file: " << target << " (" << entry.size << " bytes)" << std::endl;
+    };
+
+    fs::create_directories(destination);
+    {
+        WorkerPool pool(workers, workers * 2);
+        for (const ManifestEntry& entry : entries) {
+            ++stats.entries_scanned;
+            const fs::path target = destination / entry.path;
+            if (entry.kind == kEntryDirectory) {
+                std::error_code ec;
+                if (fs::exists(target, ec) && !fs::is_directory(fs::symlink_status(target, ec))) {
+                    fs::remove_all(target);
+                }
+                if (fs::create_directories(target)) {
+                    ++stats.directories_created;
+                    std::cout << "    Created directory: " << target << std::endl;
+                }
+                continue;
+            }
+            pool.submit([&restore_file, &entry, target](std::size_t) { restore_file(entry, target); });
+        }
+        pool.wait_idle();
+    }
+
+    // Directory attributes last, deepest first, so restoring files into
+    // them neither fails on read-only modes nor moves their mtimes.
+    for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+        if (it->kind != kEntryDirectory) {
+            continue;
+        }
+        const fs::path target = destination / it->path;
+        const timespec times[2] = {{0, UTIME_OMIT},
+                                   {static_cast<time_t>(it->mtime), static_cast<long>(it->mtime_nsec)}};
+        if (::chmod(target.c_str(), static_cast<mode_t>(it->mode)) != 0 ||
+            ::utimensat(AT_FDCWD, target.c_str(), times, 0) != 0) {
+            std::cerr << "    Warning: failed to set attributes of " << target << ": " << errno_message(errno)
+                      << std::endl;
+        }
+    }
+    stats.buffer_pool = buffers.stats();
+    stats.copy_elapsed = Clock::now() - start;
+    stats.total_elapsed = stats.copy_elapsed;
+    return stats;
+}
+
+} // namespace mfs
@@ -0,0 +1,361 @@
+#include "columnar.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace mfs {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr char kColumnMagic[7] = {'M', 'F', 'S', 'C', 'O', 'L', '1'};
+constexpr const char* kManifestName = "manifest";
+constexpr const char* kManifestTag = "mfs-columnar";
+constexpr int kFormatVersion = 1;
+constexpr std::size_t kReadChunk = 64 * 1024;
+
+void append_varint(std::string& out, std::uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+std::uint64_t zigzag_encode(std::int64_t value) {
+    return (static_cast<std::uint64_t>(value) << 1) ^ static_cast<std::uint64_t>(value >> 63);
+}
+
+std::int64_t zigzag_decode(std::uint64_t value) {
+    return static_cast<std::int64_t>(value >> 1) ^ -static_cast<std::int64_t>(value & 1);
+}
+
+fs::path column_file(const fs::path& directory, MetadataColumn column) {
+    return directory / (std::string(column_name(column)) + ".col");
+}
+
+// Sequential reader over a single column file that holds at most one chunk
+// of encoded bytes in memory.
+class ChunkedInput {
+public:
+    ChunkedInput(const fs::path& file, ColumnEncoding expected) : input_(file, std::ios::binary) {
+        if (!input_) {
+            throw std::runtime_error("Failed to open column file: " + file.string());
+        }
+        char header[sizeof(kColumnMagic) + 1];
+        input_.read(header, sizeof(header));
+        if (input_.gcount() != static_cast<std::streamsize>(sizeof(header)) ||
+            std::memcmp(header, kColumnMagic, sizeof(kColumnMagic)) != 0) {
+            throw std::runtime_error("Invalid column header: " + file.string());
+        }
+        if (static_cast<ColumnEncoding>(header[sizeof(kColumnMagic)]) != expected) {
+            throw std::runtime_error("Unexpected column encoding: " + file.string());
+        }
+        buffer_.resize(kReadChunk);
+    }
+
+    std::uint8_t byte() {
+        if (pos_ == len_) {
+            refill();
+        }
+        return static_cast<std::uint8_t>(buffer_[pos_++]);
+    }
+
+    std::uint64_t varint() {
+        std::uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            const std::uint8_t b = byte();
+            value |= static_cast<std::uint64_t>(b & 0x7f) << shift;
+            if ((b & 0x80) == 0) {
+                return value;
+            }
+        }
+        throw std::runtime_error("Malformed varint in column file");
+    }
+
+    void bytes(std::string& out, std::size_t count) {
+        while (count > 0) {
+            if (pos_ == len_) {
+                refill();
+            }
+            const std::size_t take = std::min(count, len_ - pos_);
+            out.append(buffer_.data() + pos_, take);
+            pos_ += take;
+            count -= take;
+        }
+    }
+
+private:
+    std::ifstream input_;
+    std::vector<char> buffer_;
+    std::size_t pos_{0};
+    std::size_t len_{0};
+
+    void refill() {
+        input_.read(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+        len_ = static_cast<std::size_t>(input_.gcount());
+        pos_ = 0;
+        if (len_ == 0) {
+            throw std::runtime_error("Unexpected end of column file");
+        }
+    }
+};
+
+} // namespace
+
+const char* column_name(MetadataColumn column) {
+    switch (column) {
+    case MetadataColumn::path:
+        return "path";
+    case MetadataColumn::depth:
+        return "depth";
+    case MetadataColumn::detail:
+        return "detail";
+    case MetadataColumn::mode:
+        return "mode";
+    case MetadataColumn::uid:
+        return "uid";
+    case MetadataColumn::gid:
+        return "gid";
+    case MetadataColumn::atime:
+        return "atime";
+    case MetadataColumn::atime_nsec:
+        return "atime_nsec";
+    case MetadataColumn::mtime:
+        return "mtime";
+    case MetadataColumn::mtime_nsec:
+        return "mtime_nsec";
+    case MetadataColumn::ctime:
+        return "ctime";
+    case MetadataColumn::ctime_nsec:
+        return "ctime_nsec";
+    case MetadataColumn::size:
+        return "size";
+    }
+    return "unknown";
+}
+
+ColumnEncoding column_encoding(MetadataColumn column) {
+    switch (column) {
+    case MetadataColumn::path:
+        return ColumnEncoding::front;
+    case MetadataColumn::uid:
+    case MetadataColumn::gid:
+        return ColumnEncoding::dict;
+    case MetadataColumn::atime:
+    case MetadataColumn::mtime:
+    case MetadataColumn::ctime:
+        return ColumnEncoding::delta;
+    default:
+        return ColumnEncoding::plain;
+    }
+}
+
+ColumnarWriter::ColumnarWriter(const fs::path& directory, std::size_t buffer_limit)
+    : directory_(directory), buffer_limit_(buffer_limit) {
+    fs::create_directories(directory_);
+    for (std::size_t i = 0; i < kMetadataColumnCount; ++i) {
+        const auto id = static_cast<MetadataColumn>(i);
+        Column& col = columns_[i];
+        const fs::path file = column_file(directory_, id);
+        col.file.open(file, std::ios::binary | std::ios::trunc);
+        if (!col.file) {
+            throw std::runtime_error("Failed to create column file: " + file.string());
+        }
+        col.file.write(kColumnMagic, sizeof(kColumnMagic));
+        col.file.put(static_cast<char>(column_encoding(id)));
+    }
+}
+
+ColumnarWriter::~ColumnarWriter() {
+    try {
+        close();
+    } catch (...) {
+    }
+}
+
+void ColumnarWriter::append(const FileMetadata& meta) {
+    put_path(meta.file.native());
+    put_plain(MetadataColumn::depth, static_cast<std::uint64_t>(meta.depth));
+    put_plain(MetadataColumn::detail, meta.detail ? 1 : 0);
+    put_plain(MetadataColumn::mode, meta.mode);
+    put_dict(MetadataColumn::uid, uid_dict_, meta.uid);
+    put_dict(MetadataColumn::gid, gid_dict_, meta.gid);
+    put_delta(MetadataColumn::atime, meta.atime);
+    put_plain(MetadataColumn::atime_nsec, meta.atime_nsec);
+    put_delta(MetadataColumn::mtime, meta.mtime);
+    put_plain(MetadataColumn::mtime_nsec, meta.mtime_nsec);
+    put_delta(MetadataColumn::ctime, meta.ctime);
+    put_plain(MetadataColumn::ctime_nsec, meta.ctime_nsec);
+    put_plain(MetadataColumn::size, meta.size);
+    ++rows_;
+
+    if (buffered_ >= buffer_limit_) {
+        flush();
+    }
+}
+
+void ColumnarWriter::flush() {
+    for (auto& col : columns_) {
+        if (!col.buffer.empty()) {
+            col.file.write(col.buffer.data(), static_cast<std::streamsize>(col.buffer.size()));
+            col.buffer.clear();
+        }
+    }
+    buffered_ = 0;
+}
+
+void ColumnarWriter::close() {
+    if (closed_) {
+        return;
+    }
+    closed_ = true;
+    flush();
+    for (auto& col : columns_) {
+        col.file.close();
+        if (!col.file) {
+            throw std::runtime_error("Failed to write columnar export in " + directory_.string());
+        }
+    }
+    write_manifest();
+}
+
+void ColumnarWriter::put_plain(MetadataColumn id, std::uint64_t value) {
+    std::string& buffer = column(id).buffer;
+    const std::size_t before = buffer.size();
+    append_varint(buffer, value);
+    buffered_ += buffer.size() - before;
+}
+
+void ColumnarWriter::put_dict(MetadataColumn id,
+                              std::unordered_map<std::uint64_t, std::uint64_t>& dict,
+                              std::uint64_t value) {
+    std::string& buffer = column(id).buffer;
+    const std::size_t before = buffer.size();
+    const auto found = dict.find(value);
+    if (found != dict.end()) {
+        append_varint(buffer, found->second);
+    } else {
+        const std::uint64_t code = dict.size();
+        dict.emplace(value, code);
+        append_varint(buffer, code);
+        append_varint(buffer, value);
+    }
+    buffered_ += buffer.size() - before;
+}
+
+void ColumnarWriter::put_delta(MetadataColumn id, std::uint64_t value) {
+    std::uint64_t& previous = previous_[static_cast<std::size_t>(id)];
+    const auto delta = static_cast<std::int64_t>(value - previous);
+    previous = value;
+    put_plain(id, zigzag_encode(delta));
+}
+
+void ColumnarWriter::put_path(const std::string& path) {
+    std::size_t shared = 0;
+    const std::size_t limit = std::min(path.size(), previous_path_.size());
+    while (shared < limit && path[shared] == previous_path_[shared]) {
+        ++shared;
+    }
+
+    std::string& buffer = column(MetadataColumn::path).buffer;
+    const std::size_t before = buffer.size();
+    append_varint(buffer, shared);
+    append_varint(buffer, path.size() - shared);
+    buffer.append(path, shared, std::string::npos);
+    buffered_ += buffer.size() - before;
+
+    previous_path_ = path;
+}
+
+void ColumnarWriter::write_manifest() {
+    const fs::path file = directory_ / kManifestName;
+    std::ofstream manifest(file, std::ios::trunc);
+    manifest << kManifestTag << ' ' << kFormatVersion << '\n' << "rows " << rows_ << '\n';
+    for (std::size_t i = 0; i < kMetadataColumnCount; ++i) {
+        const auto id = static_cast<MetadataColumn>(i);
+        manifest << "column " << column_name(id) << ' ' << static_cast<int>(column_encoding(id)) << '\n';
+    }
+    if (!manifest) {
+        throw std::runtime_error("Failed to write columnar manifest: " + file.string());
+    }
+}
+
+ColumnarReader::ColumnarReader(const fs::path& directory) : directory_(directory) {
+    const fs::path file = directory_ / kManifestName;
+    std::ifstream manifest(file);
+    std::string tag;
+    int version = 0;
+    std::string rows_key;
+    if (!(manifest >> tag >> version >> rows_key >> rows_) || tag != kManifestTag || rows_key != "rows") {
+        throw std::runtime_error("Invalid columnar manifest: " + file.string());
+    }
+    if (version != kFormatVersion) {
+        throw std::runtime_error("Unsupported columnar format version " + std::to_string(version));
+    }
+}
+
+void ColumnarReader::scan(MetadataColumn column, const std::function<void(std::uint64_t)>& visit) const {
+    const ColumnEncoding encoding = column_encoding(column);
+    if (encoding == ColumnEncoding::front) {
+        throw std::invalid_argument("Path column must be read with scan_paths");
+    }
+
+    ChunkedInput input(column_file(directory_, column), encoding);
+    std::vector<std::uint64_t> dictionary;
+    std::uint64_t previous = 0;
+    for (std::uint64_t row = 0; row < rows_; ++row) {
+        const std::uint64_t raw = input.varint();
+        switch (encoding) {
+        case ColumnEncoding::dict:
+            if (raw == dictionary.size()) {
+                dictionary.push_back(input.varint());
+            } else if (raw > dictionary.size()) {
+                throw std::runtime_error("Dictionary code out of range in column " +
+                                         std::string(column_name(column)));
+            }
+            visit(dictionary[raw]);
+            break;
+        case ColumnEncoding::delta:
+            previous += static_cast<std::uint64_t>(zigzag_decode(raw));
+            visit(previous);
+            break;
+        default:
+            visit(raw);
+            break;
+        }
+    }
+}
+
+void ColumnarReader::scan_paths(const std::function<void(const std::string&)>& visit) const {
+    ChunkedInput input(column_file(directory_, MetadataColumn::path), ColumnEncoding::front);
+    std::string current;
+    for (std::uint64_t row = 0; row < rows_; ++row) {
+        const std::uint64_t shared = input.varint();
+        const std::uint64_t suffix = input.varint();
+        if (shared > current.size()) {
+            throw std::runtime_error("Malformed front-coded path column");
+        }
+        current.resize(shared);
+        input.bytes(current, suffix);
+        visit(current);
+    }
+}
+
+std::vector<std::uint64_t> ColumnarReader::read(MetadataColumn column) const {
+    std::vector<std::uint64_t> values;
+    values.reserve(rows_);
+    scan(column, [&values](std::uint64_t value) { values.push_back(value); });
+    return values;
+}
+
+std::vector<std::string> ColumnarReader::read_paths() const {
+    std::vector<std::string> paths;
+    paths.reserve(rows_);
+    scan_paths([&paths](const std::string& path) { paths.push_back(path); });
+    return paths;
+}
+
+} // namespace mfs
@@ -0,0 +1,828 @@
+#include "copy_engine.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/statfs.h>
+#include <sys/xattr.h>
+#endif
+
+namespace mfs {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+[[noreturn]] void throw_copy_error(const fs::path& source, const fs::path& destination, int err) {
+    throw fs::filesystem_error("copy_file", source, destination, std::error_code(err, std::generic_category()));
+}
+
+class FileDescriptor {
+public:
+    FileDescriptor() = default;
+    ~FileDescriptor() { reset(); }
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+
+    int get() const { return fd_; }
+    int release() { return std::exchange(fd_, -1); }
+    void reset(int fd = -1) {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+        fd_ = fd;
+    }
+
+private:
+    int fd_{-1};
+};
+
+// Opens both ends of a copy the way copy_file(overwrite_existing) does and
+// returns the source's stat.
+struct stat open_copy(const fs::path& source, const fs::path& destination, FileDescriptor& in,
+                      FileDescriptor& out, int extra_flags = 0) {
+    in.reset(::open(source.c_str(), O_RDONLY | O_CLOEXEC | extra_flags));
+    if (in.get() < 0) {
+        throw_copy_error(source, destination, errno);
+    }
+    struct stat st {};
+    if (::fstat(in.get(), &st) != 0) {
+        throw_copy_error(source, destination, errno);
+    }
+    if (!S_ISREG(st.st_mode)) {
+        throw_copy_error(source, destination, EINVAL);
+    }
+#if defined(POSIX_FADV_SEQUENTIAL)
+    ::posix_fadvise(in.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    out.reset(::open(destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | extra_flags, st.st_mode & 07777));
+    if (out.get() < 0) {
+        throw_copy_error(source, destination, errno);
+    }
+    if (::fchmod(out.get(), st.st_mode & 07777) != 0) {
+        throw_copy_error(source, destination, errno);
+    }
+    return st;
+}
+
+void write_all(int fd, const char* data, std::size_t size, const fs::path& source, const fs::path& destination) {
+    while (size > 0) {
+        const ssize_t written = ::write(fd, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw_copy_error(source, destination, errno);
+        }
+        data += written;
+        size -= static_cast<std::size_t>(written);
+    }
+}
+
+void close_destination(FileDescriptor& out, const fs::path& source, const fs::path& destination) {
+    if (::close(out.release()) != 0) {
+        throw_copy_error(source, destination, errno);
+    }
+}
+
+// Errors with which copy_file_range(), FICLONE or O_DIRECT refuse a pair of
+// files as a whole (old kernel, cross-filesystem, unsupported filesystem)
+// rather than failing.
+bool unsupported(int err) {
+    return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP || err == ENOTTY || err == EPERM;
+}
+
+#if defined(__linux__)
+// Copies from the current offsets to the end of `in`; with `use_sendfile`
+// false, copy_file_range is tried first.
+std::uintmax_t kernel_copy_loop(int in, int out, bool use_sendfile, const fs::path& source,
+                                const fs::path& destination) {
+    constexpr std::size_t kChunk = std::size_t{1} << 30;
+    std::uintmax_t copied = 0;
+    for (;;) {
+        ssize_t n = 0;
+        if (!use_sendfile) {
+            n = ::copy_file_range(in, nullptr, out, nullptr, kChunk, 0);
+            if (n < 0 && copied == 0 && unsupported(errno)) {
+                use_sendfile = true;
+                continue;
+            }
+        } else {
+            n = ::sendfile(out, in, nullptr, kChunk);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw_copy_error(source, destination, errno);
+        }
+        if (n == 0) {
+            break;
+        }
+        copied += static_cast<std::uintmax_t>(n);
+    }
+    return copied;
+}
+#endif
+
+std::string hex(std::uint64_t value) {
+    char text[19];
+    std::snprintf(text, sizeof(text), "0x%llx", static_cast<unsigned long long>(value));
+    return text;
+}
+
+std::string filesystem_type_name(std::uint64_t magic) {
+    static constexpr std::pair<std::uint64_t, const char*> known[] = {
+        {0xEF53, "ext4"},           {0x58465342, "xfs"},    {0x9123683E, "btrfs"}, {0x01021994, "tmpfs"},
+        {0x794C7630, "overlayfs"},  {0x6969, "nfs"},        {0x2FC12FC1, "zfs"},   {0xF2F52010, "f2fs"},
+        {0xFF534D42, "cifs"},       {0xFE534D42, "smb2"},   {0x65735546, "fuse"},  {0x00C36400, "ceph"},
+        {0x0BD00BD0, "lustre"},     {0x47504653, "gpfs"},   {0x5346414F, "afs"},   {0x4D44, "vfat"},
+        {0x2011BAB0, "exfat"},      {0x5346544E, "ntfs"},   {0x858458F6, "ramfs"},
+    };
+    for (const auto& [value, name] : known) {
+        if (value == magic) {
+            return name;
+        }
+    }
+    return hex(magic);
+}
+
+class ScratchDirectory {
+public:
+    explicit ScratchDirectory(fs::path path) : path_(std::move(path)) { fs::create_directories(path_); }
+    ~ScratchDirectory() {
+        std::error_code ec;
+        fs::remove_all(path_, ec);
+    }
+    ScratchDirectory(const ScratchDirectory&) = delete;
+    ScratchDirectory& operator=(const ScratchDirectory&) = delete;
+
+    const fs::path& path() const { return path_; }
+
+private:
+    fs::path path_;
+};
+
+// Whether `engine` runs natively (rather than its fallback) for a copy of
+// `probe` to `copy` in the same directory.
+bool engine_supported(CopyEngine engine, const fs::path& probe, const fs::path& copy) {
+    FileDescriptor in;
+    FileDescriptor out;
+    switch (engine) {
+    case CopyEngine::reflink:
+#if defined(__linux__) && defined(FICLONE)
+        open_copy(probe, copy, in, out);
+        return ::ioctl(out.get(), FICLONE, in.get()) == 0;
+#else
+        return false;
+#endif
+    case CopyEngine::direct: {
+#if defined(O_DIRECT)
+        try {
+            open_copy(probe, copy, in, out, O_DIRECT);
+        } catch (const fs::filesystem_error&) {
+            return false;
+        }
+        alignas(4096) char block[4096];
+        return ::read(in.get(), block, sizeof(block)) >= 0;
+#else
+        return false;
+#endif
+    }
+    case CopyEngine::copy_file_range:
+    case CopyEngine::read_write:
+    case CopyEngine::mmap:
+    case CopyEngine::sendfile:
+        break;
+    }
+    return true;
+}
+
+// File size used to calibrate each size class.
+constexpr std::array<std::uintmax_t, kCopySizeClasses> kCalibrationFileBytes{
+    16 * 1024, 256 * 1024, 2 * 1024 * 1024, 8 * 1024 * 1024};
+
+// Holds the encoded PartialCopyMarker of a copy in progress.
+constexpr const char* kPartialCopyAttribute = "user.simplesync.partial";
+
+std::string encode_marker(const PartialCopyMarker& marker) {
+    return std::to_string(marker.size) + " " + std::to_string(marker.mtime) + "." +
+           std::to_string(marker.mtime_nsec) + " " + std::to_string(marker.inode);
+}
+
+} // namespace
+
+std::string_view copy_engine_name(CopyEngine engine) {
+    switch (engine) {
+    case CopyEngine::copy_file_range:
+        return "copy_file_range";
+    case CopyEngine::read_write:
+        return "read_write";
+    case CopyEngine::mmap:
+        return "mmap";
+    case CopyEngine::reflink:
+        return "reflink";
+    case CopyEngine::sendfile:
+        return "sendfile";
+    case CopyEngine::direct:
+        return "direct";
+    }
+    return "unknown";
+}
+
+std::optional<CopyEngine> parse_copy_engine(std::string_view name) {
+    for (const CopyEngine engine : kAllCopyEngines) {
+        if (copy_engine_name(engine) == name) {
+            return engine;
+        }
+    }
+    return std::nullopt;
+}
+
+std::size_t copy_size_class(std::uintmax_t size) {
+    return static_cast<std::size_t>(std::upper_bound(kCopySizeClassLimits.begin(), kCopySizeClassLimits.end(), size) -
+                                    kCopySizeClassLimits.begin());
+}
+
+std::string_view copy_size_class_label(std::size_t size_class) {
+    static constexpr std::array<std::string_view, kCopySizeClasses> labels{"<64K", "64K-1M", "1M-8M", ">=8M"};
+    return size_class < labels.size() ? labels[size_class] : "?";
+}
+
+bool CopyEngineTable::uses(CopyEngine engine) const {
+    return std::find(engines_.begin(), engines_.end(), engine) != engines_.end();
+}
+
+std::uintmax_t copy_file_kernel(const fs::path& source, const fs::path& destination) {
+#if defined(__linux__)
+    FileDescriptor in;
+    FileDescriptor out;
+    open_copy(source, destination, in, out);
+    const std::uintmax_t copied = kernel_copy_loop(in.get(), out.get(), false, source, destination);
+    close_destination(out, source, destination);
+    return copied;
+#else
+    fs::copy_file(source, destination, fs::copy_options::overwrite_existing);
+    return fs::file_size(destination);
+#endif
+}
+
+std::uintmax_t copy_file_buffered(const fs::path& source, const fs::path& destination, BufferPool& pool) {
+    FileDescriptor in;
+    FileDescriptor out;
+    open_copy(source, destination, in, out);
+
+    const BufferPool::Lease buffer = pool.acquire();
+    std::uintmax_t copied = 0;
+    for (;;) {
+        const ssize_t n = ::read(in.get(), buffer.data(), buffer.size());
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw_copy_error(source, destination, errno);
+        }
+        if (n == 0) {
+            break;
+        }
+        write_all(out.get(), buffer.data(), static_cast<std::size_t>(n), source, destination);
+        copied += static_cast<std::uintmax_t>(n);
+    }
+    close_destination(out, source, destination);
+    return copied;
+}
+
+std::uintmax_t copy_file_mmap(const fs::path& source, const fs::path& destination) {
+    FileDescriptor in;
+    FileDescriptor out;
+    const struct stat st = open_copy(source, destination, in, out);
+    const auto size = static_cast<std::size_t>(st.st_size);
+    if (size > 0) {
+        int flags = MAP_PRIVATE;
+#if defined(MAP_POPULATE)
+        flags |= MAP_POPULATE;
+#endif
+        void* mapping = ::mmap(nullptr, size, PROT_READ, flags, in.get(), 0);
+        if (mapping == MAP_FAILED) {
+            throw_copy_error(source, destination, errno);
+        }
+        ::madvise(mapping, size, MADV_SEQUENTIAL);
+        try {
+            write_all(out.get(), static_cast<const char*>(mapping), size, source, destination);
+        } catch (...) {
+            ::munmap(mapping, size);
+            throw;
+        }
+        ::munmap(mapping, size);
+    }
+    close_destination(out, source, destination);
+    return size;
+}
+
+std::uintmax_t copy_file_reflink(const fs::path& source, const fs::path& destination) {
+#if defined(__linux__) && defined(FICLONE)
+    FileDescriptor in;
+    FileDescriptor out;
+    const struct stat st = open_copy(source, destination, in, out);
+    std::uintmax_t copied = static_cast<std::uintmax_t>(st.st_size);
+    if (::ioctl(out.get(), FICLONE, in.get()) != 0) {
+        if (!unsupported(errno)) {
+            throw_copy_error(source, destination, errno);
+        }
+        copied = kernel_copy_loop(in.get(), out.get(), false, source, destination);
+    }
+    close_destination(out, source, destination);
+    return copied;
+#else
+    return copy_file_kernel(source, destination);
+#endif
+}
+
+std::uintmax_t copy_file_sendfile(const fs::path& source, const fs::path& destination) {
+#if defined(__linux__)
+    FileDescriptor in;
+    FileDescriptor out;
+    open_copy(source, destination, in, out);
+    const std::uintmax_t copied = kernel_copy_loop(in.get(), out.get(), true, source, destination);
+    close_destination(out, source, destination);
+    return copied;
+#else
+    return copy_file_kernel(source, destination);
+#endif
+}
+
+std::uintmax_t copy_file_direct(const fs::path& source, const fs::path& destination, BufferPool& pool) {
+#if defined(O_DIRECT)
+    FileDescriptor in;
+    FileDescriptor out;
+    try {
+        open_copy(source, destination, in, out, O_DIRECT);
+    } catch (const fs::filesystem_error& ex) {
+        if (!unsupported(ex.code().value())) {
+            throw;
+        }
+        return copy_file_buffered(source, destination, pool);
+    }
+
+    std::uintmax_t copied = 0;
+    bool refused = false;
+    {
+        const BufferPool::Lease buffer = pool.acquire();
+        for (;;) {
+            const ssize_t n = ::read(in.get(), buffer.data(), buffer.size());
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // Opened, but the filesystem rejects direct reads.
+                refused = copied == 0 && unsupported(errno);
+                if (refused) {
+                    break;
+                }
+                throw_copy_error(source, destination, errno);
+            }
+            if (n == 0) {
+                break;
+            }
+            // Only whole blocks can be written directly; the tail of the
+            // file goes through the page cache.
+            const std::size_t direct_bytes = static_cast<std::size_t>(n) / 4096 * 4096;
+            write_all(out.get(), buffer.data(), direct_bytes, source, destination);
+            if (direct_bytes < static_cast<std::size_t>(n)) {
+                const int flags = ::fcntl(out.get(), F_GETFL);
+                if (flags < 0 || ::fcntl(out.get(), F_SETFL, flags & ~O_DIRECT) != 0) {
+                    throw_copy_error(source, destination, errno);
+                }
+                write_all(out.get(), buffer.data() + direct_bytes, static_cast<std::size_t>(n) - direct_bytes,
+                          source, destination);
+            }
+            copied += static_cast<std::uintmax_t>(n);
+        }
+    }
+    if (refused) {
+        // The lease is back in the pool for the buffered copy to take.
+        return copy_file_buffered(source, destination, pool);
+    }
+    close_destination(out, source, destination);
+    return copied;
+#else
+    return copy_file_buffered(source, destination, pool);
+#endif
+}
+
+std::uintmax_t copy_file_with(CopyEngine engine, const fs::path& source, const fs::path& destination,
+                              BufferPool& pool) {
+    switch (engine) {
+    case CopyEngine::read_write:
+        return copy_file_buffered(source, destination, pool);
+    case CopyEngine::mmap:
+        return copy_file_mmap(source, destination);
+    case CopyEngine::reflink:
+        return copy_file_reflink(source, destination);
+    case CopyEngine::sendfile:
+        return copy_file_sendfile(source, destination);
+    case CopyEngine::direct:
+        return copy_file_direct(source, destination, pool);
+    case CopyEngine::copy_file_range:
+        break;
+    }
+    return copy_file_kernel(source, destination);
+}
+
+std::uintmax_t matching_prefix(const fs::path& source, const fs::path& destination, std::size_t block_bytes,
+                               std::size_t threads) {
+    FileDescriptor in;
+    FileDescriptor out;
+    in.reset(::open(source.c_str(), O_RDONLY | O_CLOEXEC));
+    out.reset(::open(destination.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat in_st {};
+    struct stat out_st {};
+    if (in.get() < 0 || out.get() < 0 || ::fstat(in.get(), &in_st) != 0 || ::fstat(out.get(), &out_st) != 0) {
+        throw_copy_error(source, destination, errno);
+    }
+    const auto length = static_cast<std::uintmax_t>(std::min(in_st.st_size, out_st.st_size));
+    block_bytes = std::max<std::size_t>(block_bytes, 4096);
+    const std::uintmax_t blocks = (length + block_bytes - 1) / block_bytes;
+
+    // Threads claim blocks in order; a mismatch lowers the bound, so blocks
+    // past it are not read.
+    std::atomic<std::uintmax_t> next{0};
+    std::atomic<std::uintmax_t> first_mismatch{blocks};
+    std::atomic<int> error{0};
+    auto compare = [&] {
+        std::vector<char> a(block_bytes);
+        std::vector<char> b(block_bytes);
+        auto read_block = [](int fd, char* data, std::size_t size, off_t offset) {
+            std::size_t done = 0;
+            while (done < size) {
+                const ssize_t n = ::pread(fd, data + done, size - done, offset + static_cast<off_t>(done));
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    return n < 0 ? errno : 0;
+                }
+                done += static_cast<std::size_t>(n);
+            }
+            return -1;
+        };
+        for (;;) {
+            const std::uintmax_t block = next.fetch_add(1);
+            if (block >= first_mismatch.load()) {
+                return;
+            }
+            const std::uintmax_t offset = block * block_bytes;
+            const auto size = static_cast<std::size_t>(std::min<std::uintmax_t>(block_bytes, length - offset));
+            const int a_read = read_block(in.get(), a.data(), size, static_cast<off_t>(offset));
+            const int b_read = read_block(out.get(), b.data(), size, static_cast<off_t>(offset));
+            if (a_read > 0 || b_read > 0) {
+                int expected = 0;
+                error.compare_exchange_strong(expected, a_read > 0 ? a_read : b_read);
+                first_mismatch.store(0);
+                return;
+            }
+            // A short read means a file shrank: treat the block as different.
+            if (a_read == 0 || b_read == 0 || std::memcmp(a.data(), b.data(), size) != 0) {
+                std::uintmax_t current = first_mismatch.load();
+                while (block < current && !first_mismatch.compare_exchange_weak(current, block)) {
+                }
+            }
+        }
+    };
+    std::vector<std::thread> helpers;
+    const auto workers = static_cast<std::size_t>(std::min<std::uintmax_t>(std::max<std::size_t>(threads, 1), blocks));
+    for (std::size_t i = 1; i < workers; ++i) {
+        helpers.emplace_back(compare);
+    }
+    compare();
+    for (std::thread& helper : helpers) {
+        helper.join();
+    }
+    if (error != 0) {
+        throw_copy_error(source, destination, error);
+    }
+    const std::uintmax_t mismatch = first_mismatch.load();
+    return mismatch == blocks ? length : mismatch * block_bytes;
+}
+
+std::uintmax_t resume_copy(const fs::path& source, const fs::path& destination, std::uintmax_t offset) {
+    FileDescriptor in;
+    FileDescriptor out;
+    in.reset(::open(source.c_str(), O_RDONLY | O_CLOEXEC));
+    if (in.get() < 0) {
+        throw_copy_error(source, destination, errno);
+    }
+#if defined(POSIX_FADV_SEQUENTIAL)
+    ::posix_fadvise(in.get(), static_cast<off_t>(offset), 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    struct stat st {};
+    out.reset(::open(destination.c_str(), O_WRONLY | O_CLOEXEC));
+    if (out.get() < 0 || ::fstat(in.get(), &st) != 0 || ::fchmod(out.get(), st.st_mode & 07777) != 0 ||
+        ::ftruncate(out.get(), static_cast<off_t>(offset)) != 0 ||
+        ::lseek(in.get(), static_cast<off_t>(offset), SEEK_SET) < 0 ||
+        ::lseek(out.get(), static_cast<off_t>(offset), SEEK_SET) < 0) {
+        throw_copy_error(source, destination, errno);
+    }
+#if defined(__linux__)
+    const std::uintmax_t copied = kernel_copy_loop(in.get(), out.get(), false, source, destination);
+#else
+    std::vector<char> buffer(1024 * 1024);
+    std::uintmax_t copied = 0;
+    for (;;) {
+        const ssize_t n = ::read(in.get(), buffer.data(), buffer.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            throw_copy_error(source, destination, errno);
+        }
+        if (n == 0) {
+            break;
+        }
+        write_all(out.get(), buffer.data(), static_cast<std::size_t>(n), source, destination);
+        copied += static_cast<std::uintmax_t>(n);
+    }
+#endif
+    close_destination(out, source, destination);
+    return copied;
+}
+
+bool mark_partial_copy(const fs::path& destination, const PartialCopyMarker& marker) {
+#if defined(__linux__)
+    FileDescriptor fd;
+    fd.reset(::open(destination.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600));
+    if (fd.get() < 0) {
+        return false;
+    }
+    const std::string value = encode_marker(marker);
+    return ::fsetxattr(fd.get(), kPartialCopyAttribute, value.data(), value.size(), 0) == 0;
+#else
+    (void)destination;
+    (void)marker;
+    return false;
+#endif
+}
+
+bool partial_copy_marked(const fs::path& destination, const PartialCopyMarker& marker) {
+#if defined(__linux__)
+    char value[96];
+    const ssize_t n = ::getxattr(destination.c_str(), kPartialCopyAttribute, value, sizeof(value));
+    return n > 0 && std::string_view(value, static_cast<std::size_t>(n)) == encode_marker(marker);
+#else
+    (void)destination;
+    (void)marker;
+    return false;
+#endif
+}
+
+void clear_partial_copy(const fs::path& destination) {
+#if defined(__linux__)
+    ::removexattr(destination.c_str(), kPartialCopyAttribute);
+#else
+    (void)destination;
+#endif
+}
+
+std::optional<std::uint64_t> first_extent_offset(const char* source, bool* unsupported) {
+#if defined(__linux__) && defined(FS_IOC_FIEMAP)
+    FileDescriptor fd;
+    fd.reset(::open(source, O_RDONLY | O_CLOEXEC | O_NOFOLLOW));
+    if (fd.get() < 0) {
+        return std::nullopt;
+    }
+    // Room for the header and one extent.
+    alignas(struct fiemap) unsigned char request[sizeof(struct fiemap) + sizeof(struct fiemap_extent)]{};
+    auto* map = reinterpret_cast<struct fiemap*>(request);
+    map->fm_start = 0;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+    if (::ioctl(fd.get(), FS_IOC_FIEMAP, map) != 0) {
+        if (unsupported && (errno == EOPNOTSUPP || errno == ENOTTY)) {
+            *unsupported = true;
+        }
+        return std::nullopt;
+    }
+    constexpr std::uint32_t unplaced = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_DATA_INLINE;
+    if (map->fm_mapped_extents == 0 || (map->fm_extents[0].fe_flags & unplaced) != 0) {
+        return std::nullopt;
+    }
+    return map->fm_extents[0].fe_physical;
+#else
+    (void)source;
+    if (unsupported) {
+        *unsupported = true;
+    }
+    return std::nullopt;
+#endif
+}
+
+FilesystemInfo probe_filesystem(const fs::path& path) {
+    FilesystemInfo info;
+    struct stat st {};
+    if (::stat(path.c_str(), &st) != 0) {
+        throw fs::filesystem_error("stat", path, std::error_code(errno, std::generic_category()));
+    }
+    info.device = static_cast<std::uint64_t>(st.st_dev);
+#if defined(__linux__)
+    struct statfs fs_info {};
+    if (::statfs(path.c_str(), &fs_info) != 0) {
+        throw fs::filesystem_error("statfs", path, std::error_code(errno, std::generic_category()));
+    }
+    info.magic = static_cast<std::uint64_t>(fs_info.f_type);
+    info.type = filesystem_type_name(info.magic);
+#else
+    info.type = "unknown";
+#endif
+    return info;
+}
+
+CopyCalibration calibrate_copy_engines(const fs::path& scratch_dir, const CalibrationOptions& options) {
+    using Clock = std::chrono::steady_clock;
+
+    const ScratchDirectory scratch(scratch_dir);
+    BufferPool pool(1, options.buffer_bytes);
+
+    // Engines that would only run their fallback here are left out, so
+    // that a fallback's timing is never credited to them.
+    std::vector<CopyEngine> engines;
+    const fs::path probe = scratch.path() / "probe";
+    std::ofstream(probe, std::ios::binary) << std::string(4096, 'p');
+    for (const CopyEngine engine : options.engines) {
+        if (engine_supported(engine, probe, scratch.path() / "probe_copy")) {
+            engines.push_back(engine);
+        }
+    }
+
+    CopyCalibration calibration;
+    for (std::size_t size_class = 0; size_class < kCopySizeClasses; ++size_class) {
+        const std::uintmax_t file_bytes = kCalibrationFileBytes[size_class];
+        const std::size_t files = static_cast<std::size_t>(std::max<std::uintmax_t>(2, options.bytes_per_class / file_bytes));
+
+        std::string content(static_cast<std::size_t>(file_bytes), '\0');
+        for (std::size_t i = 0; i < content.size(); ++i) {
+            content[i] = static_cast<char>(i * 131 % 251);
+        }
+        std::vector<fs::path> sources;
+        std::vector<fs::path> destinations;
+        for (std::size_t i = 0; i < files; ++i) {
+            sources.push_back(scratch.path() / ("source_" + std::to_string(size_class) + "_" + std::to_string(i)));
+            destinations.push_back(scratch.path() / ("copy_" + std::to_string(size_class) + "_" + std::to_string(i)));
+            std::ofstream(sources.back(), std::ios::binary) << content;
+        }
+
+        std::vector<double> best(engines.size(), 0.0);
+        for (unsigned round = 0; round < std::max(1u, options.rounds); ++round) {
+            for (std::size_t e = 0; e < engines.size(); ++e) {
+                // Rotate the order so no engine always runs right after the
+                // files were written.
+                const std::size_t index = (e + round) % engines.size();
+                for (const fs::path& destination : destinations) {
+                    fs::remove(destination);
+                }
+                const auto start = Clock::now();
+                std::uintmax_t copied = 0;
+                for (std::size_t i = 0; i < files; ++i) {
+                    copied += copy_file_with(engines[index], sources[i], destinations[i], pool);
+                }
+                const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+                best[index] = std::max(best[index], static_cast<double>(copied) / std::max(seconds, 1e-9));
+            }
+        }
+        for (std::size_t index = 0; index < engines.size(); ++index) {
+            calibration.timings.push_back(EngineTiming{size_class, engines[index], best[index]});
+        }
+        for (std::size_t i = 0; i < files; ++i) {
+            fs::remove(sources[i]);
+            fs::remove(destinations[i]);
+        }
+    }
+    calibration.table = choose_copy_engines(calibration.timings);
+    return calibration;
+}
+
+CopyEngineTable choose_copy_engines(const std::vector<EngineTiming>& timings) {
+    CopyEngineTable table;
+    for (std::size_t size_class = 0; size_class < kCopySizeClasses; ++size_class) {
+        const EngineTiming* fastest = nullptr;
+        for (const CopyEngine engine : kAutoCopyEngines) {
+            for (const EngineTiming& timing : timings) {
+                if (timing.size_class == size_class && timing.engine == engine &&
+                    (fastest == nullptr || timing.bytes_per_second > fastest->bytes_per_second)) {
+                    fastest = &timing;
+                }
+            }
+        }
+        if (fastest != nullptr) {
+            table.set(size_class, fastest->engine);
+        }
+    }
+    return table;
+}
+
+std::string calibration_cache_key(const FilesystemInfo& source, const FilesystemInfo& destination) {
+    return hex(source.device) + ":" + source.type + "->" + hex(destination.device) + ":" + destination.type;
+}
+
+fs::path default_calibration_cache() {
+    if (const char* cache = std::getenv("XDG_CACHE_HOME"); cache != nullptr && *cache != '\0') {
+        return fs::path(cache) / "simplesync" / "copy_engines";
+    }
+    if (const char* home = std::getenv("HOME"); home != nullptr && *home != '\0') {
+        return fs::path(home) / ".cache" / "simplesync" / "copy_engines";
+    }
+    return {};
+}
+
+// Cache lines are "<key> <size class> <engine> <bytes per second>"; keys
+// contain no spaces.
+std::optional<CopyCalibration> load_cached_calibration(const fs::path& cache, std::string_view key) {
+    std::ifstream input(cache);
+    CopyCalibration calibration;
+    std::array<bool, kCopySizeClasses> covered{};
+    std::string line;
+    while (std::getline(input, line)) {
+        std::istringstream fields(line);
+        std::string line_key;
+        std::size_t size_class = 0;
+        std::string engine_name;
+        double bytes_per_second = 0.0;
+        if (!(fields >> line_key >> size_class >> engine_name >> bytes_per_second) || line_key != key ||
+            size_class >= kCopySizeClasses) {
+            continue;
+        }
+        const std::optional<CopyEngine> engine = parse_copy_engine(engine_name);
+        if (!engine) {
+            continue;
+        }
+        calibration.timings.push_back(EngineTiming{size_class, *engine, bytes_per_second});
+        covered[size_class] = true;
+    }
+    if (std::find(covered.begin(), covered.end(), false) != covered.end()) {
+        return std::nullopt;
+    }
+    calibration.table = choose_copy_engines(calibration.timings);
+    return calibration;
+}
+
+void store_cached_calibration(const fs::path& cache, std::string_view key, const CopyCalibration& calibration) {
+    std::string kept;
+    {
+        std::ifstream input(cache);
+        std::string line;
+        while (std::getline(input, line)) {
+            if (line.compare(0, line.find(' '), key) != 0) {
+                kept += line;
+                kept += '\n';
+            }
+        }
+    }
+    std::error_code ec;
+    if (cache.has_parent_path()) {
+        fs::create_directories(cache.parent_path(), ec);
+    }
+    // Written aside and renamed, so concurrent runs never read half a file.
+    const fs::path temporary = cache.string() + "." + std::to_string(::getpid());
+    {
+        std::ofstream output(temporary, std::ios::trunc);
+        output << kept;
+        for (const EngineTiming& timing : calibration.timings) {
+            output << key << ' ' << timing.size_class << ' ' << copy_engine_name(timing.engine) << ' '
+                   << timing.bytes_per_second << '\n';
+        }
+        if (!output) {
+            fs::remove(temporary, ec);
+            throw std::runtime_error("Failed to write copy-engine cache: " + temporary.string());
+        }
+    }
+    fs::rename(temporary, cache, ec);
+    if (ec) {
+        fs::remove(temporary, ec);
+        throw std::runtime_error("Failed to write copy-engine cache: " + cache.string());
+    }
+}
+
+} // namespace mfs
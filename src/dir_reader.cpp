@@ -0,0 +1,152 @@
+#include "dir_reader.hpp"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+
+namespace mfs {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+bool is_dot_or_dotdot(const char* name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+#if defined(__linux__)
+// Kernel record layout returned by getdents64(2).
+struct LinuxDirent64 {
+    std::uint64_t d_ino;
+    std::int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+// Smallest getdents64 record: header plus a one-byte name, padded to 8.
+constexpr std::size_t kMinRecordBytes = 24;
+#else
+// readdir(3) hands out one entry at a time; batch roughly as many names as a
+// getdents64 buffer of the same size would hold.
+constexpr std::size_t kMinRecordBytes = 32;
+#endif
+
+} // namespace
+
+DirectoryReader::DirectoryReader(const fs::path& dir, BumpArena& arena, std::size_t buffer_bytes)
+    : arena_(arena), buffer_bytes_(buffer_bytes) {
+    fd_ = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd_ < 0) {
+        error_ = std::error_code(errno, std::generic_category());
+        return;
+    }
+#if defined(__linux__)
+    buffer_ = static_cast<char*>(arena_.allocate(buffer_bytes_, alignof(LinuxDirent64)));
+#else
+    dir_ = ::fdopendir(fd_);
+    if (dir_ == nullptr) {
+        error_ = std::error_code(errno, std::generic_category());
+        ::close(fd_);
+        fd_ = -1;
+    }
+#endif
+}
+
+DirectoryReader::~DirectoryReader() {
+    close();
+}
+
+void DirectoryReader::close() {
+    if (dir_ != nullptr) {
+        ::closedir(static_cast<DIR*>(dir_));
+        dir_ = nullptr;
+        fd_ = -1;
+    } else if (fd_ >= 0) {
+        ::close(fd_);
+        fd_ = -1;
+    }
+}
+
+bool DirectoryReader::next_batch(ArenaVector<DirEntryName>& batch) {
+    batch.clear();
+    while (fd_ >= 0 && batch.empty()) {
+#if defined(__linux__)
+        const long n = ::syscall(SYS_getdents64, fd_, buffer_, buffer_bytes_);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_ = std::error_code(errno, std::generic_category());
+            close();
+            return false;
+        }
+        if (n == 0) {
+            close();
+            return false;
+        }
+        // One allocation for the whole batch; with an arena the slack is free.
+        batch.reserve(static_cast<std::size_t>(n) / kMinRecordBytes + 1);
+        for (long offset = 0; offset < n;) {
+            const auto* entry = reinterpret_cast<const LinuxDirent64*>(buffer_ + offset);
+            offset += entry->d_reclen;
+            if (!is_dot_or_dotdot(entry->d_name)) {
+                batch.push_back(DirEntryName{entry->d_name, entry->d_type});
+            }
+        }
+#else
+        // readdir(3) may reuse its dirent, so names are copied into the arena.
+        DIR* dir = static_cast<DIR*>(dir_);
+        while (batch.size() < buffer_bytes_ / kMinRecordBytes) {
+            errno = 0;
+            const dirent* entry = ::readdir(dir);
+            if (entry == nullptr) {
+                if (errno != 0) {
+                    error_ = std::error_code(errno, std::generic_category());
+                }
+                close();
+                break;
+            }
+            if (!is_dot_or_dotdot(entry->d_name)) {
+                batch.push_back(DirEntryName{arena_.copy(entry->d_name), entry->d_type});
+            }
+        }
+        if (error_) {
+            return false;
+        }
+#endif
+    }
+    return !batch.empty();
+}
+
+DirectoryListing DirectoryListing::read(const fs::path& dir, std::error_code& error) {
+    DirectoryListing listing;
+    BumpArena arena;
+    DirectoryReader reader(dir, arena);
+    ArenaVector<DirEntryName> batch{ArenaAllocator<DirEntryName>(arena)};
+    while (reader.next_batch(batch)) {
+        for (const DirEntryName& entry : batch) {
+            listing.entries_.try_emplace(entry.name, entry.type);
+        }
+    }
+    error = reader.error();
+    return listing;
+}
+
+std::optional<unsigned char> DirectoryListing::find(std::string_view name) const {
+    const unsigned char* type = entries_.find(name);
+    if (type == nullptr) {
+        return std::nullopt;
+    }
+    return *type;
+}
+
+} // namespace mfs
@@ -0,0 +1,261 @@
+#include "event_stream.hpp"
+
+#include "sync.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace mfs {
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// Pending bytes that wake the writer before its periodic flush.
+constexpr std::size_t kWakeBytes = 256 * 1024;
+constexpr auto kFlushInterval = std::chrono::milliseconds(100);
+
+void append_counters(OutputBuffer& out, const SyncStats& stats) {
+    out.append(",\"entries_scanned\":");
+    out.append_uint(stats.entries_scanned);
+    out.append(",\"files_copied\":");
+    out.append_uint(stats.files_copied);
+    out.append(",\"files_skipped\":");
+    out.append_uint(stats.files_skipped);
+    out.append(",\"directories_created\":");
+    out.append_uint(stats.directories_created);
+    out.append(",\"entries_deleted\":");
+    out.append_uint(stats.files_deleted);
+    out.append(",\"bytes_copied\":");
+    out.append_uint(stats.bytes_copied);
+}
+
+} // namespace
+
+EventStream::EventStream(int fd, bool close_fd, std::chrono::milliseconds progress_interval,
+                         std::size_t max_pending_bytes)
+    : fd_(fd),
+      close_fd_(close_fd),
+      start_(Clock::now()),
+      progress_interval_(progress_interval),
+      next_progress_(start_ + progress_interval_),
+      max_pending_bytes_(max_pending_bytes),
+      front_(std::make_unique<OutputBuffer>(-1, 64 * 1024)),
+      back_(std::make_unique<OutputBuffer>(-1, 64 * 1024)) {
+    writer_ = std::thread([this] { writer_loop(); });
+}
+
+EventStream::~EventStream() {
+    try {
+        close();
+    } catch (...) {
+    }
+}
+
+std::shared_ptr<EventStream> EventStream::open_file(const fs::path& file) {
+    const int fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error("Failed to open event stream " + file.string() + ": " + std::strerror(errno));
+    }
+    return std::make_shared<EventStream>(fd, true);
+}
+
+void EventStream::copied(const fs::path& source, const fs::path& destination, std::uint64_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    OutputBuffer& out = begin_event("copied");
+    out.append(",\"source\":");
+    out.append_json_string(source.native());
+    out.append(",\"destination\":");
+    out.append_json_string(destination.native());
+    out.append(",\"bytes\":");
+    out.append_uint(bytes);
+    end_event();
+}
+
+void EventStream::skipped(const fs::path& path, std::string_view reason) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    OutputBuffer& out = begin_event("skipped");
+    out.append(",\"path\":");
+    out.append_json_string(path.native());
+    out.append(",\"reason\":");
+    out.append_json_string(reason);
+    end_event();
+}
+
+void EventStream::created_directory(const fs::path& path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    OutputBuffer& out = begin_event("mkdir");
+    out.append(",\"path\":");
+    out.append_json_string(path.native());
+    end_event();
+}
+
+void EventStream::deleted(const fs::path& path, bool directory, std::uint64_t entries) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    OutputBuffer& out = begin_event("deleted");
+    out.append(",\"path\":");
+    out.append_json_string(path.native());
+    out.append(directory ? ",\"directory\":true,\"entries\":" : ",\"directory\":false,\"entries\":");
+    out.append_uint(entries);
+    end_event();
+}
+
+void EventStream::error(std::string_view operation, const fs::path& path, std::string_view message) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    OutputBuffer& out = begin_event("error");
+    out.append(",\"op\":");
+    out.append_json_string(operation);
+    out.append(",\"path\":");
+    out.append_json_string(path.native());
+    out.append(",\"message\":");
+    out.append_json_string(message);
+    end_event();
+}
+
+void EventStream::retry(std::string_view operation, const fs::path& path, unsigned attempt,
+                        std::string_view message, std::chrono::nanoseconds delay) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    OutputBuffer& out = begin_event("retry");
+    out.append(",\"op\":");
+    out.append_json_string(operation);
+    out.append(",\"path\":");
+    out.append_json_string(path.native());
+    out.append(",\"attempt\":");
+    out.append_uint(attempt);
+    out.append(",\"message\":");
+    out.append_json_string(message);
+    out.append(",\"delay_s\":");
+    out.append_fixed(std::chrono::duration<double>(delay).count(), 6);
+    end_event();
+}
+
+void EventStream::stalled(std::string_view operation, const fs::path& path, std::size_t worker,
+                          std::chrono::duration<double> elapsed) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    OutputBuffer& out = begin_event("stalled");
+    out.append(",\"op\":");
+    out.append_json_string(operation);
+    out.append(",\"path\":");
+    out.append_json_string(path.native());
+    out.append(",\"worker\":");
+    out.append_uint(worker);
+    out.append(",\"elapsed_s\":");
+    out.append_fixed(elapsed.count(), 3);
+    end_event();
+}
+
+void EventStream::stage(std::string_view name, std::chrono::duration<double> elapsed) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    OutputBuffer& out = begin_event("stage");
+    out.append(",\"stage\":");
+    out.append_json_string(name);
+    out.append(",\"elapsed_s\":");
+    out.append_fixed(elapsed.count(), 6);
+    end_event();
+}
+
+void EventStream::progress(const SyncStats& stats) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    OutputBuffer& out = begin_event("progress");
+    append_counters(out, stats);
+    end_event();
+}
+
+void EventStream::summary(const SyncStats& stats) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    OutputBuffer& out = begin_event("summary");
+    append_counters(out, stats);
+    out.append(",\"total_elapsed_s\":");
+    out.append_fixed(stats.total_elapsed.count(), 6);
+    out.append(",\"events_dropped\":");
+    out.append_uint(dropped_.load(std::memory_order_relaxed));
+    end_event(true);
+}
+
+bool EventStream::progress_due() {
+    const auto now = Clock::now();
+    auto due = next_progress_.load(std::memory_order_relaxed);
+    if (now < due) {
+        return false;
+    }
+    // Of the threads that saw it due, the one that moves it on reports.
+    return next_progress_.compare_exchange_strong(due, now + progress_interval_, std::memory_order_relaxed);
+}
+
+std::string EventStream::take_failure() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return std::exchange(failure_, std::string());
+}
+
+void EventStream::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_) {
+            return;
+        }
+        closed_ = true;
+        stopping_ = true;
+    }
+    wake_.notify_one();
+    writer_.join();
+    if (close_fd_) {
+        ::close(fd_);
+    }
+}
+
+OutputBuffer& EventStream::begin_event(std::string_view event) {
+    OutputBuffer& out = *front_;
+    event_start_ = out.size();
+    out.append("{\"ts\":");
+    out.append_fixed(std::chrono::duration<double>(Clock::now() - start_).count(), 6);
+    out.append(",\"event\":\"");
+    out.append(event);
+    out.append('"');
+    return out;
+}
+
+void EventStream::end_event(bool keep) {
+    front_->append("}\n");
+    if (!keep && front_->size() > max_pending_bytes_) {
+        front_->truncate(event_start_);
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    if (front_->size() >= kWakeBytes) {
+        wake_.notify_one();
+    }
+}
+
+void EventStream::writer_loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        wake_.wait_for(lock, kFlushInterval, [this] { return stopping_ || front_->size() >= kWakeBytes; });
+        const bool stopping = stopping_;
+        std::swap(front_, back_);
+        lock.unlock();
+
+        if (back_->size() > 0 && !write_failed_) {
+            try {
+                write_fully(fd_, back_->view().data(), back_->size());
+            } catch (const std::exception& ex) {
+                write_failed_ = true;
+                std::lock_guard<std::mutex> failure_lock(mutex_);
+                failure_ = ex.what();
+            }
+        }
+        back_->clear();
+
+        if (stopping) {
+            return;
+        }
+        lock.lock();
+    }
+}
+
+} // namespace mfs
@@ -0,0 +1,376 @@
+#include "live_stats.hpp"
+
+#include "sync.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mfs {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+constexpr auto kRelaxed = std::memory_order_relaxed;
+
+std::uint64_t unix_now_ns() {
+    return static_cast<std::uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch())
+            .count());
+}
+
+std::size_t log2_bucket(std::uint64_t value, std::size_t buckets) {
+    std::size_t bucket = 0;
+    while (value != 0 && bucket + 1 < buckets) {
+        value >>= 1;
+        ++bucket;
+    }
+    return bucket;
+}
+
+// Inclusive upper bound of a log2 bucket, used as the Prometheus "le" label.
+std::uint64_t bucket_upper_bound(std::size_t bucket) {
+    return bucket == 0 ? 0 : (std::uint64_t{1} << bucket) - 1;
+}
+
+std::string errno_message(const std::string& what, const fs::path& file) {
+    return what + " " + file.string() + ": " + std::strerror(errno);
+}
+
+} // namespace
+
+const char* stage_name(SyncStage stage) {
+    switch (stage) {
+    case SyncStage::validate:
+        return "validate";
+    case SyncStage::prepare:
+        return "prepare";
+    case SyncStage::copy:
+        return "copy";
+    case SyncStage::prune:
+        return "prune";
+    }
+    return "unknown";
+}
+
+const char* stage_state_name(StageState state) {
+    switch (state) {
+    case StageState::pending:
+        return "pending";
+    case StageState::running:
+        return "running";
+    case StageState::done:
+        return "done";
+    case StageState::skipped:
+        return "skipped";
+    }
+    return "unknown";
+}
+
+LiveStatsPublisher::LiveStatsPublisher(const fs::path& file, bool unlink_on_close)
+    : path_(file), unlink_on_close_(unlink_on_close) {
+    const int fd = ::open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        throw std::runtime_error(errno_message("Failed to create live stats file", path_));
+    }
+    if (::ftruncate(fd, sizeof(LiveStatsLayout)) != 0) {
+        const std::string message = errno_message("Failed to size live stats file", path_);
+        ::close(fd);
+        throw std::runtime_error(message);
+    }
+    void* mapping = ::mmap(nullptr, sizeof(LiveStatsLayout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error(errno_message("Failed to map live stats file", path_));
+    }
+
+    // The file was just truncated, so every counter starts at zero; the
+    // header is written last so readers never accept a half-built file.
+    layout_ = static_cast<LiveStatsLayout*>(mapping);
+    layout_->layout_size = sizeof(LiveStatsLayout);
+    layout_->pid = static_cast<std::uint32_t>(::getpid());
+    layout_->start_unix_ns.store(unix_now_ns(), kRelaxed);
+    layout_->version = kLiveStatsVersion;
+    std::atomic_thread_fence(std::memory_order_release);
+    layout_->magic = kLiveStatsMagic;
+}
+
+LiveStatsPublisher::~LiveStatsPublisher() {
+    close();
+}
+
+fs::path LiveStatsPublisher::default_path() {
+    return fs::path("/dev/shm") / ("simplesync-" + std::to_string(::getpid()) + ".stats");
+}
+
+void LiveStatsPublisher::set_stage(SyncStage stage, StageState state, std::chrono::duration<double> elapsed) {
+    const auto index = static_cast<std::size_t>(stage);
+    stage_state_[index] = state;
+    stage_elapsed_ns_[index] = static_cast<std::uint64_t>(elapsed.count() * 1e9);
+}
+
+void LiveStatsPublisher::record_copy(std::uint64_t bytes, std::chrono::steady_clock::duration latency) {
+    const auto ns = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(latency).count());
+    size_histogram_[log2_bucket(bytes, kSizeHistogramBuckets)].fetch_add(1, kRelaxed);
+    latency_histogram_[log2_bucket(ns, kLatencyHistogramBuckets)].fetch_add(1, kRelaxed);
+    latency_sum_ns_.fetch_add(ns, kRelaxed);
+}
+
+void LiveStatsPublisher::publish(const SyncStats& stats, bool finished) {
+    if (layout_ == nullptr) {
+        return;
+    }
+    LiveStatsLayout& l = *layout_;
+    const std::uint64_t seq = l.sequence.load(kRelaxed);
+    l.sequence.store(seq + 1, kRelaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    l.update_unix_ns.store(unix_now_ns(), kRelaxed);
+    l.finished.store(finished ? 1 : 0, kRelaxed);
+    l.entries_scanned.store(stats.entries_scanned, kRelaxed);
+    l.files_copied.store(stats.files_copied, kRelaxed);
+    l.files_skipped.store(stats.files_skipped, kRelaxed);
+    l.files_deleted.store(stats.files_deleted, kRelaxed);
+    l.directories_created.store(stats.directories_created, kRelaxed);
+    l.bytes_copied.store(stats.bytes_copied, kRelaxed);
+    for (std::size_t i = 0; i < kLiveStageCount; ++i) {
+        l.stage_state[i].store(static_cast<std::uint64_t>(stage_state_[i]), kRelaxed);
+        l.stage_elapsed_ns[i].store(stage_elapsed_ns_[i], kRelaxed);
+    }
+    for (std::size_t i = 0; i < kSizeHistogramBuckets; ++i) {
+        l.size_histogram[i].store(size_histogram_[i].load(kRelaxed), kRelaxed);
+    }
+    for (std::size_t i = 0; i < kLatencyHistogramBuckets; ++i) {
+        l.latency_histogram[i].store(latency_histogram_[i].load(kRelaxed), kRelaxed);
+    }
+    l.latency_sum_ns.store(latency_sum_ns_.load(kRelaxed), kRelaxed);
+
+    l.sequence.store(seq + 2, std::memory_order_release);
+}
+
+void LiveStatsPublisher::close() {
+    if (layout_ == nullptr) {
+        return;
+    }
+    ::munmap(layout_, sizeof(LiveStatsLayout));
+    layout_ = nullptr;
+    if (unlink_on_close_) {
+        ::unlink(path_.c_str());
+    }
+}
+
+LiveStatsSnapshot read_live_stats(const fs::path& file) {
+    const int fd = ::open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error(errno_message("Failed to open live stats file", file));
+    }
+    struct stat st {};
+    if (::fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(LiveStatsLayout)) {
+        ::close(fd);
+        throw std::runtime_error("Live stats file is truncated: " + file.string());
+    }
+    void* mapping = ::mmap(nullptr, sizeof(LiveStatsLayout), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        throw std::runtime_error(errno_message("Failed to map live stats file", file));
+    }
+
+    const auto& l = *static_cast<const LiveStatsLayout*>(mapping);
+    if (l.magic != kLiveStatsMagic || l.version != kLiveStatsVersion || l.layout_size != sizeof(LiveStatsLayout)) {
+        ::munmap(mapping, sizeof(LiveStatsLayout));
+        throw std::runtime_error("Unsupported live stats layout in " + file.string());
+    }
+
+    LiveStatsSnapshot snap;
+    for (;;) {
+        const std::uint64_t before = l.sequence.load(std::memory_order_acquire);
+        if (before & 1) {
+            std::this_thread::yield();
+            continue;
+        }
+        snap.version = l.version;
+        snap.pid = l.pid;
+        snap.sequence = before;
+        snap.start_unix_ns = l.start_unix_ns.load(kRelaxed);
+        snap.update_unix_ns = l.update_unix_ns.load(kRelaxed);
+        snap.finished = l.finished.load(kRelaxed) != 0;
+        snap.entries_scanned = l.entries_scanned.load(kRelaxed);
+        snap.files_copied = l.files_copied.load(kRelaxed);
+        snap.files_skipped = l.files_skipped.load(kRelaxed);
+        snap.files_deleted = l.files_deleted.load(kRelaxed);
+        snap.directories_created = l.directories_created.load(kRelaxed);
+        snap.bytes_copied = l.bytes_copied.load(kRelaxed);
+        for (std::size_t i = 0; i < kLiveStageCount; ++i) {
+            snap.stage_state[i] = static_cast<StageState>(l.stage_state[i].load(kRelaxed));
+            snap.stage_elapsed_ns[i] = l.stage_elapsed_ns[i].load(kRelaxed);
+        }
+        for (std::size_t i = 0; i < kSizeHistogramBuckets; ++i) {
+            snap.size_histogram[i] = l.size_histogram[i].load(kRelaxed);
+        }
+        for (std::size_t i = 0; i < kLatencyHistogramBuckets; ++i) {
+            snap.latency_histogram[i] = l.latency_histogram[i].load(kRelaxed);
+        }
+        snap.latency_sum_ns = l.latency_sum_ns.load(kRelaxed);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (l.sequence.load(kRelaxed) == before) {
+            break;
+        }
+    }
+
+    ::munmap(mapping, sizeof(LiveStatsLayout));
+    return snap;
+}
+
+void format_live_stats(OutputBuffer& out, const LiveStatsSnapshot& snapshot) {
+    auto line = [&out](std::string_view label, std::uint64_t value) {
+        out.append("  ");
+        out.append_padded(label, 22);
+        out.append_uint(value);
+        out.append('\n');
+    };
+
+    out.append("=== Live Synchronization Counters ===\n");
+    line("PID:", snapshot.pid);
+    line("Sequence:", snapshot.sequence);
+    out.append("  State:                ");
+    out.append(snapshot.finished ? "finished\n" : "running\n");
+    line("Entries scanned:", snapshot.entries_scanned);
+    line("Files copied:", snapshot.files_copied);
+    line("Files skipped:", snapshot.files_skipped);
+    line("Directories created:", snapshot.directories_created);
+    line("Entries deleted:", snapshot.files_deleted);
+    line("Bytes copied:", snapshot.bytes_copied);
+
+    out.append("  Stages:\n");
+    for (std::size_t i = 0; i < kLiveStageCount; ++i) {
+        out.append("    ");
+        out.append_padded(stage_name(static_cast<SyncStage>(i)), 10);
+        out.append_padded(stage_state_name(snapshot.stage_state[i]), 9);
+        out.append_fixed(static_cast<double>(snapshot.stage_elapsed_ns[i]) / 1e9, 3);
+        out.append(" s\n");
+    }
+
+    out.append("  Copied file sizes (bytes <= bound: count):\n");
+    for (std::size_t i = 0; i < kSizeHistogramBuckets; ++i) {
+        if (snapshot.size_histogram[i] == 0) {
+            continue;
+        }
+        out.append("    <= ");
+        out.append_uint(bucket_upper_bound(i));
+        out.append(": ");
+        out.append_uint(snapshot.size_histogram[i]);
+        out.append('\n');
+    }
+}
+
+void format_live_stats_prometheus(OutputBuffer& out, const LiveStatsSnapshot& snapshot) {
+    std::string labels = "pid=\"" + std::to_string(snapshot.pid) + "\"";
+
+    auto metric = [&](std::string_view name, std::string_view type, std::string_view help, std::uint64_t value) {
+        out.append("# HELP simplesync_");
+        out.append(name);
+        out.append(' ');
+        out.append(help);
+        out.append("\n# TYPE simplesync_");
+        out.append(name);
+        out.append(' ');
+        out.append(type);
+        out.append("\nsimplesync_");
+        out.append(name);
+        out.append('{');
+        out.append(labels);
+        out.append("} ");
+        out.append_uint(value);
+        out.append('\n');
+    };
+
+    auto histogram = [&](std::string_view name, std::string_view help, const std::uint64_t* buckets,
+                         std::size_t count, std::uint64_t sum, double scale) {
+        out.append("# HELP simplesync_");
+        out.append(name);
+        out.append(' ');
+        out.append(help);
+        out.append("\n# TYPE simplesync_");
+        out.append(name);
+        out.append(" histogram\n");
+        std::uint64_t cumulative = 0;
+        for (std::size_t i = 0; i < count; ++i) {
+            cumulative += buckets[i];
+            out.append("simplesync_");
+            out.append(name);
+            out.append("_bucket{");
+            out.append(labels);
+            out.append(",le=\"");
+            if (i + 1 == count) {
+                out.append("+Inf");
+            } else {
+                out.append_fixed(static_cast<double>(bucket_upper_bound(i)) * scale, scale == 1.0 ? 0 : 9);
+            }
+            out.append("\"} ");
+            out.append_uint(cumulative);
+            out.append('\n');
+        }
+        out.append("simplesync_");
+        out.append(name);
+        out.append("_sum{");
+        out.append(labels);
+        out.append("} ");
+        out.append_fixed(static_cast<double>(sum) * scale, scale == 1.0 ? 0 : 9);
+        out.append("\nsimplesync_");
+        out.append(name);
+        out.append("_count{");
+        out.append(labels);
+        out.append("} ");
+        out.append_uint(cumulative);
+        out.append('\n');
+    };
+
+    metric("entries_scanned_total", "counter", "Source entries visited.", snapshot.entries_scanned);
+    metric("files_copied_total", "counter", "Files copied to the destination.", snapshot.files_copied);
+    metric("files_skipped_total", "counter", "Entries skipped.", snapshot.files_skipped);
+    metric("directories_created_total", "counter", "Directories created.", snapshot.directories_created);
+    metric("entries_deleted_total", "counter", "Destination entries pruned.", snapshot.files_deleted);
+    metric("bytes_copied_total", "counter", "Bytes copied.", snapshot.bytes_copied);
+    metric("finished", "gauge", "1 once the run has completed.", snapshot.finished ? 1 : 0);
+    metric("last_update_timestamp_seconds", "gauge", "Unix time of the last publish.",
+           snapshot.update_unix_ns / 1000000000);
+
+    out.append("# HELP simplesync_stage_state Stage state (0 pending, 1 running, 2 done, 3 skipped).\n"
+               "# TYPE simplesync_stage_state gauge\n");
+    for (std::size_t i = 0; i < kLiveStageCount; ++i) {
+        out.append("simplesync_stage_state{");
+        out.append(labels);
+        out.append(",stage=\"");
+        out.append(stage_name(static_cast<SyncStage>(i)));
+        out.append("\"} ");
+        out.append_uint(static_cast<std::uint64_t>(snapshot.stage_state[i]));
+        out.append('\n');
+    }
+    out.append("# HELP simplesync_stage_elapsed_seconds Elapsed time of finished stages.\n"
+               "# TYPE simplesync_stage_elapsed_seconds gauge\n");
+    for (std::size_t i = 0; i < kLiveStageCount; ++i) {
+        out.append("simplesync_stage_elapsed_seconds{");
+        out.append(labels);
+        out.append(",stage=\"");
+        out.append(stage_name(static_cast<SyncStage>(i)));
+        out.append("\"} ");
+        out.append_fixed(static_cast<double>(snapshot.stage_elapsed_ns[i]) / 1e9, 6);
+        out.append('\n');
+    }
+
+    histogram("copied_file_bytes", "Sizes of copied files.", snapshot.size_histogram.data(),
+              kSizeHistogramBuckets, snapshot.bytes_copied, 1.0);
+    histogram("copy_duration_seconds", "Per-file copy latency.", snapshot.latency_histogram.data(),
+              kLatencyHistogramBuckets, snapshot.latency_sum_ns, 1e-9);
+}
+
+} // namespace mfs
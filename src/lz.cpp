@@ -0,0 +1,206 @@
+#include "lz.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+namespace mfs {
+
+namespace {
+
+constexpr std::size_t kMinMatch = 4;
+constexpr std::size_t kMaxOffset = 65535;
+// Matches stop this far from the end and the last bytes are always
+// literals, so the decoder's match copies never run past a sequence it can
+// bounds-check cheaply.
+constexpr std::size_t kLastLiterals = 5;
+constexpr std::size_t kMatchSafety = 12;
+constexpr unsigned kHashBits = 13;
+
+std::uint32_t read32(const unsigned char* p) {
+    std::uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+std::uint32_t hash32(std::uint32_t value) {
+    return (value * 2654435761u) >> (32 - kHashBits);
+}
+
+unsigned char* put_length(unsigned char* out, std::size_t length) {
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = static_cast<unsigned char>(length);
+    return out;
+}
+
+unsigned char* put_sequence(unsigned char* out, const unsigned char* literals, std::size_t literal_length,
+                            std::size_t offset, std::size_t match_length) {
+    unsigned char* token = out++;
+    *token = static_cast<unsigned char>(std::min<std::size_t>(literal_length, 15) << 4);
+    if (literal_length >= 15) {
+        out = put_length(out, literal_length - 15);
+    }
+    std::memcpy(out, literals, literal_length);
+    out += literal_length;
+    if (match_length == 0) {
+        return out;
+    }
+    *out++ = static_cast<unsigned char>(offset);
+    *out++ = static_cast<unsigned char>(offset >> 8);
+    const std::size_t code = match_length - kMinMatch;
+    *token |= static_cast<unsigned char>(std::min<std::size_t>(code, 15));
+    if (code >= 15) {
+        out = put_length(out, code - 15);
+    }
+    return out;
+}
+
+[[noreturn]] void malformed() {
+    throw std::runtime_error("Malformed compressed block");
+}
+
+std::size_t get_length(const unsigned char*& in, const unsigned char* end, std::size_t length) {
+    if (length != 15) {
+        return length;
+    }
+    unsigned char byte;
+    do {
+        if (in == end) {
+            malformed();
+        }
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+} // namespace
+
+std::size_t lz_compress_bound(std::size_t size) {
+    return size + size / 255 + 16;
+}
+
+std::size_t lz_compress(const char* input, std::size_t size, char* output) {
+    const auto* in = reinterpret_cast<const unsigned char*>(input);
+    auto* out = reinterpret_cast<unsigned char*>(output);
+    const unsigned char* const end = in + size;
+    const unsigned char* anchor = in;
+    if (size > kMatchSafety) {
+        std::array<std::uint32_t, std::size_t{1} << kHashBits> table{};
+        const unsigned char* const match_limit = end - kMatchSafety;
+        const unsigned char* const extend_limit = end - kLastLiterals;
+        const unsigned char* ip = in;
+        while (ip < match_limit) {
+            const std::uint32_t sequence = read32(ip);
+            std::uint32_t& slot = table[hash32(sequence)];
+            const unsigned char* candidate = in + slot;
+            slot = static_cast<std::uint32_t>(ip - in);
+            if (candidate >= ip || static_cast<std::size_t>(ip - candidate) > kMaxOffset ||
+                read32(candidate) != sequence) {
+                // Step further the longer nothing has matched, so
+                // incompressible stretches cost little.
+                ip += 1 + (static_cast<std::size_t>(ip - anchor) >> 6);
+                continue;
+            }
+            std::size_t length = kMinMatch;
+            while (ip + length < extend_limit && candidate[length] == ip[length]) {
+                ++length;
+            }
+            out = put_sequence(out, anchor, static_cast<std::size_t>(ip - anchor),
+                               static_cast<std::size_t>(ip - candidate), length);
+            ip += length;
+            anchor = ip;
+            if (ip < match_limit) {
+                table[hash32(read32(ip - 2))] = static_cast<std::uint32_t>(ip - 2 - in);
+            }
+        }
+    }
+    out = put_sequence(out, anchor, static_cast<std::size_t>(end - anchor), 0, 0);
+    return static_cast<std::size_t>(out - reinterpret_cast<unsigned char*>(output));
+}
+
+void lz_decompress(const char* input, std::size_t size, char* output, std::size_t out_size) {
+    const auto* in = reinterpret_cast<const unsigned char*>(input);
+    const unsigned char* const in_end = in + size;
+    auto* out = reinterpret_cast<unsigned char*>(output);
+    unsigned char* const out_begin = out;
+    unsigned char* const out_end = out + out_size;
+    for (;;) {
+        if (in == in_end) {
+            malformed();
+        }
+        const unsigned token = *in++;
+        const std::size_t literal_length = get_length(in, in_end, token >> 4);
+        if (literal_length > static_cast<std::size_t>(in_end - in) ||
+            literal_length > static_cast<std::size_t>(out_end - out)) {
+            malformed();
+        }
+        std::memcpy(out, in, literal_length);
+        in += literal_length;
+        out += literal_length;
+        if (in == in_end) {
+            break;
+        }
+        if (in_end - in < 2) {
+            malformed();
+        }
+        const std::size_t offset = static_cast<std::size_t>(in[0]) | static_cast<std::size_t>(in[1]) << 8;
+        in += 2;
+        const std::size_t match_length = get_length(in, in_end, token & 15) + kMinMatch;
+        if (offset == 0 || offset > static_cast<std::size_t>(out - out_begin) ||
+            match_length > static_cast<std::size_t>(out_end - out)) {
+            malformed();
+        }
+        const unsigned char* match = out - offset;
+        if (offset >= match_length) {
+            std::memcpy(out, match, match_length);
+            out += match_length;
+        } else {
+            // Overlapping: the match repeats bytes it is producing.
+            for (std::size_t i = 0; i < match_length; ++i) {
+                *out++ = *match++;
+            }
+        }
+    }
+    if (out != out_end) {
+        malformed();
+    }
+}
+
+double sample_entropy(const char* data, std::size_t size) {
+    constexpr std::size_t kSlices = 64;
+    constexpr std::size_t kSliceBytes = 64;
+    std::array<std::uint32_t, 256> counts{};
+    std::size_t sampled = 0;
+    if (size <= kSlices * kSliceBytes) {
+        for (std::size_t i = 0; i < size; ++i) {
+            ++counts[static_cast<unsigned char>(data[i])];
+        }
+        sampled = size;
+    } else {
+        const std::size_t stride = (size - kSliceBytes) / (kSlices - 1);
+        for (std::size_t slice = 0; slice < kSlices; ++slice) {
+            const char* p = data + slice * stride;
+            for (std::size_t i = 0; i < kSliceBytes; ++i) {
+                ++counts[static_cast<unsigned char>(p[i])];
+            }
+        }
+        sampled = kSlices * kSliceBytes;
+    }
+    double entropy = 0.0;
+    for (const std::uint32_t count : counts) {
+        if (count > 0) {
+            const double p = static_cast<double>(count) / static_cast<double>(sampled);
+            entropy -= p * std::log2(p);
+        }
+    }
+    return entropy;
+}
+
+} // namespace mfs
@@ -1,14 +1,86 @@
 #include "sync.hpp"
 
+#include "chunk_store.hpp"
+#include "event_stream.hpp"
+#include "live_stats.hpp"
+#include "tar.hpp"
+#include "transport.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+
 #include <iostream>
+#include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 namespace {
 
 void print_usage(const char* program) {
-    std::cout << "Usage: " << program << " [--keep-extra] <source_dir> <destination_dir>\n"
-              << "  --keep-extra   Preserve files that exist only in the destination directory.\n"
+    std::cout << "Usage: " << program << " [options] <source_dir> <destination_dir>\n"
+              << "       " << program << " [options] --send-via=<command> <source_dir>\n"
+              << "       " << program << " --receiver <destination_dir>\n"
+              << "       " << program << " [options] --tar-export=<file|-> <source_dir> <reference_dir>\n"
+              << "       " << program << " [--workers=<n>] --tar-import=<file|-> <destination_dir>\n"
+              << "       " << program << " [--workers=<n>] --chunk-store=<store> <source_dir>\n"
+              << "       " << program << " [--workers=<n>] --chunk-store=<store> --restore[=<run>] <destination_dir>\n"
+              << "  --send-via=<command>       Stream <source_dir> to a receiver started with /bin/sh -c <command>,\n"
+              << "                             e.g. 'ssh host simplesync --receiver /backup'.\n"
+              << "  --receiver                 Apply a stream read from stdin to <destination_dir>; replies on stdout.\n"
+              << "  --files-in-flight=<n>      With --send-via, files streamed at once (default 4).\n"
+              << "  --no-splice                With --send-via or --receiver, move file data through buffers\n"
+              << "                             instead of splice(2).\n"
+              << "  --compress[=<threads>]     With --send-via, compress file data on <threads> threads\n"
+              << "                             (default one per CPU).\n"
+              << "  --tar-export=<file|->      Write what a sync to <reference_dir> would copy as a pax tar stream\n"
+              << "                             instead; '-' writes to stdout and moves the report to stderr.\n"
+              << "  --tar-import=<file|->      Apply a tar stream to <destination_dir>, writing files on --workers\n"
+              << "                             threads (default 4). Nothing is pruned.\n"
+              << "  --chunk-store=<store>      Back up <source_dir> into a deduplicating chunk store as a new run,\n"
+              << "                             chunking files on --workers threads (default 4).\n"
+              << "  --restore[=<run>]          With --chunk-store, rebuild <run> (default the latest) as a plain tree.\n"
+              << "  --keep-extra               Preserve files that exist only in the destination directory.\n"
+              << "  --account-usage            Report copied/skipped/deleted totals per uid, gid and\n"
+              << "                             top-level directory.\n"
+              << "  --columnar-export=<dir>    Also write synchronized entry metadata as column files in <dir>.\n"
+              << "  --format=<text|jsonl>      Render the summary and metadata dump as text (default) or JSON Lines.\n"
+              << "  --events=jsonl             Emit a JSON Lines event stream (stderr unless redirected below).\n"
+              << "  --events-file=<path>       Write the event stream to <path>.\n"
+              << "  --events-fd=<n>            Write the event stream to file descriptor <n>.\n"
+              << "  --retries=<n>              Retry transient errors (EIO, ESTALE, ...) up to <n> times (default 4).\n"
+              << "  --workers=<n>              Split directories with many entries across <n> worker threads.\n"
+              << "  --split-threshold=<n>      Entries after which a directory is split (default 10000).\n"
+              << "  --data-workers=<n>         Copy large files on <n> threads of their own, so the walk and\n"
+              << "                             small files never wait behind them.\n"
+              << "  --data-threshold=<KiB>     Files of at least <KiB> go to the data workers (default 1024).\n"
+              << "  --data-queue=<MiB>         Bytes handed to the data workers and not yet copied (default 256).\n"
+              << "  --copy-order=<order>       Issue copies in directory order (default), or in windows sorted\n"
+              << "                             by inode or by first extent on disk (FIEMAP), for rotating disks.\n"
+              << "  --copy-window=<n>          Copies held back and sorted at a time (default 256).\n"
+              << "  --numa                     With --workers, pin workers to NUMA nodes and report per-node throughput.\n"
+              << "  --copy-buffer=<KiB>        Copy through a preallocated huge-page buffer pool of <KiB> buffers.\n"
+              << "  --copy-engine=<engine>     Copy with copy_file_range, read_write, mmap, reflink, sendfile or\n"
+              << "                             direct; 'auto' picks the fastest per file size class for the\n"
+              << "                             filesystem pair (cached; never mmap), 'calibrate' re-measures it.\n"
+              << "  --copy-engine-cache=<path> Calibration cache (default $XDG_CACHE_HOME/simplesync/copy_engines).\n"
+              << "  --resume[=verify|append]   Continue copies of large files (>= 8 MiB) whose destination is\n"
+              << "                             shorter than the source: from the first differing 1 MiB block\n"
+              << "                             (verify, the default) or after what is there (append).\n"
+              << "  --priority=<glob>[:<n>]    Copy the subtrees of directories matching <glob> (relative to\n"
+              << "                             <source_dir>) first, in class <n> 1-7 (default 1); more\n"
+              << "                             urgent classes preempt less urgent ones. Repeatable.\n"
+              << "  --priority-aging=<n>       Serve a class passed over <n> times in a row anyway (default 64,\n"
+              << "                             0 never).\n"
+              << "  --watchdog[=<seconds>]     Report filesystem calls running longer than <seconds> (default 30).\n"
+              << "  --quarantine-hung          With --watchdog, skip the subtree of a hung call for the rest of the run.\n"
+              << "  --live-stats[=<path>]      Publish live counters in a shared-memory file\n"
+              << "                             (default /dev/shm/simplesync-<pid>.stats, removed on exit).\n"
               << std::endl;
 }
 
@@ -21,6 +93,39 @@ int main(int argc, char** argv) {
     }
 
     bool keep_extra = false;
+    bool account_usage = false;
+    std::string columnar_export;
+    mfs::OutputFormat format = mfs::OutputFormat::text;
+    bool events_enabled = false;
+    std::string events_file;
+    int events_fd = STDERR_FILENO;
+    bool live_stats_enabled = false;
+    mfs::RetryPolicy retry;
+    mfs::WatchdogOptions watchdog;
+    std::size_t workers = 1;
+    std::size_t split_threshold = mfs::SyncOptions{}.split_threshold;
+    bool numa = false;
+    std::size_t copy_buffer_kib = 0;
+    std::optional<mfs::CopyEngine> copy_engine;
+    bool calibrate_copy = false;
+    bool recalibrate_copy = false;
+    std::filesystem::path copy_engine_cache = mfs::default_calibration_cache();
+    std::string live_stats_file;
+    std::string send_via;
+    bool receiver = false;
+    std::string tar_export;
+    std::string tar_import;
+    std::string chunk_store;
+    mfs::ResumeMode resume = mfs::ResumeMode::off;
+    std::vector<mfs::PriorityRule> priority_rules;
+    std::size_t priority_aging = mfs::SyncOptions{}.priority_aging;
+    std::size_t data_workers = 0;
+    mfs::CopyOrder copy_order = mfs::CopyOrder::directory;
+    std::size_t copy_window = mfs::SyncOptions{}.copy_window;
+    std::uintmax_t data_min_bytes = mfs::SyncOptions{}.data_min_bytes;
+    std::uintmax_t data_queue_bytes = mfs::SyncOptions{}.data_queue_bytes;
+    std::optional<std::string> restore_run;
+    mfs::TransportOptions transport;
     std::vector<std::string> positional_args;
     positional_args.reserve(2);
 
@@ -28,6 +133,129 @@ int main(int argc, char** argv) {
         const std::string arg = argv[i];
         if (arg == "--keep-extra") {
             keep_extra = true;
+        } else if (arg == "--account-usage") {
+            account_usage = true;
+        } else if (arg.rfind("--columnar-export=", 0) == 0) {
+            columnar_export = arg.substr(std::string("--columnar-export=").size());
+        } else if (arg == "--format=text") {
+            format = mfs::OutputFormat::text;
+        } else if (arg == "--format=jsonl") {
+            format = mfs::OutputFormat::jsonl;
+        } else if (arg.rfind("--format=", 0) == 0) {
+            std::cerr << "Error: unknown output format: " << arg.substr(std::string("--format=").size()) << "\n"
+                      << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        } else if (arg == "--events=jsonl") {
+            events_enabled = true;
+        } else if (arg.rfind("--events-file=", 0) == 0) {
+            events_file = arg.substr(std::string("--events-file=").size());
+        } else if (arg.rfind("--events-fd=", 0) == 0) {
+            events_fd = std::atoi(arg.c_str() + std::string("--events-fd=").size());
+        } else if (arg.rfind("--events=", 0) == 0) {
+            std::cerr << "Error: unsupported event format: " << arg.substr(std::string("--events=").size())
+                      << "\n" << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        } else if (arg.rfind("--retries=", 0) == 0) {
+            retry.max_retries = static_cast<unsigned>(std::strtoul(arg.c_str() + std::string("--retries=").size(),
+                                                                   nullptr, 10));
+        } else if (arg.rfind("--workers=", 0) == 0) {
+            workers = std::strtoul(arg.c_str() + std::string("--workers=").size(), nullptr, 10);
+        } else if (arg.rfind("--split-threshold=", 0) == 0) {
+            split_threshold = std::strtoul(arg.c_str() + std::string("--split-threshold=").size(), nullptr, 10);
+        } else if (arg == "--numa") {
+            numa = true;
+        } else if (arg.rfind("--copy-buffer=", 0) == 0) {
+            copy_buffer_kib = std::strtoul(arg.c_str() + std::string("--copy-buffer=").size(), nullptr, 10);
+        } else if (arg.rfind("--copy-engine-cache=", 0) == 0) {
+            copy_engine_cache = arg.substr(std::string("--copy-engine-cache=").size());
+        } else if (arg.rfind("--copy-engine=", 0) == 0) {
+            const std::string value = arg.substr(std::string("--copy-engine=").size());
+            if (value == "auto" || value == "calibrate") {
+                calibrate_copy = true;
+                recalibrate_copy = value == "calibrate";
+            } else if (!(copy_engine = mfs::parse_copy_engine(value))) {
+                std::cerr << "Error: unknown copy engine: " << value << "\n" << std::endl;
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--resume" || arg == "--resume=verify") {
+            resume = mfs::ResumeMode::verify;
+        } else if (arg == "--resume=append") {
+            resume = mfs::ResumeMode::append;
+        } else if (arg.rfind("--resume=", 0) == 0) {
+            std::cerr << "Error: unknown resume mode: " << arg.substr(std::string("--resume=").size()) << "\n"
+                      << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        } else if (arg.rfind("--priority=", 0) == 0) {
+            mfs::PriorityRule rule;
+            rule.pattern = arg.substr(std::string("--priority=").size());
+            const std::size_t colon = rule.pattern.rfind(':');
+            if (colon != std::string::npos &&
+                rule.pattern.find_first_not_of("0123456789", colon + 1) == std::string::npos) {
+                rule.level = std::strtoul(rule.pattern.c_str() + colon + 1, nullptr, 10);
+                rule.pattern.resize(colon);
+            }
+            priority_rules.push_back(std::move(rule));
+        } else if (arg.rfind("--priority-aging=", 0) == 0) {
+            priority_aging = std::strtoul(arg.c_str() + std::string("--priority-aging=").size(), nullptr, 10);
+        } else if (arg == "--copy-order=directory") {
+            copy_order = mfs::CopyOrder::directory;
+        } else if (arg == "--copy-order=inode") {
+            copy_order = mfs::CopyOrder::inode;
+        } else if (arg == "--copy-order=extent") {
+            copy_order = mfs::CopyOrder::extent;
+        } else if (arg.rfind("--copy-window=", 0) == 0) {
+            copy_window = std::strtoul(arg.c_str() + std::string("--copy-window=").size(), nullptr, 10);
+        } else if (arg.rfind("--data-workers=", 0) == 0) {
+            data_workers = std::strtoul(arg.c_str() + std::string("--data-workers=").size(), nullptr, 10);
+        } else if (arg.rfind("--data-threshold=", 0) == 0) {
+            data_min_bytes = std::strtoull(arg.c_str() + std::string("--data-threshold=").size(), nullptr, 10) * 1024;
+        } else if (arg.rfind("--data-queue=", 0) == 0) {
+            data_queue_bytes =
+                std::strtoull(arg.c_str() + std::string("--data-queue=").size(), nullptr, 10) * 1024 * 1024;
+        } else if (arg == "--watchdog") {
+            watchdog.enabled = true;
+        } else if (arg.rfind("--watchdog=", 0) == 0) {
+            watchdog.enabled = true;
+            const double seconds = std::strtod(arg.c_str() + std::string("--watchdog=").size(), nullptr);
+            watchdog.threshold = std::chrono::milliseconds(static_cast<long long>(seconds * 1000.0));
+            if (watchdog.threshold < watchdog.poll_interval) {
+                watchdog.poll_interval = std::max(watchdog.threshold / 4, std::chrono::milliseconds(10));
+            }
+        } else if (arg == "--quarantine-hung") {
+            watchdog.quarantine = true;
+        } else if (arg == "--live-stats") {
+            live_stats_enabled = true;
+        } else if (arg.rfind("--live-stats=", 0) == 0) {
+            live_stats_enabled = true;
+            live_stats_file = arg.substr(std::string("--live-stats=").size());
+        } else if (arg.rfind("--send-via=", 0) == 0) {
+            send_via = arg.substr(std::string("--send-via=").size());
+        } else if (arg == "--receiver") {
+            receiver = true;
+        } else if (arg == "--compress") {
+            transport.compress = true;
+        } else if (arg.rfind("--compress=", 0) == 0) {
+            transport.compress = true;
+            transport.compress_threads = std::strtoul(arg.c_str() + std::string("--compress=").size(), nullptr, 10);
+        } else if (arg == "--no-splice") {
+            transport.zero_copy = false;
+        } else if (arg.rfind("--files-in-flight=", 0) == 0) {
+            transport.files_in_flight =
+                std::strtoul(arg.c_str() + std::string("--files-in-flight=").size(), nullptr, 10);
+        } else if (arg.rfind("--tar-export=", 0) == 0) {
+            tar_export = arg.substr(std::string("--tar-export=").size());
+        } else if (arg.rfind("--tar-import=", 0) == 0) {
+            tar_import = arg.substr(std::string("--tar-import=").size());
+        } else if (arg.rfind("--chunk-store=", 0) == 0) {
+            chunk_store = arg.substr(std::string("--chunk-store=").size());
+        } else if (arg == "--restore") {
+            restore_run = std::string();
+        } else if (arg.rfind("--restore=", 0) == 0) {
+            restore_run = arg.substr(std::string("--restore=").size());
         } else if (arg == "--help" || arg == "-h") {
             print_usage(argv[0]);
             return 0;
@@ -36,6 +264,98 @@ int main(int argc, char** argv) {
         }
     }
 
+    if (receiver || !send_via.empty()) {
+        if (positional_args.size() != 1 || (receiver && !send_via.empty())) {
+            std::cerr << "Error: expected one directory with --send-via or --receiver.\n" << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        }
+        // A peer that goes away must show up as a write error, not kill us.
+        std::signal(SIGPIPE, SIG_IGN);
+        if (receiver) {
+            try {
+                const mfs::SyncStats stats =
+                    mfs::SyncReceiver(STDIN_FILENO, STDOUT_FILENO, transport).receive(positional_args[0]);
+                std::cerr << "Received " << stats.files_copied << " files (" << stats.bytes_copied << " bytes)"
+                          << std::endl;
+            } catch (const std::exception& ex) {
+                std::cerr << "Receiver failed: " << ex.what() << std::endl;
+                return 1;
+            }
+            return 0;
+        }
+        transport.remove_extraneous = !keep_extra;
+        try {
+            mfs::ChildProcess child(send_via);
+            mfs::SyncStats stats;
+            try {
+                stats = mfs::SyncSender(child.from_child(), child.to_child(), transport).send(positional_args[0]);
+            } catch (const std::exception&) {
+                child.wait();
+                throw;
+            }
+            const int status = child.wait();
+            if (status != 0) {
+                throw std::runtime_error("receiver command exited with status " + std::to_string(status));
+            }
+            mfs::print_report(stats, format);
+        } catch (const std::exception& ex) {
+            std::cerr << "Synchronization failed: " << ex.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (!chunk_store.empty()) {
+        if (positional_args.size() != 1) {
+            std::cerr << "Error: expected one directory with --chunk-store.\n" << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        }
+        try {
+            mfs::ChunkStoreOptions store_options;
+            if (workers > 1) {
+                store_options.workers = workers;
+            }
+            mfs::ChunkStore store(chunk_store, store_options);
+            const mfs::SyncStats stats = restore_run ? store.restore(*restore_run, positional_args[0])
+                                                     : store.backup(positional_args[0]);
+            mfs::print_report(stats, format);
+        } catch (const std::exception& ex) {
+            std::cerr << (restore_run ? "Restore failed: " : "Backup failed: ") << ex.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    if (!tar_import.empty()) {
+        if (positional_args.size() != 1 || !tar_export.empty()) {
+            std::cerr << "Error: expected one destination directory with --tar-import.\n" << std::endl;
+            print_usage(argv[0]);
+            return 1;
+        }
+        const int fd = tar_import == "-" ? STDIN_FILENO : ::open(tar_import.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "Error: cannot open " << tar_import << std::endl;
+            return 1;
+        }
+        try {
+            mfs::TarImportOptions import_options;
+            if (workers > 1) {
+                import_options.workers = workers;
+            }
+            if (copy_buffer_kib > 0) {
+                import_options.buffer_bytes = copy_buffer_kib * 1024;
+            }
+            const mfs::SyncStats stats = mfs::TarImporter(import_options).apply(fd, positional_args[0]);
+            mfs::print_report(stats, format);
+        } catch (const std::exception& ex) {
+            std::cerr << "Import failed: " << ex.what() << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
     if (positional_args.size() != 2) {
         std::cerr << "Error: expected source and destination directories.\n" << std::endl;
         print_usage(argv[0]);
@@ -47,16 +367,76 @@ int main(int argc, char** argv) {
 
     mfs::SyncOptions options;
     options.remove_extraneous = !keep_extra;
+    options.resume = resume;
+    options.priority_rules = std::move(priority_rules);
+    options.priority_aging = priority_aging;
+    options.columnar_export_dir = columnar_export;
+    options.account_usage = account_usage;
+    options.retry = retry;
+    options.watchdog = watchdog;
+    options.workers = workers;
+    options.split_threshold = split_threshold;
+    options.data_workers = data_workers;
+    options.copy_order = copy_order;
+    options.copy_window = copy_window;
+    options.data_min_bytes = data_min_bytes;
+    options.data_queue_bytes = data_queue_bytes;
+    options.numa = numa;
+    options.copy_buffer_bytes = copy_buffer_kib * 1024;
+    options.copy_engine = copy_engine;
+    options.calibrate_copy = calibrate_copy;
+    options.recalibrate_copy = recalibrate_copy;
+    options.copy_engine_cache = copy_engine_cache;
+    options.watchdog.enabled = options.watchdog.enabled || options.watchdog.quarantine;
+
+    int tar_fd = -1;
+    if (tar_export == "-") {
+        // The stream takes stdout; progress and the report move to stderr.
+        tar_fd = ::dup(STDOUT_FILENO);
+        ::dup2(STDERR_FILENO, STDOUT_FILENO);
+    } else if (!tar_export.empty()) {
+        tar_fd = ::open(tar_export.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+    if (!tar_export.empty()) {
+        if (tar_fd < 0) {
+            std::cerr << "Error: cannot open " << tar_export << std::endl;
+            return 1;
+        }
+        std::signal(SIGPIPE, SIG_IGN);
+        options.tar_export = std::make_shared<mfs::TarWriter>(tar_fd);
+    }
 
     try {
+        if (events_enabled) {
+            options.events = events_file.empty() ? std::make_shared<mfs::EventStream>(events_fd)
+                                                 : mfs::EventStream::open_file(events_file);
+        }
+        if (live_stats_enabled) {
+            options.live_stats = live_stats_file.empty()
+                                     ? std::make_shared<mfs::LiveStatsPublisher>(
+                                           mfs::LiveStatsPublisher::default_path(), true)
+                                     : std::make_shared<mfs::LiveStatsPublisher>(live_stats_file);
+            std::cout << "Publishing live counters to " << options.live_stats->path() << std::endl;
+        }
         mfs::DirectorySyncer syncer(options);
         mfs::SyncStats stats = syncer.synchronize(source, destination);
-        mfs::print_report(stats);
-        mfs::print_synced_metadata(stats.synced_entries);
+        if (options.events) {
+            options.events->close();
+            // The last events are written by close().
+            if (const std::string failure = options.events->take_failure(); !failure.empty()) {
+                std::cerr << "    Warning: event stream disabled: " << failure << std::endl;
+            }
+        }
+        mfs::print_report(stats, format);
+        mfs::print_synced_metadata(stats.synced_entries, format);
     } catch (const std::exception& ex) {
         std::cerr << "Synchronization failed: " << ex.what() << std::endl;
         return 1;
     }
+    if (tar_fd >= 0 && ::close(tar_fd) != 0) {
+        std::cerr << "Error: failed to close " << tar_export << std::endl;
+        return 1;
+    }
 
     return 0;
 }
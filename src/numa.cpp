@@ -0,0 +1,145 @@
+#include "numa.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+namespace mfs {
+
+namespace fs = std::filesystem;
+
+namespace {
+
+int parse_cpu(std::string_view text, std::string_view list) {
+    if (text.empty() || text.size() > 9 ||
+        !std::all_of(text.begin(), text.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+        throw std::runtime_error("Malformed CPU list: " + std::string(list));
+    }
+    return std::stoi(std::string(text));
+}
+
+std::string_view trim(std::string_view text) {
+    while (!text.empty() && std::isspace(static_cast<unsigned char>(text.front()))) {
+        text.remove_prefix(1);
+    }
+    while (!text.empty() && std::isspace(static_cast<unsigned char>(text.back()))) {
+        text.remove_suffix(1);
+    }
+    return text;
+}
+
+#if defined(__linux__)
+std::vector<int> current_affinity() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (::sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) {
+                cpus.push_back(cpu);
+            }
+        }
+    }
+    return cpus;
+}
+#endif
+
+} // namespace
+
+NumaTopology::NumaTopology() : nodes_{NumaNode{0, {}}} {}
+
+NumaTopology::NumaTopology(std::vector<NumaNode> nodes) : nodes_(std::move(nodes)) {
+    if (nodes_.empty()) {
+        nodes_.push_back(NumaNode{0, {}});
+    }
+}
+
+NumaTopology NumaTopology::detect(const fs::path& sysfs_root) {
+    std::vector<NumaNode> nodes;
+    std::error_code ec;
+    for (fs::directory_iterator it(sysfs_root, ec), end; !ec && it != end; it.increment(ec)) {
+        const std::string name = it->path().filename().string();
+        if (name.size() <= 4 || name.compare(0, 4, "node") != 0 ||
+            !std::all_of(name.begin() + 4, name.end(), [](char c) { return std::isdigit(static_cast<unsigned char>(c)); })) {
+            continue;
+        }
+        std::ifstream input(it->path() / "cpulist");
+        std::string list;
+        std::getline(input, list);
+        try {
+            std::vector<int> cpus = parse_cpu_list(list);
+            if (!cpus.empty()) {
+                nodes.push_back(NumaNode{std::stoi(name.substr(4)), std::move(cpus)});
+            }
+        } catch (const std::exception&) {
+            // An unreadable node is treated like a memory-only one.
+        }
+    }
+    std::sort(nodes.begin(), nodes.end(), [](const NumaNode& a, const NumaNode& b) { return a.id < b.id; });
+    return NumaTopology(std::move(nodes));
+}
+
+std::vector<int> parse_cpu_list(std::string_view list) {
+    std::vector<int> cpus;
+    list = trim(list);
+    while (!list.empty()) {
+        const std::size_t comma = list.find(',');
+        const std::string_view range = trim(list.substr(0, comma));
+        list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+
+        const std::size_t dash = range.find('-');
+        const int first = parse_cpu(range.substr(0, dash), range);
+        const int last = dash == std::string_view::npos ? first : parse_cpu(range.substr(dash + 1), range);
+        if (last < first) {
+            throw std::runtime_error("Malformed CPU list: " + std::string(range));
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+bool pin_current_thread(const std::vector<int>& cpus) {
+#if defined(__linux__)
+    if (cpus.empty()) {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) {
+            CPU_SET(cpu, &set);
+        }
+    }
+    return ::sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+ScopedThreadPin::ScopedThreadPin(const std::vector<int>& cpus) {
+#if defined(__linux__)
+    previous_ = current_affinity();
+    pinned_ = !previous_.empty() && pin_current_thread(cpus);
+#else
+    (void)cpus;
+#endif
+}
+
+ScopedThreadPin::~ScopedThreadPin() {
+    if (pinned_) {
+        pin_current_thread(previous_);
+    }
+}
+
+} // namespace mfs
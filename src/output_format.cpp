@@ -0,0 +1,188 @@
+#include "output_format.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+
+namespace mfs {
+
+namespace {
+
+constexpr char kHexDigits[] = "0123456789abcdef";
+
+} // namespace
+
+void write_fully(int fd, const char* data, std::size_t size) {
+    std::size_t offset = 0;
+    while (offset < size) {
+        const ssize_t written = ::write(fd, data + offset, size - offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Failed to write output: ") + std::strerror(errno));
+        }
+        offset += static_cast<std::size_t>(written);
+    }
+}
+
+OutputBuffer::OutputBuffer(int fd, std::size_t capacity)
+    : fd_(fd), capacity_(capacity < 256 ? 256 : capacity), data_(new char[capacity_]) {}
+
+OutputBuffer::~OutputBuffer() {
+    try {
+        flush();
+    } catch (...) {
+    }
+}
+
+void OutputBuffer::append_slow(std::string_view text) {
+    if (fd_ >= 0 && text.size() > capacity_) {
+        flush();
+        std::size_t offset = 0;
+        while (offset < text.size()) {
+            const std::size_t take = std::min(capacity_, text.size() - offset);
+            std::memcpy(reserve(take), text.data() + offset, take);
+            used_ += take;
+            offset += take;
+            flush();
+        }
+        return;
+    }
+    std::memcpy(reserve(text.size()), text.data(), text.size());
+    used_ += text.size();
+}
+
+void OutputBuffer::append_uint(std::uint64_t value) {
+    char* out = reserve(20);
+    used_ = static_cast<std::size_t>(std::to_chars(out, out + 20, value).ptr - data_.get());
+}
+
+void OutputBuffer::append_int(std::int64_t value) {
+    char* out = reserve(21);
+    used_ = static_cast<std::size_t>(std::to_chars(out, out + 21, value).ptr - data_.get());
+}
+
+void OutputBuffer::append_uint_right(std::uint64_t value, std::size_t width) {
+    char digits[20];
+    const std::size_t length = static_cast<std::size_t>(std::to_chars(digits, digits + 20, value).ptr - digits);
+    const std::size_t pad = width > length ? width - length : 0;
+    char* out = reserve(pad + length);
+    std::memset(out, ' ', pad);
+    std::memcpy(out + pad, digits, length);
+    used_ += pad + length;
+}
+
+void OutputBuffer::append_fixed(double value, int precision) {
+    // Fixed notation of a double never needs more than 309 integer digits.
+    const std::size_t bound = 320 + static_cast<std::size_t>(precision);
+    char* out = reserve(bound);
+    const auto result = std::to_chars(out, out + bound, value, std::chars_format::fixed, precision);
+    if (result.ec != std::errc()) {
+        append("nan");
+        return;
+    }
+    used_ = static_cast<std::size_t>(result.ptr - data_.get());
+}
+
+void OutputBuffer::append_quoted(std::string_view text) {
+    append('"');
+    // Paths almost never contain quotes or backslashes; memchr keeps that
+    // check vectorized and leaves a single copy for the common case.
+    if (std::memchr(text.data(), '"', text.size()) == nullptr &&
+        std::memchr(text.data(), '\\', text.size()) == nullptr) {
+        append(text);
+    } else {
+        std::size_t run = 0;
+        for (std::size_t i = 0; i < text.size(); ++i) {
+            if (text[i] == '"' || text[i] == '\\') {
+                append(text.substr(run, i - run));
+                append('\\');
+                run = i;
+            }
+        }
+        append(text.substr(run));
+    }
+    append('"');
+}
+
+void OutputBuffer::append_json_string(std::string_view text) {
+    append('"');
+    std::size_t run = 0;
+    for (std::size_t i = 0; i < text.size(); ++i) {
+        const auto c = static_cast<unsigned char>(text[i]);
+        if (c >= 0x20 && c != '"' && c != '\\') {
+            continue;
+        }
+        append(text.substr(run, i - run));
+        run = i + 1;
+        switch (c) {
+        case '"':
+            append("\\\"");
+            break;
+        case '\\':
+            append("\\\\");
+            break;
+        case '\n':
+            append("\\n");
+            break;
+        case '\t':
+            append("\\t");
+            break;
+        case '\r':
+            append("\\r");
+            break;
+        default: {
+            char* out = reserve(6);
+            std::memcpy(out, "\\u00", 4);
+            out[4] = kHexDigits[c >> 4];
+            out[5] = kHexDigits[c & 0xf];
+            used_ += 6;
+            break;
+        }
+        }
+    }
+    append(text.substr(run));
+    append('"');
+}
+
+void OutputBuffer::append_padded(std::string_view text, std::size_t width) {
+    append(text);
+    if (text.size() < width) {
+        const std::size_t pad = width - text.size();
+        std::memset(reserve(pad), ' ', pad);
+        used_ += pad;
+    }
+}
+
+void OutputBuffer::flush() {
+    if (fd_ < 0) {
+        return;
+    }
+    const std::size_t pending = used_;
+    used_ = 0;
+    write_fully(fd_, data_.get(), pending);
+}
+
+void OutputBuffer::make_room(std::size_t bytes) {
+    if (fd_ >= 0 && bytes <= capacity_) {
+        flush();
+    } else {
+        grow(bytes);
+    }
+}
+
+void OutputBuffer::grow(std::size_t bytes) {
+    std::size_t capacity = capacity_ * 2;
+    while (capacity - used_ < bytes) {
+        capacity *= 2;
+    }
+    std::unique_ptr<char[]> data(new char[capacity]);
+    std::memcpy(data.get(), data_.get(), used_);
+    data_ = std::move(data);
+    capacity_ = capacity;
+}
+
+} // namespace mfs
@@ -0,0 +1,45 @@
+#include "retry.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+
+namespace mfs {
+
+ErrorClass classify_errno(int err) {
+    switch (err) {
+    case EIO:
+    case ESTALE:
+    case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+    case EWOULDBLOCK:
+#endif
+    case ETIMEDOUT:
+    case EINTR:
+    case EBUSY:
+    case ENOLCK:
+        return ErrorClass::transient;
+    default:
+        return ErrorClass::permanent;
+    }
+}
+
+ErrorClass classify_error(const std::error_code& ec) {
+    if (ec.category() == std::generic_category() || ec.category() == std::system_category()) {
+        return classify_errno(ec.value());
+    }
+    return ErrorClass::permanent;
+}
+
+std::chrono::nanoseconds retry_delay(const RetryPolicy& policy, unsigned attempt, std::mt19937_64& rng) {
+    const double base = static_cast<double>(std::chrono::nanoseconds(policy.initial_delay).count());
+    const double cap = static_cast<double>(std::chrono::nanoseconds(policy.max_delay).count());
+    const double exponent = attempt > 0 ? static_cast<double>(attempt - 1) : 0.0;
+    const double delay = std::min(cap, base * std::pow(policy.multiplier, exponent));
+
+    const double jitter = std::clamp(policy.jitter, 0.0, 1.0);
+    std::uniform_real_distribution<double> spread(1.0 - jitter, 1.0);
+    return std::chrono::nanoseconds(static_cast<std::int64_t>(delay * spread(rng)));
+}
+
+} // namespace mfs
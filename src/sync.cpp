@@ -1,13 +1,39 @@
 #include "sync.hpp"
 
+#include "arena.hpp"
+#include "buffer_pool.hpp"
+#include "columnar.hpp"
+#include "copy_engine.hpp"
+#include "dir_reader.hpp"
+#include "event_stream.hpp"
+#include "flat_hash.hpp"
+#include "live_stats.hpp"
+#include "log.hpp"
+#include "numa.hpp"
+#include "retry.hpp"
+#include "tar.hpp"
+#include "watchdog.hpp"
+#include "worker_pool.hpp"
+
 #include <algorithm>
+#include <atomic>
 #include <cerrno>
+#include <condition_variable>
 #include <cstring>
 #include <exception>
-#include <iomanip>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #include <vector>
 
+#include <dirent.h>
+#include <fnmatch.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -16,33 +42,541 @@ namespace mfs {
 namespace fs = std::filesystem;
 using Clock = std::chrono::steady_clock;
 
-DirectorySyncer::DirectorySyncer(SyncOptions options) : options_(options) {}
+namespace {
+
+// Entries visited between two publishes of the live shared-memory counters.
+constexpr std::size_t kLivePublishInterval = 256;
+// How often the walking thread, done walking, reports progress while it
+// waits for the workers.
+constexpr std::chrono::milliseconds kProgressWaitInterval{100};
+
+// Copy buffer size when an engine table needs a pool but
+// SyncOptions::copy_buffer_bytes is 0.
+constexpr std::size_t kDefaultCopyBufferBytes = 1024 * 1024;
+
+bool needs_buffers(const CopyEngineTable& table) {
+    return table.uses(CopyEngine::read_write) || table.uses(CopyEngine::direct);
+}
+
+// Directory iteration wrapped in watchdog guards: opening a directory and
+// advancing past an entry are the readdir/opendir calls that can hang.
+fs::recursive_directory_iterator open_walk(const fs::path& root) {
+    FsOpGuard guard(FsOp::readdir, root);
+    return fs::recursive_directory_iterator(root, fs::directory_options::skip_permission_denied);
+}
+
+void advance_walk(fs::recursive_directory_iterator& it) {
+    FsOpGuard guard(FsOp::readdir, it->path());
+    ++it;
+}
+
+bool exists_guarded(const fs::path& path) {
+    FsOpGuard guard(FsOp::lstat, path);
+    return fs::exists(path);
+}
+
+fs::file_status status_guarded(const fs::path& path) {
+    FsOpGuard guard(FsOp::lstat, path);
+    return fs::status(path);
+}
+
+fs::file_type file_type_of(mode_t mode) {
+    if (S_ISREG(mode)) {
+        return fs::file_type::regular;
+    }
+    if (S_ISDIR(mode)) {
+        return fs::file_type::directory;
+    }
+    if (S_ISLNK(mode)) {
+        return fs::file_type::symlink;
+    }
+    if (S_ISBLK(mode)) {
+        return fs::file_type::block;
+    }
+    if (S_ISCHR(mode)) {
+        return fs::file_type::character;
+    }
+    if (S_ISFIFO(mode)) {
+        return fs::file_type::fifo;
+    }
+    if (S_ISSOCK(mode)) {
+        return fs::file_type::socket;
+    }
+    return fs::file_type::unknown;
+}
+
+// Destination lookup for an entry. With the listing of a split directory,
+// names missing from it need no system call at all and d_type answers for
+// regular files and directories; anything else (symlinks, DT_UNKNOWN) is
+// stat'ed. The stat() goes straight to the NUL-terminated buffer; only
+// unexpected errors take fs::status() so they are reported as before.
+fs::file_status destination_status(const std::string& dest_path, std::string_view name,
+                                   const DirectoryListing* listing) {
+    if (listing) {
+        const auto type = listing->find(name);
+        if (!type) {
+            return fs::file_status(fs::file_type::not_found);
+        }
+        if (*type == DT_REG) {
+            return fs::file_status(fs::file_type::regular);
+        }
+        if (*type == DT_DIR) {
+            return fs::file_status(fs::file_type::directory);
+        }
+    }
+    struct stat st {};
+    int err = 0;
+    {
+        FsOpGuard guard(FsOp::lstat, dest_path);
+        if (::stat(dest_path.c_str(), &st) != 0) {
+            err = errno;
+        }
+    }
+    if (err == 0) {
+        return fs::file_status(file_type_of(st.st_mode));
+    }
+    if (err == ENOENT || err == ENOTDIR) {
+        return fs::file_status(fs::file_type::not_found);
+    }
+    return status_guarded(fs::path(dest_path));
+}
+
+// Appends `name` as a new last component of `path`, which may be empty.
+void append_component(std::string& path, std::string_view name) {
+    if (!path.empty() && path.back() != '/') {
+        path.push_back('/');
+    }
+    path.append(name);
+}
+
+// Compile-time feature bundle for the copy loop. A feature that is off is a
+// constant false here, so its per-entry tests and calls compile away in that
+// specialization; a feature that is on is still checked against the pass.
+template <bool Observe, bool Usage, bool Track, bool Quarantine>
+struct SyncPolicy {
+    // Event stream and/or live counters.
+    static constexpr bool observe = Observe;
+    // Per-uid/gid/project accounting.
+    static constexpr bool usage = Usage;
+    // Recording source entries for the prune stage.
+    static constexpr bool track = Track;
+    // Watchdog quarantine checks.
+    static constexpr bool quarantine = Quarantine;
+};
+
+// Every feature on: the loop tests each option per entry.
+using GenericPolicy = SyncPolicy<true, true, true, true>;
+
+// Turns run-time feature flags into a SyncPolicy type, one flag at a time,
+// and calls `fn` with a value of that type.
+template <bool... Chosen, typename Fn>
+void dispatch_policy(Fn&& fn) {
+    fn(SyncPolicy<Chosen...>{});
+}
+
+template <bool... Chosen, typename Fn, typename... Flags>
+void dispatch_policy(Fn&& fn, bool flag, Flags... rest) {
+    if (flag) {
+        dispatch_policy<Chosen..., true>(std::forward<Fn>(fn), rest...);
+    } else {
+        dispatch_policy<Chosen..., false>(std::forward<Fn>(fn), rest...);
+    }
+}
+
+// Counts a directory or split batch towards its priority class. What walks
+// nested inside it copied (more urgent directories preempting it, subtrees
+// a worker came across) counts for their own classes and is left out
+// through exclude().
+class ClassTally {
+public:
+    explicit ClassTally(const SyncStats& stats)
+        : stats_(stats), files_(stats.files_copied), bytes_(stats.bytes_copied) {}
+
+    template <typename Fn>
+    void exclude(Fn&& nested) {
+        const std::size_t files = stats_.files_copied;
+        const std::uintmax_t bytes = stats_.bytes_copied;
+        nested();
+        files_ += stats_.files_copied - files;
+        bytes_ += stats_.bytes_copied - bytes;
+    }
+
+    void record(PriorityClassStats& cls, std::size_t entries, Clock::time_point copy_start) const {
+        cls.entries += entries;
+        cls.files_copied += stats_.files_copied - files_;
+        cls.bytes_copied += stats_.bytes_copied - bytes_;
+        cls.completed = std::max<std::chrono::duration<double>>(cls.completed, Clock::now() - copy_start);
+    }
+
+private:
+    const SyncStats& stats_;
+    std::size_t files_;
+    std::uintmax_t bytes_;
+};
+
+PartialCopyMarker partial_copy_marker(const FileMetadata& meta) {
+    return PartialCopyMarker{meta.size, meta.mtime, meta.mtime_nsec, meta.inode};
+}
+
+void merge_worker_stats(SyncStats& into, SyncStats& from) {
+    into.entries_scanned += from.entries_scanned;
+    into.files_copied += from.files_copied;
+    into.files_skipped += from.files_skipped;
+    into.directories_created += from.directories_created;
+    into.bytes_copied += from.bytes_copied;
+    into.files_resumed += from.files_resumed;
+    into.bytes_resumed += from.bytes_resumed;
+    for (std::size_t level = 0; level < from.priority_classes.size(); ++level) {
+        PriorityClassStats& cls = into.priority_classes[level];
+        const PriorityClassStats& local = from.priority_classes[level];
+        cls.directories += local.directories;
+        cls.entries += local.entries;
+        cls.files_copied += local.files_copied;
+        cls.bytes_copied += local.bytes_copied;
+        cls.completed = std::max(cls.completed, local.completed);
+    }
+    into.retries += from.retries;
+    into.retry_failures += from.retry_failures;
+    into.retry_elapsed += from.retry_elapsed;
+    into.copy_elapsed += from.copy_elapsed;
+    into.quarantine_skipped += from.quarantine_skipped;
+    for (std::size_t i = 0; i < kCopySizeClasses; ++i) {
+        into.copy_engines.files_copied[i] += from.copy_engines.files_copied[i];
+    }
+    into.copy_order.windows += from.copy_order.windows;
+    into.copy_order.by_extent += from.copy_order.by_extent;
+    into.copy_order.by_inode += from.copy_order.by_inode;
+    into.synced_entries.insert(into.synced_entries.end(), std::make_move_iterator(from.synced_entries.begin()),
+                               std::make_move_iterator(from.synced_entries.end()));
+}
+
+} // namespace
+
+// What concurrent synchronize() calls share. Each member has its own lock,
+// so a call calibrating does not hold up one that only needs the pool.
+struct DirectorySyncer::Shared {
+    std::mutex pool_mutex;
+    std::unique_ptr<WorkerPool> pool;
+    std::shared_ptr<const NumaTopology> topology;
+    // Node of each pool worker; empty without NUMA placement.
+    std::vector<std::size_t> worker_nodes;
+    std::unique_ptr<WorkerPool> data_pool;
+
+    // Calibrations made by this syncer, by calibration_cache_key(). Held
+    // while calibrating, so concurrent calls on the same filesystems wait
+    // for one calibration instead of timing the engines against each other.
+    std::mutex calibration_mutex;
+    std::map<std::string, CopyCalibration> calibrations;
+
+    // Calls using an option that names a single output.
+    std::mutex exclusive_mutex;
+    bool exclusive_busy{false};
+};
+
+// Everything one synchronize() call owns.
+struct DirectorySyncer::Run {
+    std::ostream& out;
+    std::ostream& err;
+    EventStream* events;
+    LiveStatsPublisher* live;
+    std::unique_ptr<ColumnarWriter> columnar{};
+    std::mutex columnar_mutex{};
+    std::unique_ptr<UsageAccounting> accounting{};
+    std::unique_ptr<Watchdog> watchdog{};
+    std::unique_ptr<BufferPool> buffer_pool{};
+    // Set when files are copied through copy_file_with() rather than
+    // std::filesystem::copy_file; buffer_pool is then set as well.
+    std::optional<CopyEngineTable> copy_engines{};
+    // Relative paths seen by the copy stage; prune consults it before falling
+    // back to a stat() of the source side. Lives from copy to end of prune.
+    std::unique_ptr<ShardedFlatStringSet> source_entries{};
+    // Set once FIEMAP failed for lack of support: inode order from then on.
+    std::atomic<bool> extents_unsupported{false};
+};
+
+DirectorySyncer::DirectorySyncer(SyncOptions options)
+    : options_(std::move(options)), shared_(std::make_unique<Shared>()) {}
+
+DirectorySyncer::~DirectorySyncer() = default;
+
+WorkerPool* DirectorySyncer::shared_pool() {
+    const std::size_t worker_count = options_.workers > 1 ? options_.workers : 0;
+    if (worker_count == 0) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(shared_->pool_mutex);
+    if (!shared_->pool) {
+        if (options_.numa) {
+            shared_->topology = options_.numa_topology
+                                    ? options_.numa_topology
+                                    : std::make_shared<const NumaTopology>(NumaTopology::detect());
+            if (shared_->topology->multi_node()) {
+                for (std::size_t worker = 0; worker < worker_count; ++worker) {
+                    shared_->worker_nodes.push_back(shared_->topology->node_of_worker(worker));
+                }
+            } else {
+                shared_->topology.reset();
+            }
+        }
+        // Only the placement is per thread; each call attaches its watchdog
+        // and accounting around its own tasks.
+        auto on_start = [topology = shared_->topology, nodes = shared_->worker_nodes](std::size_t worker) {
+            if (topology) {
+                // Before anything else, so the passes' arenas are node-local.
+                pin_current_thread(topology->nodes()[nodes[worker]].cpus);
+            }
+        };
+        shared_->pool = std::make_unique<WorkerPool>(worker_count, worker_count * 2, on_start,
+                                                     WorkerPool::ThreadHook{}, shared_->worker_nodes);
+    }
+    return shared_->pool.get();
+}
+
+WorkerPool* DirectorySyncer::shared_data_pool() {
+    if (options_.data_workers == 0) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(shared_->pool_mutex);
+    if (!shared_->data_pool) {
+        // Copies wait on the byte budget rather than on this queue.
+        shared_->data_pool = std::make_unique<WorkerPool>(options_.data_workers, options_.data_workers * 4);
+    }
+    return shared_->data_pool.get();
+}
+
+// Builds the engine table for this source/destination pair: from an earlier
+// call of this syncer, or from the cache when it has an entry for the pair's
+// devices and filesystem types, otherwise by calibrating in a scratch
+// directory inside the destination (the source is never written to) and
+// caching the result. Falls back to copy_file_range for every size class if
+// that fails.
+CopyEngineTable DirectorySyncer::select_copy_engines(Run& run, const fs::path& source, const fs::path& destination,
+                                                     std::size_t buffer_bytes, SyncStats& stats) {
+    CopyEngineStats& engines = stats.copy_engines;
+    try {
+        engines.source_filesystem = probe_filesystem(source);
+        engines.destination_filesystem = probe_filesystem(destination);
+        log_line(run.out, "    Filesystems: ", engines.source_filesystem.type, " -> ",
+                 engines.destination_filesystem.type);
 
-SyncStats DirectorySyncer::synchronize(const fs::path& source, const fs::path& destination) {
+        const std::string key = calibration_cache_key(engines.source_filesystem, engines.destination_filesystem);
+        std::lock_guard<std::mutex> lock(shared_->calibration_mutex);
+        const auto known = shared_->calibrations.find(key);
+        const fs::path& cache = options_.copy_engine_cache;
+        std::optional<CopyCalibration> calibration;
+        if (known != shared_->calibrations.end()) {
+            calibration = known->second;
+            engines.cached = true;
+            log_line(run.out, "    Using the copy-engine calibration of an earlier run");
+        } else if (!cache.empty() && !options_.recalibrate_copy) {
+            calibration = load_cached_calibration(cache, key);
+            engines.cached = calibration.has_value();
+            if (calibration) {
+                log_line(run.out, "    Using cached copy-engine calibration from ", cache);
+            }
+        }
+        if (!calibration) {
+            log_line(run.out, "    Calibrating copy engines...");
+            CalibrationOptions calibration_options = options_.calibration;
+            calibration_options.buffer_bytes = buffer_bytes;
+            if (engines.source_filesystem.device != engines.destination_filesystem.device) {
+                // A clone cannot cross filesystems; the probe in the
+                // destination alone would not notice.
+                auto& candidates = calibration_options.engines;
+                candidates.erase(std::remove(candidates.begin(), candidates.end(), CopyEngine::reflink),
+                                 candidates.end());
+            }
+            calibration = calibrate_copy_engines(
+                destination / (".simplesync-calibration-" + std::to_string(::getpid())), calibration_options);
+            if (!cache.empty()) {
+                try {
+                    store_cached_calibration(cache, key, *calibration);
+                } catch (const std::runtime_error& ex) {
+                    log_line(run.err, "    Warning: ", ex.what());
+                }
+            }
+        }
+        shared_->calibrations.emplace(key, *calibration);
+        for (std::size_t size_class = 0; size_class < kCopySizeClasses; ++size_class) {
+            log_line(run.out, "    Copy engine for ", copy_size_class_label(size_class), ": ",
+                     copy_engine_name(calibration->table.engine(size_class)));
+        }
+        engines.calibration = std::move(calibration->timings);
+        return calibration->table;
+    } catch (const fs::filesystem_error& ex) {
+        log_line(run.err, "    Warning: copy engine calibration failed: ", ex.what());
+        return CopyEngineTable();
+    }
+}
+
+SyncStats DirectorySyncer::synchronize(const fs::path& source, const fs::path& destination, const SyncCall& call) {
     SyncStats stats{};
     const auto total_start = Clock::now();
 
-    const int total_steps = options_.remove_extraneous ? 4 : 3;
-    std::cout << "[1/" << total_steps << "] Validating input directories..." << std::endl;
+    const bool exclusive = options_.tar_export || !options_.columnar_export_dir.empty() || options_.live_stats;
+    if (exclusive) {
+        std::lock_guard<std::mutex> lock(shared_->exclusive_mutex);
+        if (shared_->exclusive_busy) {
+            throw std::runtime_error(
+                "Concurrent synchronize() calls cannot share a tar export, columnar export or live stats.");
+        }
+        shared_->exclusive_busy = true;
+    }
+    struct ExclusiveRelease {
+        Shared* shared;
+        ~ExclusiveRelease() {
+            if (shared) {
+                std::lock_guard<std::mutex> lock(shared->exclusive_mutex);
+                shared->exclusive_busy = false;
+            }
+        }
+    } exclusive_release{exclusive ? shared_.get() : nullptr};
+
+    Run run{call.out ? *call.out : std::cout, call.err ? *call.err : std::cerr,
+            call.events ? call.events.get() : options_.events.get(), options_.live_stats.get()};
+    LiveStatsPublisher* live = run.live;
+    auto enter_stage = [live, &stats](SyncStage stage) {
+        if (live) {
+            live->set_stage(stage, StageState::running);
+            live->publish(stats);
+        }
+    };
+    auto leave_stage = [live](SyncStage stage, std::chrono::duration<double> elapsed) {
+        if (live) {
+            live->set_stage(stage, StageState::done, elapsed);
+        }
+    };
+
+    // A tar export leaves the destination alone; deletions have no tar form.
+    TarWriter* const tar = options_.tar_export.get();
+    const bool prune = options_.remove_extraneous && !tar;
+    const int total_steps = prune ? 4 : 3;
+    log_line(run.out, "[1/", total_steps, "] Validating input directories...");
+    enter_stage(SyncStage::validate);
     validate_inputs(source, destination);
+    leave_stage(SyncStage::validate, Clock::now() - total_start);
 
-    std::cout << "[2/" << total_steps << "] Preparing destination directory tree..." << std::endl;
-    ensure_destination_root(destination);
-    if (fs::equivalent(source, destination)) {
+    log_line(run.out, "[2/", total_steps, "] Preparing destination directory tree...");
+    const auto prepare_start = Clock::now();
+    enter_stage(SyncStage::prepare);
+    if (!tar) {
+        ensure_destination_root(run, destination);
+    }
+    if (fs::exists(destination) && fs::equivalent(source, destination)) {
         throw std::runtime_error("Source and destination resolve to the same location.");
     }
+    leave_stage(SyncStage::prepare, Clock::now() - prepare_start);
+    if (run.events) {
+        run.events->stage("prepare", Clock::now() - total_start);
+    }
 
-    std::cout << "[3/" << total_steps << "] Copying new and updated entries from source..." << std::endl;
-    copy_from_source(source, destination, stats);
+    if (options_.watchdog.enabled) {
+        run.watchdog = std::make_unique<Watchdog>(options_.watchdog, run.events, &run.err);
+        log_line(run.out, "    Watchdog reports filesystem calls running longer than ",
+                 options_.watchdog.threshold.count() / 1000.0, " s");
+    }
+    WatchdogAttachment attachment(run.watchdog.get());
+
+    if (options_.account_usage) {
+        run.accounting = std::make_unique<UsageAccounting>();
+    }
+    if (prune) {
+        run.source_entries = std::make_unique<ShardedFlatStringSet>();
+    }
+    if (!options_.columnar_export_dir.empty()) {
+        run.columnar = std::make_unique<ColumnarWriter>(options_.columnar_export_dir, options_.columnar_buffer_bytes);
+        log_line(run.out, "    Streaming columnar metadata export to: ", options_.columnar_export_dir);
+    }
+
+    if (tar) {
+        // Export reads files through the pool rather than copying them.
+        const std::size_t buffer_bytes =
+            options_.copy_buffer_bytes > 0 ? options_.copy_buffer_bytes : kDefaultCopyBufferBytes;
+        const std::size_t copiers = (options_.workers > 1 ? options_.workers + 1 : 1) + options_.data_workers;
+        run.buffer_pool = std::make_unique<BufferPool>(copiers, buffer_bytes);
+        log_line(run.out, "    Exporting entries to a tar stream instead of copying them");
+    } else if (options_.copy_buffer_bytes > 0 || options_.copy_engine || options_.calibrate_copy) {
+        const std::size_t buffer_bytes =
+            options_.copy_buffer_bytes > 0 ? options_.copy_buffer_bytes : kDefaultCopyBufferBytes;
+        if (options_.calibrate_copy) {
+            run.copy_engines = select_copy_engines(run, source, destination, buffer_bytes, stats);
+        } else {
+            // A buffer size on its own selects the buffered read/write loop.
+            run.copy_engines = CopyEngineTable(options_.copy_engine.value_or(CopyEngine::read_write));
+        }
+        stats.copy_engines.active = true;
+        stats.copy_engines.table = *run.copy_engines;
+
+        // One buffer for each thread that copies: the walker and the workers
+        // of both lanes.
+        const std::size_t copiers = (options_.workers > 1 ? options_.workers + 1 : 1) + options_.data_workers;
+        run.buffer_pool = std::make_unique<BufferPool>(copiers, buffer_bytes);
+        if (needs_buffers(*run.copy_engines)) {
+            const BufferPoolStats pool = run.buffer_pool->stats();
+            log_line(run.out, "    Copy buffer pool: ", pool.buffers, " x ", pool.buffer_bytes / 1024, " KiB, ",
+                     pool.huge_page_bytes / (1024 * 1024), " MiB on ", (pool.hugetlb ? "reserved" : "transparent"),
+                     " huge pages");
+        }
+    }
+
+    log_line(run.out, "[3/", total_steps, "] Copying new and updated entries from source...");
+    enter_stage(SyncStage::copy);
+    copy_from_source(run, source, destination, stats);
+    leave_stage(SyncStage::copy, stats.scan_elapsed);
+
+    if (run.columnar) {
+        run.columnar->close();
+        run.columnar.reset();
+    }
+    if (tar) {
+        tar->finish();
+        stats.archive_bytes = tar->bytes();
+    }
+    if (run.buffer_pool) {
+        if (!run.copy_engines || needs_buffers(*run.copy_engines)) {
+            stats.buffer_pool = run.buffer_pool->stats();
+        }
+        run.buffer_pool.reset();
+        run.copy_engines.reset();
+    }
 
-    if (options_.remove_extraneous) {
-        std::cout << "[4/" << total_steps << "] Pruning entries that no longer exist in source..." << std::endl;
-        prune_destination(source, destination, stats);
+    if (prune) {
+        log_line(run.out, "[4/", total_steps, "] Pruning entries that no longer exist in source...");
+        enter_stage(SyncStage::prune);
+        prune_destination(run, source, destination, stats);
+        leave_stage(SyncStage::prune, stats.prune_elapsed);
+        run.source_entries.reset();
     } else {
-        std::cout << "[3/" << total_steps << "] Skipping prune stage (extraneous files retained)." << std::endl;
+        log_line(run.out, "[3/", total_steps, "] Skipping prune stage (extraneous files retained).");
+        if (live) {
+            live->set_stage(SyncStage::prune, StageState::skipped);
+        }
+    }
+
+    if (run.accounting) {
+        stats.usage = run.accounting->merge();
+        run.accounting.reset();
+    }
+    if (run.watchdog) {
+        run.watchdog->stop();
+        stats.stalled_operations = run.watchdog->stalled_operations();
+        stats.quarantined = run.watchdog->quarantined_paths();
     }
 
     stats.total_elapsed = Clock::now() - total_start;
+    if (run.events) {
+        run.events->summary(stats);
+        // A shared stream's failure goes to whichever call notices it first.
+        if (const std::string failure = run.events->take_failure(); !failure.empty()) {
+            log_line(run.err, "    Warning: event stream disabled: ", failure);
+        }
+        if (const std::uint64_t dropped = run.events->dropped(); dropped > 0) {
+            log_line(run.err, "    Warning: event stream dropped ", dropped, " events its reader did not keep up with");
+        }
+    }
+    if (live) {
+        live->publish(stats, true);
+    }
     return stats;
 }
 
@@ -54,187 +588,1173 @@ void DirectorySyncer::validate_inputs(const fs::path& source, const fs::path& de
         throw std::runtime_error("Source path is not a directory: " + source.string());
     }
 
-    if (fs::exists(destination) && !fs::is_directory(destination)) {
-        throw std::runtime_error("Destination exists but is not a directory: " + destination.string());
+    if (fs::exists(destination) && !fs::is_directory(destination)) {
+        throw std::runtime_error("Destination exists but is not a directory: " + destination.string());
+    }
+    for (const PriorityRule& rule : options_.priority_rules) {
+        if (rule.level == 0 || rule.level >= kPriorityLevels) {
+            throw std::runtime_error("Priority level of '" + rule.pattern + "' must be between 1 and " +
+                                     std::to_string(kPriorityLevels - 1) + ".");
+        }
+    }
+}
+
+void DirectorySyncer::ensure_destination_root(Run& run, const fs::path& destination) {
+    if (!fs::exists(destination)) {
+        fs::create_directories(destination);
+        log_line(run.out, "    Created destination root: ", destination);
+    }
+}
+
+// Paths of the entry being synchronized, composed into buffers that each pass
+// reuses: once they have grown to the longest path, visiting an entry does
+// not allocate. std::string keeps them NUL-terminated for system calls.
+struct DirectorySyncer::EntryPaths {
+    std::string source;
+    std::string relative;
+    std::string destination;
+    std::size_t name_size{0};
+
+    void compose(const fs::path& destination_root, std::string_view parent_source, std::string_view parent_relative,
+                 std::string_view name) {
+        source.assign(parent_source);
+        append_component(source, name);
+        relative.assign(parent_relative);
+        append_component(relative, name);
+        destination.assign(destination_root.native());
+        append_component(destination, relative);
+        name_size = name.size();
+    }
+
+    std::string_view name() const { return std::string_view(source).substr(source.size() - name_size); }
+
+    std::string_view destination_parent() const {
+        std::string_view parent(destination);
+        parent.remove_suffix(name_size);
+        if (parent.size() > 1 && parent.back() == '/') {
+            parent.remove_suffix(1);
+        }
+        return parent;
+    }
+};
+
+struct DirectorySyncer::CopyPass {
+    struct RetryItem {
+        EntryPaths paths;
+        int depth;
+        std::string project;
+        unsigned attempt;
+    };
+    // A copy held back to be issued in sorted order.
+    struct HeldCopy {
+        EntryPaths paths;
+        FileMetadata meta;
+        int depth;
+        std::string project;
+        std::uintmax_t partial_bytes;
+        std::size_t priority;
+        // Files with a placed extent sort before the rest, by offset; the
+        // rest by inode number.
+        bool by_inode{true};
+        std::uint64_t key{0};
+    };
+
+    Run& run;
+    const fs::path& source;
+    const fs::path& destination;
+    SyncStats& stats;
+    EventStream* events;
+    LiveStatsPublisher* live;
+    UsageShard* usage;
+    // Set on the walking thread's pass only: batches of split directories are
+    // handed to `pool`, which runs them on the matching `workers` pass.
+    WorkerPool::TaskSet* pool;
+    std::vector<CopyPass>* workers;
+    // Destination directories known to exist, shared by all passes, so a
+    // file copy does not re-create its parent directory every time.
+    ShardedFlatStringSet& known_directories;
+    DeferredRetryQueue<RetryItem> retries;
+    // Start of the copy stage, for the priority classes' completion times.
+    Clock::time_point started{};
+    // Class of the directory or batch being visited.
+    std::size_t priority{0};
+    // Large files go here when set (SyncOptions::data_workers).
+    DataLane* data{nullptr};
+    // Copies held back under SyncOptions::copy_order.
+    std::vector<HeldCopy> held{};
+    // This run's watchdog slot on the pool thread running a worker pass.
+    WatchdogSlot* watchdog_slot{nullptr};
+    // Set on the other passes: where they store their counts as they go.
+    PassProgress* progress{nullptr};
+    // Set on the walking thread's pass only, the one that reports progress:
+    // the counts stored by all other passes.
+    const std::vector<PassProgress>* others{nullptr};
+    // Per-directory transient state (read buffer, entry batches); every
+    // directory rewinds it on the way out.
+    BumpArena scratch{};
+    EntryPaths entry{};
+};
+
+struct DirectorySyncer::PendingDirectory {
+    fs::path path;
+    // Path below the source root, empty for the root itself.
+    std::string relative;
+    // Depth of the directory's entries.
+    int depth;
+    std::string project;
+    // Class under SyncOptions::priority_rules.
+    std::size_t priority{0};
+};
+
+// Entries of a split directory handed to a worker. Their names are copied out
+// of the walker's read buffer, which is reused for the next batch.
+struct DirectorySyncer::EntryBatch {
+    BumpArena arena{16 * 1024};
+    ArenaVector<DirEntryName> entries{ArenaAllocator<DirEntryName>(arena)};
+
+    void add(const DirEntryName& entry) { entries.push_back(DirEntryName{arena.copy(entry.name), entry.type}); }
+};
+
+// Directories the walker has yet to visit, one stack per priority class.
+// take() serves the most urgent class, unless a less urgent one has been
+// passed over more than `aging` times in a row (0: never).
+struct DirectorySyncer::DirectoryQueue {
+    using Marks = std::array<std::size_t, kPriorityLevels>;
+
+    // Classes in use, at least 1.
+    std::size_t levels;
+    std::size_t aging;
+    std::array<std::vector<PendingDirectory>, kPriorityLevels> stacks{};
+    std::array<std::size_t, kPriorityLevels> passed_over{};
+
+    void push(PendingDirectory dir) { stacks[dir.priority].push_back(std::move(dir)); }
+
+    bool waiting_above(std::size_t level) const {
+        for (std::size_t more_urgent = level + 1; more_urgent < levels; ++more_urgent) {
+            if (!stacks[more_urgent].empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Next directory of class `min_level` or above. Nothing either when
+    // none is left or when a class below `min_level` is starved: the walk
+    // asking (one preempting a less urgent directory) then yields to the
+    // walks it interrupted.
+    std::optional<PendingDirectory> take(std::size_t min_level) {
+        std::size_t serve = levels;
+        for (std::size_t level = levels; level-- > min_level;) {
+            if (!stacks[level].empty()) {
+                serve = level;
+                break;
+            }
+        }
+        if (serve == levels) {
+            return std::nullopt;
+        }
+        if (aging > 0) {
+            std::size_t starved = serve;
+            for (std::size_t level = 0; level < serve; ++level) {
+                if (stacks[level].empty()) {
+                    passed_over[level] = 0;
+                } else if (++passed_over[level] > aging && starved == serve) {
+                    starved = level;
+                }
+            }
+            if (starved < min_level) {
+                return std::nullopt;
+            }
+            serve = starved;
+        }
+        passed_over[serve] = 0;
+        std::vector<PendingDirectory>& stack = stacks[serve];
+        PendingDirectory dir = std::move(stack.back());
+        stack.pop_back();
+        return dir;
+    }
+
+    Marks mark() const {
+        Marks marks{};
+        for (std::size_t level = 0; level < levels; ++level) {
+            marks[level] = stacks[level].size();
+        }
+        return marks;
+    }
+
+    // Puts what was pushed since `marks` back in listing order, so that it
+    // is taken first to last. A nested walk may have taken some of it.
+    void keep_listing_order(const Marks& marks) {
+        for (std::size_t level = 0; level < levels; ++level) {
+            std::vector<PendingDirectory>& stack = stacks[level];
+            const std::size_t first = std::min(marks[level], stack.size());
+            std::reverse(stack.begin() + static_cast<std::ptrdiff_t>(first), stack.end());
+        }
+    }
+};
+
+// The bulk data lane of one run: copies handed off by the walker and the
+// metadata workers, run on the data pool with one pass per data worker.
+struct DirectorySyncer::DataLane {
+    DataLane(WorkerPool& pool, std::vector<CopyPass>& passes, std::uintmax_t limit)
+        : tasks(pool), passes(passes), limit(limit) {}
+
+    WorkerPool::TaskSet tasks;
+    std::vector<CopyPass>& passes;
+    const std::uintmax_t limit;
+
+    std::mutex mutex{};
+    std::condition_variable space{};
+    std::uintmax_t queued_bytes{0};
+    DataLaneStats stats{};
+
+    // Blocks while `bytes` more would exceed the limit; a copy larger than
+    // the limit still goes through on its own.
+    void reserve(std::uintmax_t bytes) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (queued_bytes > 0 && queued_bytes + bytes > limit) {
+            ++stats.waits;
+            space.wait(lock, [&] { return queued_bytes == 0 || queued_bytes + bytes <= limit; });
+        }
+        queued_bytes += bytes;
+        ++stats.files;
+        stats.bytes += bytes;
+        stats.peak_queued_bytes = std::max(stats.peak_queued_bytes, queued_bytes);
+    }
+
+    void release(std::uintmax_t bytes) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queued_bytes -= bytes;
+        }
+        space.notify_all();
+    }
+};
+
+// Counts of a worker or data lane pass so far. Those passes keep their
+// SyncStats to themselves until the stage ends, so each one also stores
+// these as it goes (single writer) for the walking thread to add to its own.
+struct DirectorySyncer::PassProgress {
+    std::atomic<std::uint64_t> entries_scanned{0};
+    std::atomic<std::uint64_t> files_copied{0};
+    std::atomic<std::uint64_t> files_skipped{0};
+    std::atomic<std::uint64_t> files_deleted{0};
+    std::atomic<std::uint64_t> directories_created{0};
+    std::atomic<std::uint64_t> bytes_copied{0};
+
+    void store(const SyncStats& stats) {
+        entries_scanned.store(stats.entries_scanned, std::memory_order_relaxed);
+        files_copied.store(stats.files_copied, std::memory_order_relaxed);
+        files_skipped.store(stats.files_skipped, std::memory_order_relaxed);
+        files_deleted.store(stats.files_deleted, std::memory_order_relaxed);
+        directories_created.store(stats.directories_created, std::memory_order_relaxed);
+        bytes_copied.store(stats.bytes_copied, std::memory_order_relaxed);
+    }
+
+    void add_to(SyncStats& stats) const {
+        stats.entries_scanned += entries_scanned.load(std::memory_order_relaxed);
+        stats.files_copied += files_copied.load(std::memory_order_relaxed);
+        stats.files_skipped += files_skipped.load(std::memory_order_relaxed);
+        stats.files_deleted += files_deleted.load(std::memory_order_relaxed);
+        stats.directories_created += directories_created.load(std::memory_order_relaxed);
+        stats.bytes_copied += bytes_copied.load(std::memory_order_relaxed);
+    }
+};
+
+void DirectorySyncer::copy_from_source(Run& run,
+                                       const fs::path& source,
+                                       const fs::path& destination,
+                                       SyncStats& stats) {
+    const auto stage_start = Clock::now();
+    auto known_directories = std::make_unique<ShardedFlatStringSet>();
+    CopyPass pass{run,
+                  source,
+                  destination,
+                  stats,
+                  run.events,
+                  run.live,
+                  run.accounting ? &run.accounting->local() : nullptr,
+                  nullptr,
+                  nullptr,
+                  *known_directories,
+                  DeferredRetryQueue<CopyPass::RetryItem>(options_.retry)};
+
+    pass.started = stage_start;
+    std::size_t priority_levels = 0;
+    for (const PriorityRule& rule : options_.priority_rules) {
+        priority_levels = std::max(priority_levels, rule.level + 1);
+    }
+    stats.priority_classes.resize(priority_levels);
+
+    // One pass per pool worker; a pool thread may serve other runs between
+    // this run's tasks.
+    auto make_passes = [&](std::vector<SyncStats>& local_stats, std::vector<CopyPass>& passes,
+                           PassProgress* progress) {
+        passes.reserve(local_stats.size());
+        for (SyncStats& local : local_stats) {
+            local.priority_classes.resize(priority_levels);
+            passes.push_back(CopyPass{run,
+                                      source,
+                                      destination,
+                                      local,
+                                      pass.events,
+                                      pass.live,
+                                      nullptr,
+                                      nullptr,
+                                      nullptr,
+                                      *known_directories,
+                                      DeferredRetryQueue<CopyPass::RetryItem>(options_.retry)});
+            passes.back().started = stage_start;
+            passes.back().progress = progress++;
+        }
+    };
+    WorkerPool* const pool = shared_pool();
+    const std::size_t worker_count = pool ? pool->size() : 0;
+    WorkerPool* const data_pool = shared_data_pool();
+    std::vector<SyncStats> worker_stats(worker_count);
+    std::vector<SyncStats> data_stats(data_pool ? data_pool->size() : 0);
+    std::vector<PassProgress> progress(worker_stats.size() + data_stats.size());
+    pass.others = &progress;
+
+    std::vector<CopyPass> worker_passes;
+    make_passes(worker_stats, worker_passes, progress.data());
+    std::vector<CopyPass> data_passes;
+    make_passes(data_stats, data_passes, progress.data() + worker_count);
+    // Declared before the metadata tasks, which may hand copies to it.
+    std::optional<DataLane> lane;
+    if (data_pool) {
+        lane.emplace(*data_pool, data_passes, options_.data_queue_bytes);
+        pass.data = &*lane;
+        for (CopyPass& worker : worker_passes) {
+            worker.data = &*lane;
+        }
+        log_line(run.out, "    Files of ", options_.data_min_bytes, " bytes and more are copied by ",
+                 data_pool->size(), " data workers");
+    }
+    if (options_.copy_order != CopyOrder::directory) {
+        log_line(run.out, "    Copies are issued in windows of ", options_.copy_window, " files by ",
+                 options_.copy_order == CopyOrder::extent ? "first extent" : "inode number");
+    }
+
+    // Fixed once the pool exists.
+    const std::shared_ptr<const NumaTopology> topology = pool ? shared_->topology : nullptr;
+    const std::vector<std::size_t>& worker_nodes = shared_->worker_nodes;
+    std::vector<std::size_t> stolen(worker_count, 0);
+    std::optional<ScopedThreadPin> walker_pin;
+    if (topology) {
+        walker_pin.emplace(topology->nodes().front().cpus);
+        log_line(run.out, "    Placing ", worker_count, " workers on ", topology->size(), " NUMA nodes");
+    }
+
+    std::optional<WorkerPool::TaskSet> tasks;
+    if (pool) {
+        tasks.emplace(*pool);
+        pass.pool = &*tasks;
+        pass.workers = &worker_passes;
+        log_line(run.out, "    Directories with more than ", options_.split_threshold, " entries are split across ",
+                 worker_count, " workers");
+    }
+
+    auto copy = [&](auto policy) {
+        using Policy = decltype(policy);
+        // Progress goes on while the workers finish what was handed to them.
+        auto wait = [&](WorkerPool::TaskSet& set) {
+            if (!Policy::observe) {
+                set.wait();
+                return;
+            }
+            while (!set.wait_for(kProgressWaitInterval)) {
+                report_progress(pass, true);
+            }
+        };
+        walk_source<Policy>(pass, source, std::string(), 0, std::string(kRootProject));
+        flush_copies<Policy>(pass);
+        drain_retries<Policy>(pass);
+        if (tasks) {
+            wait(*tasks);
+            for (std::size_t worker = 0; worker < worker_count; ++worker) {
+                stolen[worker] = tasks->stolen(worker);
+            }
+        }
+        if (lane) {
+            // Only now: the metadata workers hand copies to the lane too.
+            wait(lane->tasks);
+            pass.data = nullptr;
+            for (CopyPass& worker : worker_passes) {
+                worker.data = nullptr;
+            }
+        }
+        // The workers are done with this run; whatever they deferred is
+        // retried here.
+        for (CopyPass& worker : worker_passes) {
+            drain_retries<Policy>(worker);
+        }
+        for (CopyPass& worker : data_passes) {
+            drain_retries<Policy>(worker);
+        }
+    };
+    if (options_.specialize) {
+        dispatch_policy(copy, pass.events || pass.live, run.accounting != nullptr, run.source_entries != nullptr,
+                        run.watchdog && options_.watchdog.quarantine);
+    } else {
+        copy(GenericPolicy{});
+    }
+
+    if (topology) {
+        for (const NumaNode& node : topology->nodes()) {
+            stats.numa_nodes.push_back(NodeThroughput{node.id});
+        }
+        // The walking thread ran on the first node.
+        NodeThroughput& first = stats.numa_nodes.front();
+        first.files_copied += stats.files_copied;
+        first.bytes_copied += stats.bytes_copied;
+        first.copy_elapsed += stats.copy_elapsed;
+        for (std::size_t worker = 0; worker < worker_count; ++worker) {
+            const SyncStats& local = worker_passes[worker].stats;
+            NodeThroughput& node = stats.numa_nodes[worker_nodes[worker]];
+            ++node.workers;
+            node.files_copied += local.files_copied;
+            node.bytes_copied += local.bytes_copied;
+            node.copy_elapsed += local.copy_elapsed;
+            node.tasks_stolen += stolen[worker];
+        }
+    }
+    for (CopyPass& worker : worker_passes) {
+        merge_worker_stats(stats, worker.stats);
+    }
+    for (CopyPass& worker : data_passes) {
+        merge_worker_stats(stats, worker.stats);
+    }
+    if (lane) {
+        stats.data_lane = lane->stats;
+    }
+
+    stats.scan_elapsed = Clock::now() - stage_start;
+    if (pass.events) {
+        pass.events->stage("copy", stats.scan_elapsed);
+    }
+}
+
+template <typename Policy>
+void DirectorySyncer::walk_source(CopyPass& pass, const fs::path& root, std::string relative, int base_depth,
+                                  std::string project) {
+    std::size_t priority = 0;
+    if (!options_.priority_rules.empty() && !relative.empty()) {
+        // Nested walks start below the source root: every ancestor's rules
+        // apply.
+        for (std::size_t end = relative.find('/');; end = relative.find('/', end + 1)) {
+            priority = directory_priority(relative.substr(0, end), priority);
+            if (end == std::string::npos) {
+                break;
+            }
+        }
+    }
+    // Explicit stacks rather than recursion: only one directory is open at
+    // a time (and one more per preempting class) and deep trees cannot
+    // exhaust the call stack.
+    DirectoryQueue queue{std::max<std::size_t>(pass.stats.priority_classes.size(), 1), options_.priority_aging};
+    queue.push(PendingDirectory{root, std::move(relative), base_depth, std::move(project), priority});
+    walk_queue<Policy>(pass, queue, 0);
+}
+
+template <typename Policy>
+void DirectorySyncer::walk_queue(CopyPass& pass, DirectoryQueue& queue, std::size_t min_level) {
+    while (std::optional<PendingDirectory> dir = queue.take(min_level)) {
+        const DirectoryQueue::Marks marks = queue.mark();
+        walk_directory<Policy>(pass, *dir, queue);
+        // Keep listing order for the subdirectories just found.
+        queue.keep_listing_order(marks);
+    }
+}
+
+std::size_t DirectorySyncer::directory_priority(const std::string& relative, std::size_t inherited) const {
+    std::size_t priority = inherited;
+    for (const PriorityRule& rule : options_.priority_rules) {
+        if (rule.level > priority && ::fnmatch(rule.pattern.c_str(), relative.c_str(), FNM_PATHNAME) == 0) {
+            priority = rule.level;
+        }
+    }
+    return priority;
+}
+
+template <typename Policy>
+void DirectorySyncer::walk_directory(CopyPass& pass, const PendingDirectory& dir, DirectoryQueue& queue) {
+    SyncStats& stats = pass.stats;
+    ClassTally tally(stats);
+    // The read buffer and every batch come from the pass's arena. Retries
+    // run from the loop below may walk further directories; their scopes
+    // nest inside this one.
+    ArenaScope directory_scope(pass.scratch);
+
+    std::optional<DirectoryReader> reader;
+    {
+        FsOpGuard guard(FsOp::readdir, dir.path);
+        reader.emplace(dir.path, pass.scratch);
+    }
+
+    std::string project = dir.project;
+    std::size_t seen = 0;
+    // Entries handed to the workers, which count them for the class.
+    std::size_t queued = 0;
+    bool split = false;
+    std::shared_ptr<const DirectoryListing> listing;
+
+    for (;;) {
+        ArenaScope batch_scope(pass.scratch);
+        ArenaVector<DirEntryName> batch{ArenaAllocator<DirEntryName>(pass.scratch)};
+        {
+            FsOpGuard guard(FsOp::readdir, dir.path);
+            if (!reader->next_batch(batch)) {
+                break;
+            }
+        }
+        seen += batch.size();
+        // Preempting directories below change it; copies handed to the data
+        // lane carry it.
+        pass.priority = dir.priority;
+        if (!split && pass.pool && seen > options_.split_threshold) {
+            // From here on every batch becomes a work item; the walking thread
+            // keeps only the directories, which it has to descend into anyway.
+            split = true;
+            ++stats.directories_split;
+            listing = read_destination_listing(pass, dir);
+        }
+
+        std::shared_ptr<EntryBatch> work;
+        for (const DirEntryName& entry : batch) {
+            ++stats.entries_scanned;
+            if (Policy::observe) {
+                if (pass.progress) {
+                    pass.progress->store(stats);
+                } else if (pass.others) {
+                    report_progress(pass, (stats.entries_scanned % kLivePublishInterval) == 0);
+                }
+            }
+            if (!pass.retries.empty()) {
+                run_due_retries<Policy>(pass);
+            }
+
+            // DT_UNKNOWN entries stay here too: they may be directories.
+            if (split && entry.type != DT_DIR && entry.type != DT_UNKNOWN) {
+                if (!work) {
+                    work = std::make_shared<EntryBatch>();
+                    work->entries.reserve(batch.size());
+                }
+                work->add(entry);
+                ++queued;
+                continue;
+            }
+
+            EntryPaths& paths = pass.entry;
+            paths.compose(pass.destination, dir.path.native(), dir.relative, entry.name);
+            if (Policy::quarantine && skip_quarantined(pass, paths)) {
+                continue;
+            }
+            if (sync_source_entry<Policy>(pass, paths, dir.depth, 0, project, listing.get())) {
+                const std::size_t priority =
+                    queue.levels > 1 ? directory_priority(paths.relative, dir.priority) : dir.priority;
+                queue.push(
+                    PendingDirectory{fs::path(paths.source), paths.relative, dir.depth + 1, project, priority});
+            } else if (pass.held.size() >= options_.copy_window) {
+                tally.exclude([&] { flush_copies<Policy>(pass); });
+            }
+        }
+
+        if (work) {
+            std::vector<CopyPass>* workers = pass.workers;
+            pass.pool->submit([this, workers, dir, listing, work = std::move(work)](std::size_t worker) {
+                // The pool thread may serve other runs between batches.
+                CopyPass& worker_pass = (*workers)[worker];
+                Run& run = worker_pass.run;
+                WatchdogAttachment attachment(run.watchdog.get(), worker_pass.watchdog_slot);
+                if (run.accounting && !worker_pass.usage) {
+                    worker_pass.usage = &run.accounting->local();
+                }
+                process_batch<Policy>(worker_pass, dir, *work, listing.get());
+            });
+        }
+
+        if (queue.waiting_above(dir.priority)) {
+            // Preempt this directory: the more urgent ones go first.
+            tally.exclude([&] { walk_queue<Policy>(pass, queue, dir.priority + 1); });
+        }
+    }
+
+    const std::error_code& ec = reader->error();
+    if (ec && ec != std::errc::permission_denied) {
+        log_line(pass.run.err, "    Warning: failed to read directory ", dir.path, ": ", ec.message());
+        if (pass.events) {
+            pass.events->error("readdir", dir.path, ec.message());
+        }
+    }
+    if (!stats.priority_classes.empty()) {
+        PriorityClassStats& cls = stats.priority_classes[dir.priority];
+        ++cls.directories;
+        tally.record(cls, seen - queued, pass.started);
+    }
+}
+
+template <typename Policy>
+void DirectorySyncer::process_batch(CopyPass& pass, const PendingDirectory& dir, const EntryBatch& batch,
+                                    const DirectoryListing* listing) {
+    if (!pass.retries.empty()) {
+        run_due_retries<Policy>(pass);
+    }
+    ClassTally tally(pass.stats);
+    std::string project = dir.project;
+    EntryPaths& paths = pass.entry;
+    for (const DirEntryName& entry : batch.entries) {
+        pass.priority = dir.priority;
+        paths.compose(pass.destination, dir.path.native(), dir.relative, entry.name);
+        if (Policy::quarantine && skip_quarantined(pass, paths)) {
+            continue;
+        }
+        if (sync_source_entry<Policy>(pass, paths, dir.depth, 0, project, listing)) {
+            // d_type said otherwise, but the entry is a directory by now.
+            tally.exclude([&] {
+                walk_source<Policy>(pass, fs::path(paths.source), paths.relative, dir.depth + 1, project);
+            });
+        } else if (pass.held.size() >= options_.copy_window) {
+            tally.exclude([&] { flush_copies<Policy>(pass); });
+        }
+        if (Policy::observe && pass.progress) {
+            pass.progress->store(pass.stats);
+        }
+    }
+    // The batch is the worker's unit of work: nothing stays held after it.
+    tally.exclude([&] { flush_copies<Policy>(pass); });
+    if (Policy::observe && pass.progress) {
+        pass.progress->store(pass.stats);
+    }
+    if (!pass.stats.priority_classes.empty()) {
+        tally.record(pass.stats.priority_classes[dir.priority], batch.entries.size(), pass.started);
+    }
+}
+
+std::shared_ptr<const DirectoryListing> DirectorySyncer::read_destination_listing(CopyPass& pass,
+                                                                                  const PendingDirectory& dir) {
+    const fs::path dest_dir = dir.relative.empty() ? pass.destination : pass.destination / dir.relative;
+
+    std::error_code ec;
+    auto listing = std::make_shared<DirectoryListing>();
+    {
+        FsOpGuard guard(FsOp::readdir, dest_dir);
+        *listing = DirectoryListing::read(dest_dir, ec);
+    }
+    if (ec) {
+        // Not fatal: the entries are then compared with one stat() each.
+        log_line(pass.run.err, "    Warning: failed to list destination directory ", dest_dir, ": ", ec.message());
+        return nullptr;
+    }
+    log_line(pass.run.out, "    Splitting large directory ", dir.path, " across ", pass.workers->size(), " workers (",
+             listing->size(), " destination entries indexed)");
+    return listing;
+}
+
+void DirectorySyncer::report_progress(CopyPass& pass, bool publish_live) {
+    const bool events_due = pass.events && pass.events->progress_due();
+    publish_live = publish_live && pass.live;
+    if (!events_due && !publish_live) {
+        return;
+    }
+    // The counters published: the walking thread's own (the call's) and
+    // what the other passes have stored so far.
+    SyncStats view;
+    view.entries_scanned = pass.stats.entries_scanned;
+    view.files_copied = pass.stats.files_copied;
+    view.files_skipped = pass.stats.files_skipped;
+    view.files_deleted = pass.stats.files_deleted;
+    view.directories_created = pass.stats.directories_created;
+    view.bytes_copied = pass.stats.bytes_copied;
+    for (const PassProgress& other : *pass.others) {
+        other.add_to(view);
+    }
+    if (events_due) {
+        pass.events->progress(view);
+    }
+    if (publish_live) {
+        pass.live->publish(view);
+    }
+}
+
+bool DirectorySyncer::skip_quarantined(CopyPass& pass, const EntryPaths& paths) {
+    const Watchdog* watchdog = pass.run.watchdog.get();
+    if (!watchdog || !watchdog->any_quarantined()) {
+        return false;
+    }
+    // A stalled mkdir, stat or listing on the destination side fences off
+    // a destination subtree.
+    const fs::path entry_path(paths.source);
+    if (!watchdog->quarantined(entry_path) && !watchdog->quarantined(fs::path(paths.destination))) {
+        return false;
+    }
+    ++pass.stats.quarantine_skipped;
+    if (pass.events) {
+        pass.events->skipped(entry_path, "quarantined");
+    }
+    return true;
+}
+
+template <typename Policy>
+bool DirectorySyncer::sync_source_entry(CopyPass& pass, const EntryPaths& paths, int depth, unsigned attempt,
+                                        std::string& project, const DirectoryListing* listing) {
+    SyncStats& stats = pass.stats;
+    // Constant null in specializations without the feature, which removes
+    // every branch below that depends on it.
+    EventStream* events = Policy::observe ? pass.events : nullptr;
+    UsageShard* usage = Policy::usage ? pass.usage : nullptr;
+    ShardedFlatStringSet* tracked = Policy::track ? pass.run.source_entries.get() : nullptr;
+    TarWriter* const tar = options_.tar_export.get();
+
+    FileMetadata src_meta;
+    int lstat_error = 0;
+    if (!collect_metadata(pass.run, paths.source.c_str(), depth, src_meta, &lstat_error)) {
+        const std::error_code ec(lstat_error, std::generic_category());
+        schedule_retry(pass, paths, depth, project, attempt, "lstat", ec);
+        return false;
+    }
+    if (usage && depth == 0) {
+        // Pre-order traversal: everything until the next depth-0 entry
+        // belongs to this top-level directory.
+        project.assign(S_ISDIR(static_cast<mode_t>(src_meta.mode)) ? paths.name() : kRootProject);
     }
-}
 
-void DirectorySyncer::ensure_destination_root(const fs::path& destination) {
-    if (!fs::exists(destination)) {
-        fs::create_directories(destination);
-        std::cout << "    Created destination root: " << destination << std::endl;
+    // fs::path objects are only built below where an entry is logged,
+    // reported or modified; an unchanged entry never needs one.
+    const bool is_symlink = S_ISLNK(static_cast<mode_t>(src_meta.mode));
+    if (is_symlink) {
+        const fs::path path(paths.source);
+        log_line(pass.run.out, "    Skipping symlink: ", path);
+        ++stats.files_skipped;
+        if (events) {
+            events->skipped(path, "symlink");
+        }
+        if (usage) {
+            usage->skipped(src_meta.uid, src_meta.gid, project);
+        }
+        return false;
     }
-}
 
-void DirectorySyncer::copy_from_source(const fs::path& source,
-                                       const fs::path& destination,
-                                       SyncStats& stats) {
-    const auto stage_start = Clock::now();
-    fs::directory_options options = fs::directory_options::skip_permission_denied;
+    const bool is_directory = S_ISDIR(static_cast<mode_t>(src_meta.mode));
 
-    for (fs::recursive_directory_iterator it(source, options), end; it != end; ++it) {
-        const fs::directory_entry& entry = *it;
-        ++stats.entries_scanned;
+    if (tracked) {
+        tracked->insert(paths.relative);
+    }
 
-        FileMetadata src_meta;
-        if (!collect_metadata(entry.path(), static_cast<int>(it.depth()), src_meta)) {
-            if (entry.is_directory()) {
-                it.disable_recursion_pending();
+    if (is_directory) {
+        const fs::file_status dest_dir_status = destination_status(paths.destination, paths.name(), listing);
+        if (fs::is_directory(dest_dir_status)) {
+            pass.known_directories.insert(paths.destination);
+        } else if (tar && !fs::exists(dest_dir_status)) {
+            tar->add_directory(paths.relative, src_meta);
+            ++stats.directories_created;
+            log_line(pass.run.out, "    Exported directory: ", paths.relative);
+            record_synced(pass.run, src_meta, paths.source, stats);
+        } else if (!fs::exists(dest_dir_status)) {
+            const fs::path dest_path(paths.destination);
+            try {
+                FsOpGuard guard(FsOp::mkdir, dest_path);
+                fs::create_directories(dest_path);
+                ++stats.directories_created;
+                log_line(pass.run.out, "    Created directory: ", dest_path);
+                if (events) {
+                    events->created_directory(dest_path);
+                }
+                record_synced(pass.run, src_meta, paths.source, stats);
+                pass.known_directories.insert(paths.destination);
+            } catch (const fs::filesystem_error& ex) {
+                if (!schedule_retry(pass, paths, depth, project, attempt, "mkdir", ex.code())) {
+                    log_line(pass.run.err, "    Warning: failed to create directory ", dest_path, ": ", ex.what());
+                    if (events) {
+                        events->error("mkdir", dest_path, ex.what());
+                    }
+                }
+                return false;
             }
-            continue;
         }
+        return true;
+    }
 
-        const bool is_symlink = S_ISLNK(static_cast<mode_t>(src_meta.mode));
-        if (is_symlink) {
-            std::cout << "    Skipping symlink: " << entry.path() << std::endl;
-            it.disable_recursion_pending();
-            ++stats.files_skipped;
-            continue;
+    const bool is_regular = S_ISREG(static_cast<mode_t>(src_meta.mode));
+    if (!is_regular) {
+        const fs::path path(paths.source);
+        log_line(pass.run.out, "    Skipping non-regular entry: ", path);
+        ++stats.files_skipped;
+        if (events) {
+            events->skipped(path, "non-regular");
         }
+        if (usage) {
+            usage->skipped(src_meta.uid, src_meta.gid, project);
+        }
+        return false;
+    }
 
-        const bool is_directory = S_ISDIR(static_cast<mode_t>(src_meta.mode));
+    bool should_copy = false;
+    const std::uintmax_t source_size = src_meta.size;
+    // Bytes of an interrupted copy already in the destination.
+    std::uintmax_t partial_bytes = 0;
 
-        fs::path relative_path;
+    const fs::file_status dest_status = destination_status(paths.destination, paths.name(), listing);
+    if (!fs::exists(dest_status)) {
+        should_copy = true;
+    } else if (tar && !fs::is_regular_file(dest_status)) {
+        // The importer replaces it.
+        should_copy = true;
+    } else if (!fs::is_regular_file(dest_status)) {
+        const fs::path dest_path(paths.destination);
+        log_line(pass.run.out, "    Destination entry is not a regular file (will replace): ", dest_path);
         try {
-            relative_path = fs::relative(entry.path(), source);
+            FsOpGuard guard(FsOp::remove, dest_path);
+            fs::remove_all(dest_path);
+            should_copy = true;
         } catch (const fs::filesystem_error& ex) {
-            std::cerr << "    Warning: failed to compute relative path for " << entry.path()
-                      << ": " << ex.what() << std::endl;
-            if (entry.is_directory()) {
-                it.disable_recursion_pending();
+            log_line(pass.run.err, "    Warning: failed to remove non-regular destination entry ", dest_path, ": ",
+                     ex.what());
+            if (events) {
+                events->error("remove", dest_path, ex.what());
             }
-            continue;
+            return false;
         }
-
-        const fs::path dest_path = destination / relative_path;
-
-        if (is_directory) {
-            if (!fs::exists(dest_path)) {
+    } else {
+        FileMetadata dest_meta;
+        if (!collect_metadata(pass.run, paths.destination.c_str(), depth, dest_meta)) {
+            should_copy = true;
+        } else {
+            const bool dest_is_symlink = S_ISLNK(static_cast<mode_t>(dest_meta.mode));
+            if (dest_is_symlink && tar) {
+                should_copy = true;
+            } else if (dest_is_symlink) {
+                const fs::path dest_path(paths.destination);
+                log_line(pass.run.out, "    Destination entry is a symlink (will replace): ", dest_path);
                 try {
-                    fs::create_directories(dest_path);
-                    ++stats.directories_created;
-                    std::cout << "    Created directory: " << dest_path << std::endl;
-                    stats.synced_entries.push_back(src_meta);
+                    FsOpGuard guard(FsOp::remove, dest_path);
+                    fs::remove(dest_path);
+                    should_copy = true;
                 } catch (const fs::filesystem_error& ex) {
-                    std::cerr << "    Warning: failed to create directory " << dest_path << ": " << ex.what()
-                              << std::endl;
-                    it.disable_recursion_pending();
+                    log_line(pass.run.err, "    Warning: failed to remove symlink ", dest_path, ": ", ex.what());
+                    if (events) {
+                        events->error("remove", dest_path, ex.what());
+                    }
+                    return false;
+                }
+            } else {
+                const std::uintmax_t dest_size = dest_meta.size;
+                const bool size_differs = source_size != dest_size;
+                const bool time_newer = (src_meta.mtime > dest_meta.mtime) ||
+                                        (src_meta.mtime == dest_meta.mtime &&
+                                         src_meta.mtime_nsec > dest_meta.mtime_nsec);
+                if (size_differs || time_newer) {
+                    should_copy = true;
+                }
+                // append trusts the prefix only if it was written from this
+                // very version of the source; verify checks it anyway.
+                if (options_.resume != ResumeMode::off && !tar && dest_size < source_size && dest_size > 0 &&
+                    source_size >= options_.resume_min_bytes &&
+                    (options_.resume == ResumeMode::verify ||
+                     partial_copy_marked(paths.destination, partial_copy_marker(src_meta)))) {
+                    partial_bytes = dest_size;
                 }
             }
-            continue;
         }
+    }
 
-        const bool is_regular = S_ISREG(static_cast<mode_t>(src_meta.mode));
-        if (!is_regular) {
-            std::cout << "    Skipping non-regular entry: " << entry.path() << std::endl;
-            ++stats.files_skipped;
-            continue;
+    if (!should_copy) {
+        ++stats.files_skipped;
+        if (events) {
+            events->skipped(fs::path(paths.source), "unchanged");
         }
+        if (usage) {
+            usage->skipped(src_meta.uid, src_meta.gid, project);
+        }
+        return false;
+    }
 
-        bool should_copy = false;
-        const std::uintmax_t source_size = src_meta.size;
+    const fs::path path(paths.source);
+    const fs::path dest_path(paths.destination);
+    const std::string_view dest_parent = paths.destination_parent();
+    if (!tar && !pass.known_directories.contains(dest_parent)) {
+        const fs::path parent(dest_parent);
+        try {
+            FsOpGuard guard(FsOp::mkdir, parent);
+            fs::create_directories(parent);
+            pass.known_directories.insert(dest_parent);
+        } catch (const fs::filesystem_error& ex) {
+            if (!schedule_retry(pass, paths, depth, project, attempt, "mkdir", ex.code())) {
+                log_line(pass.run.err, "    Warning: failed to ensure parent directory for ", dest_path, ": ",
+                         ex.what());
+                if (events) {
+                    events->error("mkdir", parent, ex.what());
+                }
+            }
+            return false;
+        }
+    }
 
-        if (!fs::exists(dest_path)) {
-            should_copy = true;
-        } else if (!fs::is_regular_file(dest_path)) {
-            std::cout << "    Destination entry is not a regular file (will replace): " << dest_path << std::endl;
-            try {
-                fs::remove_all(dest_path);
-                should_copy = true;
-            } catch (const fs::filesystem_error& ex) {
-                std::cerr << "    Warning: failed to remove non-regular destination entry " << dest_path
-                          << ": " << ex.what() << std::endl;
-                continue;
+    if (pass.data && source_size >= options_.data_min_bytes) {
+        hand_off_copy<Policy>(pass, paths, src_meta, depth, attempt, project, partial_bytes);
+    } else if (options_.copy_order != CopyOrder::directory && attempt == 0) {
+        // Retries are not held back: they have waited enough.
+        pass.held.push_back(CopyPass::HeldCopy{paths, src_meta, depth, project, partial_bytes, pass.priority});
+    } else {
+        copy_entry<Policy>(pass, paths, src_meta, depth, attempt, project, partial_bytes);
+    }
+    return false;
+}
+
+template <typename Policy>
+void DirectorySyncer::hand_off_copy(CopyPass& pass, const EntryPaths& paths, const FileMetadata& src_meta, int depth,
+                                    unsigned attempt, const std::string& project, std::uintmax_t partial_bytes) {
+    DataLane& lane = *pass.data;
+    const std::uintmax_t bytes = src_meta.size;
+    lane.reserve(bytes);
+    lane.tasks.submit([this, &lane, bytes, paths, src_meta = FileMetadata(src_meta), depth, attempt, project,
+                       partial_bytes, priority = pass.priority](std::size_t worker) mutable {
+        struct Release {
+            DataLane& lane;
+            std::uintmax_t bytes;
+            ~Release() { lane.release(bytes); }
+        } release{lane, bytes};
+        CopyPass& data_pass = lane.passes[worker];
+        Run& run = data_pass.run;
+        WatchdogAttachment attachment(run.watchdog.get(), data_pass.watchdog_slot);
+        if (run.accounting && !data_pass.usage) {
+            data_pass.usage = &run.accounting->local();
+        }
+        ClassTally tally(data_pass.stats);
+        copy_entry<Policy>(data_pass, paths, src_meta, depth, attempt, project, partial_bytes);
+        if (Policy::observe) {
+            data_pass.progress->store(data_pass.stats);
+        }
+        if (!data_pass.stats.priority_classes.empty()) {
+            tally.record(data_pass.stats.priority_classes[priority], 0, data_pass.started);
+        }
+    });
+}
+
+template <typename Policy>
+void DirectorySyncer::copy_entry(CopyPass& pass, const EntryPaths& paths, FileMetadata& src_meta, int depth,
+                                 unsigned attempt, const std::string& project, std::uintmax_t partial_bytes) {
+    SyncStats& stats = pass.stats;
+    EventStream* events = Policy::observe ? pass.events : nullptr;
+    LiveStatsPublisher* live = Policy::observe ? pass.live : nullptr;
+    UsageShard* usage = Policy::usage ? pass.usage : nullptr;
+    TarWriter* const tar = options_.tar_export.get();
+    const std::uintmax_t source_size = src_meta.size;
+    const fs::path path(paths.source);
+    const fs::path dest_path(paths.destination);
+
+    const auto copy_start = Clock::now();
+    try {
+        std::uintmax_t resumed = 0;
+        {
+            FsOpGuard guard(FsOp::copy, path);
+            // Marked before the first byte, cleared once the copy is whole.
+            const bool marked = options_.resume != ResumeMode::off && !tar &&
+                                source_size >= options_.resume_min_bytes &&
+                                mark_partial_copy(dest_path, partial_copy_marker(src_meta));
+            if (partial_bytes > 0) {
+                resumed = options_.resume == ResumeMode::verify
+                              ? matching_prefix(path, dest_path, options_.resume_block_bytes, options_.resume_threads)
+                              : partial_bytes;
+                resume_copy(path, dest_path, resumed);
+            } else if (tar) {
+                BufferPool::Lease lease = pass.run.buffer_pool->acquire();
+                tar->add_file(paths.relative, src_meta, path, lease.data(), lease.size(), &pass.run.err);
+            } else if (pass.run.copy_engines) {
+                copy_file_with(pass.run.copy_engines->engine_for(source_size), path, dest_path, *pass.run.buffer_pool);
+                ++stats.copy_engines.files_copied[copy_size_class(source_size)];
+            } else {
+                fs::copy_file(path, dest_path, fs::copy_options::overwrite_existing);
+            }
+            if (marked) {
+                clear_partial_copy(dest_path);
             }
+        }
+        const auto copy_end = Clock::now();
+        stats.copy_elapsed += copy_end - copy_start;
+        if (live) {
+            live->record_copy(source_size - resumed, copy_end - copy_start);
+        }
+        ++stats.files_copied;
+        stats.bytes_copied += source_size - resumed;
+        if (resumed > 0) {
+            ++stats.files_resumed;
+            stats.bytes_resumed += resumed;
+            log_line(pass.run.out, "    Resumed file: ", path, " -> ", dest_path, " (", resumed, " of ", source_size,
+                     " bytes already present)");
+        } else if (tar) {
+            log_line(pass.run.out, "    Exported file: ", paths.relative, " (", source_size, " bytes)");
         } else {
-            FileMetadata dest_meta;
-            if (!collect_metadata(dest_path, static_cast<int>(it.depth()), dest_meta)) {
-                should_copy = true;
-            } else {
-                const bool dest_is_symlink = S_ISLNK(static_cast<mode_t>(dest_meta.mode));
-                if (dest_is_symlink) {
-                    std::cout << "    Destination entry is a symlink (will replace): " << dest_path << std::endl;
-                    try {
-                        fs::remove(dest_path);
-                        should_copy = true;
-                    } catch (const fs::filesystem_error& ex) {
-                        std::cerr << "    Warning: failed to remove symlink " << dest_path << ": " << ex.what()
-                                  << std::endl;
-                        continue;
-                    }
-                } else {
-                    const std::uintmax_t dest_size = dest_meta.size;
-                    const bool size_differs = source_size != dest_size;
-                    const bool time_newer = (src_meta.mtime > dest_meta.mtime) ||
-                                            (src_meta.mtime == dest_meta.mtime &&
-                                             src_meta.mtime_nsec > dest_meta.mtime_nsec);
-                    if (size_differs || time_newer) {
-                        should_copy = true;
-                    }
-                }
+            log_line(pass.run.out, "    Copied file: ", path, " -> ", dest_path, " (", source_size, " bytes)");
+        }
+        if (events) {
+            events->copied(path, dest_path, source_size - resumed);
+        }
+        if (usage) {
+            usage->copied(src_meta.uid, src_meta.gid, project, source_size - resumed);
+        }
+        record_synced(pass.run, src_meta, paths.source, stats);
+    } catch (const fs::filesystem_error& ex) {
+        if (!schedule_retry(pass, paths, depth, project, attempt, "copy", ex.code())) {
+            log_line(pass.run.err, "    Warning: failed to copy ", path, " to ", dest_path, ": ", ex.what());
+            if (events) {
+                events->error("copy", path, ex.what());
             }
         }
+    }
+}
 
-        if (should_copy) {
-            try {
-                fs::create_directories(dest_path.parent_path());
-            } catch (const fs::filesystem_error& ex) {
-                std::cerr << "    Warning: failed to ensure parent directory for " << dest_path << ": " << ex.what()
-                          << std::endl;
+template <typename Policy>
+void DirectorySyncer::flush_copies(CopyPass& pass) {
+    if (pass.held.empty()) {
+        return;
+    }
+    // Copies may schedule retries, never more held copies, but keep the
+    // vector's capacity for the next window anyway.
+    std::vector<CopyPass::HeldCopy> held;
+    held.swap(pass.held);
+    CopyOrderStats& order = pass.stats.copy_order;
+    for (CopyPass::HeldCopy& copy : held) {
+        if (options_.copy_order == CopyOrder::extent &&
+            !pass.run.extents_unsupported.load(std::memory_order_relaxed)) {
+            bool unsupported = false;
+            if (const auto offset = first_extent_offset(copy.paths.source.c_str(), &unsupported)) {
+                copy.by_inode = false;
+                copy.key = *offset;
+                ++order.by_extent;
                 continue;
             }
-
-            const auto copy_start = Clock::now();
-            try {
-                fs::copy_file(entry.path(), dest_path, fs::copy_options::overwrite_existing);
-                const auto copy_end = Clock::now();
-                stats.copy_elapsed += copy_end - copy_start;
-                ++stats.files_copied;
-                stats.bytes_copied += source_size;
-                std::cout << "    Copied file: " << entry.path() << " -> " << dest_path << " (" << source_size
-                          << " bytes)" << std::endl;
-                stats.synced_entries.push_back(src_meta);
-            } catch (const fs::filesystem_error& ex) {
-                std::cerr << "    Warning: failed to copy " << entry.path() << " to " << dest_path
-                          << ": " << ex.what() << std::endl;
-                continue;
+            if (unsupported) {
+                pass.run.extents_unsupported.store(true, std::memory_order_relaxed);
             }
-        } else {
-            ++stats.files_skipped;
         }
+        copy.key = copy.meta.inode;
+        ++order.by_inode;
     }
+    std::stable_sort(held.begin(), held.end(), [](const CopyPass::HeldCopy& a, const CopyPass::HeldCopy& b) {
+        if (a.priority != b.priority) {
+            return a.priority > b.priority;
+        }
+        return std::tie(a.by_inode, a.key) < std::tie(b.by_inode, b.key);
+    });
+    ++order.windows;
 
-    stats.scan_elapsed = Clock::now() - stage_start;
+    for (CopyPass::HeldCopy& copy : held) {
+        ClassTally tally(pass.stats);
+        copy_entry<Policy>(pass, copy.paths, copy.meta, copy.depth, 0, copy.project, copy.partial_bytes);
+        if (!pass.stats.priority_classes.empty()) {
+            tally.record(pass.stats.priority_classes[copy.priority], 0, pass.started);
+        }
+    }
+    held.clear();
+    pass.held.swap(held);
+}
+
+bool DirectorySyncer::schedule_retry(CopyPass& pass, const EntryPaths& paths, int depth, const std::string& project,
+                                     unsigned attempt, std::string_view operation, const std::error_code& ec) {
+    if (classify_error(ec) != ErrorClass::transient) {
+        return false;
+    }
+
+    const fs::path path(paths.source);
+    const unsigned max_retries = pass.retries.policy().max_retries;
+    if (attempt >= max_retries) {
+        ++pass.stats.retry_failures;
+        log_line(pass.run.err, "    Error: giving up on ", path, " after ", attempt, " retries (", operation, ": ",
+                 ec.message(), ")");
+        if (pass.events) {
+            pass.events->error(operation, path, "retries exhausted: " + ec.message());
+        }
+        return true;
+    }
+
+    const unsigned next = attempt + 1;
+    const auto delay = pass.retries.push(CopyPass::RetryItem{paths, depth, project, next}, next);
+    const double delay_ms = std::chrono::duration<double, std::milli>(delay).count();
+    log_line(pass.run.err, "    Transient ", operation, " error on ", path, ": ", ec.message(), "; retry ", next, "/",
+             max_retries, " in ", static_cast<long long>(delay_ms), " ms");
+    if (pass.events) {
+        pass.events->retry(operation, path, next, ec.message(), delay);
+    }
+    return true;
 }
 
-void DirectorySyncer::prune_destination(const fs::path& source,
+template <typename Policy>
+void DirectorySyncer::run_due_retries(CopyPass& pass) {
+    while (auto item = pass.retries.pop_due()) {
+        ++pass.stats.retries;
+        const auto retry_start = Clock::now();
+        std::string project = item->project;
+        const bool descend = sync_source_entry<Policy>(pass, item->paths, item->depth, item->attempt, project);
+        pass.stats.retry_elapsed += Clock::now() - retry_start;
+        if (descend) {
+            // The directory itself was unreadable before, so its subtree has
+            // not been visited yet.
+            walk_source<Policy>(pass, fs::path(item->paths.source), item->paths.relative, item->depth + 1, project);
+        }
+    }
+}
+
+template <typename Policy>
+void DirectorySyncer::drain_retries(CopyPass& pass) {
+    while (!pass.retries.empty()) {
+        const auto due = pass.retries.next_due();
+        const auto now = Clock::now();
+        if (due > now) {
+            // Nothing else is left to do; waiting here no longer delays other work.
+            std::this_thread::sleep_until(due);
+            pass.stats.retry_elapsed += Clock::now() - now;
+        }
+        run_due_retries<Policy>(pass);
+    }
+}
+
+void DirectorySyncer::prune_destination(Run& run,
+                                        const fs::path& source,
                                         const fs::path& destination,
                                         SyncStats& stats) {
     const auto prune_start = Clock::now();
 
-    fs::directory_options options = fs::directory_options::skip_permission_denied;
-
     struct RemovalCandidate {
         fs::path path;
         bool is_directory;
         std::size_t depth;
+        std::uint64_t uid;
+        std::uint64_t gid;
+        std::string project;
     };
 
     std::vector<RemovalCandidate> candidates;
+    EventStream* events = run.events;
+    LiveStatsPublisher* live = run.live;
+    UsageShard* usage = run.accounting ? &run.accounting->local() : nullptr;
+    std::string project(kRootProject);
+    std::size_t visited = 0;
 
-    for (fs::recursive_directory_iterator it(destination, options), end; it != end; ++it) {
+    for (auto it = open_walk(destination), end = fs::recursive_directory_iterator(); it != end; advance_walk(it)) {
         const fs::directory_entry& entry = *it;
+        if (events && events->progress_due()) {
+            events->progress(stats);
+        }
+        if (live && (++visited % kLivePublishInterval) == 0) {
+            live->publish(stats);
+        }
         FileMetadata dest_meta;
-        if (!collect_metadata(entry.path(), static_cast<int>(it.depth()), dest_meta)) {
+        if (!collect_metadata(run, entry.path().c_str(), static_cast<int>(it.depth()), dest_meta)) {
             if (entry.is_directory()) {
                 it.disable_recursion_pending();
             }
             continue;
         }
 
+        if (usage && it.depth() == 0) {
+            project = S_ISDIR(static_cast<mode_t>(dest_meta.mode)) ? entry.path().filename().string()
+                                                                   : std::string(kRootProject);
+        }
+
         const bool is_symlink = S_ISLNK(static_cast<mode_t>(dest_meta.mode));
         if (is_symlink) {
-            std::cout << "    Skipping symlink in destination: " << entry.path() << std::endl;
+            log_line(run.out, "    Skipping symlink in destination: ", entry.path());
             continue;
         }
 
@@ -242,8 +1762,11 @@ void DirectorySyncer::prune_destination(const fs::path& source,
         try {
             relative_path = fs::relative(entry.path(), destination);
         } catch (const fs::filesystem_error& ex) {
-            std::cerr << "    Warning: failed to compute relative path for destination entry " << entry.path()
-                      << ": " << ex.what() << std::endl;
+            log_line(run.err, "    Warning: failed to compute relative path for destination entry ", entry.path(),
+                     ": ", ex.what());
+            if (events) {
+                events->error("relative", entry.path(), ex.what());
+            }
             if (entry.is_directory()) {
                 it.disable_recursion_pending();
             }
@@ -251,13 +1774,25 @@ void DirectorySyncer::prune_destination(const fs::path& source,
         }
 
         const fs::path source_match = source / relative_path;
-        if (fs::exists(source_match)) {
+        const Watchdog* watchdog = run.watchdog.get();
+        if (watchdog && (watchdog->quarantined(entry.path()) || watchdog->quarantined(source_match))) {
+            // The source side could not be inspected reliably; never delete
+            // on the basis of a hung or fenced-off subtree.
+            ++stats.quarantine_skipped;
+            it.disable_recursion_pending();
+            continue;
+        }
+        if (run.source_entries && run.source_entries->contains(relative_path.native())) {
+            continue;
+        }
+        if (exists_guarded(source_match)) {
             continue;
         }
 
         const bool is_dir = S_ISDIR(static_cast<mode_t>(dest_meta.mode));
         const std::size_t depth = static_cast<std::size_t>(std::distance(entry.path().begin(), entry.path().end()));
-        candidates.push_back(RemovalCandidate{entry.path(), is_dir, depth});
+        candidates.push_back(RemovalCandidate{entry.path(), is_dir, depth, dest_meta.uid, dest_meta.gid,
+                                              usage ? project : std::string()});
     }
 
     std::sort(candidates.begin(), candidates.end(),
@@ -266,37 +1801,75 @@ void DirectorySyncer::prune_destination(const fs::path& source,
     for (const auto& candidate : candidates) {
         try {
             if (candidate.is_directory) {
-                std::cout << "    Removing extraneous directory: " << candidate.path << std::endl;
+                log_line(run.out, "    Removing extraneous directory: ", candidate.path);
+                FsOpGuard guard(FsOp::remove, candidate.path);
                 const std::uintmax_t removed = fs::remove_all(candidate.path);
                 stats.files_deleted += removed;
+                if (events) {
+                    events->deleted(candidate.path, true, removed);
+                }
+                if (usage) {
+                    usage->deleted(candidate.uid, candidate.gid, candidate.project, removed);
+                }
             } else {
-                std::cout << "    Removing extraneous file: " << candidate.path << std::endl;
+                log_line(run.out, "    Removing extraneous file: ", candidate.path);
+                FsOpGuard guard(FsOp::remove, candidate.path);
                 if (fs::remove(candidate.path)) {
                     ++stats.files_deleted;
+                    if (events) {
+                        events->deleted(candidate.path, false, 1);
+                    }
+                    if (usage) {
+                        usage->deleted(candidate.uid, candidate.gid, candidate.project, 1);
+                    }
                 }
             }
         } catch (const fs::filesystem_error& ex) {
-            std::cerr << "    Warning: failed to remove " << candidate.path << ": " << ex.what() << std::endl;
+            log_line(run.err, "    Warning: failed to remove ", candidate.path, ": ", ex.what());
+            if (events) {
+                events->error("remove", candidate.path, ex.what());
+            }
         }
     }
 
     stats.prune_elapsed = Clock::now() - prune_start;
+    if (events) {
+        events->stage("prune", stats.prune_elapsed);
+    }
+}
+
+void DirectorySyncer::record_synced(Run& run, FileMetadata& meta, std::string_view path, SyncStats& stats) {
+    meta.file = path;
+    stats.synced_entries.push_back(meta);
+    if (run.columnar) {
+        std::lock_guard<std::mutex> lock(run.columnar_mutex);
+        run.columnar->append(meta);
+    }
 }
 
-bool DirectorySyncer::collect_metadata(const fs::path& path, int depth, FileMetadata& out) {
+bool DirectorySyncer::collect_metadata(Run& run, const char* path, int depth, FileMetadata& out, int* error) {
     struct stat st {};
-    if (::lstat(path.c_str(), &st) != 0) {
-        log_lstat_error(path, errno);
+    int rc = 0;
+    {
+        FsOpGuard guard(FsOp::lstat, path);
+        rc = ::lstat(path, &st);
+    }
+    if (rc != 0) {
+        const int err = errno;
+        if (error) {
+            *error = err;
+        }
+        log_lstat_error(run, path, err);
         return false;
     }
 
-    out.file = path;
     out.depth = depth;
     out.detail = true;
     out.mode = static_cast<std::uint64_t>(st.st_mode);
     out.uid = static_cast<std::uint64_t>(st.st_uid);
     out.gid = static_cast<std::uint64_t>(st.st_gid);
     out.size = static_cast<std::uint64_t>(st.st_size);
+    out.inode = static_cast<std::uint64_t>(st.st_ino);
 
 #if defined(__APPLE__) || defined(__MACH__)
     const auto atime = st.st_atimespec;
@@ -318,58 +1891,606 @@ bool DirectorySyncer::collect_metadata(const fs::path& path, int depth, FileMeta
     return true;
 }
 
-void DirectorySyncer::log_lstat_error(const fs::path& path, int err) {
-    std::cerr << "    Error: lstat failed for " << path << ": " << std::strerror(err) << " (errno " << err << ")"
-              << std::endl;
+void DirectorySyncer::log_lstat_error(Run& run, const char* c_path, int err) {
+    const fs::path path(c_path);
+    log_line(run.err, "    Error: lstat failed for ", path, ": ", std::strerror(err), " (errno ", err, ")");
+    if (run.events) {
+        run.events->error("lstat", path, std::strerror(err));
+    }
 }
 
-void print_report(const SyncStats& stats) {
-    std::cout << "\n=== Synchronization Summary ===" << std::endl;
-    std::cout << "  Entries scanned:      " << stats.entries_scanned << std::endl;
-    std::cout << "  Files copied:         " << stats.files_copied << std::endl;
-    std::cout << "  Files skipped:        " << stats.files_skipped << std::endl;
-    std::cout << "  Directories created:  " << stats.directories_created << std::endl;
-    std::cout << "  Entries deleted:      " << stats.files_deleted << std::endl;
-    std::cout << "  Bytes copied:         " << stats.bytes_copied << std::endl;
+namespace {
 
-    auto print_duration = [](const std::string& label, const std::chrono::duration<double>& d) {
-        std::cout << "  " << std::setw(20) << std::left << (label + ":") << std::fixed << std::setprecision(3)
-                  << d.count() << " s" << std::endl;
-    };
+void append_usage_counters_json(OutputBuffer& out, const UsageCounters& counters) {
+    out.append(",\"bytes_copied\":");
+    out.append_uint(counters.bytes_copied);
+    out.append(",\"files_copied\":");
+    out.append_uint(counters.files_copied);
+    out.append(",\"files_deleted\":");
+    out.append_uint(counters.files_deleted);
+    out.append(",\"files_skipped\":");
+    out.append_uint(counters.files_skipped);
+    out.append("}\n");
+}
+
+void append_usage_row(OutputBuffer& out, const UsageCounters& counters) {
+    out.append_uint_right(counters.bytes_copied, 16);
+    out.append_uint_right(counters.files_copied, 16);
+    out.append_uint_right(counters.files_deleted, 16);
+    out.append_uint_right(counters.files_skipped, 16);
+    out.append('\n');
+}
+
+template <typename Key>
+void format_usage_table(OutputBuffer& out, std::string_view title, std::string_view key,
+                        const std::vector<std::pair<Key, UsageCounters>>& rows, OutputFormat format) {
+    for (const auto& [id, counters] : rows) {
+        if (format == OutputFormat::jsonl) {
+            out.append("{\"type\":\"usage\",\"key\":\"");
+            out.append(key);
+            out.append("\",\"id\":");
+            if constexpr (std::is_same_v<Key, std::string>) {
+                out.append_json_string(id);
+            } else {
+                out.append_uint(id);
+            }
+            append_usage_counters_json(out, counters);
+        }
+    }
+    if (format == OutputFormat::jsonl || rows.empty()) {
+        return;
+    }
+
+    out.append("\n=== ");
+    out.append(title);
+    out.append(" ===\n  ");
+    out.append_padded(key, 24);
+    out.append("    bytes_copied    files_copied   files_deleted   files_skipped\n");
+    for (const auto& [id, counters] : rows) {
+        out.append("  ");
+        if constexpr (std::is_same_v<Key, std::string>) {
+            out.append_padded(id, 24);
+        } else {
+            out.append_padded(std::to_string(id), 24);
+        }
+        append_usage_row(out, counters);
+    }
+}
+
+void format_usage(OutputBuffer& out, const UsageReport& usage, OutputFormat format) {
+    format_usage_table(out, "Usage by UID", "uid", usage.by_uid, format);
+    format_usage_table(out, "Usage by GID", "gid", usage.by_gid, format);
+    format_usage_table(out, "Usage by Top-Level Directory", "project", usage.by_project, format);
+}
+
+void format_numa_nodes(OutputBuffer& out, const SyncStats& stats, OutputFormat format) {
+    const double seconds = stats.scan_elapsed.count();
+    if (format == OutputFormat::jsonl) {
+        for (const NodeThroughput& node : stats.numa_nodes) {
+            out.append("{\"type\":\"numa_node\",\"node\":");
+            out.append_int(node.node);
+            out.append(",\"workers\":");
+            out.append_uint(node.workers);
+            out.append(",\"files_copied\":");
+            out.append_uint(node.files_copied);
+            out.append(",\"bytes_copied\":");
+            out.append_uint(node.bytes_copied);
+            out.append(",\"copy_elapsed_s\":");
+            out.append_fixed(node.copy_elapsed.count(), 6);
+            out.append(",\"tasks_stolen\":");
+            out.append_uint(node.tasks_stolen);
+            out.append("}\n");
+        }
+        return;
+    }
+    if (stats.numa_nodes.empty()) {
+        return;
+    }
+
+    // MiB/s over the copy stage's wall time, so the rows add up to the run.
+    out.append("\n=== Per-Node Throughput ===\n  node     workers    files_copied    bytes_copied    tasks_stolen  MiB/s\n");
+    for (const NodeThroughput& node : stats.numa_nodes) {
+        out.append("  ");
+        out.append_padded(std::to_string(node.node), 4);
+        out.append_uint_right(node.workers, 12);
+        out.append_uint_right(node.files_copied, 16);
+        out.append_uint_right(node.bytes_copied, 16);
+        out.append_uint_right(node.tasks_stolen, 16);
+        out.append("  ");
+        if (seconds > 0.0) {
+            out.append_fixed(static_cast<double>(node.bytes_copied) / (1024.0 * 1024.0) / seconds, 3);
+        } else {
+            out.append("n/a");
+        }
+        out.append('\n');
+    }
+}
+
+// Classes that did no work (levels no rule uses) are left out.
+void format_priority_classes(OutputBuffer& out, const SyncStats& stats, OutputFormat format) {
+    const std::vector<PriorityClassStats>& classes = stats.priority_classes;
+    if (format == OutputFormat::jsonl) {
+        for (std::size_t level = 0; level < classes.size(); ++level) {
+            const PriorityClassStats& cls = classes[level];
+            if (cls.directories == 0 && cls.entries == 0) {
+                continue;
+            }
+            out.append("{\"type\":\"priority_class\",\"class\":");
+            out.append_uint(level);
+            out.append(",\"directories\":");
+            out.append_uint(cls.directories);
+            out.append(",\"entries\":");
+            out.append_uint(cls.entries);
+            out.append(",\"files_copied\":");
+            out.append_uint(cls.files_copied);
+            out.append(",\"bytes_copied\":");
+            out.append_uint(cls.bytes_copied);
+            out.append(",\"completed_s\":");
+            out.append_fixed(cls.completed.count(), 6);
+            out.append("}\n");
+        }
+        return;
+    }
+    if (classes.empty()) {
+        return;
+    }
+
+    // Completion is measured from the start of the copy stage.
+    out.append("\n=== Priority Classes ===\n  class   directories         entries    files_copied    bytes_copied  done (s)\n");
+    for (std::size_t level = classes.size(); level-- > 0;) {
+        const PriorityClassStats& cls = classes[level];
+        if (cls.directories == 0 && cls.entries == 0) {
+            continue;
+        }
+        out.append("  ");
+        out.append_padded(level == 0 ? std::string("bulk") : std::to_string(level), 5);
+        out.append_uint_right(cls.directories, 14);
+        out.append_uint_right(cls.entries, 16);
+        out.append_uint_right(cls.files_copied, 16);
+        out.append_uint_right(cls.bytes_copied, 16);
+        out.append("  ");
+        out.append_fixed(cls.completed.count(), 3);
+        out.append('\n');
+    }
+}
+
+// Calibrated throughput of `engine` for `size_class` in MiB/s; nothing if
+// the engine was not timed (unsupported, or no calibration).
+std::optional<double> calibrated_mib_s(const CopyEngineStats& engines, std::size_t size_class, CopyEngine engine) {
+    for (const EngineTiming& timing : engines.calibration) {
+        if (timing.size_class == size_class && timing.engine == engine) {
+            return timing.bytes_per_second / (1024.0 * 1024.0);
+        }
+    }
+    return std::nullopt;
+}
+
+void format_copy_engines(OutputBuffer& out, const CopyEngineStats& engines, OutputFormat format) {
+    if (!engines.active) {
+        return;
+    }
+    const bool calibrated = !engines.calibration.empty();
+    if (format == OutputFormat::jsonl) {
+        for (std::size_t size_class = 0; size_class < kCopySizeClasses; ++size_class) {
+            out.append("{\"type\":\"copy_engine\",\"size_class\":\"");
+            out.append(copy_size_class_label(size_class));
+            out.append("\",\"engine\":\"");
+            out.append(copy_engine_name(engines.table.engine(size_class)));
+            out.append("\",\"files_copied\":");
+            out.append_uint(engines.files_copied[size_class]);
+            if (calibrated) {
+                out.append(",\"source_fs\":");
+                out.append_json_string(engines.source_filesystem.type);
+                out.append(",\"destination_fs\":");
+                out.append_json_string(engines.destination_filesystem.type);
+                out.append(engines.cached ? ",\"cached\":true" : ",\"cached\":false");
+                for (const CopyEngine engine : kAllCopyEngines) {
+                    if (const std::optional<double> mib_s = calibrated_mib_s(engines, size_class, engine)) {
+                        out.append(",\"");
+                        out.append(copy_engine_name(engine));
+                        out.append("_mib_s\":");
+                        out.append_fixed(*mib_s, 3);
+                    }
+                }
+            }
+            out.append("}\n");
+        }
+        return;
+    }
+
+    out.append("\n=== Copy Engines ===\n");
+    if (calibrated) {
+        out.append("  ");
+        out.append(engines.source_filesystem.type);
+        out.append(" -> ");
+        out.append(engines.destination_filesystem.type);
+        out.append(engines.cached ? ", cached calibration (MiB/s, - = unsupported)\n"
+                                  : ", calibrated at startup (MiB/s, - = unsupported)\n");
+    }
+    out.append("  size class  engine            files_copied");
+    if (calibrated) {
+        for (const CopyEngine engine : kAllCopyEngines) {
+            const std::string_view name = copy_engine_name(engine);
+            out.append(std::string(16 - name.size(), ' '));
+            out.append(name);
+        }
+    }
+    out.append('\n');
+    for (std::size_t size_class = 0; size_class < kCopySizeClasses; ++size_class) {
+        out.append("  ");
+        out.append_padded(copy_size_class_label(size_class), 12);
+        out.append_padded(copy_engine_name(engines.table.engine(size_class)), 16);
+        out.append_uint_right(engines.files_copied[size_class], 14);
+        if (calibrated) {
+            for (const CopyEngine engine : kAllCopyEngines) {
+                if (const std::optional<double> mib_s = calibrated_mib_s(engines, size_class, engine)) {
+                    out.append_uint_right(static_cast<std::uint64_t>(*mib_s + 0.5), 16);
+                } else {
+                    out.append("               -");
+                }
+            }
+        }
+        out.append('\n');
+    }
+}
 
-    print_duration("Scan elapsed", stats.scan_elapsed);
-    print_duration("Copy elapsed", stats.copy_elapsed);
-    print_duration("Prune elapsed", stats.prune_elapsed);
-    print_duration("Total elapsed", stats.total_elapsed);
+// File bytes per wire byte over every chunk the compressing sender sent.
+double compression_ratio(const TransportStats& transport) {
+    return transport.compress_bytes_out > 0
+               ? static_cast<double>(transport.compress_bytes_in) / static_cast<double>(transport.compress_bytes_out)
+               : 0.0;
+}
+
+// MiB per second of codec thread time.
+double codec_throughput(const TransportStats& transport) {
+    const double seconds = transport.codec_elapsed.count();
+    return seconds > 0.0 ? static_cast<double>(transport.codec_bytes) / (1024.0 * 1024.0) / seconds : 0.0;
+}
+
+// Logical bytes of the snapshot per byte held in the store's packs.
+double dedup_ratio(const DedupStats& dedup) {
+    return dedup.store_bytes > 0
+               ? static_cast<double>(dedup.snapshot_bytes) / static_cast<double>(dedup.store_bytes)
+               : 0.0;
+}
+
+// MiB per second of chunking thread time.
+double chunk_throughput(const DedupStats& dedup) {
+    const double seconds = dedup.chunk_elapsed.count();
+    return seconds > 0.0 ? static_cast<double>(dedup.bytes_chunked) / (1024.0 * 1024.0) / seconds : 0.0;
+}
+
+} // namespace
 
+void format_report(OutputBuffer& out, const SyncStats& stats, OutputFormat format) {
     const double total_seconds = stats.total_elapsed.count();
+    const double mib = static_cast<double>(stats.bytes_copied) / (1024.0 * 1024.0);
+
+    if (format == OutputFormat::jsonl) {
+        out.append("{\"type\":\"summary\",\"entries_scanned\":");
+        out.append_uint(stats.entries_scanned);
+        out.append(",\"files_copied\":");
+        out.append_uint(stats.files_copied);
+        out.append(",\"files_skipped\":");
+        out.append_uint(stats.files_skipped);
+        out.append(",\"directories_created\":");
+        out.append_uint(stats.directories_created);
+        out.append(",\"directories_split\":");
+        out.append_uint(stats.directories_split);
+        out.append(",\"entries_deleted\":");
+        out.append_uint(stats.files_deleted);
+        out.append(",\"bytes_copied\":");
+        out.append_uint(stats.bytes_copied);
+        out.append(",\"retries\":");
+        out.append_uint(stats.retries);
+        out.append(",\"retry_failures\":");
+        out.append_uint(stats.retry_failures);
+        out.append(",\"retry_elapsed_s\":");
+        out.append_fixed(stats.retry_elapsed.count(), 6);
+        out.append(",\"stalled_operations\":");
+        out.append_uint(stats.stalled_operations.size());
+        out.append(",\"quarantine_skipped\":");
+        out.append_uint(stats.quarantine_skipped);
+        if (stats.buffer_pool.buffers > 0) {
+            const BufferPoolStats& pool = stats.buffer_pool;
+            out.append(",\"copy_buffers\":");
+            out.append_uint(pool.buffers);
+            out.append(",\"copy_buffer_bytes\":");
+            out.append_uint(pool.buffer_bytes);
+            out.append(",\"copy_buffer_peak\":");
+            out.append_uint(pool.peak_in_use);
+            out.append(",\"copy_buffer_waits\":");
+            out.append_uint(pool.waits);
+            out.append(",\"huge_page_bytes\":");
+            out.append_uint(pool.huge_page_bytes);
+        }
+        if (stats.files_resumed > 0) {
+            out.append(",\"files_resumed\":");
+            out.append_uint(stats.files_resumed);
+            out.append(",\"bytes_resumed\":");
+            out.append_uint(stats.bytes_resumed);
+        }
+        if (stats.copy_order.windows > 0) {
+            out.append(",\"copy_windows\":");
+            out.append_uint(stats.copy_order.windows);
+            out.append(",\"copies_by_extent\":");
+            out.append_uint(stats.copy_order.by_extent);
+            out.append(",\"copies_by_inode\":");
+            out.append_uint(stats.copy_order.by_inode);
+        }
+        if (stats.data_lane.files > 0) {
+            const DataLaneStats& lane = stats.data_lane;
+            out.append(",\"data_lane_files\":");
+            out.append_uint(lane.files);
+            out.append(",\"data_lane_bytes\":");
+            out.append_uint(lane.bytes);
+            out.append(",\"data_lane_peak_bytes\":");
+            out.append_uint(lane.peak_queued_bytes);
+            out.append(",\"data_lane_waits\":");
+            out.append_uint(lane.waits);
+        }
+        if (stats.transport.frames_sent > 0) {
+            const TransportStats& transport = stats.transport;
+            out.append(",\"frames_sent\":");
+            out.append_uint(transport.frames_sent);
+            out.append(",\"frames_received\":");
+            out.append_uint(transport.frames_received);
+            out.append(",\"wire_bytes_sent\":");
+            out.append_uint(transport.bytes_sent);
+            out.append(",\"wire_bytes_received\":");
+            out.append_uint(transport.bytes_received);
+            out.append(",\"bytes_spliced\":");
+            out.append_uint(transport.bytes_spliced);
+            if (transport.compress_bytes_in > 0) {
+                out.append(",\"chunks_compressed\":");
+                out.append_uint(transport.chunks_compressed);
+                out.append(",\"chunks_skipped\":");
+                out.append_uint(transport.chunks_skipped);
+                out.append(",\"compression_ratio\":");
+                out.append_fixed(compression_ratio(transport), 3);
+                out.append(",\"codec_mib_s\":");
+                out.append_fixed(codec_throughput(transport), 1);
+            }
+        }
+        if (stats.archive_bytes > 0) {
+            out.append(",\"archive_bytes\":");
+            out.append_uint(stats.archive_bytes);
+        }
+        if (stats.dedup.store_bytes > 0) {
+            const DedupStats& dedup = stats.dedup;
+            out.append(",\"chunks\":");
+            out.append_uint(dedup.chunks);
+            out.append(",\"chunks_stored\":");
+            out.append_uint(dedup.chunks_stored);
+            out.append(",\"chunk_bytes_stored\":");
+            out.append_uint(dedup.bytes_stored);
+            out.append(",\"snapshot_bytes\":");
+            out.append_uint(dedup.snapshot_bytes);
+            out.append(",\"store_bytes\":");
+            out.append_uint(dedup.store_bytes);
+            out.append(",\"dedup_ratio\":");
+            out.append_fixed(dedup_ratio(dedup), 3);
+            out.append(",\"chunk_mib_s\":");
+            out.append_fixed(chunk_throughput(dedup), 1);
+        }
+        out.append(",\"scan_elapsed_s\":");
+        out.append_fixed(stats.scan_elapsed.count(), 6);
+        out.append(",\"copy_elapsed_s\":");
+        out.append_fixed(stats.copy_elapsed.count(), 6);
+        out.append(",\"prune_elapsed_s\":");
+        out.append_fixed(stats.prune_elapsed.count(), 6);
+        out.append(",\"total_elapsed_s\":");
+        out.append_fixed(total_seconds, 6);
+        if (total_seconds > 0.0) {
+            out.append(",\"throughput_mib_s\":");
+            out.append_fixed(mib / total_seconds, 3);
+        }
+        out.append("}\n");
+        format_numa_nodes(out, stats, format);
+        format_priority_classes(out, stats, format);
+        format_copy_engines(out, stats.copy_engines, format);
+        format_usage(out, stats.usage, format);
+        return;
+    }
+
+    auto count_line = [&out](std::string_view label, std::uint64_t value) {
+        out.append("  ");
+        out.append_padded(label, 22);
+        out.append_uint(value);
+        out.append('\n');
+    };
+    auto duration_line = [&out](std::string_view label, const std::chrono::duration<double>& d) {
+        out.append("  ");
+        out.append_padded(label, 20);
+        out.append_fixed(d.count(), 3);
+        out.append(" s\n");
+    };
+
+    out.append("\n=== Synchronization Summary ===\n");
+    count_line("Entries scanned:", stats.entries_scanned);
+    count_line("Files copied:", stats.files_copied);
+    count_line("Files skipped:", stats.files_skipped);
+    count_line("Directories created:", stats.directories_created);
+    if (stats.directories_split > 0) {
+        count_line("Directories split:", stats.directories_split);
+    }
+    count_line("Entries deleted:", stats.files_deleted);
+    count_line("Bytes copied:", stats.bytes_copied);
+    if (stats.files_resumed > 0) {
+        count_line("Files resumed:", stats.files_resumed);
+        count_line("Bytes resumed:", stats.bytes_resumed);
+    }
+    if (stats.copy_order.windows > 0) {
+        count_line("Copy windows:", stats.copy_order.windows);
+        count_line("Copies by extent:", stats.copy_order.by_extent);
+        count_line("Copies by inode:", stats.copy_order.by_inode);
+    }
+    if (stats.data_lane.files > 0) {
+        count_line("Data lane files:", stats.data_lane.files);
+        count_line("Data lane bytes:", stats.data_lane.bytes);
+        count_line("Data lane peak bytes:", stats.data_lane.peak_queued_bytes);
+        count_line("Data lane waits:", stats.data_lane.waits);
+    }
+    if (stats.retries > 0 || stats.retry_failures > 0) {
+        count_line("Retries:", stats.retries);
+        count_line("Retry failures:", stats.retry_failures);
+    }
+    if (!stats.stalled_operations.empty() || stats.quarantine_skipped > 0) {
+        count_line("Stalled operations:", stats.stalled_operations.size());
+        count_line("Quarantine skipped:", stats.quarantine_skipped);
+    }
+    if (stats.buffer_pool.buffers > 0) {
+        const BufferPoolStats& pool = stats.buffer_pool;
+        count_line("Copy buffers:", pool.buffers);
+        count_line("Buffers peak in use:", pool.peak_in_use);
+        count_line("Buffer waits:", pool.waits);
+        out.append("  ");
+        out.append_padded("Huge page coverage:", 22);
+        out.append_fixed(100.0 * static_cast<double>(pool.huge_page_bytes) /
+                             static_cast<double>(pool.buffers * pool.buffer_bytes),
+                         1);
+        out.append(" %\n");
+    }
+    if (stats.transport.frames_sent > 0) {
+        const TransportStats& transport = stats.transport;
+        count_line("Frames sent:", transport.frames_sent);
+        count_line("Frames received:", transport.frames_received);
+        count_line("Wire bytes sent:", transport.bytes_sent);
+        count_line("Wire bytes received:", transport.bytes_received);
+        count_line("Bytes spliced:", transport.bytes_spliced);
+        if (transport.peak_files_in_flight > 0) {
+            count_line("Files in flight peak:", transport.peak_files_in_flight);
+        }
+        if (transport.compress_bytes_in > 0) {
+            count_line("Chunks compressed:", transport.chunks_compressed);
+            count_line("Chunks skipped:", transport.chunks_skipped);
+            out.append("  ");
+            out.append_padded("Compression ratio:", 22);
+            out.append_fixed(compression_ratio(transport), 2);
+            out.append("\n  ");
+            out.append_padded("Codec throughput:", 22);
+            out.append_fixed(codec_throughput(transport), 1);
+            out.append(" MiB/s\n");
+        }
+    }
+    if (stats.archive_bytes > 0) {
+        count_line("Archive bytes:", stats.archive_bytes);
+    }
+    if (stats.dedup.store_bytes > 0) {
+        const DedupStats& dedup = stats.dedup;
+        count_line("Chunks read:", dedup.chunks);
+        count_line("Chunks stored:", dedup.chunks_stored);
+        count_line("Chunk bytes stored:", dedup.bytes_stored);
+        count_line("Snapshot bytes:", dedup.snapshot_bytes);
+        count_line("Store bytes:", dedup.store_bytes);
+        out.append("  ");
+        out.append_padded("Dedup ratio:", 22);
+        out.append_fixed(dedup_ratio(dedup), 2);
+        out.append("\n  ");
+        out.append_padded("Chunking throughput:", 22);
+        out.append_fixed(chunk_throughput(dedup), 1);
+        out.append(" MiB/s\n");
+    }
+
+    duration_line("Scan elapsed:", stats.scan_elapsed);
+    duration_line("Copy elapsed:", stats.copy_elapsed);
+    duration_line("Prune elapsed:", stats.prune_elapsed);
+    if (stats.retries > 0 || stats.retry_failures > 0) {
+        duration_line("Retry elapsed:", stats.retry_elapsed);
+    }
+    duration_line("Total elapsed:", stats.total_elapsed);
+
     if (total_seconds > 0.0) {
-        const double mb = static_cast<double>(stats.bytes_copied) / (1024.0 * 1024.0);
-        const double throughput = mb / total_seconds;
-        std::cout << "  Effective throughput: " << std::fixed << std::setprecision(3) << throughput << " MiB/s"
-                  << std::endl;
+        out.append("  Effective throughput: ");
+        out.append_fixed(mib / total_seconds, 3);
+        out.append(" MiB/s\n");
     } else {
-        std::cout << "  Effective throughput: n/a" << std::endl;
+        out.append("  Effective throughput: n/a\n");
     }
+
+    format_numa_nodes(out, stats, format);
+    format_priority_classes(out, stats, format);
+    format_copy_engines(out, stats.copy_engines, format);
+    format_usage(out, stats.usage, format);
 }
 
-void print_synced_metadata(const std::vector<FileMetadata>& entries) {
+void format_synced_metadata(OutputBuffer& out, const std::vector<FileMetadata>& entries, OutputFormat format) {
+    if (format == OutputFormat::jsonl) {
+        for (const auto& meta : entries) {
+            out.append("{\"type\":\"entry\",\"path\":");
+            out.append_json_string(meta.file.native());
+            out.append(",\"depth\":");
+            out.append_int(meta.depth);
+            out.append(",\"mode\":");
+            out.append_uint(meta.mode);
+            out.append(",\"uid\":");
+            out.append_uint(meta.uid);
+            out.append(",\"gid\":");
+            out.append_uint(meta.gid);
+            out.append(",\"size\":");
+            out.append_uint(meta.size);
+            out.append(",\"mtime\":");
+            out.append_uint(meta.mtime);
+            out.append(",\"mtime_nsec\":");
+            out.append_uint(meta.mtime_nsec);
+            out.append(",\"atime\":");
+            out.append_uint(meta.atime);
+            out.append(",\"atime_nsec\":");
+            out.append_uint(meta.atime_nsec);
+            out.append(",\"ctime\":");
+            out.append_uint(meta.ctime);
+            out.append(",\"ctime_nsec\":");
+            out.append_uint(meta.ctime_nsec);
+            out.append("}\n");
+        }
+        return;
+    }
+
     if (entries.empty()) {
-        std::cout << "\nNo entries were synchronized." << std::endl;
+        out.append("\nNo entries were synchronized.\n");
         return;
     }
 
-    std::cout << "\n=== Synchronized Source Entries ===" << std::endl;
+    out.append("\n=== Synchronized Source Entries ===\n");
     for (const auto& meta : entries) {
-        std::cout << "  Path: " << meta.file << "\n"
-                  << "    depth: " << meta.depth << "\n"
-                  << "    mode: " << meta.mode << "\n"
-                  << "    uid: " << meta.uid << ", gid: " << meta.gid << "\n"
-                  << "    size: " << meta.size << " bytes\n"
-                  << "    mtime: " << meta.mtime << "s + " << meta.mtime_nsec << "ns\n"
-                  << "    atime: " << meta.atime << "s + " << meta.atime_nsec << "ns\n"
-                  << "    ctime: " << meta.ctime << "s + " << meta.ctime_nsec << "ns\n";
+        out.append("  Path: ");
+        out.append_quoted(meta.file.native());
+        out.append("\n    depth: ");
+        out.append_int(meta.depth);
+        out.append("\n    mode: ");
+        out.append_uint(meta.mode);
+        out.append("\n    uid: ");
+        out.append_uint(meta.uid);
+        out.append(", gid: ");
+        out.append_uint(meta.gid);
+        out.append("\n    size: ");
+        out.append_uint(meta.size);
+        out.append(" bytes\n    mtime: ");
+        out.append_uint(meta.mtime);
+        out.append("s + ");
+        out.append_uint(meta.mtime_nsec);
+        out.append("ns\n    atime: ");
+        out.append_uint(meta.atime);
+        out.append("s + ");
+        out.append_uint(meta.atime_nsec);
+        out.append("ns\n    ctime: ");
+        out.append_uint(meta.ctime);
+        out.append("s + ");
+        out.append_uint(meta.ctime_nsec);
+        out.append("ns\n");
     }
 }
 
+void print_report(const SyncStats& stats, OutputFormat format) {
+    std::cout.flush();
+    OutputBuffer out(STDOUT_FILENO);
+    format_report(out, stats, format);
+}
+
+void print_synced_metadata(const std::vector<FileMetadata>& entries, OutputFormat format) {
+    std::cout.flush();
+    OutputBuffer out(STDOUT_FILENO);
+    format_synced_metadata(out, entries, format);
+}
+
 } // namespace mfs
@@ -0,0 +1,73 @@
+#include "live_stats.hpp"
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include <unistd.h>
+
+namespace {
+
+void print_usage(const char* program) {
+    std::cout << "Usage: " << program << " [--prometheus] [--watch=<seconds>] <stats_file|pid>\n"
+              << "  --prometheus        Print counters in Prometheus text exposition format.\n"
+              << "  --watch=<seconds>   Re-read and print every <seconds> until the run finishes.\n"
+              << "  A numeric argument is resolved to /dev/shm/simplesync-<pid>.stats.\n"
+              << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    bool prometheus = false;
+    double watch_seconds = 0.0;
+    std::string target;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--prometheus") {
+            prometheus = true;
+        } else if (arg.rfind("--watch=", 0) == 0) {
+            watch_seconds = std::atof(arg.c_str() + std::string("--watch=").size());
+        } else if (arg == "--help" || arg == "-h") {
+            print_usage(argv[0]);
+            return 0;
+        } else {
+            target = arg;
+        }
+    }
+
+    if (target.empty()) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::filesystem::path file = target;
+    if (target.find_first_not_of("0123456789") == std::string::npos) {
+        file = std::filesystem::path("/dev/shm") / ("simplesync-" + target + ".stats");
+    }
+
+    try {
+        for (;;) {
+            const mfs::LiveStatsSnapshot snapshot = mfs::read_live_stats(file);
+            mfs::OutputBuffer out(STDOUT_FILENO);
+            if (prometheus) {
+                mfs::format_live_stats_prometheus(out, snapshot);
+            } else {
+                mfs::format_live_stats(out, snapshot);
+            }
+            out.flush();
+            if (watch_seconds <= 0.0 || snapshot.finished) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::duration<double>(watch_seconds));
+        }
+    } catch (const std::exception& ex) {
+        std::cerr << "syncstat: " << ex.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,631 @@
+#include "tar.hpp"
+
+#include "buffer_pool.hpp"
+#include "log.hpp"
+#include "output_format.hpp"
+#include "worker_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace mfs {
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr std::size_t kBlock = 512;
+// Pax extended headers larger than this are taken for a corrupt stream.
+constexpr std::uint64_t kMaxPaxHeader = 1 << 20;
+constexpr std::uint64_t kUnknownSize = ~std::uint64_t{0};
+// ImportFile::error of a file whose data the stream did not deliver whole.
+constexpr int kIncomplete = ECANCELED;
+
+// ustar header field offsets and widths.
+constexpr std::size_t kNameOffset = 0, kNameSize = 100;
+constexpr std::size_t kModeOffset = 100;
+constexpr std::size_t kUidOffset = 108;
+constexpr std::size_t kGidOffset = 116;
+constexpr std::size_t kSizeOffset = 124, kSizeSize = 12;
+constexpr std::size_t kMtimeOffset = 136;
+constexpr std::size_t kChecksumOffset = 148;
+constexpr std::size_t kTypeOffset = 156;
+constexpr std::size_t kMagicOffset = 257;
+constexpr std::size_t kPrefixOffset = 345, kPrefixSize = 155;
+constexpr std::size_t kIdSize = 8, kTimeSize = 12;
+
+std::string errno_message(int err) {
+    return std::error_code(err, std::generic_category()).message();
+}
+
+// Returns the bytes read; less than `size` only at end of stream.
+std::size_t read_fully(int fd, char* data, std::size_t size) {
+    std::size_t done = 0;
+    while (done < size) {
+        const ssize_t n = ::read(fd, data + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Tar stream read failed: " + errno_message(errno));
+        }
+        if (n == 0) {
+            break;
+        }
+        done += static_cast<std::size_t>(n);
+    }
+    return done;
+}
+
+std::size_t padding(std::uint64_t size) {
+    return static_cast<std::size_t>((kBlock - size % kBlock) % kBlock);
+}
+
+// Octal, NUL-terminated, in a field of `width` bytes. Returns false if the
+// value does not fit.
+bool put_octal(char* field, std::size_t width, std::uint64_t value) {
+    field[width - 1] = '\0';
+    for (std::size_t i = width - 1; i-- > 0;) {
+        field[i] = static_cast<char>('0' + (value & 7));
+        value >>= 3;
+    }
+    return value == 0;
+}
+
+void append_pax_record(std::string& records, std::string_view key, std::string_view value) {
+    // "<length> key=value\n", where the length counts its own digits.
+    const std::size_t body = 1 + key.size() + 1 + value.size() + 1;
+    std::size_t length = body + 1;
+    while (std::to_string(length).size() + body != length) {
+        ++length;
+    }
+    records += std::to_string(length);
+    records += ' ';
+    records += key;
+    records += '=';
+    records += value;
+    records += '\n';
+}
+
+// Decimal seconds since the epoch. Before it, `seconds` is negative and
+// `nanoseconds` still counts forward from it, as in a timespec.
+std::string pax_time(std::int64_t seconds, std::uint64_t nanoseconds) {
+    std::string text;
+    if (seconds < 0 && nanoseconds != 0) {
+        ++seconds;
+        nanoseconds = 1000000000 - nanoseconds;
+        text = seconds == 0 ? "-0" : std::to_string(seconds);
+    } else {
+        text = std::to_string(seconds);
+    }
+    if (nanoseconds != 0) {
+        std::string fraction = std::to_string(nanoseconds);
+        text += '.';
+        text.append(9 - fraction.size(), '0');
+        text += fraction;
+        while (text.back() == '0') {
+            text.pop_back();
+        }
+    }
+    return text;
+}
+
+void fill_header(char* block, std::string_view name, char type, const FileMetadata& meta, std::uint64_t size,
+                 std::string* records) {
+    std::memset(block, 0, kBlock);
+    std::memcpy(block + kNameOffset, name.data(), std::min(name.size(), kNameSize));
+    put_octal(block + kModeOffset, kIdSize, meta.mode & 07777);
+    if (!put_octal(block + kUidOffset, kIdSize, meta.uid) && records) {
+        put_octal(block + kUidOffset, kIdSize, 0);
+        append_pax_record(*records, "uid", std::to_string(meta.uid));
+    }
+    if (!put_octal(block + kGidOffset, kIdSize, meta.gid) && records) {
+        put_octal(block + kGidOffset, kIdSize, 0);
+        append_pax_record(*records, "gid", std::to_string(meta.gid));
+    }
+    if (!put_octal(block + kSizeOffset, kSizeSize, size) && records) {
+        put_octal(block + kSizeOffset, kSizeSize, 0);
+        append_pax_record(*records, "size", std::to_string(size));
+    }
+    // Sub-second, negative and far-future times go in a pax record.
+    const bool mtime_fits = put_octal(block + kMtimeOffset, kTimeSize, meta.mtime);
+    if ((!mtime_fits || meta.mtime_nsec != 0) && records) {
+        append_pax_record(*records, "mtime", pax_time(static_cast<std::int64_t>(meta.mtime), meta.mtime_nsec));
+    }
+    if (!mtime_fits) {
+        put_octal(block + kMtimeOffset, kTimeSize, 0);
+    }
+    block[kTypeOffset] = type;
+    std::memcpy(block + kMagicOffset, "ustar\0" "00", 8);
+
+    // The checksum is summed with its own field as spaces.
+    std::memset(block + kChecksumOffset, ' ', 8);
+    unsigned sum = 0;
+    for (std::size_t i = 0; i < kBlock; ++i) {
+        sum += static_cast<unsigned char>(block[i]);
+    }
+    put_octal(block + kChecksumOffset, 7, sum);
+    block[kChecksumOffset + 7] = ' ';
+}
+
+// Octal or, with the high bit of the first byte set, GNU base-256.
+std::uint64_t parse_number(const char* field, std::size_t width) {
+    std::uint64_t value = 0;
+    if (static_cast<unsigned char>(field[0]) & 0x80) {
+        for (std::size_t i = 1; i < width; ++i) {
+            value = value << 8 | static_cast<unsigned char>(field[i]);
+        }
+        return value;
+    }
+    std::size_t i = 0;
+    while (i < width && (field[i] == ' ' || field[i] == '\0')) {
+        ++i;
+    }
+    for (; i < width && field[i] >= '0' && field[i] <= '7'; ++i) {
+        value = value << 3 | static_cast<std::uint64_t>(field[i] - '0');
+    }
+    return value;
+}
+
+std::string_view field_text(const char* field, std::size_t width) {
+    return std::string_view(field, ::strnlen(field, width));
+}
+
+// Strips "./" prefixes and trailing slashes. Returns nothing for paths that
+// would leave the destination.
+std::optional<std::string> safe_relative(std::string path) {
+    while (path.compare(0, 2, "./") == 0) {
+        path.erase(0, 2);
+    }
+    while (!path.empty() && path.back() == '/') {
+        path.pop_back();
+    }
+    if (!path.empty() && path.front() == '/') {
+        return std::nullopt;
+    }
+    std::string_view rest = path;
+    while (!rest.empty()) {
+        const std::size_t slash = rest.find('/');
+        const std::string_view part = rest.substr(0, slash);
+        if (part == "..") {
+            return std::nullopt;
+        }
+        rest = slash == std::string_view::npos ? std::string_view() : rest.substr(slash + 1);
+    }
+    return path;
+}
+
+} // namespace
+
+TarWriter::TarWriter(int fd) : fd_(fd) {}
+
+void TarWriter::write(const char* data, std::size_t size) {
+    write_fully(fd_, data, size);
+    bytes_ += size;
+}
+
+void TarWriter::write_header(std::string_view path, char type, const FileMetadata& meta, std::uint64_t size) {
+    std::string records;
+    if (path.size() > kNameSize) {
+        append_pax_record(records, "path", path);
+    }
+    std::array<char, kBlock> block;
+    fill_header(block.data(), path, type, meta, size, &records);
+    if (!records.empty()) {
+        // The extended header goes first and describes the entry after it.
+        std::array<char, kBlock> pax;
+        const std::string_view base = path.substr(path.rfind('/', path.size() - 2) + 1);
+        const std::string name = "PaxHeaders/" + std::string(base.substr(0, kNameSize - 11));
+        fill_header(pax.data(), name, 'x', meta, records.size(), nullptr);
+        write(pax.data(), pax.size());
+        records.append(padding(records.size()), '\0');
+        write(records.data(), records.size());
+    }
+    write(block.data(), block.size());
+}
+
+void TarWriter::add_directory(std::string_view path, const FileMetadata& meta) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    write_header(std::string(path) + '/', '5', meta, 0);
+    ++entries_;
+}
+
+void TarWriter::add_file(std::string_view path, const FileMetadata& meta, const fs::path& source, char* buffer,
+                         std::size_t buffer_bytes, std::ostream* log) {
+    const int fd = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw fs::filesystem_error("cannot open file", source, std::error_code(errno, std::generic_category()));
+    }
+#if defined(POSIX_FADV_SEQUENTIAL)
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    std::lock_guard<std::mutex> lock(mutex_);
+    try {
+        write_header(path, '0', meta, meta.size);
+        std::uint64_t remaining = meta.size;
+        int read_error = 0;
+        while (remaining > 0 && read_error == 0) {
+            const std::size_t want = static_cast<std::size_t>(std::min<std::uint64_t>(remaining, buffer_bytes));
+            const ssize_t n = ::read(fd, buffer, want);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                read_error = n < 0 ? errno : 0;
+                break;
+            }
+            write(buffer, static_cast<std::size_t>(n));
+            remaining -= static_cast<std::uint64_t>(n);
+        }
+        if (remaining > 0) {
+            log_line(log ? *log : std::cerr, "    Warning: ", source,
+                     (read_error ? " could not be read: " : " shrank while read"),
+                     (read_error ? errno_message(read_error) : std::string()), "; padded with ", remaining,
+                     " zero bytes");
+            std::memset(buffer, 0, std::min<std::uint64_t>(remaining, buffer_bytes));
+            while (remaining > 0) {
+                const std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(remaining, buffer_bytes));
+                write(buffer, n);
+                remaining -= n;
+            }
+        }
+        struct stat st {};
+        if (::fstat(fd, &st) == 0 && static_cast<std::uint64_t>(st.st_size) > meta.size) {
+            log_line(log ? *log : std::cerr, "    Warning: ", source, " grew while read; cut at ", meta.size,
+                     " of ", st.st_size, " bytes");
+        }
+        static const char zeros[kBlock] = {};
+        write(zeros, padding(meta.size));
+    } catch (...) {
+        ::close(fd);
+        throw;
+    }
+    ::close(fd);
+    ++entries_;
+}
+
+void TarWriter::finish() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (finished_) {
+        return;
+    }
+    static const char zeros[2 * kBlock] = {};
+    write(zeros, sizeof(zeros));
+    finished_ = true;
+}
+
+std::uint64_t TarWriter::entries() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_;
+}
+
+std::uint64_t TarWriter::bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+}
+
+namespace {
+
+// What the importer shares with the writing threads.
+struct ImportState {
+    std::mutex mutex;
+    SyncStats& stats;
+
+    explicit ImportState(SyncStats& s) : stats(s) {}
+};
+
+// A file being written; the last chunk to finish closes it.
+struct ImportFile {
+    ImportState& state;
+    int fd;
+    fs::path path;
+    mode_t mode;
+    std::uint64_t mtime;
+    std::uint64_t mtime_nsec;
+    std::uint64_t size;
+    std::atomic<int> error{0};
+
+    void fail(int err) {
+        int expected = 0;
+        error.compare_exchange_strong(expected, err);
+    }
+};
+
+void finish_import_file(ImportFile* file) {
+    if (file->error == 0) {
+        const timespec times[2] = {{0, UTIME_OMIT},
+                                   {static_cast<time_t>(file->mtime), static_cast<long>(file->mtime_nsec)}};
+        if (::fchmod(file->fd, file->mode) != 0 || ::futimens(file->fd, times) != 0) {
+            file->fail(errno);
+        }
+    }
+    if (::close(file->fd) != 0) {
+        file->fail(errno);
+    }
+    {
+        std::lock_guard<std::mutex> lock(file->state.mutex);
+        if (file->error == 0) {
+            ++file->state.stats.files_copied;
+            file->state.stats.bytes_copied += file->size;
+            std::cout << "    Extracted file: " << file->path << " (" << file->size << " bytes)" << std::endl;
+        } else {
+            // Never left behind looking complete: no mode, no mtime.
+            ++file->state.stats.files_skipped;
+            std::cerr << "    Warning: failed to write " << file->path << ": "
+                      << (file->error == kIncomplete ? "incomplete in the tar stream" : errno_message(file->error))
+                      << std::endl;
+            std::error_code ec;
+            fs::remove(file->path, ec);
+        }
+    }
+    delete file;
+}
+
+// Removes whatever is at `path` unless it is of the wanted kind.
+void clear_path(const fs::path& path, bool directory) {
+    struct stat st {};
+    if (::lstat(path.c_str(), &st) != 0) {
+        return;
+    }
+    if (directory ? S_ISDIR(st.st_mode) : S_ISREG(st.st_mode)) {
+        return;
+    }
+    std::cout << "    Destination entry is of another type (will replace): " << path << std::endl;
+    fs::remove_all(path);
+}
+
+} // namespace
+
+TarImporter::TarImporter(TarImportOptions options) : options_(options) {}
+
+SyncStats TarImporter::apply(int fd, const fs::path& destination) {
+    const auto start = Clock::now();
+    SyncStats stats;
+    fs::create_directories(destination);
+
+    ImportState state(stats);
+    const std::size_t workers = std::max<std::size_t>(options_.workers, 1);
+    BufferPool buffers(workers + 2, std::max<std::size_t>(options_.buffer_bytes, kBlock));
+    WorkerPool writers(workers, workers * 2);
+    // Applied once everything is written, so read-only directories can
+    // still be filled.
+    std::vector<std::pair<fs::path, FileMetadata>> directories;
+
+    std::array<char, kBlock> block;
+    std::vector<char> scratch;
+    auto read_data = [&](std::uint64_t size) -> std::string {
+        std::string data(static_cast<std::size_t>(size), '\0');
+        if (read_fully(fd, data.data(), data.size()) != data.size()) {
+            throw std::runtime_error("Tar stream ended inside an entry");
+        }
+        stats.archive_bytes += size;
+        return data;
+    };
+    auto skip = [&](std::uint64_t size) {
+        scratch.resize(64 * 1024);
+        while (size > 0) {
+            const std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(size, scratch.size()));
+            if (read_fully(fd, scratch.data(), n) != n) {
+                throw std::runtime_error("Tar stream ended inside an entry");
+            }
+            stats.archive_bytes += n;
+            size -= n;
+        }
+    };
+
+    // Overrides from a pax extended header or GNU long name, for the next entry.
+    std::optional<std::string> next_path;
+    // kUnknownSize when the header's size field applies.
+    std::uint64_t next_size = kUnknownSize;
+    std::optional<std::pair<std::uint64_t, std::uint64_t>> next_mtime;
+
+    for (;;) {
+        const std::size_t got = read_fully(fd, block.data(), block.size());
+        if (got == 0) {
+            break;
+        }
+        if (got != block.size()) {
+            throw std::runtime_error("Tar stream ended inside a header");
+        }
+        stats.archive_bytes += got;
+        if (std::all_of(block.begin(), block.end(), [](char c) { return c == '\0'; })) {
+            // End of archive; the second zero block is optional.
+            stats.archive_bytes += read_fully(fd, block.data(), block.size());
+            break;
+        }
+        unsigned sum = 0;
+        for (std::size_t i = 0; i < kBlock; ++i) {
+            const bool in_checksum = i >= kChecksumOffset && i < kChecksumOffset + 8;
+            sum += in_checksum ? ' ' : static_cast<unsigned char>(block[i]);
+        }
+        if (sum != parse_number(block.data() + kChecksumOffset, 8)) {
+            throw std::runtime_error("Malformed tar header (checksum mismatch)");
+        }
+
+        const char type = block[kTypeOffset];
+        const std::uint64_t size =
+            next_size != kUnknownSize ? next_size : parse_number(block.data() + kSizeOffset, kSizeSize);
+        if (type == 'x' || type == 'g' || type == 'L') {
+            if (size > kMaxPaxHeader) {
+                throw std::runtime_error("Malformed tar stream (oversized extended header)");
+            }
+            const std::string data = read_data(size);
+            skip(padding(size));
+            if (type == 'L') {
+                next_path = std::string(data.c_str());
+                continue;
+            }
+            if (type == 'g') {
+                continue;
+            }
+            for (std::size_t pos = 0; pos < data.size();) {
+                const std::size_t space = data.find(' ', pos);
+                const std::uint64_t length = std::strtoull(data.c_str() + pos, nullptr, 10);
+                if (space == std::string::npos || length == 0 || pos + length > data.size()) {
+                    throw std::runtime_error("Malformed pax extended header");
+                }
+                const std::string record = data.substr(space + 1, pos + length - space - 2);
+                pos += static_cast<std::size_t>(length);
+                const std::size_t equals = record.find('=');
+                if (equals == std::string::npos) {
+                    continue;
+                }
+                const std::string key = record.substr(0, equals);
+                const std::string value = record.substr(equals + 1);
+                if (key == "path") {
+                    next_path = value;
+                } else if (key == "size") {
+                    next_size = std::strtoull(value.c_str(), nullptr, 10);
+                } else if (key == "mtime") {
+                    char* end = nullptr;
+                    std::int64_t seconds = std::strtoll(value.c_str(), &end, 10);
+                    std::uint64_t nanoseconds = 0;
+                    if (*end == '.') {
+                        std::string digits = std::string(end + 1).substr(0, 9);
+                        digits.append(9 - digits.size(), '0');
+                        nanoseconds = std::strtoull(digits.c_str(), nullptr, 10);
+                    }
+                    if (!value.empty() && value.front() == '-' && nanoseconds != 0) {
+                        // Back to a timespec: -1.25 is -2 s plus 0.75 s.
+                        --seconds;
+                        nanoseconds = 1000000000 - nanoseconds;
+                    }
+                    next_mtime.emplace(static_cast<std::uint64_t>(seconds), nanoseconds);
+                }
+            }
+            continue;
+        }
+
+        std::string name;
+        if (next_path) {
+            name = std::move(*next_path);
+        } else {
+            const std::string_view prefix = field_text(block.data() + kPrefixOffset, kPrefixSize);
+            if (std::memcmp(block.data() + kMagicOffset, "ustar", 5) == 0 && !prefix.empty()) {
+                name.assign(prefix);
+                name += '/';
+            }
+            name += field_text(block.data() + kNameOffset, kNameSize);
+        }
+        FileMetadata meta;
+        meta.mode = parse_number(block.data() + kModeOffset, kIdSize) & 07777;
+        meta.size = size;
+        if (next_mtime) {
+            meta.mtime = next_mtime->first;
+            meta.mtime_nsec = next_mtime->second;
+        } else {
+            meta.mtime = parse_number(block.data() + kMtimeOffset, kTimeSize);
+        }
+        next_path.reset();
+        next_size = kUnknownSize;
+        next_mtime.reset();
+        ++stats.entries_scanned;
+
+        const std::optional<std::string> relative = safe_relative(name);
+        const bool directory = type == '5';
+        const bool regular = type == '0' || type == '\0' || type == '7';
+        if (!relative || (!directory && !regular) || (relative->empty() && !directory)) {
+            std::cerr << "    Warning: skipping " << (relative ? "unsupported" : "unsafe") << " tar entry: " << name
+                      << std::endl;
+            ++stats.files_skipped;
+            skip(size + padding(size));
+            continue;
+        }
+        const fs::path target = relative->empty() ? destination : destination / *relative;
+
+        if (directory) {
+            skip(size + padding(size));
+            clear_path(target, true);
+            if (fs::create_directories(target)) {
+                ++stats.directories_created;
+                std::cout << "    Created directory: " << target << std::endl;
+            }
+            directories.emplace_back(target, meta);
+            continue;
+        }
+
+        clear_path(target, false);
+        int out = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if (out < 0 && errno == ENOENT) {
+            std::error_code ec;
+            fs::create_directories(target.parent_path(), ec);
+            out = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        }
+        if (out < 0) {
+            std::cerr << "    Warning: failed to create " << target << ": " << errno_message(errno) << std::endl;
+            skip(size + padding(size));
+            continue;
+        }
+        std::shared_ptr<ImportFile> file(
+            new ImportFile{state, out, target, static_cast<mode_t>(meta.mode), meta.mtime, meta.mtime_nsec, size},
+            finish_import_file);
+        // Chunks go to the writers as they arrive; the pool bounds how many
+        // are in memory at once. If the stream ends inside the file, it is
+        // removed rather than finished.
+        try {
+            for (std::uint64_t offset = 0; offset < size;) {
+                auto lease = std::make_shared<BufferPool::Lease>(buffers.acquire());
+                const std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(size - offset, lease->size()));
+                if (read_fully(fd, lease->data(), n) != n) {
+                    throw std::runtime_error("Tar stream ended inside an entry");
+                }
+                stats.archive_bytes += n;
+                writers.submit([file, lease, offset, n](std::size_t) {
+                    std::size_t done = 0;
+                    while (done < n && file->error == 0) {
+                        const ssize_t written = ::pwrite(file->fd, lease->data() + done, n - done,
+                                                         static_cast<off_t>(offset + done));
+                        if (written < 0) {
+                            if (errno != EINTR) {
+                                file->fail(errno);
+                            }
+                            continue;
+                        }
+                        done += static_cast<std::size_t>(written);
+                    }
+                });
+                offset += n;
+            }
+        } catch (...) {
+            file->fail(kIncomplete);
+            throw;
+        }
+        file.reset();
+        skip(padding(size));
+    }
+    writers.wait_idle();
+
+    // Deepest first, so a parent's mtime is set after its children.
+    for (auto it = directories.rbegin(); it != directories.rend(); ++it) {
+        const FileMetadata& meta = it->second;
+        const timespec times[2] = {{0, UTIME_OMIT},
+                                   {static_cast<time_t>(meta.mtime), static_cast<long>(meta.mtime_nsec)}};
+        if (::chmod(it->first.c_str(), static_cast<mode_t>(meta.mode)) != 0 ||
+            ::utimensat(AT_FDCWD, it->first.c_str(), times, 0) != 0) {
+            std::cerr << "    Warning: failed to set attributes of " << it->first << ": " << errno_message(errno)
+                      << std::endl;
+        }
+    }
+    stats.buffer_pool = buffers.stats();
+    stats.copy_elapsed = Clock::now() - start;
+    stats.total_elapsed = stats.copy_elapsed;
+    return stats;
+}
+
+} // namespace mfs
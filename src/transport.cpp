@@ -0,0 +1,1540 @@
+#include "transport.hpp"
+
+#include "arena.hpp"
+#include "dir_reader.hpp"
+#include "flat_hash.hpp"
+#include "lz.hpp"
+#include "worker_pool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace mfs {
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+constexpr std::uint8_t kEntryFile = 0;
+constexpr std::uint8_t kEntryDirectory = 1;
+constexpr std::uint64_t kFlagRemoveExtraneous = 1;
+// Wanted files queued on the sender before it stops walking to send data.
+constexpr std::size_t kMaxPendingFiles = 4096;
+// Chunks whose byte sample has more bits per byte than this only go to the
+// codec if a trial on their first kTrialBytes shrinks.
+constexpr double kIncompressibleEntropy = 7.5;
+constexpr std::size_t kTrialBytes = 8 * 1024;
+
+std::string errno_message(int err) {
+    return std::error_code(err, std::generic_category()).message();
+}
+
+// A flat byte histogram means either compressed or encrypted data, or data
+// whose redundancy lies in repeats rather than byte frequencies; compressing
+// a small sample tells the two apart. `scratch` must hold
+// lz_compress_bound(size) bytes.
+bool worth_compressing(const char* data, std::size_t size, char* scratch) {
+    if (sample_entropy(data, size) <= kIncompressibleEntropy) {
+        return true;
+    }
+    const std::size_t trial = std::min(size, kTrialBytes);
+    return lz_compress(data, trial, scratch) < trial - trial / 32;
+}
+
+double thread_cpu_seconds() {
+    timespec now{};
+    ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return static_cast<double>(now.tv_sec) + static_cast<double>(now.tv_nsec) / 1e9;
+}
+
+void write_fully(int fd, iovec* parts, int count) {
+    while (count > 0) {
+        const ssize_t written = ::writev(fd, parts, count);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EPIPE) {
+                throw std::runtime_error("Transport peer closed the stream");
+            }
+            throw std::runtime_error("Transport write failed: " + errno_message(errno));
+        }
+        auto remaining = static_cast<std::size_t>(written);
+        while (count > 0 && remaining >= parts->iov_len) {
+            remaining -= parts->iov_len;
+            ++parts;
+            --count;
+        }
+        if (count > 0) {
+            parts->iov_base = static_cast<char*>(parts->iov_base) + remaining;
+            parts->iov_len -= remaining;
+        }
+    }
+}
+
+// Reads exactly `size` bytes; returns false on end of stream before the
+// first byte.
+bool read_fully(int fd, char* data, std::size_t size) {
+    std::size_t done = 0;
+    while (done < size) {
+        const ssize_t n = ::read(fd, data + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error("Transport read failed: " + errno_message(errno));
+        }
+        if (n == 0) {
+            if (done == 0) {
+                return false;
+            }
+            throw std::runtime_error("Transport stream ended inside a frame");
+        }
+        done += static_cast<std::size_t>(n);
+    }
+    return true;
+}
+
+void read_exactly(int fd, char* data, std::size_t size) {
+    if (size > 0 && !read_fully(fd, data, size)) {
+        throw std::runtime_error("Transport stream ended inside a frame");
+    }
+}
+
+void write_all(int fd, const char* data, std::size_t size) {
+    iovec part{const_cast<char*>(data), size};
+    write_fully(fd, &part, 1);
+}
+
+// Errors meaning a descriptor cannot take part in splice(2) at all, as
+// opposed to an I/O error on it.
+bool splice_refused(int err) {
+    return err == EINVAL || err == ENOSYS || err == EOPNOTSUPP;
+}
+
+// A pipe that file data passes through on its way between a file and the
+// stream: splice(2) needs a pipe on one side, and moving pages into and out
+// of one only shuffles page references. Invalid where splice is missing.
+class SplicePipe {
+public:
+    explicit SplicePipe(std::size_t bytes) {
+#if defined(__linux__)
+        int fds[2];
+        if (::pipe2(fds, O_CLOEXEC) != 0) {
+            return;
+        }
+        read_end_ = fds[0];
+        write_end_ = fds[1];
+        // Larger pipes need privileges past /proc/sys/fs/pipe-max-size; keep
+        // whatever size we get.
+        ::fcntl(write_end_, F_SETPIPE_SZ, static_cast<int>(std::min<std::size_t>(bytes, 1 << 30)));
+        const int size = ::fcntl(write_end_, F_GETPIPE_SZ);
+        capacity_ = size > 0 ? static_cast<std::size_t>(size) : 64 * 1024;
+#else
+        (void)bytes;
+#endif
+    }
+
+    ~SplicePipe() {
+        for (const int fd : {read_end_, write_end_}) {
+            if (fd >= 0) {
+                ::close(fd);
+            }
+        }
+    }
+
+    SplicePipe(const SplicePipe&) = delete;
+    SplicePipe& operator=(const SplicePipe&) = delete;
+
+    bool valid() const { return read_end_ >= 0; }
+    std::size_t capacity() const { return capacity_; }
+
+    // Moves up to `size` bytes (at most capacity()) from `from` into the
+    // empty pipe. Returns the bytes moved, 0 at end of file, or -1 with
+    // errno set.
+    ssize_t fill(int from, std::size_t size) {
+#if defined(__linux__)
+        for (;;) {
+            const ssize_t n = ::splice(from, nullptr, write_end_, nullptr, std::min(size, capacity_), SPLICE_F_MOVE);
+            if (n >= 0 || errno != EINTR) {
+                return n;
+            }
+        }
+#else
+        (void)from;
+        (void)size;
+        errno = ENOSYS;
+        return -1;
+#endif
+    }
+
+    // Moves `size` bytes from the pipe to `to`. Returns the bytes moved; less
+    // than `size` on error, with errno set and the rest left in the pipe.
+    std::size_t drain(int to, std::size_t size) {
+        std::size_t moved = 0;
+#if defined(__linux__)
+        while (moved < size) {
+            const ssize_t n = ::splice(read_end_, nullptr, to, nullptr, size - moved, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            moved += static_cast<std::size_t>(n);
+        }
+#else
+        (void)to;
+        errno = ENOSYS;
+#endif
+        return moved;
+    }
+
+    // Takes bytes left by a failed drain() back into user space.
+    void read_back(char* data, std::size_t size) { read_exactly(read_end_, data, size); }
+
+private:
+    int read_end_{-1};
+    int write_end_{-1};
+    std::size_t capacity_{0};
+};
+
+void write_hello(FrameWriter& writer, std::uint64_t flags) {
+    WireWriter hello;
+    hello.put_varint(kTransportVersion);
+    hello.put_varint(flags);
+    writer.write(FrameType::hello, hello.view());
+}
+
+std::uint64_t read_hello(const Frame& frame) {
+    if (frame.type != FrameType::hello) {
+        throw std::runtime_error("Transport peer did not start with a hello frame");
+    }
+    WireReader hello(frame.payload);
+    const std::uint64_t version = hello.get_varint();
+    if (version != kTransportVersion) {
+        throw std::runtime_error("Unsupported transport protocol version " + std::to_string(version));
+    }
+    return hello.get_varint();
+}
+
+// Relative paths from the stream must stay below the destination.
+void check_relative_path(std::string_view path) {
+    bool safe = !path.empty() && path.front() != '/';
+    while (safe && !path.empty()) {
+        const std::size_t slash = path.find('/');
+        const std::string_view part = path.substr(0, slash);
+        safe = !part.empty() && part != "." && part != "..";
+        path = slash == std::string_view::npos ? std::string_view() : path.substr(slash + 1);
+    }
+    if (!safe) {
+        throw std::runtime_error("Unsafe path in transport stream");
+    }
+}
+
+// A count of varints to follow, each at least one byte: anything larger
+// than what is left of the payload is malformed, not a size to allocate.
+std::size_t get_count(WireReader& payload) {
+    const std::uint64_t count = payload.get_varint();
+    if (count > payload.rest().size()) {
+        throw std::runtime_error("Malformed transport frame");
+    }
+    return static_cast<std::size_t>(count);
+}
+
+// "a/b/c" -> {"a/b", "c"}; "c" -> {"", "c"}. The name is a suffix of
+// `path`, so it stays NUL-terminated when `path` is.
+std::pair<std::string_view, std::string_view> split_parent(std::string_view path) {
+    const std::size_t slash = path.rfind('/');
+    if (slash == std::string_view::npos) {
+        return {std::string_view(), path};
+    }
+    return {path.substr(0, slash), path.substr(slash + 1)};
+}
+
+// Opens the directory `relative` below `root_fd` one component at a time,
+// never following a symlink, so one planted in the destination cannot lead
+// outside it. Missing components are created when `create` is set. Returns
+// -1 with errno set; ELOOP or ENOTDIR where a component is no directory.
+int open_directory_beneath(int root_fd, std::string_view relative, bool create) {
+    int fd = ::openat(root_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    while (fd >= 0 && !relative.empty()) {
+        const std::size_t slash = relative.find('/');
+        const std::string part(relative.substr(0, slash));
+        relative = slash == std::string_view::npos ? std::string_view() : relative.substr(slash + 1);
+        int next = ::openat(fd, part.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (next < 0 && errno == ENOENT && create && (::mkdirat(fd, part.c_str(), 0777) == 0 || errno == EEXIST)) {
+            next = ::openat(fd, part.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        }
+        const int err = errno;
+        ::close(fd);
+        fd = next;
+        errno = err;
+    }
+    return fd;
+}
+
+// Removes `name` in `dir_fd` and, if it is a directory, everything below
+// it, without following symlinks.
+void remove_beneath(int dir_fd, const char* name) {
+    if (::unlinkat(dir_fd, name, 0) == 0 || (errno != EISDIR && errno != EPERM)) {
+        return;
+    }
+    const int fd = ::openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    DIR* dir = ::fdopendir(fd);
+    if (dir == nullptr) {
+        ::close(fd);
+        return;
+    }
+    std::vector<std::string> names;
+    while (const dirent* entry = ::readdir(dir)) {
+        if (std::strcmp(entry->d_name, ".") != 0 && std::strcmp(entry->d_name, "..") != 0) {
+            names.emplace_back(entry->d_name);
+        }
+    }
+    for (const std::string& child : names) {
+        remove_beneath(::dirfd(dir), child.c_str());
+    }
+    ::closedir(dir);
+    ::unlinkat(dir_fd, name, AT_REMOVEDIR);
+}
+
+std::string join(std::string_view directory, std::string_view name) {
+    std::string path;
+    path.reserve(directory.size() + 1 + name.size());
+    path.append(directory);
+    if (!directory.empty()) {
+        path.push_back('/');
+    }
+    path.append(name);
+    return path;
+}
+
+class SenderSession {
+public:
+    SenderSession(int in_fd, int out_fd, const TransportOptions& options, const fs::path& source, SyncStats& stats)
+        : reader_(in_fd), writer_(out_fd), options_(options), source_(source), stats_(stats),
+          chunk_(std::clamp<std::size_t>(options.chunk_bytes, 4096, kMaxFramePayload / 2)) {
+        if (options.compress) {
+            const std::size_t threads = options.compress_threads > 0
+                                            ? options.compress_threads
+                                            : std::max(1u, std::thread::hardware_concurrency());
+            codec_pool_.emplace(threads, threads * 2);
+        } else if (options.zero_copy) {
+            splice_.emplace(chunk_.size());
+            if (!splice_->valid()) {
+                splice_.reset();
+            }
+        }
+    }
+
+    ~SenderSession() {
+        for (const InFlight& file : in_flight_) {
+            ::close(file.fd);
+        }
+    }
+
+    void run();
+
+private:
+    struct SentBatch {
+        std::uint64_t first_id;
+        std::vector<std::string> paths;
+    };
+    struct Wanted {
+        std::uint64_t id;
+        std::string path;
+    };
+    struct InFlight {
+        std::uint64_t id;
+        int fd;
+        std::uint64_t sent;
+        std::string path;
+        // Cleared for files whose filesystem cannot splice.
+        bool splice{true};
+    };
+
+    FrameReader reader_;
+    FrameWriter writer_;
+    const TransportOptions& options_;
+    const fs::path& source_;
+    SyncStats& stats_;
+
+    // Shared with the reader thread.
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<std::vector<std::uint64_t>> wants_;
+    std::vector<std::uint64_t> summary_;
+    bool summary_received_{false};
+    bool peer_finished_{false};
+    std::string peer_error_;
+
+    // Main thread only.
+    WireWriter batch_;
+    std::size_t batch_count_{0};
+    std::uint64_t next_id_{0};
+    SentBatch open_batch_{0, {}};
+    std::deque<SentBatch> unanswered_;
+    std::deque<Wanted> pending_;
+    std::vector<InFlight> in_flight_;
+    std::vector<char> chunk_;
+    WireWriter prefix_;
+    // Unset without zero copy, or once the stream refused a splice.
+    std::optional<SplicePipe> splice_;
+    // With compression: the threads and the chunks of the current round.
+    struct Chunk {
+        std::size_t file{0};
+        std::vector<char> raw;
+        std::size_t size{0};
+        std::vector<char> packed;
+        std::size_t packed_size{0};
+        bool skipped{false};
+        double codec_seconds{0.0};
+    };
+    std::optional<WorkerPool> codec_pool_;
+    std::vector<Chunk> chunks_;
+    // Per file in flight after a round: -1 open, 0 at end, else errno.
+    std::vector<int> read_status_;
+
+    void read_loop();
+    void walk();
+    void add_entry(std::uint8_t kind, const struct stat& st, std::string path);
+    void flush_batch();
+    bool pump();
+    ssize_t send_chunk(InFlight& file);
+    void send_compressed_round();
+    void wait_for_peer();
+    void check_peer();
+    void abort_file(std::uint64_t id, const std::string& path, int err);
+};
+
+void SenderSession::read_loop() {
+    Frame frame;
+    try {
+        if (!reader_.read(frame)) {
+            throw std::runtime_error("Receiver closed the stream before its hello");
+        }
+        read_hello(frame);
+        while (reader_.read(frame)) {
+            WireReader payload(frame.payload);
+            if (frame.type == FrameType::want) {
+                std::vector<std::uint64_t> ids(get_count(payload));
+                for (std::uint64_t& id : ids) {
+                    id = payload.get_varint();
+                }
+                std::lock_guard<std::mutex> lock(mutex_);
+                wants_.push_back(std::move(ids));
+            } else if (frame.type == FrameType::summary) {
+                std::vector<std::uint64_t> counters(get_count(payload));
+                for (std::uint64_t& counter : counters) {
+                    counter = payload.get_varint();
+                }
+                std::lock_guard<std::mutex> lock(mutex_);
+                summary_ = std::move(counters);
+                summary_received_ = true;
+                break;
+            } else if (frame.type == FrameType::error) {
+                throw std::runtime_error("Receiver failed: " + std::string(payload.get_string()));
+            } else {
+                throw std::runtime_error("Unexpected frame from receiver");
+            }
+            changed_.notify_all();
+        }
+    } catch (const std::exception& ex) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        peer_error_ = ex.what();
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        peer_finished_ = true;
+    }
+    changed_.notify_all();
+}
+
+void SenderSession::run() {
+    write_hello(writer_, options_.remove_extraneous ? kFlagRemoveExtraneous : 0);
+    std::thread reader([this] { read_loop(); });
+    try {
+        const auto walk_start = Clock::now();
+        walk();
+        flush_batch();
+        stats_.scan_elapsed = Clock::now() - walk_start;
+
+        const auto data_start = Clock::now();
+        while (!unanswered_.empty() || !pending_.empty() || !in_flight_.empty()) {
+            if (!pump()) {
+                std::unique_lock<std::mutex> lock(mutex_);
+                changed_.wait(lock, [this] { return !wants_.empty() || peer_finished_; });
+                if (wants_.empty()) {
+                    lock.unlock();
+                    check_peer();
+                    throw std::runtime_error("Receiver closed the stream early");
+                }
+            }
+        }
+        stats_.copy_elapsed = Clock::now() - data_start;
+        writer_.write(FrameType::done, {});
+        wait_for_peer();
+    } catch (const std::exception& ex) {
+        // Tell the receiver, so that it stops and closes its end, which
+        // ends the reader thread.
+        try {
+            WireWriter message;
+            message.put_string(ex.what());
+            writer_.write(FrameType::error, message.view());
+        } catch (const std::exception&) {
+        }
+        reader.join();
+        throw;
+    }
+    reader.join();
+    check_peer();
+
+    // Counters in the order SyncReceiver sends them.
+    std::size_t* const counters[] = {&stats_.files_copied, &stats_.files_skipped, &stats_.files_deleted,
+                                     &stats_.directories_created};
+    for (std::size_t i = 0; i < std::size(counters) && i < summary_.size(); ++i) {
+        *counters[i] = static_cast<std::size_t>(summary_[i]);
+    }
+    if (summary_.size() > std::size(counters)) {
+        stats_.bytes_copied = summary_[std::size(counters)];
+    }
+    stats_.transport.frames_sent = writer_.frames();
+    stats_.transport.bytes_sent = writer_.bytes();
+    stats_.transport.frames_received = reader_.frames();
+    stats_.transport.bytes_received = reader_.bytes();
+}
+
+void SenderSession::walk() {
+    BumpArena arena;
+    std::vector<std::string> stack{std::string()};
+    std::vector<std::string> subdirs;
+    while (!stack.empty()) {
+        const std::string relative = std::move(stack.back());
+        stack.pop_back();
+        const fs::path directory = relative.empty() ? source_ : source_ / relative;
+
+        ArenaScope directory_scope(arena);
+        DirectoryReader reader(directory, arena);
+        ArenaVector<DirEntryName> batch{ArenaAllocator<DirEntryName>(arena)};
+        while (reader.next_batch(batch)) {
+            for (const DirEntryName& entry : batch) {
+                std::string path = join(relative, entry.name);
+                const std::string full = (source_ / path).string();
+                struct stat st {};
+                if (::lstat(full.c_str(), &st) != 0) {
+                    std::cerr << "    Error: lstat failed for " << full << ": " << std::strerror(errno) << std::endl;
+                    continue;
+                }
+                ++stats_.entries_scanned;
+                if (S_ISLNK(st.st_mode)) {
+                    std::cout << "    Skipping symlink: " << full << std::endl;
+                } else if (S_ISDIR(st.st_mode)) {
+                    subdirs.push_back(path);
+                    add_entry(kEntryDirectory, st, std::move(path));
+                } else if (S_ISREG(st.st_mode)) {
+                    add_entry(kEntryFile, st, std::move(path));
+                } else {
+                    std::cout << "    Skipping non-regular entry: " << full << std::endl;
+                }
+            }
+        }
+        if (reader.error()) {
+            std::cerr << "    Warning: failed to read directory " << directory << ": " << reader.error().message()
+                      << std::endl;
+        }
+        // Depth first, in listing order.
+        stack.insert(stack.end(), std::make_move_iterator(subdirs.rbegin()), std::make_move_iterator(subdirs.rend()));
+        subdirs.clear();
+    }
+}
+
+void SenderSession::add_entry(std::uint8_t kind, const struct stat& st, std::string path) {
+    if (batch_count_ == 0) {
+        open_batch_.first_id = next_id_;
+    }
+#if defined(__APPLE__) || defined(__MACH__)
+    const auto mtime = st.st_mtimespec;
+#else
+    const auto mtime = st.st_mtim;
+#endif
+    batch_.put_u8(kind);
+    batch_.put_varint(static_cast<std::uint64_t>(st.st_mode & 07777));
+    batch_.put_varint(kind == kEntryFile ? static_cast<std::uint64_t>(st.st_size) : 0);
+    batch_.put_varint(static_cast<std::uint64_t>(mtime.tv_sec));
+    batch_.put_varint(static_cast<std::uint64_t>(mtime.tv_nsec));
+    batch_.put_string(path);
+    open_batch_.paths.push_back(kind == kEntryFile ? std::move(path) : std::string());
+    ++next_id_;
+    if (++batch_count_ >= options_.batch_entries) {
+        flush_batch();
+        // Keep data moving while walking, but stop walking ahead when too
+        // many wanted files are waiting.
+        pump();
+        while (pending_.size() > kMaxPendingFiles) {
+            pump();
+        }
+    }
+}
+
+void SenderSession::flush_batch() {
+    if (batch_count_ == 0) {
+        return;
+    }
+    WireWriter header;
+    header.put_varint(open_batch_.first_id);
+    header.put_varint(batch_count_);
+    writer_.write(FrameType::entries, header.view(), batch_.view());
+    unanswered_.push_back(std::move(open_batch_));
+    open_batch_ = SentBatch{next_id_, {}};
+    batch_.clear();
+    batch_count_ = 0;
+}
+
+// One round: takes the wants that arrived, opens wanted files up to the
+// in-flight limit and sends one chunk of each open file. Returns false if
+// there was nothing to do.
+bool SenderSession::pump() {
+    check_peer();
+    bool progress = false;
+    for (;;) {
+        std::vector<std::uint64_t> ids;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (wants_.empty()) {
+                break;
+            }
+            ids = std::move(wants_.front());
+            wants_.pop_front();
+        }
+        if (unanswered_.empty()) {
+            throw std::runtime_error("Receiver sent more wants than entry batches");
+        }
+        // Wants answer the entry batches in order.
+        SentBatch& batch = unanswered_.front();
+        for (const std::uint64_t id : ids) {
+            if (id < batch.first_id || id - batch.first_id >= batch.paths.size() ||
+                batch.paths[id - batch.first_id].empty()) {
+                throw std::runtime_error("Receiver wanted an unknown file");
+            }
+            pending_.push_back(Wanted{id, std::move(batch.paths[id - batch.first_id])});
+        }
+        unanswered_.pop_front();
+        progress = true;
+    }
+
+    while (in_flight_.size() < std::max<std::size_t>(options_.files_in_flight, 1) && !pending_.empty()) {
+        Wanted wanted = std::move(pending_.front());
+        pending_.pop_front();
+        const std::string full = (source_ / wanted.path).string();
+        const int fd = ::open(full.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            abort_file(wanted.id, full, errno);
+        } else {
+#if defined(POSIX_FADV_SEQUENTIAL)
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+            in_flight_.push_back(InFlight{wanted.id, fd, 0, std::move(full)});
+            stats_.transport.peak_files_in_flight =
+                std::max(stats_.transport.peak_files_in_flight, in_flight_.size());
+        }
+        progress = true;
+    }
+
+    if (codec_pool_) {
+        if (!in_flight_.empty()) {
+            send_compressed_round();
+            progress = true;
+        }
+        return progress;
+    }
+    for (std::size_t i = 0; i < in_flight_.size();) {
+        InFlight& file = in_flight_[i];
+        const ssize_t n = send_chunk(file);
+        if (n > 0) {
+            file.sent += static_cast<std::uint64_t>(n);
+            ++i;
+        } else {
+            if (n < 0) {
+                abort_file(file.id, file.path, errno);
+            } else {
+                prefix_.clear();
+                prefix_.put_varint(file.id);
+                prefix_.put_varint(file.sent);
+                writer_.write(FrameType::file_end, prefix_.view());
+            }
+            ::close(file.fd);
+            in_flight_.erase(in_flight_.begin() + static_cast<std::ptrdiff_t>(i));
+        }
+        progress = true;
+    }
+    return progress;
+}
+
+// Sends the next chunk of `file` as a data frame. Returns its size, 0 at end
+// of file, or -1 with errno set if the file could not be read.
+ssize_t SenderSession::send_chunk(InFlight& file) {
+    prefix_.clear();
+    prefix_.put_varint(file.id);
+    if (splice_ && file.splice) {
+        // The page references go into the pipe first, so the frame header
+        // can carry the size actually read.
+        const ssize_t n = splice_->fill(file.fd, chunk_.size());
+        if (n > 0) {
+            const auto size = static_cast<std::size_t>(n);
+            writer_.write_header(FrameType::data, prefix_.view(), size);
+            const std::size_t moved = splice_->drain(writer_.fd(), size);
+            stats_.transport.bytes_spliced += moved;
+            if (moved < size) {
+                const int err = errno;
+                if (err == EPIPE) {
+                    throw std::runtime_error("Transport peer closed the stream");
+                }
+                if (!splice_refused(err)) {
+                    throw std::runtime_error("Transport write failed: " + errno_message(err));
+                }
+                // The stream cannot be spliced to; finish this frame from a
+                // buffer and stop splicing.
+                splice_->read_back(chunk_.data(), size - moved);
+                write_all(writer_.fd(), chunk_.data(), size - moved);
+                splice_.reset();
+            }
+            return n;
+        }
+        if (n == 0 || !splice_refused(errno)) {
+            return n;
+        }
+        file.splice = false;
+    }
+    for (;;) {
+        const ssize_t n = ::read(file.fd, chunk_.data(), chunk_.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n > 0) {
+            writer_.write(FrameType::data, prefix_.view(), std::string_view(chunk_.data(), static_cast<std::size_t>(n)));
+        }
+        return n;
+    }
+}
+
+// Reads chunks from every file in flight, enough to keep the codec threads
+// busy, compresses them in parallel, then sends them in order and finishes
+// the files that ran out.
+void SenderSession::send_compressed_round() {
+    const std::size_t files = in_flight_.size();
+    const std::size_t per_file = std::max<std::size_t>(1, (codec_pool_->size() + files - 1) / files);
+    read_status_.assign(files, -1);
+    std::size_t count = 0;
+    for (std::size_t f = 0; f < files; ++f) {
+        for (std::size_t k = 0; k < per_file; ++k) {
+            if (chunks_.size() == count) {
+                chunks_.emplace_back();
+            }
+            Chunk& chunk = chunks_[count];
+            chunk.raw.resize(chunk_.size());
+            ssize_t n;
+            do {
+                n = ::read(in_flight_[f].fd, chunk.raw.data(), chunk.raw.size());
+            } while (n < 0 && errno == EINTR);
+            if (n <= 0) {
+                read_status_[f] = n < 0 ? errno : 0;
+                break;
+            }
+            chunk.file = f;
+            chunk.size = static_cast<std::size_t>(n);
+            ++count;
+        }
+    }
+
+    for (std::size_t i = 0; i < count; ++i) {
+        codec_pool_->submit([&chunk = chunks_[i]](std::size_t) {
+            const double start = thread_cpu_seconds();
+            chunk.packed.resize(lz_compress_bound(chunk.size));
+            chunk.skipped = !worth_compressing(chunk.raw.data(), chunk.size, chunk.packed.data());
+            chunk.packed_size = 0;
+            if (!chunk.skipped) {
+                chunk.packed_size = lz_compress(chunk.raw.data(), chunk.size, chunk.packed.data());
+            }
+            chunk.codec_seconds = thread_cpu_seconds() - start;
+        });
+    }
+    codec_pool_->wait_idle();
+
+    TransportStats& transport = stats_.transport;
+    for (std::size_t i = 0; i < count; ++i) {
+        const Chunk& chunk = chunks_[i];
+        InFlight& file = in_flight_[chunk.file];
+        prefix_.clear();
+        prefix_.put_varint(file.id);
+        std::string_view wire(chunk.raw.data(), chunk.size);
+        if (chunk.skipped) {
+            ++transport.chunks_skipped;
+        } else {
+            transport.codec_bytes += chunk.size;
+            transport.codec_elapsed += std::chrono::duration<double>(chunk.codec_seconds);
+            // Only worth the receiver's time if it saves a few percent.
+            if (chunk.packed_size < chunk.size - chunk.size / 32) {
+                ++transport.chunks_compressed;
+                prefix_.put_varint(chunk.size);
+                wire = std::string_view(chunk.packed.data(), chunk.packed_size);
+            }
+        }
+        writer_.write(wire.size() < chunk.size ? FrameType::data_lz : FrameType::data, prefix_.view(), wire);
+        transport.compress_bytes_in += chunk.size;
+        transport.compress_bytes_out += wire.size();
+        file.sent += chunk.size;
+    }
+
+    for (std::size_t f = files; f-- > 0;) {
+        InFlight& file = in_flight_[f];
+        if (read_status_[f] < 0) {
+            continue;
+        }
+        if (read_status_[f] > 0) {
+            abort_file(file.id, file.path, read_status_[f]);
+        } else {
+            prefix_.clear();
+            prefix_.put_varint(file.id);
+            prefix_.put_varint(file.sent);
+            writer_.write(FrameType::file_end, prefix_.view());
+        }
+        ::close(file.fd);
+        in_flight_.erase(in_flight_.begin() + static_cast<std::ptrdiff_t>(f));
+    }
+}
+
+void SenderSession::abort_file(std::uint64_t id, const std::string& path, int err) {
+    std::cerr << "    Warning: failed to read " << path << ": " << std::strerror(err) << std::endl;
+    WireWriter abort;
+    abort.put_varint(id);
+    abort.put_string(std::strerror(err));
+    writer_.write(FrameType::file_abort, abort.view());
+}
+
+void SenderSession::wait_for_peer() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    changed_.wait(lock, [this] { return summary_received_ || peer_finished_; });
+}
+
+void SenderSession::check_peer() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!peer_error_.empty()) {
+        throw std::runtime_error(peer_error_);
+    }
+}
+
+class ReceiverSession {
+public:
+    ReceiverSession(int in_fd, int out_fd, const TransportOptions& options, const fs::path& destination,
+                    SyncStats& stats)
+        : reader_(in_fd), writer_(out_fd), destination_(destination), stats_(stats),
+          scratch_(std::max<std::size_t>(options.chunk_bytes, 4096)) {
+        if (options.zero_copy) {
+            struct stat st {};
+            // A pipe can be spliced to files directly; anything else (a
+            // socket) goes through a pipe of our own.
+            if (::fstat(in_fd, &st) == 0 && S_ISFIFO(st.st_mode)) {
+                splice_mode_ = SpliceMode::direct;
+            } else {
+                splice_.emplace(scratch_.size());
+                splice_mode_ = splice_->valid() ? SpliceMode::staged : SpliceMode::none;
+            }
+            // read_back() must fit any staged chunk.
+            if (splice_mode_ == SpliceMode::staged && splice_->capacity() > scratch_.size()) {
+                scratch_.resize(splice_->capacity());
+            }
+        }
+    }
+
+    ~ReceiverSession() {
+        for (auto& [id, file] : files_) {
+            if (file.fd >= 0) {
+                ::close(file.fd);
+            }
+        }
+        if (directory_fd_ >= 0) {
+            ::close(directory_fd_);
+        }
+        if (root_fd_ >= 0) {
+            ::close(root_fd_);
+        }
+    }
+
+    void run();
+
+private:
+    struct IncomingFile {
+        std::string path;
+        mode_t mode;
+        std::uint64_t size;
+        int fd{-1};
+        std::uint64_t written{0};
+        bool failed{false};
+        // Cleared for files whose filesystem cannot splice.
+        bool splice{true};
+    };
+    enum class SpliceMode { none, direct, staged };
+
+    FrameReader reader_;
+    FrameWriter writer_;
+    const fs::path& destination_;
+    SyncStats& stats_;
+    bool remove_extraneous_{false};
+    FlatStringSet seen_;
+    std::unordered_map<std::uint64_t, IncomingFile> files_;
+    WireWriter reply_;
+    std::vector<char> scratch_;
+    SpliceMode splice_mode_{SpliceMode::none};
+    std::optional<SplicePipe> splice_;
+    // The destination, which every entry is created and replaced below
+    // through descriptors, and the directory used last (`directory_`).
+    int root_fd_{-1};
+    int directory_fd_{-1};
+    std::string directory_;
+
+    int directory_fd(std::string_view relative, bool create);
+    void apply_entries(WireReader& payload);
+    bool wants_file(const std::string& path, std::uint64_t size, std::uint64_t mtime, std::uint64_t mtime_nsec);
+    IncomingFile& wanted_file(std::uint64_t id);
+    void receive_data(std::uint32_t length);
+    void splice_data(IncomingFile& file, std::uint32_t& length);
+    void receive_compressed(WireReader& payload);
+    void write_data(IncomingFile& file, const char* data, std::size_t size);
+    void finish_file(WireReader& payload);
+    void abort_file(WireReader& payload);
+    bool open_file(IncomingFile& file);
+    void fail_file(IncomingFile& file, const std::string& reason);
+    void prune();
+};
+
+void ReceiverSession::run() {
+    Frame frame;
+    if (!reader_.read(frame)) {
+        throw std::runtime_error("Sender closed the stream before its hello");
+    }
+    remove_extraneous_ = (read_hello(frame) & kFlagRemoveExtraneous) != 0;
+    write_hello(writer_, 0);
+    fs::create_directories(destination_);
+    root_fd_ = ::open(destination_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd_ < 0) {
+        throw std::runtime_error("Cannot open destination " + destination_.string() + ": " + errno_message(errno));
+    }
+
+    const auto start = Clock::now();
+    std::uint32_t length = 0;
+    while (reader_.read_header(frame.type, length)) {
+        // File data is taken straight from the stream, not from a frame
+        // buffer.
+        if (frame.type == FrameType::data) {
+            receive_data(length);
+            continue;
+        }
+        reader_.read_payload(frame.payload, length);
+        WireReader payload(frame.payload);
+        switch (frame.type) {
+        case FrameType::entries:
+            apply_entries(payload);
+            break;
+        case FrameType::data_lz:
+            receive_compressed(payload);
+            break;
+        case FrameType::file_end:
+            finish_file(payload);
+            break;
+        case FrameType::file_abort:
+            abort_file(payload);
+            break;
+        case FrameType::done: {
+            stats_.copy_elapsed = Clock::now() - start;
+            if (remove_extraneous_) {
+                const auto prune_start = Clock::now();
+                prune();
+                stats_.prune_elapsed = Clock::now() - prune_start;
+            }
+            reply_.clear();
+            const std::uint64_t counters[] = {stats_.files_copied, stats_.files_skipped, stats_.files_deleted,
+                                              stats_.directories_created, stats_.bytes_copied};
+            reply_.put_varint(std::size(counters));
+            for (const std::uint64_t counter : counters) {
+                reply_.put_varint(counter);
+            }
+            writer_.write(FrameType::summary, reply_.view());
+            stats_.transport.frames_sent = writer_.frames();
+            stats_.transport.bytes_sent = writer_.bytes();
+            stats_.transport.frames_received = reader_.frames();
+            stats_.transport.bytes_received = reader_.bytes();
+            return;
+        }
+        case FrameType::error:
+            throw std::runtime_error("Sender failed: " + std::string(payload.get_string()));
+        default:
+            throw std::runtime_error("Unexpected frame from sender");
+        }
+    }
+    throw std::runtime_error("Sender closed the stream before finishing");
+}
+
+// Descriptor of the directory `relative` below the destination (see
+// open_directory_beneath), kept while the files of one directory arrive;
+// -1 with errno set on failure.
+int ReceiverSession::directory_fd(std::string_view relative, bool create) {
+    if (directory_fd_ >= 0 && relative == directory_) {
+        return directory_fd_;
+    }
+    const int fd = open_directory_beneath(root_fd_, relative, create);
+    if (fd < 0) {
+        return -1;
+    }
+    if (directory_fd_ >= 0) {
+        ::close(directory_fd_);
+    }
+    directory_fd_ = fd;
+    directory_.assign(relative);
+    return fd;
+}
+
+void ReceiverSession::apply_entries(WireReader& payload) {
+    const std::uint64_t first_id = payload.get_varint();
+    const std::uint64_t count = payload.get_varint();
+    reply_.clear();
+    std::vector<std::uint64_t> wanted;
+    for (std::uint64_t i = 0; i < count; ++i) {
+        const std::uint8_t kind = payload.get_u8();
+        const auto mode = static_cast<mode_t>(payload.get_varint());
+        const std::uint64_t size = payload.get_varint();
+        const std::uint64_t mtime = payload.get_varint();
+        const std::uint64_t mtime_nsec = payload.get_varint();
+        const std::string path(payload.get_string());
+        check_relative_path(path);
+        ++stats_.entries_scanned;
+        seen_.insert(path);
+
+        if (kind == kEntryDirectory) {
+            const fs::path target = destination_ / path;
+            const auto [parent_path, name] = split_parent(path);
+            const int parent = directory_fd(parent_path, true);
+            struct stat st {};
+            if (parent >= 0 && ::fstatat(parent, name.data(), &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                if (S_ISDIR(st.st_mode)) {
+                    continue;
+                }
+                std::cerr << "    Destination entry is not a directory (will replace): " << target << std::endl;
+                remove_beneath(parent, name.data());
+            }
+            if (parent >= 0 && ::mkdirat(parent, name.data(), 0777) == 0) {
+                ++stats_.directories_created;
+                std::cerr << "    Created directory: " << target << std::endl;
+            } else {
+                std::cerr << "    Warning: failed to create directory " << target << ": " << std::strerror(errno)
+                          << std::endl;
+            }
+        } else if (kind == kEntryFile) {
+            if (wants_file(path, size, mtime, mtime_nsec)) {
+                wanted.push_back(first_id + i);
+                files_.emplace(first_id + i, IncomingFile{path, mode, size});
+            }
+        } else {
+            throw std::runtime_error("Unknown entry kind in transport stream");
+        }
+    }
+    reply_.put_varint(wanted.size());
+    for (const std::uint64_t id : wanted) {
+        reply_.put_varint(id);
+    }
+    writer_.write(FrameType::want, reply_.view());
+}
+
+// The comparison DirectorySyncer makes: copy when the destination is
+// missing, not a regular file, of another size, or older.
+bool ReceiverSession::wants_file(const std::string& path, std::uint64_t size, std::uint64_t mtime,
+                                 std::uint64_t mtime_nsec) {
+    const auto [parent_path, name] = split_parent(path);
+    const int parent = directory_fd(parent_path, false);
+    struct stat st {};
+    if (parent < 0 || ::fstatat(parent, name.data(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return true;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        std::cerr << "    Destination entry is not a regular file (will replace): " << (destination_ / path)
+                  << std::endl;
+        remove_beneath(parent, name.data());
+        return true;
+    }
+#if defined(__APPLE__) || defined(__MACH__)
+    const auto dest_mtime = st.st_mtimespec;
+#else
+    const auto dest_mtime = st.st_mtim;
+#endif
+    const auto dest_sec = static_cast<std::uint64_t>(dest_mtime.tv_sec);
+    const auto dest_nsec = static_cast<std::uint64_t>(dest_mtime.tv_nsec);
+    if (static_cast<std::uint64_t>(st.st_size) != size || mtime > dest_sec ||
+        (mtime == dest_sec && mtime_nsec > dest_nsec)) {
+        return true;
+    }
+    ++stats_.files_skipped;
+    return false;
+}
+
+bool ReceiverSession::open_file(IncomingFile& file) {
+    if (file.fd >= 0 || file.failed) {
+        return !file.failed;
+    }
+    // O_NOFOLLOW: a symlink left in place of the file is not written
+    // through either.
+    const auto [parent_path, name] = split_parent(file.path);
+    const int parent = directory_fd(parent_path, true);
+    if (parent >= 0) {
+        file.fd = ::openat(parent, name.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, file.mode);
+    }
+    if (file.fd < 0 || ::fchmod(file.fd, file.mode) != 0) {
+        fail_file(file, std::strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void ReceiverSession::fail_file(IncomingFile& file, const std::string& reason) {
+    std::cerr << "    Warning: failed to write " << (destination_ / file.path) << ": " << reason << std::endl;
+    if (file.fd >= 0) {
+        ::close(file.fd);
+        file.fd = -1;
+    }
+    const auto [parent_path, name] = split_parent(file.path);
+    const int parent = directory_fd(parent_path, false);
+    if (parent >= 0) {
+        ::unlinkat(parent, name.data(), 0);
+    }
+    file.failed = true;
+}
+
+ReceiverSession::IncomingFile& ReceiverSession::wanted_file(std::uint64_t id) {
+    const auto it = files_.find(id);
+    if (it == files_.end()) {
+        throw std::runtime_error("Transport frame for a file that was not wanted");
+    }
+    return it->second;
+}
+
+void ReceiverSession::receive_data(std::uint32_t length) {
+    IncomingFile& file = wanted_file(reader_.read_varint(length));
+    if (open_file(file) && splice_mode_ != SpliceMode::none && file.splice) {
+        splice_data(file, length);
+    }
+    // Whatever splicing left (all of it without splice, the rest of a
+    // failed file) passes through the scratch buffer.
+    while (length > 0) {
+        const std::size_t size = std::min<std::size_t>(length, scratch_.size());
+        read_exactly(reader_.fd(), scratch_.data(), size);
+        length -= static_cast<std::uint32_t>(size);
+        if (!file.failed) {
+            write_data(file, scratch_.data(), size);
+        }
+    }
+}
+
+// Moves up to `length` payload bytes into `file` without copying them
+// through user space, reducing `length` by what it consumed. Stops early
+// if the file or stream refuses splice, or the file fails.
+void ReceiverSession::splice_data(IncomingFile& file, std::uint32_t& length) {
+#if defined(__linux__)
+    if (splice_mode_ == SpliceMode::direct) {
+        while (length > 0) {
+            const ssize_t n = ::splice(reader_.fd(), nullptr, file.fd, nullptr, length, SPLICE_F_MOVE);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n == 0) {
+                throw std::runtime_error("Transport stream ended inside a frame");
+            }
+            if (n < 0) {
+                // The bytes are still in the stream either way.
+                if (splice_refused(errno)) {
+                    file.splice = false;
+                } else {
+                    fail_file(file, std::strerror(errno));
+                }
+                return;
+            }
+            length -= static_cast<std::uint32_t>(n);
+            file.written += static_cast<std::uint64_t>(n);
+            stats_.transport.bytes_spliced += static_cast<std::uint64_t>(n);
+        }
+        return;
+    }
+    while (length > 0) {
+        const ssize_t n = splice_->fill(reader_.fd(), length);
+        if (n == 0) {
+            throw std::runtime_error("Transport stream ended inside a frame");
+        }
+        if (n < 0) {
+            if (!splice_refused(errno)) {
+                throw std::runtime_error("Transport read failed: " + errno_message(errno));
+            }
+            splice_mode_ = SpliceMode::none;
+            splice_.reset();
+            return;
+        }
+        const auto size = static_cast<std::size_t>(n);
+        length -= static_cast<std::uint32_t>(size);
+        const std::size_t moved = splice_->drain(file.fd, size);
+        file.written += moved;
+        stats_.transport.bytes_spliced += moved;
+        if (moved < size) {
+            const int err = errno;
+            splice_->read_back(scratch_.data(), size - moved);
+            if (splice_refused(err)) {
+                file.splice = false;
+                write_data(file, scratch_.data(), size - moved);
+            } else {
+                fail_file(file, std::strerror(err));
+            }
+            return;
+        }
+    }
+#else
+    (void)file;
+    (void)length;
+#endif
+}
+
+void ReceiverSession::receive_compressed(WireReader& payload) {
+    IncomingFile& file = wanted_file(payload.get_varint());
+    const std::uint64_t size = payload.get_varint();
+    if (size > kMaxFramePayload) {
+        throw std::runtime_error("Malformed transport frame");
+    }
+    if (!open_file(file)) {
+        return;
+    }
+    if (scratch_.size() < size) {
+        scratch_.resize(static_cast<std::size_t>(size));
+    }
+    const std::string_view block = payload.rest();
+    lz_decompress(block.data(), block.size(), scratch_.data(), static_cast<std::size_t>(size));
+    write_data(file, scratch_.data(), static_cast<std::size_t>(size));
+}
+
+void ReceiverSession::write_data(IncomingFile& file, const char* data, std::size_t size) {
+    std::size_t done = 0;
+    while (done < size) {
+        const ssize_t n = ::write(file.fd, data + done, size - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fail_file(file, std::strerror(errno));
+            return;
+        }
+        done += static_cast<std::size_t>(n);
+    }
+    file.written += size;
+}
+
+void ReceiverSession::finish_file(WireReader& payload) {
+    const auto it = files_.find(payload.get_varint());
+    if (it == files_.end()) {
+        throw std::runtime_error("End of a file that was not wanted");
+    }
+    IncomingFile& file = it->second;
+    const std::uint64_t size = payload.get_varint();
+    if (open_file(file)) {
+        const int fd = std::exchange(file.fd, -1);
+        if (::close(fd) != 0) {
+            fail_file(file, std::strerror(errno));
+        } else if (size != file.written) {
+            fail_file(file, "sender reported " + std::to_string(size) + " bytes, received " +
+                                std::to_string(file.written));
+        } else {
+            ++stats_.files_copied;
+            stats_.bytes_copied += file.written;
+            std::cerr << "    Received file: " << (destination_ / file.path) << " (" << file.written << " bytes)"
+                      << std::endl;
+        }
+    }
+    files_.erase(it);
+}
+
+void ReceiverSession::abort_file(WireReader& payload) {
+    const auto it = files_.find(payload.get_varint());
+    if (it == files_.end()) {
+        throw std::runtime_error("Abort of a file that was not wanted");
+    }
+    if (!it->second.failed) {
+        fail_file(it->second, "sender could not read it: " + std::string(payload.get_string()));
+    }
+    files_.erase(it);
+}
+
+void ReceiverSession::prune() {
+    std::error_code ec;
+    fs::recursive_directory_iterator it(destination_, fs::directory_options::skip_permission_denied, ec);
+    for (const fs::recursive_directory_iterator end; !ec && it != end; it.increment(ec)) {
+        const std::string relative = it->path().lexically_relative(destination_).generic_string();
+        if (seen_.contains(relative)) {
+            continue;
+        }
+        const fs::path extraneous = it->path();
+        it.disable_recursion_pending();
+        std::cerr << "    Removing extraneous entry: " << extraneous << std::endl;
+        std::error_code remove_ec;
+        const std::uintmax_t removed = fs::remove_all(extraneous, remove_ec);
+        if (remove_ec) {
+            std::cerr << "    Warning: failed to remove " << extraneous << ": " << remove_ec.message() << std::endl;
+        }
+        stats_.files_deleted += static_cast<std::size_t>(removed);
+    }
+}
+
+} // namespace
+
+void WireWriter::put_varint(std::uint64_t value) {
+    while (value >= 0x80) {
+        bytes_.push_back(static_cast<char>((value & 0x7F) | 0x80));
+        value >>= 7;
+    }
+    bytes_.push_back(static_cast<char>(value));
+}
+
+void WireWriter::put_string(std::string_view text) {
+    put_varint(text.size());
+    bytes_.append(text);
+}
+
+std::uint8_t WireReader::get_u8() {
+    if (offset_ >= bytes_.size()) {
+        throw std::runtime_error("Malformed transport frame");
+    }
+    return static_cast<std::uint8_t>(bytes_[offset_++]);
+}
+
+std::uint64_t WireReader::get_varint() {
+    std::uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        const std::uint8_t byte = get_u8();
+        value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    throw std::runtime_error("Malformed transport frame");
+}
+
+std::string_view WireReader::get_string() {
+    return get_bytes(static_cast<std::size_t>(get_varint()));
+}
+
+std::string_view WireReader::get_bytes(std::size_t size) {
+    if (size > bytes_.size() - offset_) {
+        throw std::runtime_error("Malformed transport frame");
+    }
+    const std::string_view bytes = bytes_.substr(offset_, size);
+    offset_ += size;
+    return bytes;
+}
+
+void FrameWriter::write(FrameType type, std::string_view payload) {
+    write(type, payload, {});
+}
+
+void FrameWriter::write(FrameType type, std::string_view prefix, std::string_view body) {
+    const std::size_t length = prefix.size() + body.size();
+    if (length > kMaxFramePayload) {
+        throw std::runtime_error("Transport frame too large");
+    }
+    unsigned char header[5] = {static_cast<unsigned char>(type),
+                               static_cast<unsigned char>(length),
+                               static_cast<unsigned char>(length >> 8),
+                               static_cast<unsigned char>(length >> 16),
+                               static_cast<unsigned char>(length >> 24)};
+    iovec parts[3] = {{header, sizeof(header)},
+                      {const_cast<char*>(prefix.data()), prefix.size()},
+                      {const_cast<char*>(body.data()), body.size()}};
+    write_fully(fd_, parts, 3);
+    ++frames_;
+    bytes_ += sizeof(header) + length;
+}
+
+void FrameWriter::write_header(FrameType type, std::string_view prefix, std::size_t body_bytes) {
+    const std::size_t length = prefix.size() + body_bytes;
+    if (length > kMaxFramePayload) {
+        throw std::runtime_error("Transport frame too large");
+    }
+    unsigned char header[5] = {static_cast<unsigned char>(type),
+                               static_cast<unsigned char>(length),
+                               static_cast<unsigned char>(length >> 8),
+                               static_cast<unsigned char>(length >> 16),
+                               static_cast<unsigned char>(length >> 24)};
+    iovec parts[2] = {{header, sizeof(header)}, {const_cast<char*>(prefix.data()), prefix.size()}};
+    write_fully(fd_, parts, 2);
+    ++frames_;
+    bytes_ += sizeof(header) + length;
+}
+
+bool FrameReader::read(Frame& frame) {
+    std::uint32_t length = 0;
+    if (!read_header(frame.type, length)) {
+        return false;
+    }
+    read_payload(frame.payload, length);
+    return true;
+}
+
+bool FrameReader::read_header(FrameType& type, std::uint32_t& length) {
+    unsigned char header[5];
+    if (!read_fully(fd_, reinterpret_cast<char*>(header), sizeof(header))) {
+        return false;
+    }
+    length = static_cast<std::uint32_t>(header[1]) | static_cast<std::uint32_t>(header[2]) << 8 |
+             static_cast<std::uint32_t>(header[3]) << 16 | static_cast<std::uint32_t>(header[4]) << 24;
+    if (length > kMaxFramePayload) {
+        throw std::runtime_error("Transport frame too large");
+    }
+    type = static_cast<FrameType>(header[0]);
+    ++frames_;
+    bytes_ += sizeof(header) + length;
+    return true;
+}
+
+void FrameReader::read_payload(std::string& payload, std::uint32_t length) {
+    payload.resize(length);
+    read_exactly(fd_, payload.data(), length);
+}
+
+std::uint64_t FrameReader::read_varint(std::uint32_t& length) {
+    std::uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64 && length > 0; shift += 7) {
+        char byte;
+        read_exactly(fd_, &byte, 1);
+        --length;
+        value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    throw std::runtime_error("Malformed transport frame");
+}
+
+SyncSender::SyncSender(int in_fd, int out_fd, TransportOptions options)
+    : in_fd_(in_fd), out_fd_(out_fd), options_(options) {}
+
+SyncStats SyncSender::send(const fs::path& source) {
+    const auto start = Clock::now();
+    if (!fs::is_directory(source)) {
+        throw std::runtime_error("Source directory does not exist: " + source.string());
+    }
+    SyncStats stats;
+    std::cout << "Streaming " << source << " to receiver..." << std::endl;
+    SenderSession(in_fd_, out_fd_, options_, source, stats).run();
+    stats.total_elapsed = Clock::now() - start;
+    return stats;
+}
+
+SyncReceiver::SyncReceiver(int in_fd, int out_fd, TransportOptions options)
+    : in_fd_(in_fd), out_fd_(out_fd), options_(options) {}
+
+SyncStats SyncReceiver::receive(const fs::path& destination) {
+    const auto start = Clock::now();
+    SyncStats stats;
+    ReceiverSession session(in_fd_, out_fd_, options_, destination, stats);
+    try {
+        session.run();
+    } catch (const std::exception& ex) {
+        // Best effort: the sender may be gone already.
+        try {
+            WireWriter message;
+            message.put_string(ex.what());
+            FrameWriter(out_fd_).write(FrameType::error, message.view());
+        } catch (const std::exception&) {
+        }
+        throw;
+    }
+    stats.total_elapsed = Clock::now() - start;
+    return stats;
+}
+
+ChildProcess::ChildProcess(const std::string& command) {
+    int to[2];
+    int from[2];
+    if (::pipe(to) != 0) {
+        throw std::runtime_error("pipe failed: " + errno_message(errno));
+    }
+    if (::pipe(from) != 0) {
+        const int err = errno;
+        ::close(to[0]);
+        ::close(to[1]);
+        throw std::runtime_error("pipe failed: " + errno_message(err));
+    }
+    pid_ = ::fork();
+    if (pid_ < 0) {
+        const int err = errno;
+        for (const int fd : {to[0], to[1], from[0], from[1]}) {
+            ::close(fd);
+        }
+        throw std::runtime_error("fork failed: " + errno_message(err));
+    }
+    if (pid_ == 0) {
+        ::dup2(to[0], STDIN_FILENO);
+        ::dup2(from[1], STDOUT_FILENO);
+        for (const int fd : {to[0], to[1], from[0], from[1]}) {
+            ::close(fd);
+        }
+        ::execl("/bin/sh", "sh", "-c", command.c_str(), static_cast<char*>(nullptr));
+        ::_exit(127);
+    }
+    ::close(to[0]);
+    ::close(from[1]);
+    to_child_ = to[1];
+    from_child_ = from[0];
+    ::fcntl(to_child_, F_SETFD, FD_CLOEXEC);
+    ::fcntl(from_child_, F_SETFD, FD_CLOEXEC);
+}
+
+ChildProcess::~ChildProcess() {
+    if (pid_ > 0) {
+        wait();
+    }
+}
+
+int ChildProcess::wait() {
+    for (int* fd : {&to_child_, &from_child_}) {
+        if (*fd >= 0) {
+            ::close(*fd);
+            *fd = -1;
+        }
+    }
+    int status = 0;
+    while (::waitpid(pid_, &status, 0) < 0 && errno == EINTR) {
+    }
+    pid_ = -1;
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+} // namespace mfs
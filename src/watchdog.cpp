@@ -0,0 +1,183 @@
+#include "watchdog.hpp"
+
+#include "event_stream.hpp"
+#include "log.hpp"
+
+#include <iostream>
+
+namespace mfs {
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+thread_local WatchdogSlot* current_slot = nullptr;
+
+std::int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// Lexical prefix test on whole path components.
+bool within(const fs::path& root, const fs::path& path) {
+    auto r = root.begin();
+    auto p = path.begin();
+    for (; r != root.end(); ++r, ++p) {
+        if (p == path.end() || *r != *p) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+const char* fs_op_name(FsOp op) {
+    switch (op) {
+    case FsOp::lstat:
+        return "lstat";
+    case FsOp::readdir:
+        return "readdir";
+    case FsOp::mkdir:
+        return "mkdir";
+    case FsOp::copy:
+        return "copy";
+    case FsOp::remove:
+        return "remove";
+    }
+    return "unknown";
+}
+
+Watchdog::Watchdog(WatchdogOptions options, EventStream* events, std::ostream* log)
+    : options_(options), events_(events), log_(log ? *log : std::cerr) {
+    thread_ = std::thread([this] { monitor(); });
+}
+
+Watchdog::~Watchdog() {
+    stop();
+}
+
+WatchdogSlot* Watchdog::attach_current_thread() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    slots_.push_back(std::make_unique<WatchdogSlot>());
+    slots_.back()->worker = slots_.size() - 1;
+    current_slot = slots_.back().get();
+    return current_slot;
+}
+
+void Watchdog::resume_current_thread(WatchdogSlot* slot) {
+    current_slot = slot;
+}
+
+void Watchdog::detach_current_thread() {
+    current_slot = nullptr;
+}
+
+bool Watchdog::quarantined(const fs::path& path) const {
+    if (!any_quarantined()) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& root : quarantine_) {
+        if (within(root, path)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<fs::path> Watchdog::quarantined_paths() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return quarantine_;
+}
+
+std::vector<StalledOperation> Watchdog::stalled_operations() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stalled_;
+}
+
+void Watchdog::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) {
+            return;
+        }
+        stopping_ = true;
+    }
+    wake_.notify_one();
+    thread_.join();
+}
+
+void Watchdog::monitor() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!wake_.wait_for(lock, options_.poll_interval, [this] { return stopping_; })) {
+        const std::int64_t now = now_ns();
+        for (auto& slot : slots_) {
+            inspect(*slot, now);
+        }
+    }
+}
+
+void Watchdog::inspect(WatchdogSlot& slot, std::int64_t now) {
+    const std::int64_t start = slot.start_ns.load(std::memory_order_acquire);
+    if (start == 0) {
+        return;
+    }
+    const auto elapsed = std::chrono::nanoseconds(now - start);
+    if (elapsed < options_.threshold) {
+        return;
+    }
+
+    StalledOperation stalled{slot.worker, FsOp::lstat, {}, elapsed};
+    {
+        // Re-check under the slot lock: the operation seen above may have
+        // finished and a new one started in between.
+        std::lock_guard<std::mutex> slot_lock(slot.mutex);
+        const std::int64_t current = slot.start_ns.load(std::memory_order_acquire);
+        const std::uint64_t generation = slot.generation.load(std::memory_order_relaxed);
+        if (current != start || generation == slot.reported_generation) {
+            return;
+        }
+        slot.reported_generation = generation;
+        stalled.op = slot.op;
+        stalled.path = slot.path;
+    }
+
+    log_line(log_, "    Watchdog: ", fs_op_name(stalled.op), " on ", stalled.path, " has been running for ",
+             stalled.elapsed.count(), " s (worker ", stalled.worker, ")");
+    if (events_) {
+        events_->stalled(fs_op_name(stalled.op), stalled.path, stalled.worker, stalled.elapsed);
+    }
+    stalled_.push_back(stalled);
+
+    if (options_.quarantine) {
+        // A hung lookup or copy usually means the containing directory (or the
+        // server behind it) is unhealthy, so the whole directory is fenced off.
+        const bool directory_op = stalled.op == FsOp::readdir || stalled.op == FsOp::mkdir;
+        fs::path root = directory_op ? stalled.path : stalled.path.parent_path();
+        log_line(log_, "    Watchdog: quarantining subtree ", root);
+        quarantine_.push_back(std::move(root));
+        any_quarantined_.store(true, std::memory_order_release);
+    }
+}
+
+FsOpGuard::FsOpGuard(FsOp op, std::string_view path) : slot_(current_slot) {
+    if (slot_ == nullptr) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(slot_->mutex);
+        slot_->op = op;
+        slot_->path.assign(path);
+        slot_->generation.fetch_add(1, std::memory_order_relaxed);
+    }
+    slot_->start_ns.store(now_ns(), std::memory_order_release);
+}
+
+FsOpGuard::~FsOpGuard() {
+    if (slot_ != nullptr) {
+        slot_->start_ns.store(0, std::memory_order_release);
+    }
+}
+
+} // namespace mfs
@@ -0,0 +1,171 @@
+#include "worker_pool.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+
+namespace mfs {
+
+WorkerPool::WorkerPool(std::size_t threads, std::size_t queue_capacity, ThreadHook on_start, ThreadHook on_exit,
+                       std::vector<std::size_t> worker_groups)
+    : capacity_(std::max<std::size_t>(queue_capacity, 1)),
+      on_start_(std::move(on_start)),
+      on_exit_(std::move(on_exit)),
+      worker_groups_(std::move(worker_groups)) {
+    threads = std::max<std::size_t>(threads, 1);
+    if (worker_groups_.empty()) {
+        worker_groups_.assign(threads, 0);
+    } else if (worker_groups_.size() != threads) {
+        throw std::runtime_error("Worker pool needs one group per thread.");
+    }
+    queues_.resize(*std::max_element(worker_groups_.begin(), worker_groups_.end()) + 1);
+    stolen_.assign(threads, 0);
+    threads_.reserve(threads);
+    for (std::size_t i = 0; i < threads; ++i) {
+        threads_.emplace_back([this, i] { run(i); });
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    work_ready_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+void WorkerPool::submit(Task task) {
+    enqueue(std::move(task), nullptr);
+}
+
+void WorkerPool::enqueue(Task task, TaskSet* set) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    space_ready_.wait(lock, [this] { return queued_ < capacity_; });
+    queues_[next_group_].push_back(Job{std::move(task), set});
+    if (set) {
+        ++set->pending_;
+    }
+    next_group_ = (next_group_ + 1) % queues_.size();
+    ++queued_;
+    lock.unlock();
+    work_ready_.notify_one();
+}
+
+void WorkerPool::wait_idle() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return queued_ == 0 && running_ == 0; });
+    if (failure_) {
+        std::exception_ptr failure = std::exchange(failure_, nullptr);
+        std::rethrow_exception(failure);
+    }
+}
+
+std::size_t WorkerPool::stolen(std::size_t worker) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stolen_.at(worker);
+}
+
+WorkerPool::TaskSet::TaskSet(WorkerPool& pool) : pool_(pool), stolen_(pool.size(), 0) {}
+
+WorkerPool::TaskSet::~TaskSet() {
+    std::unique_lock<std::mutex> lock(pool_.mutex_);
+    done_.wait(lock, [this] { return pending_ == 0; });
+}
+
+void WorkerPool::TaskSet::submit(Task task) {
+    pool_.enqueue(std::move(task), this);
+}
+
+void WorkerPool::TaskSet::wait() {
+    std::unique_lock<std::mutex> lock(pool_.mutex_);
+    done_.wait(lock, [this] { return pending_ == 0; });
+    if (failure_) {
+        std::exception_ptr failure = std::exchange(failure_, nullptr);
+        std::rethrow_exception(failure);
+    }
+}
+
+bool WorkerPool::TaskSet::wait_for(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(pool_.mutex_);
+    if (!done_.wait_for(lock, timeout, [this] { return pending_ == 0; })) {
+        return false;
+    }
+    if (failure_) {
+        std::exception_ptr failure = std::exchange(failure_, nullptr);
+        std::rethrow_exception(failure);
+    }
+    return true;
+}
+
+std::size_t WorkerPool::TaskSet::stolen(std::size_t worker) const {
+    std::lock_guard<std::mutex> lock(pool_.mutex_);
+    return stolen_.at(worker);
+}
+
+WorkerPool::Job WorkerPool::take(std::size_t worker) {
+    std::size_t group = worker_groups_[worker];
+    bool stole = false;
+    if (queues_[group].empty()) {
+        const auto fullest = std::max_element(queues_.begin(), queues_.end(),
+                                              [](const auto& a, const auto& b) { return a.size() < b.size(); });
+        group = static_cast<std::size_t>(fullest - queues_.begin());
+        ++stolen_[worker];
+        stole = true;
+    }
+    Job job = std::move(queues_[group].front());
+    queues_[group].pop_front();
+    --queued_;
+    if (stole && job.set) {
+        ++job.set->stolen_[worker];
+    }
+    return job;
+}
+
+void WorkerPool::run(std::size_t worker) {
+    if (on_start_) {
+        on_start_(worker);
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        work_ready_.wait(lock, [this] { return stopping_ || queued_ > 0; });
+        if (queued_ == 0) {
+            break;
+        }
+        Job job = take(worker);
+        ++running_;
+        lock.unlock();
+        space_ready_.notify_one();
+
+        std::exception_ptr failure;
+        try {
+            job.task(worker);
+        } catch (...) {
+            failure = std::current_exception();
+        }
+        // Drop the task's captures before its set can be waited out.
+        job.task = nullptr;
+
+        lock.lock();
+        std::exception_ptr& first = job.set ? job.set->failure_ : failure_;
+        if (failure && !first) {
+            first = failure;
+        }
+        if (job.set && --job.set->pending_ == 0) {
+            // Under the lock: the set may be destroyed once wait() sees it.
+            job.set->done_.notify_all();
+        }
+        --running_;
+        if (queued_ == 0 && running_ == 0) {
+            idle_.notify_all();
+        }
+    }
+    lock.unlock();
+    if (on_exit_) {
+        on_exit_(worker);
+    }
+}
+
+} // namespace mfs
@@ -1,13 +1,49 @@
 #include "sync.hpp"
+#include "arena.hpp"
+#include "buffer_pool.hpp"
+#include "chunk_store.hpp"
+#include "columnar.hpp"
+#include "copy_engine.hpp"
+#include "dir_reader.hpp"
+#include "event_stream.hpp"
+#include "flat_hash.hpp"
+#include "live_stats.hpp"
+#include "lz.hpp"
+#include "numa.hpp"
+#include "retry.hpp"
+#include "tar.hpp"
+#include "transport.hpp"
+#include "watchdog.hpp"
+#include "worker_pool.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
 #include <chrono>
+#include <cstdint>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <random>
 #include <set>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
+
+#include <csignal>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 namespace fs = std::filesystem;
 
@@ -106,6 +142,1635 @@ void test_keep_extra(const fs::path& source_root, const fs::path& dest_root) {
     assert(stats.synced_entries.size() == 3);
 }
 
+void test_columnar_export(const fs::path& source_root, const fs::path& dest_root) {
+    TempDir temp_source;
+    TempDir temp_dest;
+    TempDir temp_export;
+    copy_tree(source_root, temp_source.path);
+    copy_tree(dest_root, temp_dest.path);
+
+    mfs::SyncOptions options;
+    options.columnar_export_dir = temp_export.path / "columns";
+    // Tiny buffer limit forces incremental flushes during the sync.
+    options.columnar_buffer_bytes = 16;
+
+    mfs::DirectorySyncer syncer(options);
+    auto stats = syncer.synchronize(temp_source.path, temp_dest.path);
+
+    mfs::ColumnarReader reader(options.columnar_export_dir);
+    assert(reader.rows() == stats.synced_entries.size());
+
+    const auto paths = reader.read_paths();
+    const auto uids = reader.read(mfs::MetadataColumn::uid);
+    const auto mtimes = reader.read(mfs::MetadataColumn::mtime);
+    const auto mtime_nsecs = reader.read(mfs::MetadataColumn::mtime_nsec);
+    const auto sizes = reader.read(mfs::MetadataColumn::size);
+    for (std::size_t i = 0; i < stats.synced_entries.size(); ++i) {
+        const auto& meta = stats.synced_entries[i];
+        assert(paths[i] == meta.file.native());
+        assert(uids[i] == meta.uid);
+        assert(mtimes[i] == meta.mtime);
+        assert(mtime_nsecs[i] == meta.mtime_nsec);
+        assert(sizes[i] == meta.size);
+    }
+
+    // Scanning one column must not depend on the others being present.
+    fs::remove(options.columnar_export_dir / "uid.col");
+    std::size_t scanned = 0;
+    reader.scan(mfs::MetadataColumn::gid, [&scanned](std::uint64_t) { ++scanned; });
+    assert(scanned == stats.synced_entries.size());
+}
+
+void test_output_format() {
+    mfs::FileMetadata meta;
+    meta.file = fs::path("/data/with \"quote\"/back\\slash.txt");
+    meta.depth = 2;
+    meta.mode = 0100644;
+    meta.uid = 1000;
+    meta.gid = 100;
+    meta.size = 18446744073709551615ULL;
+    meta.mtime = 1700000000;
+    meta.mtime_nsec = 123456789;
+    meta.atime = 1700000001;
+    meta.ctime = 1700000002;
+    meta.ctime_nsec = 7;
+
+    // The text layout must stay byte-identical to the former iostream rendering.
+    std::ostringstream legacy;
+    legacy << "\n=== Synchronized Source Entries ===\n"
+           << "  Path: " << meta.file << "\n"
+           << "    depth: " << meta.depth << "\n"
+           << "    mode: " << meta.mode << "\n"
+           << "    uid: " << meta.uid << ", gid: " << meta.gid << "\n"
+           << "    size: " << meta.size << " bytes\n"
+           << "    mtime: " << meta.mtime << "s + " << meta.mtime_nsec << "ns\n"
+           << "    atime: " << meta.atime << "s + " << meta.atime_nsec << "ns\n"
+           << "    ctime: " << meta.ctime << "s + " << meta.ctime_nsec << "ns\n";
+
+    mfs::OutputBuffer text(-1, 256);
+    mfs::format_synced_metadata(text, {meta}, mfs::OutputFormat::text);
+    assert(text.view() == legacy.str());
+
+    mfs::OutputBuffer json(-1, 256);
+    mfs::format_synced_metadata(json, {meta}, mfs::OutputFormat::jsonl);
+    const std::string line(json.view());
+    assert(line.find("\"path\":\"/data/with \\\"quote\\\"/back\\\\slash.txt\"") != std::string::npos);
+    assert(line.find("\"size\":18446744073709551615") != std::string::npos);
+    assert(line.back() == '\n');
+
+    mfs::SyncStats stats;
+    stats.files_copied = 3;
+    stats.total_elapsed = std::chrono::duration<double>(0.5);
+    mfs::OutputBuffer report(-1, 256);
+    mfs::format_report(report, stats, mfs::OutputFormat::text);
+    const std::string summary(report.view());
+    assert(summary.find("  Files copied:         3\n") != std::string::npos);
+    assert(summary.find("  Total elapsed:      0.500 s\n") != std::string::npos);
+}
+
+void test_event_stream(const fs::path& source_root, const fs::path& dest_root) {
+    TempDir temp_source;
+    TempDir temp_dest;
+    TempDir temp_events;
+    copy_tree(source_root, temp_source.path);
+    copy_tree(dest_root, temp_dest.path);
+
+    const fs::path events_file = temp_events.path / "events.jsonl";
+    mfs::SyncOptions options;
+    options.events = mfs::EventStream::open_file(events_file);
+
+    mfs::DirectorySyncer syncer(options);
+    auto stats = syncer.synchronize(temp_source.path, temp_dest.path);
+    options.events->close();
+
+    std::ifstream input(events_file);
+    std::size_t copied = 0;
+    std::size_t deleted = 0;
+    std::size_t stages = 0;
+    std::size_t summaries = 0;
+    for (std::string line; std::getline(input, line);) {
+        assert(line.front() == '{' && line.back() == '}');
+        assert(line.rfind("{\"ts\":", 0) == 0);
+        copied += line.find("\"event\":\"copied\"") != std::string::npos;
+        deleted += line.find("\"event\":\"deleted\"") != std::string::npos;
+        stages += line.find("\"event\":\"stage\"") != std::string::npos;
+        summaries += line.find("\"event\":\"summary\"") != std::string::npos;
+    }
+    assert(copied == stats.files_copied);
+    assert(deleted == stats.files_deleted);
+    assert(stages == 3);
+    assert(summaries == 1);
+
+    // A reader that does not read: the writer blocks on the full pipe and
+    // events past the cap are dropped, but the summary still arrives.
+    int fds[2];
+    assert(::pipe2(fds, O_CLOEXEC) == 0);
+    constexpr std::size_t kEvents = 20000;
+    std::uint64_t dropped = 0;
+    {
+        mfs::EventStream stalled(fds[1], true, std::chrono::seconds(1), 64 * 1024);
+        for (std::size_t i = 0; i < kEvents; ++i) {
+            stalled.skipped(temp_source.path / ("file" + std::to_string(i)), "unchanged");
+        }
+        dropped = stalled.dropped();
+        assert(dropped > 0 && dropped < kEvents);
+        stalled.summary(stats);
+        std::thread drain([&] {
+            const std::string all = read_file("/proc/self/fd/" + std::to_string(fds[0]));
+            std::istringstream lines(all);
+            std::size_t written = 0;
+            std::string last;
+            for (std::string line; std::getline(lines, line); ++written) {
+                last = line;
+            }
+            assert(written == kEvents - dropped + 1);
+            assert(last.find("\"events_dropped\":" + std::to_string(dropped) + "}") != std::string::npos);
+        });
+        stalled.close();
+        drain.join();
+    }
+    ::close(fds[0]);
+}
+
+void test_live_stats(const fs::path& source_root, const fs::path& dest_root) {
+    TempDir temp_source;
+    TempDir temp_dest;
+    TempDir temp_stats;
+    copy_tree(source_root, temp_source.path);
+    copy_tree(dest_root, temp_dest.path);
+
+    const fs::path stats_file = temp_stats.path / "live.stats";
+    mfs::SyncOptions options;
+    options.remove_extraneous = false;
+    options.live_stats = std::make_shared<mfs::LiveStatsPublisher>(stats_file);
+
+    mfs::DirectorySyncer syncer(options);
+    auto stats = syncer.synchronize(temp_source.path, temp_dest.path);
+
+    const mfs::LiveStatsSnapshot snapshot = mfs::read_live_stats(stats_file);
+    assert(snapshot.finished);
+    assert(snapshot.sequence % 2 == 0);
+    assert(snapshot.entries_scanned == stats.entries_scanned);
+    assert(snapshot.files_copied == stats.files_copied);
+    assert(snapshot.bytes_copied == stats.bytes_copied);
+    assert(snapshot.stage_state[static_cast<std::size_t>(mfs::SyncStage::copy)] == mfs::StageState::done);
+    assert(snapshot.stage_state[static_cast<std::size_t>(mfs::SyncStage::prune)] == mfs::StageState::skipped);
+
+    std::uint64_t histogram_total = 0;
+    for (const auto count : snapshot.size_histogram) {
+        histogram_total += count;
+    }
+    assert(histogram_total == stats.files_copied);
+
+    mfs::OutputBuffer prometheus(-1);
+    mfs::format_live_stats_prometheus(prometheus, snapshot);
+    const std::string exposition(prometheus.view());
+    assert(exposition.find("simplesync_files_copied_total{pid=\"" + std::to_string(snapshot.pid) + "\"} " +
+                           std::to_string(stats.files_copied) + "\n") != std::string::npos);
+    assert(exposition.find("simplesync_copied_file_bytes_bucket{pid=\"" + std::to_string(snapshot.pid) +
+                           "\",le=\"+Inf\"} " + std::to_string(stats.files_copied)) != std::string::npos);
+}
+
+void test_usage_accounting(const fs::path& source_root, const fs::path& dest_root) {
+    TempDir temp_source;
+    TempDir temp_dest;
+    copy_tree(source_root, temp_source.path);
+    copy_tree(dest_root, temp_dest.path);
+
+    mfs::SyncOptions options;
+    options.account_usage = true;
+
+    mfs::DirectorySyncer syncer(options);
+    auto stats = syncer.synchronize(temp_source.path, temp_dest.path);
+
+    auto project = [&stats](const std::string& name) {
+        for (const auto& [key, counters] : stats.usage.by_project) {
+            if (key == name) {
+                return counters;
+            }
+        }
+        return mfs::UsageCounters{};
+    };
+
+    // file1.txt lives in the root; dirA gets file3.txt, dirB gets updated.txt.
+    assert(project(".").files_copied == 1);
+    assert(project(".").files_deleted == 1);
+    assert(project("dirA").files_copied == 1);
+    assert(project("dirA").files_skipped == 1);
+    assert(project("dirA").files_deleted == 1);
+    assert(project("dirB").files_copied == 1);
+    assert(project("dirB").files_skipped == 1);
+
+    std::uint64_t uid_bytes = 0;
+    std::uint64_t uid_files = 0;
+    for (const auto& row : stats.usage.by_uid) {
+        uid_bytes += row.second.bytes_copied;
+        uid_files += row.second.files_copied;
+    }
+    assert(uid_bytes == stats.bytes_copied);
+    assert(uid_files == stats.files_copied);
+
+    for (std::size_t i = 1; i < stats.usage.by_project.size(); ++i) {
+        assert(stats.usage.by_project[i - 1].second.bytes_copied >= stats.usage.by_project[i].second.bytes_copied);
+    }
+
+    mfs::OutputBuffer json(-1);
+    mfs::format_report(json, stats, mfs::OutputFormat::jsonl);
+    assert(std::string(json.view()).find("{\"type\":\"usage\",\"key\":\"project\",\"id\":\"dirA\"") !=
+           std::string::npos);
+
+    // Shards from several threads merge into one report.
+    mfs::UsageAccounting accounting;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < 4; ++t) {
+        workers.emplace_back([&accounting] {
+            mfs::UsageShard& shard = accounting.local();
+            for (int i = 0; i < 1000; ++i) {
+                shard.copied(42, 7, "proj", 10);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    const mfs::UsageReport merged = accounting.merge();
+    assert(merged.by_uid.size() == 1 && merged.by_uid[0].second.files_copied == 4000);
+    assert(merged.by_project[0].second.bytes_copied == 40000);
+}
+
+void test_generic_loop(const fs::path& source_root, const fs::path& dest_root) {
+    // The specialized loops must behave exactly like the generic one.
+    auto run = [&](bool specialize, bool account_usage) {
+        TempDir temp_source;
+        TempDir temp_dest;
+        copy_tree(source_root, temp_source.path);
+        copy_tree(dest_root, temp_dest.path);
+        mfs::SyncOptions options;
+        options.account_usage = account_usage;
+        options.specialize = specialize;
+        return mfs::DirectorySyncer(options).synchronize(temp_source.path, temp_dest.path);
+    };
+    for (const bool account_usage : {false, true}) {
+        const auto generic = run(false, account_usage);
+        const auto specialized = run(true, account_usage);
+        assert(generic.entries_scanned == specialized.entries_scanned);
+        assert(generic.files_copied == specialized.files_copied);
+        assert(generic.files_skipped == specialized.files_skipped);
+        assert(generic.files_deleted == specialized.files_deleted);
+        assert(generic.synced_entries.size() == specialized.synced_entries.size());
+        assert(generic.usage.by_project.size() == specialized.usage.by_project.size());
+        for (std::size_t i = 0; i < generic.usage.by_project.size(); ++i) {
+            assert(generic.usage.by_project[i].first == specialized.usage.by_project[i].first);
+            assert(generic.usage.by_project[i].second.files_skipped ==
+                   specialized.usage.by_project[i].second.files_skipped);
+        }
+    }
+    std::cout << "Generic loop test passed." << std::endl;
+}
+
+void test_retry_queue() {
+    assert(mfs::classify_errno(EIO) == mfs::ErrorClass::transient);
+    assert(mfs::classify_errno(ESTALE) == mfs::ErrorClass::transient);
+    assert(mfs::classify_errno(EAGAIN) == mfs::ErrorClass::transient);
+    assert(mfs::classify_errno(ETIMEDOUT) == mfs::ErrorClass::transient);
+    assert(mfs::classify_errno(ENOENT) == mfs::ErrorClass::permanent);
+    assert(mfs::classify_errno(EACCES) == mfs::ErrorClass::permanent);
+    assert(mfs::classify_error(std::make_error_code(std::errc::io_error)) == mfs::ErrorClass::transient);
+
+    mfs::RetryPolicy policy;
+    policy.initial_delay = std::chrono::milliseconds(10);
+    policy.max_delay = std::chrono::milliseconds(50);
+    policy.multiplier = 2.0;
+    policy.jitter = 0.5;
+    std::mt19937_64 rng(1);
+    for (unsigned attempt = 1; attempt <= 6; ++attempt) {
+        const auto expected = std::min<std::chrono::nanoseconds>(
+            std::chrono::milliseconds(10 << (attempt - 1)), std::chrono::milliseconds(50));
+        const auto delay = mfs::retry_delay(policy, attempt, rng);
+        assert(delay <= expected);
+        assert(delay >= expected / 2);
+    }
+
+    // Items become available in due order and never before their delay.
+    policy.jitter = 0.0;
+    mfs::DeferredRetryQueue<int> queue(policy);
+    queue.push(3, 3);
+    queue.push(1, 1);
+    queue.push(2, 2);
+    assert(queue.size() == 3);
+    assert(!queue.pop_due());
+    std::vector<int> order;
+    while (!queue.empty()) {
+        std::this_thread::sleep_until(queue.next_due());
+        while (auto item = queue.pop_due()) {
+            order.push_back(*item);
+        }
+    }
+    assert((order == std::vector<int>{1, 2, 3}));
+}
+
+void test_watchdog() {
+    mfs::WatchdogOptions options;
+    options.enabled = true;
+    options.threshold = std::chrono::milliseconds(50);
+    options.poll_interval = std::chrono::milliseconds(10);
+    options.quarantine = true;
+
+    mfs::Watchdog watchdog(options);
+    {
+        mfs::WatchdogAttachment attachment(&watchdog);
+        {
+            mfs::FsOpGuard quick(mfs::FsOp::mkdir, "/fast/dir");
+        }
+        mfs::FsOpGuard hung(mfs::FsOp::lstat, "/hung/mount/file");
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    }
+    watchdog.stop();
+
+    const auto stalled = watchdog.stalled_operations();
+    assert(stalled.size() == 1);
+    assert(stalled.front().op == mfs::FsOp::lstat);
+    assert(stalled.front().path == "/hung/mount/file");
+    assert(stalled.front().elapsed >= std::chrono::milliseconds(50));
+    assert(watchdog.quarantined("/hung/mount/other"));
+    assert(watchdog.quarantined("/hung/mount"));
+    assert(!watchdog.quarantined("/hung/mountain"));
+    assert(!watchdog.quarantined("/fast/dir"));
+
+    // Unattached threads are not tracked at all.
+    mfs::FsOpGuard untracked(mfs::FsOp::copy, "/elsewhere");
+
+    // A stall on the destination side fences off the destination subtree.
+    // The "Created directory" line is written inside the mkdir's guard, so
+    // a log stream that hangs on it stands in for a hung mkdir.
+    TempDir source;
+    TempDir destination;
+    fs::create_directories(source.path / "slow");
+    std::ofstream(source.path / "slow" / "kept.txt") << "kept";
+    // Visited before the contents of "slow", giving the watchdog time to
+    // record the quarantine once the stalled line is through.
+    fs::create_directories(source.path / "urgent");
+    for (int f = 0; f < 200; ++f) {
+        std::ofstream(source.path / "urgent" / ("f" + std::to_string(f))) << f;
+    }
+    struct StallingBuffer : std::stringbuf {
+        bool stalled{false};
+        std::streamsize xsputn(const char* data, std::streamsize size) override {
+            const std::string_view text(data, static_cast<std::size_t>(size));
+            if (!stalled && text.find("Created directory") != std::string_view::npos &&
+                text.find("slow") != std::string_view::npos) {
+                stalled = true;
+                std::this_thread::sleep_for(std::chrono::milliseconds(300));
+            }
+            return std::stringbuf::xsputn(data, size);
+        }
+    } buffer;
+    std::ostream out(&buffer);
+    std::ostringstream err;
+    mfs::SyncCall call;
+    call.out = &out;
+    call.err = &err;
+    mfs::SyncOptions sync_options;
+    sync_options.watchdog = options;
+    sync_options.priority_rules = {{"urgent", 1}};
+    sync_options.remove_extraneous = false;
+    const mfs::SyncStats stats = mfs::DirectorySyncer(sync_options).synchronize(source.path, destination.path, call);
+    assert(buffer.stalled);
+    assert((stats.quarantined == std::vector<fs::path>{destination.path / "slow"}));
+    assert(stats.quarantine_skipped == 1);
+    assert(!fs::exists(destination.path / "slow" / "kept.txt"));
+    assert(stats.files_copied == 200);
+    std::cout << "Watchdog test passed." << std::endl;
+}
+
+void test_split_directory() {
+    TempDir temp_source;
+    TempDir temp_dest;
+    const fs::path big = temp_source.path / "big";
+    fs::create_directories(big / "nested");
+    for (int i = 0; i < 3000; ++i) {
+        std::ofstream(big / ("f" + std::to_string(i))) << i;
+    }
+    std::ofstream(big / "nested" / "leaf.txt") << "leaf";
+    // A directory on the destination side where the source has a file must
+    // still be replaced when the listing is used instead of stat().
+    fs::create_directories(temp_dest.path / "big" / "f7" / "stale");
+
+    mfs::BumpArena arena;
+    mfs::DirectoryReader reader(big, arena);
+    mfs::ArenaVector<mfs::DirEntryName> batch{mfs::ArenaAllocator<mfs::DirEntryName>(arena)};
+    std::size_t listed = 0;
+    while (reader.next_batch(batch)) {
+        listed += batch.size();
+        for (const auto& entry : batch) {
+            assert(entry.name.data()[entry.name.size()] == '\0');
+        }
+    }
+    assert(!reader.error());
+    assert(listed == 3001);
+
+    mfs::SyncOptions options;
+    options.workers = 4;
+    options.split_threshold = 100;
+    options.account_usage = true;
+
+    auto stats = mfs::DirectorySyncer(options).synchronize(temp_source.path, temp_dest.path);
+    assert(stats.directories_split == 1);
+    assert(stats.entries_scanned == 3003);
+    assert(stats.files_copied == 3001);
+    assert(stats.synced_entries.size() == 3002); // "big" already existed
+    assert(fs::is_regular_file(temp_dest.path / "big" / "f7"));
+    assert(fs::exists(temp_dest.path / "big" / "nested" / "leaf.txt"));
+    std::uint64_t usage_files = 0;
+    for (const auto& row : stats.usage.by_uid) {
+        usage_files += row.second.files_copied;
+    }
+    assert(usage_files == 3001);
+
+    // Second run: every destination entry is found through the listing.
+    stats = mfs::DirectorySyncer(options).synchronize(temp_source.path, temp_dest.path);
+    assert(stats.files_copied == 0);
+    assert(stats.files_skipped == 3001);
+
+    // Progress is reported by the walking thread only, counting what the
+    // workers did so far: it never goes back.
+    TempDir progress_dest;
+    TempDir progress_events;
+    const fs::path events_file = progress_events.path / "events.jsonl";
+    const int events_fd = ::open(events_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    assert(events_fd >= 0);
+    options.events = std::make_shared<mfs::EventStream>(events_fd, true, std::chrono::milliseconds(0));
+    stats = mfs::DirectorySyncer(options).synchronize(temp_source.path, progress_dest.path);
+    options.events->close();
+    std::ifstream input(events_file);
+    std::size_t progress_events_seen = 0;
+    std::size_t last_copied = 0;
+    for (std::string line; std::getline(input, line);) {
+        if (line.find("\"event\":\"progress\"") == std::string::npos) {
+            continue;
+        }
+        const std::string key = "\"files_copied\":";
+        const std::size_t copied = std::stoull(line.substr(line.find(key) + key.size()));
+        assert(copied >= last_copied);
+        last_copied = copied;
+        ++progress_events_seen;
+    }
+    assert(progress_events_seen > 0 && last_copied <= stats.files_copied);
+    std::cout << "Split directory test passed." << std::endl;
+}
+
+void test_numa() {
+    assert((mfs::parse_cpu_list("0-3,8,10-11\n") == std::vector<int>{0, 1, 2, 3, 8, 10, 11}));
+    assert(mfs::parse_cpu_list("").empty());
+    for (const char* bad : {"3-1", "x", "1,,2"}) {
+        bool threw = false;
+        try {
+            mfs::parse_cpu_list(bad);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+    }
+
+    TempDir sysfs;
+    for (const auto& [node, cpus] : {std::pair<const char*, const char*>{"node1", "2-3"}, {"node0", "0-1"},
+                                     {"node2", ""}}) {
+        fs::create_directories(sysfs.path / node);
+        std::ofstream(sysfs.path / node / "cpulist") << cpus << "\n";
+    }
+    std::ofstream(sysfs.path / "possible") << "0-2\n";
+    const mfs::NumaTopology detected = mfs::NumaTopology::detect(sysfs.path);
+    assert(detected.size() == 2 && detected.multi_node()); // node2 has no CPUs
+    assert(detected.nodes()[0].id == 0 && detected.nodes()[1].cpus == (std::vector<int>{2, 3}));
+    assert(!mfs::NumaTopology::detect(sysfs.path / "missing").multi_node());
+
+    // Two groups: every task runs, whichever group it was queued for.
+    std::atomic<int> ran{0};
+    {
+        mfs::WorkerPool pool(2, 4, {}, {}, {0, 1});
+        for (int i = 0; i < 100; ++i) {
+            pool.submit([&ran](std::size_t) { ++ran; });
+        }
+        pool.wait_idle();
+    }
+    assert(ran == 100);
+
+    // Nodes without CPU lists make pinning a no-op, so this runs anywhere.
+    TempDir temp_source;
+    TempDir temp_dest;
+    for (int i = 0; i < 500; ++i) {
+        std::ofstream(temp_source.path / ("f" + std::to_string(i))) << i;
+    }
+    mfs::SyncOptions options;
+    options.workers = 4;
+    options.split_threshold = 10;
+    options.numa = true;
+    options.numa_topology = std::make_shared<const mfs::NumaTopology>(
+        std::vector<mfs::NumaNode>{mfs::NumaNode{0, {}}, mfs::NumaNode{1, {}}});
+    const auto stats = mfs::DirectorySyncer(options).synchronize(temp_source.path, temp_dest.path);
+    assert(stats.files_copied == 500);
+    assert(stats.numa_nodes.size() == 2);
+    assert(stats.numa_nodes[0].workers == 2 && stats.numa_nodes[1].workers == 2);
+    assert(stats.numa_nodes[0].files_copied + stats.numa_nodes[1].files_copied == 500);
+    mfs::OutputBuffer text(-1);
+    mfs::format_report(text, stats, mfs::OutputFormat::text);
+    assert(std::string(text.view()).find("=== Per-Node Throughput ===") != std::string::npos);
+    mfs::OutputBuffer json(-1);
+    mfs::format_report(json, stats, mfs::OutputFormat::jsonl);
+    assert(std::string(json.view()).find("{\"type\":\"numa_node\",\"node\":1,\"workers\":2") != std::string::npos);
+    std::cout << "NUMA test passed." << std::endl;
+}
+
+void test_bump_arena() {
+    mfs::BumpArena arena(1024);
+    const auto outer = arena.mark();
+    const std::string_view name = arena.copy("entry-name");
+    assert(name == "entry-name" && name.data()[name.size()] == '\0');
+    void* aligned = arena.allocate(24, 64);
+    assert(reinterpret_cast<std::uintptr_t>(aligned) % 64 == 0);
+    {
+        mfs::ArenaScope scope(arena);
+        mfs::ArenaVector<int> values{mfs::ArenaAllocator<int>(arena)};
+        for (int i = 0; i < 10000; ++i) {
+            values.push_back(i);
+        }
+        assert(values[9999] == 9999);
+        // Oversized requests get a chunk of their own.
+        std::memset(arena.allocate(4096), 0xab, 4096);
+    }
+    assert(name == "entry-name");
+
+    // Rewinding keeps the chunks: the same work again reserves nothing new.
+    arena.rewind(outer);
+    const std::size_t reserved = arena.allocated_bytes();
+    for (int round = 0; round < 3; ++round) {
+        mfs::ArenaScope scope(arena);
+        mfs::ArenaVector<int> values{mfs::ArenaAllocator<int>(arena)};
+        for (int i = 0; i < 10000; ++i) {
+            values.push_back(i);
+        }
+        arena.allocate(4096);
+    }
+    assert(arena.allocated_bytes() == reserved);
+    std::cout << "Bump arena test passed." << std::endl;
+}
+
+void test_flat_hash() {
+    mfs::FlatStringMap<int> map;
+    for (int i = 0; i < 50000; ++i) {
+        const std::string key = "dir/" + std::to_string(i % 97) + "/file_" + std::to_string(i);
+        assert(map.try_emplace(key, i).second);
+    }
+    assert(map.size() == 50000);
+    assert(!map.try_emplace("dir/3/file_3", -1).second);
+    for (int i = 0; i < 50000; i += 7) {
+        const int* value = map.find("dir/" + std::to_string(i % 97) + "/file_" + std::to_string(i));
+        assert(value != nullptr && *value == i);
+    }
+    assert(map.find("dir/3/file_50000") == nullptr);
+    assert(!map.contains(""));
+    assert(map.try_emplace("").second && map.contains(""));
+    // Keys point into the arena, which survives a move of the map.
+    mfs::FlatStringMap<int> moved = std::move(map);
+    assert(*moved.find("dir/96/file_96") == 96);
+
+    mfs::FlatHashMap<std::uint64_t, std::string> inodes;
+    for (std::uint64_t ino = 0; ino < 1000; ++ino) {
+        inodes.try_emplace(ino << 20, "path" + std::to_string(ino));
+    }
+    assert(inodes.size() == 1000 && *inodes.find(std::uint64_t{7} << 20) == "path7");
+    assert(inodes.find(1) == nullptr);
+
+    mfs::ShardedFlatStringSet shared;
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 4; ++t) {
+        writers.emplace_back([&shared, t] {
+            // Overlapping ranges: every key is inserted by two threads.
+            for (int i = t * 5000; i < t * 5000 + 10000; ++i) {
+                shared.insert("k" + std::to_string(i));
+            }
+        });
+    }
+    for (auto& writer : writers) {
+        writer.join();
+    }
+    assert(shared.size() == 25000);
+    assert(shared.contains("k0") && shared.contains("k24999") && !shared.contains("k25000"));
+    std::cout << "Flat hash test passed." << std::endl;
+}
+
+void test_buffer_pool(const fs::path& source_root, const fs::path& dest_root) {
+    {
+        mfs::BufferPool pool(2, 100);
+        assert(pool.stats().buffers == 2 && pool.stats().buffer_bytes == 4096);
+        auto first = std::make_unique<mfs::BufferPool::Lease>(pool.acquire());
+        const mfs::BufferPool::Lease second = pool.acquire();
+        assert(first->data() != second.data() && pool.stats().peak_in_use == 2);
+        std::thread waiter([&pool] { const mfs::BufferPool::Lease third = pool.acquire(); });
+        while (pool.stats().waits == 0) {
+            std::this_thread::yield();
+        }
+        first.reset();
+        waiter.join();
+        assert(pool.stats().acquisitions == 3 && pool.stats().peak_in_use == 2);
+    }
+
+    TempDir temp;
+    const fs::path source = temp.path / "source.bin";
+    const fs::path destination = temp.path / "destination.bin";
+    std::string data(5 * 512 * 1024, '\0');
+    for (std::size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(i * 131 % 251);
+    }
+    std::ofstream(source, std::ios::binary) << data;
+    fs::permissions(source, fs::perms::owner_read | fs::perms::owner_write | fs::perms::group_read);
+    std::ofstream(destination, std::ios::binary) << std::string(data.size() + 4096, 'x');
+    mfs::BufferPool pool(1, 1024 * 1024);
+    assert(mfs::copy_file_buffered(source, destination, pool) == data.size());
+    assert(read_file(destination) == data);
+    assert(fs::status(destination).permissions() == fs::status(source).permissions());
+    bool threw = false;
+    try {
+        mfs::copy_file_buffered(temp.path / "missing", destination, pool);
+    } catch (const fs::filesystem_error&) {
+        threw = true;
+    }
+    assert(threw);
+
+    // Copying through the pool must give the same result as copy_file.
+    TempDir plain_dest;
+    TempDir pooled_dest;
+    auto run = [&](std::size_t copy_buffer_bytes, const fs::path& destination_root) {
+        TempDir temp_source;
+        copy_tree(source_root, temp_source.path);
+        copy_tree(dest_root, destination_root);
+        mfs::SyncOptions options;
+        options.copy_buffer_bytes = copy_buffer_bytes;
+        return mfs::DirectorySyncer(options).synchronize(temp_source.path, destination_root);
+    };
+    const auto plain = run(0, plain_dest.path);
+    const auto pooled = run(64 * 1024, pooled_dest.path);
+    assert(plain.buffer_pool.buffers == 0);
+    assert(pooled.buffer_pool.buffers == 1 && pooled.buffer_pool.acquisitions == pooled.files_copied);
+    assert(plain.files_copied == pooled.files_copied && pooled.files_copied > 0);
+    for (const auto& entry : fs::recursive_directory_iterator(plain_dest.path)) {
+        const fs::path other = pooled_dest.path / fs::relative(entry.path(), plain_dest.path);
+        if (entry.is_regular_file()) {
+            assert_file_equals(entry.path(), other);
+            assert(entry.status().permissions() == fs::status(other).permissions());
+        } else {
+            assert(fs::is_directory(other));
+        }
+    }
+    std::cout << "Buffer pool test passed." << std::endl;
+}
+
+std::size_t count_entries(const fs::path& root) {
+    return static_cast<std::size_t>(
+        std::distance(fs::recursive_directory_iterator(root), fs::recursive_directory_iterator()));
+}
+
+void test_copy_engines(const fs::path& source_root, const fs::path& dest_root) {
+    assert(mfs::copy_size_class(0) == 0 && mfs::copy_size_class(64 * 1024 - 1) == 0);
+    assert(mfs::copy_size_class(64 * 1024) == 1 && mfs::copy_size_class(8 * 1024 * 1024) == 3);
+    assert(mfs::copy_size_class_label(1) == "64K-1M");
+    for (const mfs::CopyEngine engine : mfs::kAllCopyEngines) {
+        assert(mfs::parse_copy_engine(mfs::copy_engine_name(engine)) == engine);
+    }
+    assert(!mfs::parse_copy_engine("auto"));
+
+    TempDir temp;
+    mfs::BufferPool pool(1, 64 * 1024);
+    for (const std::size_t size : {std::size_t{0}, std::size_t{1000}, std::size_t{300 * 1024 + 123}}) {
+        std::string data(size, '\0');
+        for (std::size_t i = 0; i < data.size(); ++i) {
+            data[i] = static_cast<char>(i * 7 % 253);
+        }
+        const fs::path source = temp.path / ("source_" + std::to_string(size));
+        std::ofstream(source, std::ios::binary) << data;
+        for (const mfs::CopyEngine engine : mfs::kAllCopyEngines) {
+            const fs::path destination = temp.path / std::string(mfs::copy_engine_name(engine));
+            std::ofstream(destination, std::ios::binary) << std::string(size + 10, 'x');
+            assert(mfs::copy_file_with(engine, source, destination, pool) == size);
+            assert(read_file(destination) == data);
+        }
+    }
+
+    mfs::CalibrationOptions options;
+    options.bytes_per_class = 256 * 1024;
+    options.rounds = 1;
+    const fs::path scratch = temp.path / "calibration";
+    const mfs::CopyCalibration calibration = mfs::calibrate_copy_engines(scratch, options);
+    // Engines the filesystem cannot run natively (reflink, maybe direct) are
+    // not timed; the others are timed for every class.
+    assert(calibration.timings.size() % mfs::kCopySizeClasses == 0);
+    assert(calibration.timings.size() >= mfs::kCopySizeClasses * 3);
+    for (const mfs::EngineTiming& timing : calibration.timings) {
+        assert(timing.bytes_per_second > 0.0);
+        // mmap is only ever used by name.
+        assert(timing.engine != mfs::CopyEngine::mmap);
+    }
+    assert(!fs::exists(scratch));
+
+    const std::vector<mfs::EngineTiming> timings{{0, mfs::CopyEngine::mmap, 5.0},
+                                                 {0, mfs::CopyEngine::read_write, 5.0},
+                                                 {2, mfs::CopyEngine::sendfile, 9.0},
+                                                 {2, mfs::CopyEngine::copy_file_range, 3.0},
+                                                 {3, mfs::CopyEngine::mmap, 9.0},
+                                                 {3, mfs::CopyEngine::direct, 1.0}};
+    const mfs::CopyEngineTable chosen = mfs::choose_copy_engines(timings);
+    assert(chosen.engine(0) == mfs::CopyEngine::read_write);
+    assert(chosen.engine(3) == mfs::CopyEngine::direct);
+    assert(chosen.engine(1) == mfs::CopyEngine::copy_file_range);
+    assert(chosen.engine(2) == mfs::CopyEngine::sendfile);
+
+    const mfs::FilesystemInfo filesystem = mfs::probe_filesystem(temp.path);
+    assert(!filesystem.type.empty());
+    const fs::path cache = temp.path / "cache" / "copy_engines";
+    const std::string key = mfs::calibration_cache_key(filesystem, filesystem);
+    assert(!mfs::load_cached_calibration(cache, key));
+    mfs::store_cached_calibration(cache, "other", mfs::CopyCalibration{chosen, timings});
+    mfs::store_cached_calibration(cache, key, calibration);
+    std::ofstream(cache, std::ios::app) << "garbage line\n" << key << " 9 mmap 1\n";
+    const std::optional<mfs::CopyCalibration> loaded = mfs::load_cached_calibration(cache, key);
+    assert(loaded && loaded->timings.size() == calibration.timings.size());
+    for (std::size_t size_class = 0; size_class < mfs::kCopySizeClasses; ++size_class) {
+        assert(loaded->table.engine(size_class) == calibration.table.engine(size_class));
+    }
+    // "other" covers only two classes: incomplete, so not used.
+    assert(!mfs::load_cached_calibration(cache, "other"));
+    mfs::store_cached_calibration(cache, key, mfs::CopyCalibration{chosen, timings});
+    assert(!mfs::load_cached_calibration(cache, key));
+
+    // Every engine, and the calibrated table, must leave the same tree.
+    auto run = [&](auto configure, const fs::path& destination_root) {
+        TempDir temp_source;
+        copy_tree(source_root, temp_source.path);
+        copy_tree(dest_root, destination_root);
+        mfs::SyncOptions options;
+        configure(options);
+        return mfs::DirectorySyncer(options).synchronize(temp_source.path, destination_root);
+    };
+    TempDir plain_dest;
+    const auto plain = run([](mfs::SyncOptions&) {}, plain_dest.path);
+    assert(!plain.copy_engines.active);
+    const fs::path sync_cache = temp.path / "sync_cache";
+    const std::size_t engines = mfs::kCopyEngines;
+    for (std::size_t variant = 0; variant < engines + 2; ++variant) {
+        TempDir engine_dest;
+        const auto stats = run(
+            [&](mfs::SyncOptions& options) {
+                if (variant < engines) {
+                    options.copy_engine = mfs::kAllCopyEngines[variant];
+                } else {
+                    // Calibrates and fills the cache, then reuses it.
+                    options.calibrate_copy = true;
+                    options.calibration.bytes_per_class = 128 * 1024;
+                    options.calibration.rounds = 1;
+                    options.copy_engine_cache = sync_cache;
+                }
+            },
+            engine_dest.path);
+        assert(stats.copy_engines.active && stats.files_copied == plain.files_copied);
+        assert(stats.copy_engines.calibration.empty() == (variant < engines));
+        assert(stats.copy_engines.cached == (variant == engines + 1));
+        std::size_t counted = 0;
+        for (const std::size_t files : stats.copy_engines.files_copied) {
+            counted += files;
+        }
+        assert(counted == stats.files_copied);
+        for (const auto& entry : fs::recursive_directory_iterator(plain_dest.path)) {
+            const fs::path other = engine_dest.path / fs::relative(entry.path(), plain_dest.path);
+            if (entry.is_regular_file()) {
+                assert_file_equals(entry.path(), other);
+            }
+        }
+        // The calibration's scratch directory is gone again.
+        assert(count_entries(engine_dest.path) == count_entries(plain_dest.path));
+    }
+    std::cout << "Copy engine test passed." << std::endl;
+}
+
+void test_lz() {
+    std::mt19937 rng(7);
+    std::vector<std::string> blocks = {"", "a", "abcabcabcabcabcabcabcabcabc", std::string(100000, 'z')};
+    std::string text;
+    for (int i = 0; i < 5000; ++i) {
+        text += "entry " + std::to_string(i % 113) + " of a compressible block\n";
+    }
+    blocks.push_back(text);
+    std::string noise(200000, '\0');
+    for (char& c : noise) {
+        c = static_cast<char>(rng());
+    }
+    blocks.push_back(noise);
+    for (const std::string& block : blocks) {
+        std::vector<char> packed(mfs::lz_compress_bound(block.size()));
+        const std::size_t size = mfs::lz_compress(block.data(), block.size(), packed.data());
+        assert(size <= packed.size());
+        std::string unpacked(block.size(), '\0');
+        mfs::lz_decompress(packed.data(), size, unpacked.data(), unpacked.size());
+        assert(unpacked == block);
+        if (block.size() > 1000 && &block != &blocks.back()) {
+            assert(size < block.size() / 2);
+        }
+        // Any other size is an error, as is a cut block.
+        bool threw = false;
+        try {
+            mfs::lz_decompress(packed.data(), size, unpacked.data(), unpacked.size() + 1);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+        if (size > 1) {
+            threw = false;
+            try {
+                mfs::lz_decompress(packed.data(), size - 1, unpacked.data(), unpacked.size());
+            } catch (const std::runtime_error&) {
+                threw = true;
+            }
+            assert(threw);
+        }
+    }
+    assert(mfs::sample_entropy(noise.data(), noise.size()) > 7.5);
+    assert(mfs::sample_entropy(text.data(), text.size()) < 6.0);
+    std::cout << "LZ codec test passed." << std::endl;
+}
+
+mfs::SyncStats send_over_socketpair(const fs::path& source, const fs::path& destination,
+                                    const mfs::TransportOptions& options) {
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+        throw std::runtime_error("socketpair failed");
+    }
+    const pid_t pid = ::fork();
+    if (pid == 0) {
+        ::close(fds[0]);
+        int status = 0;
+        try {
+            mfs::SyncReceiver(fds[1], fds[1], options).receive(destination);
+        } catch (const std::exception& ex) {
+            std::cerr << "Receiver failed: " << ex.what() << std::endl;
+            status = 1;
+        }
+        ::_exit(status);
+    }
+    ::close(fds[1]);
+    mfs::SyncStats stats = mfs::SyncSender(fds[0], fds[0], options).send(source);
+    ::close(fds[0]);
+    int status = -1;
+    ::waitpid(pid, &status, 0);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    return stats;
+}
+
+void test_transport(const fs::path& source_root, const fs::path& dest_root) {
+    mfs::WireWriter writer;
+    writer.put_u8(7);
+    writer.put_varint(0);
+    writer.put_varint(300);
+    writer.put_varint(UINT64_MAX);
+    writer.put_string("dir/name");
+    mfs::WireReader reader(writer.view());
+    assert(reader.get_u8() == 7 && reader.get_varint() == 0 && reader.get_varint() == 300);
+    assert(reader.get_varint() == UINT64_MAX && reader.get_string() == "dir/name" && reader.at_end());
+    bool threw = false;
+    try {
+        mfs::WireReader truncated(writer.view().substr(0, writer.size() - 3));
+        truncated.get_u8();
+        truncated.get_varint();
+        truncated.get_varint();
+        truncated.get_varint();
+        truncated.get_string();
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+
+    std::signal(SIGPIPE, SIG_IGN);
+    TempDir temp_source;
+    TempDir plain_dest;
+    TempDir streamed_dest;
+    copy_tree(source_root, temp_source.path);
+    copy_tree(dest_root, plain_dest.path);
+    copy_tree(dest_root, streamed_dest.path);
+    // Larger than a chunk, so data frames of several files interleave.
+    std::string data(200 * 1024 + 17, '\0');
+    for (std::size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(i * 13 % 251);
+    }
+    for (int i = 0; i < 6; ++i) {
+        std::ofstream(temp_source.path / "dirA" / ("large" + std::to_string(i)), std::ios::binary) << data;
+    }
+
+    const mfs::SyncStats plain = mfs::DirectorySyncer().synchronize(temp_source.path, plain_dest.path);
+    mfs::TransportOptions options;
+    options.chunk_bytes = 64 * 1024;
+    options.batch_entries = 3;
+    options.files_in_flight = 3;
+    options.zero_copy = false;
+    {
+        TempDir buffered_dest;
+        copy_tree(dest_root, buffered_dest.path);
+        const mfs::SyncStats buffered = send_over_socketpair(temp_source.path, buffered_dest.path, options);
+        assert(buffered.files_copied == plain.files_copied && buffered.transport.bytes_spliced == 0);
+        assert(read_file(buffered_dest.path / "dirA" / "large5") == data);
+    }
+    options.zero_copy = true;
+    const mfs::SyncStats streamed = send_over_socketpair(temp_source.path, streamed_dest.path, options);
+    mfs::print_report(streamed);
+#if defined(__linux__)
+    assert(streamed.transport.bytes_spliced == streamed.bytes_copied);
+#endif
+
+    assert(streamed.files_copied == plain.files_copied);
+    assert(streamed.bytes_copied == plain.bytes_copied);
+    assert(streamed.files_deleted == plain.files_deleted);
+    assert(streamed.entries_scanned == plain.entries_scanned);
+    assert(streamed.transport.frames_sent > 0 && streamed.transport.peak_files_in_flight == 3);
+    assert(count_entries(streamed_dest.path) == count_entries(plain_dest.path));
+    for (const auto& entry : fs::recursive_directory_iterator(plain_dest.path)) {
+        if (entry.is_regular_file()) {
+            assert_file_equals(entry.path(), streamed_dest.path / fs::relative(entry.path(), plain_dest.path));
+        }
+    }
+
+    // Compressed: the periodic files shrink, a random one is sent as is.
+    {
+        std::string noise(150 * 1024, '\0');
+        std::mt19937 rng(3);
+        for (char& c : noise) {
+            c = static_cast<char>(rng());
+        }
+        std::ofstream(temp_source.path / "noise.bin", std::ios::binary) << noise;
+        TempDir compressed_dest;
+        copy_tree(dest_root, compressed_dest.path);
+        mfs::TransportOptions compressed = options;
+        compressed.compress = true;
+        compressed.compress_threads = 2;
+        const mfs::SyncStats stats = send_over_socketpair(temp_source.path, compressed_dest.path, compressed);
+        mfs::print_report(stats);
+        assert(stats.files_copied == plain.files_copied + 1);
+        assert(stats.transport.chunks_compressed > 0 && stats.transport.chunks_skipped >= 2);
+        assert(stats.transport.compress_bytes_in == stats.bytes_copied);
+        assert(stats.transport.compress_bytes_out < stats.bytes_copied / 2);
+        assert(read_file(compressed_dest.path / "noise.bin") == noise);
+        assert(read_file(compressed_dest.path / "dirA" / "large2") == data);
+        fs::remove(temp_source.path / "noise.bin");
+    }
+
+    // Nothing changed, so the second run only exchanges metadata.
+    const mfs::SyncStats again = send_over_socketpair(temp_source.path, streamed_dest.path, options);
+    assert(again.files_copied == 0 && again.files_skipped == streamed.files_copied + streamed.files_skipped);
+
+    // A sender naming a file below a symlink planted in the destination,
+    // without listing its directory first, must not write through it.
+    {
+        TempDir planted_dest;
+        TempDir outside;
+        fs::create_directory_symlink(outside.path, planted_dest.path / "link");
+        int fds[2];
+        assert(::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0);
+        const pid_t pid = ::fork();
+        if (pid == 0) {
+            ::close(fds[0]);
+            int status = 0;
+            try {
+                mfs::SyncReceiver(fds[1], fds[1]).receive(planted_dest.path);
+            } catch (const std::exception& ex) {
+                std::cerr << "Receiver failed: " << ex.what() << std::endl;
+                status = 1;
+            }
+            ::_exit(status);
+        }
+        ::close(fds[1]);
+        mfs::FrameWriter frames(fds[0]);
+        mfs::FrameReader replies(fds[0]);
+        mfs::Frame reply;
+        mfs::WireWriter payload;
+        payload.put_varint(mfs::kTransportVersion);
+        payload.put_varint(0);
+        frames.write(mfs::FrameType::hello, payload.view());
+        payload.clear();
+        payload.put_varint(0);
+        payload.put_varint(1);
+        payload.put_u8(0);
+        for (const std::uint64_t field : {0644, 3, 1, 0}) {
+            payload.put_varint(field);
+        }
+        payload.put_string("link/x");
+        frames.write(mfs::FrameType::entries, payload.view());
+        assert(replies.read(reply) && reply.type == mfs::FrameType::hello);
+        assert(replies.read(reply) && reply.type == mfs::FrameType::want);
+        payload.clear();
+        payload.put_varint(0);
+        frames.write(mfs::FrameType::data, payload.view(), "abc");
+        payload.put_varint(3);
+        frames.write(mfs::FrameType::file_end, payload.view());
+        frames.write(mfs::FrameType::done, {});
+        assert(replies.read(reply) && reply.type == mfs::FrameType::summary);
+        mfs::WireReader counters(reply.payload);
+        assert(counters.get_varint() == 5 && counters.get_varint() == 0);
+        ::close(fds[0]);
+        int status = -1;
+        ::waitpid(pid, &status, 0);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        assert(fs::is_symlink(planted_dest.path / "link") && fs::is_empty(outside.path));
+    }
+    std::cout << "Transport test passed." << std::endl;
+}
+
+void test_tar(const fs::path& source_root, const fs::path& dest_root) {
+    TempDir temp_source;
+    TempDir plain_dest;
+    TempDir imported_dest;
+    TempDir archive;
+    copy_tree(source_root, temp_source.path);
+    copy_tree(dest_root, plain_dest.path);
+    copy_tree(dest_root, imported_dest.path);
+    // Over the 100-byte ustar name field, so it needs a pax path record.
+    const fs::path long_dir = temp_source.path / std::string(70, 'd') / std::string(70, 'e');
+    fs::create_directories(long_dir);
+    std::string data(300 * 1024 + 5, '\0');
+    for (std::size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<char>(i * 7 % 253);
+    }
+    std::ofstream(long_dir / "long_file.bin", std::ios::binary) << data;
+    std::ofstream(temp_source.path / "empty.txt").close();
+
+    const fs::path tar_file = archive.path / "export.tar";
+    const int out = ::open(tar_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(out >= 0);
+    mfs::SyncOptions export_options;
+    export_options.tar_export = std::make_shared<mfs::TarWriter>(out);
+    export_options.workers = 3;
+    export_options.split_threshold = 2;
+    const fs::path before = archive.path / "reference";
+    copy_tree(dest_root, before);
+    const mfs::SyncStats exported = mfs::DirectorySyncer(export_options).synchronize(temp_source.path, before);
+    ::close(out);
+    // The reference destination is only compared against.
+    assert(count_entries(before) == count_entries(dest_root));
+    assert(exported.archive_bytes == fs::file_size(tar_file) && exported.archive_bytes % 512 == 0);
+
+    const mfs::SyncStats plain = mfs::DirectorySyncer().synchronize(temp_source.path, plain_dest.path);
+    assert(exported.files_copied == plain.files_copied && exported.bytes_copied == plain.bytes_copied);
+
+    const int in = ::open(tar_file.c_str(), O_RDONLY);
+    assert(in >= 0);
+    mfs::TarImportOptions import_options;
+    import_options.workers = 3;
+    import_options.buffer_bytes = 64 * 1024;
+    const mfs::SyncStats imported = mfs::TarImporter(import_options).apply(in, imported_dest.path);
+    ::close(in);
+    mfs::print_report(imported);
+    assert(imported.files_copied == plain.files_copied && imported.bytes_copied == plain.bytes_copied);
+    assert(imported.archive_bytes == exported.archive_bytes);
+    assert(imported.buffer_pool.peak_in_use <= import_options.workers + 2);
+    // Every file of the plain sync matches; only its deletions are missing.
+    for (const auto& entry : fs::recursive_directory_iterator(plain_dest.path)) {
+        if (entry.is_regular_file()) {
+            const fs::path relative = fs::relative(entry.path(), plain_dest.path);
+            assert_file_equals(entry.path(), imported_dest.path / relative);
+            // Files the sync left alone keep the destination's own mtime.
+            if (!fs::exists(dest_root / relative)) {
+                assert(fs::last_write_time(imported_dest.path / relative) ==
+                       fs::last_write_time(temp_source.path / relative));
+            }
+        }
+    }
+    assert(read_file(imported_dest.path / fs::relative(long_dir, temp_source.path) / "long_file.bin") == data);
+    assert(fs::file_size(imported_dest.path / "empty.txt") == 0);
+
+    // A corrupted header checksum is rejected.
+    {
+        std::fstream corrupt(tar_file, std::ios::in | std::ios::out | std::ios::binary);
+        corrupt.seekp(10);
+        corrupt.put('#');
+    }
+    TempDir rejected;
+    const int bad = ::open(tar_file.c_str(), O_RDONLY);
+    bool threw = false;
+    try {
+        mfs::TarImporter().apply(bad, rejected.path);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    ::close(bad);
+    assert(threw);
+
+    // mtimes the ustar field cannot hold travel in pax records; a file
+    // longer than its header says is cut, with a warning.
+    const fs::path times_file = archive.path / "times.tar";
+    const int times_out = ::open(times_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(times_out >= 0);
+    std::ostringstream export_log;
+    {
+        mfs::TarWriter writer(times_out);
+        std::vector<char> buffer(4096);
+        mfs::FileMetadata meta;
+        meta.mode = 0644;
+        meta.size = 10;
+        meta.mtime = static_cast<std::uint64_t>(std::int64_t{-2});
+        meta.mtime_nsec = 750000000;
+        writer.add_file("before_epoch", meta, long_dir / "long_file.bin", buffer.data(), buffer.size(),
+                        &export_log);
+        meta.mtime = 10000000000; // 2286, past the 11 octal digits
+        meta.mtime_nsec = 0;
+        writer.add_file("far_future", meta, long_dir / "long_file.bin", buffer.data(), buffer.size(),
+                        &export_log);
+        writer.finish();
+    }
+    ::close(times_out);
+    assert(export_log.str().find("grew while read; cut at 10 of " + std::to_string(data.size())) !=
+           std::string::npos);
+    TempDir times_dest;
+    const int times_in = ::open(times_file.c_str(), O_RDONLY);
+    const mfs::SyncStats times = mfs::TarImporter().apply(times_in, times_dest.path);
+    ::close(times_in);
+    assert(times.files_copied == 2);
+    struct stat st {};
+    assert(::stat((times_dest.path / "before_epoch").c_str(), &st) == 0);
+    assert(st.st_mtim.tv_sec == -2 && st.st_mtim.tv_nsec == 750000000 && st.st_size == 10);
+    assert(::stat((times_dest.path / "far_future").c_str(), &st) == 0);
+    assert(st.st_mtim.tv_sec == 10000000000 && st.st_mtim.tv_nsec == 0);
+
+    // A stream that ends inside a file leaves no partial file behind.
+    const fs::path cut_file = archive.path / "cut.tar";
+    const int cut_out = ::open(cut_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    assert(cut_out >= 0);
+    {
+        mfs::TarWriter writer(cut_out);
+        std::vector<char> buffer(64 * 1024);
+        const fs::path source = long_dir / "long_file.bin";
+        mfs::FileMetadata meta;
+        meta.mode = 0644;
+        meta.size = data.size();
+        meta.mtime = 1000;
+        writer.add_file("cut.bin", meta, source, buffer.data(), buffer.size());
+    }
+    ::close(cut_out);
+    fs::resize_file(cut_file, 512 + data.size() / 2);
+    TempDir cut_dest;
+    const int cut_in = ::open(cut_file.c_str(), O_RDONLY);
+    threw = false;
+    try {
+        mfs::TarImporter(import_options).apply(cut_in, cut_dest.path);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    ::close(cut_in);
+    assert(threw);
+    assert(!fs::exists(cut_dest.path / "cut.bin"));
+    std::cout << "Tar test passed." << std::endl;
+}
+
+void test_chunk_store(const fs::path& source_root) {
+    assert(mfs::to_hex(mfs::sha256("abc", 3)) ==
+           "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    const std::string two_blocks = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    assert(mfs::to_hex(mfs::sha256(two_blocks.data(), two_blocks.size())) ==
+           "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+
+    std::string data(2 * 1024 * 1024, '\0');
+    std::mt19937 rng(11);
+    for (char& c : data) {
+        c = static_cast<char>(rng());
+    }
+    // Boundaries depend on content only: after an insertion the cuts
+    // resynchronize and most chunks are shared.
+    mfs::ChunkingParams params;
+    auto digests = [&params](const std::string& bytes) {
+        std::set<std::string> set;
+        for (std::size_t offset = 0; offset < bytes.size();) {
+            const std::size_t length = mfs::cdc_cut(bytes.data() + offset, bytes.size() - offset, params);
+            assert(length <= params.max_bytes);
+            assert(length >= params.min_bytes || offset + length == bytes.size());
+            set.insert(mfs::to_hex(mfs::sha256(bytes.data() + offset, length)));
+            offset += length;
+        }
+        return set;
+    };
+    const std::set<std::string> original = digests(data);
+    const std::set<std::string> shifted = digests("inserted" + data);
+    std::size_t shared = 0;
+    for (const std::string& digest : shifted) {
+        shared += original.count(digest);
+    }
+    assert(original.size() > 10 && shared + 2 >= original.size());
+
+    TempDir temp_source;
+    TempDir store_dir;
+    TempDir restored;
+    copy_tree(source_root, temp_source.path);
+    std::ofstream(temp_source.path / "big.bin", std::ios::binary) << data;
+    std::ofstream(temp_source.path / "dirA" / "big_shifted.bin", std::ios::binary) << "inserted" << data;
+
+    mfs::ChunkStoreOptions options;
+    options.workers = 3;
+    options.pack_bytes = 1024 * 1024;
+    mfs::SyncStats first;
+    {
+        mfs::ChunkStore store(store_dir.path, options);
+        first = store.backup(temp_source.path);
+        mfs::print_report(first);
+    }
+    assert(first.dedup.chunks > first.dedup.chunks_stored);
+    assert(first.dedup.bytes_stored < first.dedup.snapshot_bytes * 6 / 10);
+    assert(first.dedup.store_bytes == first.dedup.bytes_stored && first.dedup.snapshot_bytes == first.bytes_copied);
+    assert(count_entries(store_dir.path / "packs") > 1);
+
+    // A reopened store reuses the previous run for unchanged files.
+    mfs::ChunkStore store(store_dir.path, options);
+    std::ofstream(temp_source.path / "new.txt") << "new file";
+    const mfs::SyncStats second = store.backup(temp_source.path);
+    assert(second.files_copied == 1 && second.files_skipped == first.files_copied);
+    assert(second.dedup.chunks_stored == 1 && store.runs().size() == 2 && store.runs().back() == store.last_run());
+
+    const mfs::SyncStats restore = store.restore("", restored.path);
+    assert(restore.files_copied == second.files_copied + second.files_skipped);
+    for (const auto& entry : fs::recursive_directory_iterator(temp_source.path)) {
+        const fs::path copy = restored.path / fs::relative(entry.path(), temp_source.path);
+        if (entry.is_regular_file()) {
+            assert_file_equals(entry.path(), copy);
+            assert(fs::last_write_time(copy) == entry.last_write_time());
+        } else {
+            assert(fs::is_directory(copy));
+        }
+    }
+
+    // Corrupted chunk data is caught by the digest check.
+    const fs::path pack = store_dir.path / "packs" / "00000001.pack";
+    {
+        std::fstream corrupt(pack, std::ios::in | std::ios::out | std::ios::binary);
+        corrupt.seekg(100);
+        const char byte = static_cast<char>(corrupt.get());
+        corrupt.seekp(100);
+        corrupt.put(static_cast<char>(byte ^ 1));
+    }
+    TempDir broken;
+    bool threw = false;
+    try {
+        store.restore(store.runs().front(), broken.path);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    std::cout << "Chunk store test passed." << std::endl;
+}
+
+void test_resume() {
+    const std::size_t kMiB = 1024 * 1024;
+    std::string data(12 * kMiB, '\0');
+    std::mt19937 rng(5);
+    for (char& c : data) {
+        c = static_cast<char>(rng());
+    }
+    TempDir source;
+    TempDir destination;
+    std::ofstream(source.path / "large.bin", std::ios::binary) << data;
+    std::ofstream(source.path / "small.txt") << "small";
+    std::ofstream(destination.path / "small.txt") << "sm";
+
+    mfs::SyncOptions options;
+    options.resume = mfs::ResumeMode::verify;
+    options.resume_block_bytes = kMiB;
+    options.resume_threads = 3;
+
+    // Cut part way through a block: the whole prefix matches.
+    std::ofstream(destination.path / "large.bin", std::ios::binary).write(data.data(), 9 * kMiB + kMiB / 2);
+    mfs::SyncStats stats = mfs::DirectorySyncer(options).synchronize(source.path, destination.path);
+    assert(stats.files_copied == 2 && stats.files_resumed == 1);
+    assert(stats.bytes_resumed == 9 * kMiB + kMiB / 2);
+    assert(stats.bytes_copied == data.size() - stats.bytes_resumed + 5);
+    assert(read_file(destination.path / "large.bin") == data);
+
+    // A damaged block ends the verified prefix.
+    std::string damaged = data.substr(0, 10 * kMiB);
+    damaged[3 * kMiB + 17] ^= 1;
+    std::ofstream(destination.path / "large.bin", std::ios::binary | std::ios::trunc) << damaged;
+    stats = mfs::DirectorySyncer(options).synchronize(source.path, destination.path);
+    assert(stats.files_resumed == 1 && stats.bytes_resumed == 3 * kMiB);
+    assert(read_file(destination.path / "large.bin") == data);
+
+    // Append trusts what is there if it is marked as a copy of this source.
+    const auto marker_of = [](const std::filesystem::path& path) {
+        struct stat st {};
+        assert(::stat(path.c_str(), &st) == 0);
+        return mfs::PartialCopyMarker{static_cast<std::uint64_t>(st.st_size),
+                                      static_cast<std::uint64_t>(st.st_mtim.tv_sec),
+                                      static_cast<std::uint64_t>(st.st_mtim.tv_nsec),
+                                      static_cast<std::uint64_t>(st.st_ino)};
+    };
+    options.resume = mfs::ResumeMode::append;
+    std::ofstream(destination.path / "large.bin", std::ios::binary | std::ios::trunc).write(data.data(), 5 * kMiB);
+    assert(mfs::mark_partial_copy(destination.path / "large.bin", marker_of(source.path / "large.bin")));
+    stats = mfs::DirectorySyncer(options).synchronize(source.path, destination.path);
+    assert(stats.bytes_resumed == 5 * kMiB && stats.bytes_copied == 7 * kMiB);
+    assert(read_file(destination.path / "large.bin") == data);
+    assert(!mfs::partial_copy_marked(destination.path / "large.bin", marker_of(source.path / "large.bin")));
+
+    // Unmarked, it is copied again.
+    std::ofstream(destination.path / "large.bin", std::ios::binary | std::ios::trunc).write(data.data(), 5 * kMiB);
+    stats = mfs::DirectorySyncer(options).synchronize(source.path, destination.path);
+    assert(stats.files_resumed == 0 && stats.bytes_copied == data.size());
+    assert(read_file(destination.path / "large.bin") == data);
+
+    // The source was edited and grew after the interrupted copy: the old
+    // prefix is no longer part of it.
+    std::ofstream(destination.path / "large.bin", std::ios::binary | std::ios::trunc).write(data.data(), 5 * kMiB);
+    assert(mfs::mark_partial_copy(destination.path / "large.bin", marker_of(source.path / "large.bin")));
+    std::string edited = data + std::string(kMiB, 'e');
+    edited[kMiB] ^= 1;
+    std::ofstream(source.path / "large.bin", std::ios::binary | std::ios::trunc) << edited;
+    stats = mfs::DirectorySyncer(options).synchronize(source.path, destination.path);
+    assert(stats.files_resumed == 0 && stats.bytes_copied == edited.size());
+    assert(read_file(destination.path / "large.bin") == edited);
+    mfs::print_report(stats);
+    std::cout << "Resume test passed." << std::endl;
+}
+
+void test_concurrent_syncs() {
+    // Task sets on one pool wait for, and fail with, their own tasks only.
+    {
+        mfs::WorkerPool pool(3, 4);
+        mfs::WorkerPool::TaskSet first(pool);
+        mfs::WorkerPool::TaskSet second(pool);
+        std::atomic<int> done{0};
+        for (int i = 0; i < 50; ++i) {
+            first.submit([&done](std::size_t) { ++done; });
+            second.submit([](std::size_t) { throw std::runtime_error("second"); });
+        }
+        first.wait();
+        assert(done == 50);
+        bool threw = false;
+        try {
+            second.wait();
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+        pool.wait_idle();
+    }
+
+    TempDir source;
+    TempDir destinations;
+    const fs::path big = source.path / "big";
+    fs::create_directories(big);
+    for (int i = 0; i < 400; ++i) {
+        std::ofstream(big / ("f" + std::to_string(i))) << std::string(static_cast<std::size_t>(i), 'x');
+    }
+    fs::create_directories(source.path / "a" / "b");
+    std::ofstream(source.path / "a" / "b" / "leaf.txt") << "leaf";
+
+    mfs::SyncOptions options;
+    options.workers = 4;
+    options.split_threshold = 50;
+    options.account_usage = true;
+    options.watchdog.enabled = true;
+    options.calibrate_copy = true;
+    options.calibration.bytes_per_class = 128 * 1024;
+    options.calibration.rounds = 1;
+    // One stream for every call, polled for progress by all their threads.
+    const fs::path events_file = destinations.path / "events.jsonl";
+    const int events_fd = ::open(events_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    assert(events_fd >= 0);
+    options.events = std::make_shared<mfs::EventStream>(events_fd, true, std::chrono::milliseconds(1));
+    mfs::DirectorySyncer syncer(options);
+
+    constexpr int kSyncs = 32;
+    std::vector<mfs::SyncStats> results(kSyncs);
+    std::vector<std::ostringstream> logs(kSyncs);
+    std::vector<std::thread> threads;
+    std::atomic<int> failures{0};
+    for (int i = 0; i < kSyncs; ++i) {
+        threads.emplace_back([&, i] {
+            const fs::path destination = destinations.path / ("d" + std::to_string(i));
+            // Some destinations hold an extraneous file to prune.
+            if (i % 2 == 0) {
+                fs::create_directories(destination);
+                std::ofstream(destination / "extra.txt") << "extra";
+            }
+            mfs::SyncCall call;
+            call.out = &logs[i];
+            call.err = &logs[i];
+            try {
+                results[i] = syncer.synchronize(source.path, destination, call);
+            } catch (const std::exception& ex) {
+                std::cerr << "Concurrent sync " << i << " failed: " << ex.what() << std::endl;
+                ++failures;
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    assert(failures == 0);
+
+    int calibrated = 0;
+    for (int i = 0; i < kSyncs; ++i) {
+        const mfs::SyncStats& stats = results[i];
+        const fs::path destination = destinations.path / ("d" + std::to_string(i));
+        assert(stats.files_copied == 401);
+        assert(stats.directories_split == 1);
+        assert(stats.files_deleted == (i % 2 == 0 ? 1u : 0u));
+        std::uint64_t usage_files = 0;
+        for (const auto& row : stats.usage.by_uid) {
+            usage_files += row.second.files_copied;
+        }
+        assert(usage_files == 401);
+        calibrated += stats.copy_engines.cached ? 0 : 1;
+        assert(read_file(destination / "big" / "f399") == std::string(399, 'x'));
+        assert(read_file(destination / "a" / "b" / "leaf.txt") == "leaf");
+        assert(!fs::exists(destination / "extra.txt"));
+        // Each call's progress went to its own log, and only its own.
+        const std::string log = logs[i].str();
+        assert(log.find("Copied file: ") != std::string::npos);
+        assert(log.find(destination.string() + "/") != std::string::npos);
+        const fs::path other = destinations.path / ("d" + std::to_string((i + 1) % kSyncs));
+        assert(log.find(other.string() + "/") == std::string::npos);
+    }
+    // The calibration was made once and shared.
+    assert(calibrated == 1);
+    options.events->close();
+    assert(options.events->take_failure().empty());
+    std::size_t summaries = 0;
+    std::istringstream events(read_file(events_file));
+    for (std::string line; std::getline(events, line);) {
+        summaries += line.find("\"event\":\"summary\"") != std::string::npos ? 1 : 0;
+    }
+    assert(summaries == kSyncs);
+    std::cout << "Concurrent syncs test passed." << std::endl;
+}
+
+void test_priority_paths() {
+    TempDir source;
+    for (int d = 0; d < 6; ++d) {
+        const fs::path bulk = source.path / ("b" + std::to_string(d));
+        fs::create_directories(bulk);
+        for (int f = 0; f < 10; ++f) {
+            std::ofstream(bulk / ("f" + std::to_string(f))) << "bulk";
+        }
+        const fs::path current = source.path / "current" / ("s" + std::to_string(d));
+        fs::create_directories(current);
+        std::ofstream(current / "c.txt") << "current";
+    }
+    fs::create_directories(source.path / "b3" / "index");
+    for (int f = 0; f < 4; ++f) {
+        std::ofstream(source.path / "b3" / "index" / ("i" + std::to_string(f))) << "index";
+    }
+
+    // Position in sync order of the first and last entry below `prefix`.
+    auto span = [&source](const mfs::SyncStats& stats, const std::string& prefix) {
+        const std::string root = source.path.string() + "/";
+        std::size_t first = stats.synced_entries.size();
+        std::size_t last = 0;
+        for (std::size_t i = 0; i < stats.synced_entries.size(); ++i) {
+            const std::string path = stats.synced_entries[i].file.string();
+            if (path.compare(0, root.size() + prefix.size(), root + prefix) == 0) {
+                first = std::min(first, i);
+                last = i;
+            }
+        }
+        return std::make_pair(first, last);
+    };
+    auto first_bulk = [&](const mfs::SyncStats& stats) {
+        std::size_t first = stats.synced_entries.size();
+        for (int d = 0; d < 6; ++d) {
+            first = std::min(first, span(stats, "b" + std::to_string(d) + "/f").first);
+        }
+        return first;
+    };
+
+    mfs::SyncOptions options;
+    options.priority_rules = {{"current", 2}, {"*/index", 1}};
+    options.priority_aging = 0;
+    TempDir plain;
+    mfs::SyncStats stats = mfs::DirectorySyncer(options).synchronize(source.path, plain.path);
+    assert(stats.files_copied == 70);
+    // The whole current/ subtree preempts the bulk directories.
+    assert(span(stats, "current/").second < first_bulk(stats));
+    // b3/index is walked as soon as b3 has been read.
+    const auto index = span(stats, "b3/index/");
+    assert(index.second - index.first == 3);
+    assert(stats.priority_classes.size() == 3);
+    assert(stats.priority_classes[2].directories == 7 && stats.priority_classes[2].files_copied == 6);
+    assert(stats.priority_classes[1].directories == 1 && stats.priority_classes[1].files_copied == 4);
+    assert(stats.priority_classes[0].directories == 7 && stats.priority_classes[0].files_copied == 60);
+    assert(stats.priority_classes[2].completed <= stats.priority_classes[0].completed);
+    mfs::OutputBuffer report(-1, 1 << 16);
+    mfs::format_report(report, stats, mfs::OutputFormat::text);
+    assert(report.view().find("=== Priority Classes ===") != std::string_view::npos);
+
+    // With aging, bulk work gets a turn while current/ is still pending.
+    options.priority_aging = 1;
+    TempDir aged;
+    stats = mfs::DirectorySyncer(options).synchronize(source.path, aged.path);
+    assert(stats.files_copied == 70);
+    assert(first_bulk(stats) < span(stats, "current/").second);
+
+    options.priority_rules = {{"current", mfs::kPriorityLevels}};
+    bool threw = false;
+    try {
+        mfs::DirectorySyncer(options).synchronize(source.path, aged.path);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    assert(threw);
+    std::cout << "Priority paths test passed." << std::endl;
+}
+
+void test_data_lane() {
+    TempDir source;
+    fs::create_directories(source.path / "media");
+    fs::create_directories(source.path / "hot");
+    for (int f = 0; f < 8; ++f) {
+        std::ofstream(source.path / "media" / ("clip" + std::to_string(f))) << std::string(64 * 1024, char('a' + f));
+    }
+    std::ofstream(source.path / "hot" / "large") << std::string(48 * 1024, 'h');
+    for (int f = 0; f < 100; ++f) {
+        std::ofstream(source.path / "media" / ("note" + std::to_string(f))) << "note " << f;
+    }
+
+    mfs::SyncOptions options;
+    options.workers = 3;
+    options.split_threshold = 16;
+    options.data_workers = 2;
+    options.data_min_bytes = 32 * 1024;
+    options.data_queue_bytes = 128 * 1024;
+    options.priority_rules = {{"hot", 1}};
+    TempDir destination;
+    mfs::DirectorySyncer syncer(options);
+    mfs::SyncStats stats = syncer.synchronize(source.path, destination.path);
+    assert(stats.files_copied == 109);
+    assert(stats.data_lane.files == 9);
+    assert(stats.data_lane.bytes == 8 * 64 * 1024 + 48 * 1024);
+    assert(stats.data_lane.peak_queued_bytes > 0 && stats.data_lane.peak_queued_bytes <= 128 * 1024);
+    // Copies done by the lane count for the class of their directory.
+    assert(stats.priority_classes[1].files_copied == 1);
+    assert(stats.priority_classes[0].files_copied == 108);
+    for (const auto& entry : fs::recursive_directory_iterator(source.path)) {
+        if (entry.is_regular_file()) {
+            const fs::path copied = destination.path / fs::relative(entry.path(), source.path);
+            assert(read_file(copied) == read_file(entry.path()));
+        }
+    }
+    mfs::OutputBuffer report(-1, 1 << 16);
+    mfs::format_report(report, stats, mfs::OutputFormat::jsonl);
+    assert(report.view().find("\"data_lane_files\":9") != std::string_view::npos);
+
+    stats = syncer.synchronize(source.path, destination.path);
+    assert(stats.files_copied == 0 && stats.data_lane.files == 0);
+    std::cout << "Data lane test passed." << std::endl;
+}
+
+void test_copy_order() {
+    TempDir source;
+    fs::create_directories(source.path / "flat");
+    for (int f = 0; f < 20; ++f) {
+        std::ofstream(source.path / "flat" / ("f" + std::to_string(f))) << std::string(100 + f, 'o');
+    }
+
+    mfs::SyncOptions options;
+    options.copy_order = mfs::CopyOrder::inode;
+    options.copy_window = 4;
+    TempDir by_inode;
+    mfs::SyncStats stats = mfs::DirectorySyncer(options).synchronize(source.path, by_inode.path);
+    assert(stats.files_copied == 20);
+    assert(stats.copy_order.windows == 5 && stats.copy_order.by_inode == 20);
+    // Every window is issued in inode order.
+    std::vector<std::uint64_t> inodes;
+    for (const mfs::FileMetadata& entry : stats.synced_entries) {
+        if (S_ISREG(static_cast<mode_t>(entry.mode))) {
+            inodes.push_back(entry.inode);
+        }
+    }
+    assert(inodes.size() == 20);
+    for (std::size_t i = 0; i < inodes.size(); ++i) {
+        if (i % 4 != 0) {
+            assert(inodes[i - 1] < inodes[i]);
+        }
+    }
+    mfs::OutputBuffer report(-1, 1 << 16);
+    mfs::format_report(report, stats, mfs::OutputFormat::jsonl);
+    assert(report.view().find("\"copy_windows\":5") != std::string_view::npos);
+
+    // Extents where the filesystem reports them, inode numbers otherwise;
+    // split batches issue what they hold before the batch is done.
+    options.copy_order = mfs::CopyOrder::extent;
+    options.workers = 2;
+    options.split_threshold = 4;
+    TempDir by_extent;
+    stats = mfs::DirectorySyncer(options).synchronize(source.path, by_extent.path);
+    assert(stats.files_copied == 20);
+    assert(stats.copy_order.by_extent + stats.copy_order.by_inode == 20);
+    for (int f = 0; f < 20; ++f) {
+        const fs::path relative = fs::path("flat") / ("f" + std::to_string(f));
+        assert(read_file(by_extent.path / relative) == read_file(source.path / relative));
+    }
+    std::cout << "Copy order test passed." << std::endl;
+}
+
 } // namespace
 
 int main() {
@@ -116,6 +1781,29 @@ int main() {
 
         test_default_sync(source_root, dest_root);
         test_keep_extra(source_root, dest_root);
+        test_columnar_export(source_root, dest_root);
+        test_output_format();
+        test_event_stream(source_root, dest_root);
+        test_live_stats(source_root, dest_root);
+        test_usage_accounting(source_root, dest_root);
+        test_generic_loop(source_root, dest_root);
+        test_retry_queue();
+        test_watchdog();
+        test_split_directory();
+        test_numa();
+        test_bump_arena();
+        test_flat_hash();
+        test_buffer_pool(source_root, dest_root);
+        test_copy_engines(source_root, dest_root);
+        test_lz();
+        test_transport(source_root, dest_root);
+        test_tar(source_root, dest_root);
+        test_chunk_store(source_root);
+        test_resume();
+        test_concurrent_syncs();
+        test_priority_paths();
+        test_data_lane();
+        test_copy_order();
 
     } catch (const std::exception& ex) {
         std::cerr << "Test failure: " << ex.what() << std::endl;